@@ -38,14 +38,24 @@ setup(
             'sortedmap._sortedmap',
             ['sortedmap/_sortedmap.cpp'],
             include_dirs=['sortedmap/include'],
-            depends=['sortedmap/include/sortedmap.h'],
+            depends=[
+                'sortedmap/include/sortedmap.h',
+                'sortedmap/include/sortedmultimap.h',
+                'sortedmap/include/frozensortedmap.h',
+                'sortedmap/include/shardedsortedmap.h',
+                'sortedmap/include/sharedsortedmap.h',
+            ],
             extra_compile_args=[
                 '-Wall',
                 '-Wextra',
                 '-Wno-missing-field-initializers',
                 '-Wno-unused-parameter',
-                '-std=gnu++14',
+                '-std=gnu++17',
+                '-pthread',
             ],
+            extra_link_args=['-pthread'],
+            # shm_open is in librt before glibc 2.34
+            libraries=['rt'] if sys.platform.startswith('linux') else [],
             language='c++',
         ),
     ],
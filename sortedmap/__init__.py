@@ -1,9 +1,20 @@
-from collections.abc import MutableMapping
+from collections.abc import Mapping, MutableMapping
 
-from ._sortedmap import sortedmap
+from ._sortedmap import (
+    frozensortedmap,
+    intern_pool,
+    shardedsortedmap,
+    sharedsortedmap,
+    sortedmap,
+    sortedmultimap,
+)
 
 
 MutableMapping.register(sortedmap)
+MutableMapping.register(shardedsortedmap)
+Mapping.register(frozensortedmap)
+Mapping.register(sharedsortedmap)
+del Mapping
 del MutableMapping
 
 
@@ -11,5 +22,10 @@ __version__ = '0.2.0'
 
 
 __all__ = [
+    'frozensortedmap',
+    'intern_pool',
+    'shardedsortedmap',
+    'sharedsortedmap',
     'sortedmap',
+    'sortedmultimap',
 ]
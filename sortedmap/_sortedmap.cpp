@@ -1,8 +1,30 @@
-#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <exception>
+#include <iterator>
 #include <map>
+#include <random>
 #include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "sortedmap.h"
+#include "sortedmultimap.h"
+#include "frozensortedmap.h"
+#include "shardedsortedmap.h"
+#include "sharedsortedmap.h"
 
 const char *sortedmap::keyiter::name = "sortedmap.keyiter";
 const char *sortedmap::valiter::name = "sortedmap.valiter";
@@ -10,6 +32,24 @@ const char *sortedmap::itemiter::name = "sortedmap.itemiter";
 const char *sortedmap::keyview::name = "sortedmap.keyview";
 const char *sortedmap::valview::name = "sortedmap.valview";
 const char *sortedmap::itemview::name = "sortedmap.itemview";
+const char *sortedmultimap::keyiter::name = "sortedmap.multikeyiter";
+const char *sortedmultimap::valiter::name = "sortedmap.multivaliter";
+const char *sortedmultimap::itemiter::name = "sortedmap.multiitemiter";
+const char *sortedmultimap::keyview::name = "sortedmap.multikeyview";
+const char *sortedmultimap::valview::name = "sortedmap.multivalview";
+const char *sortedmultimap::itemview::name = "sortedmap.multiitemview";
+const char *frozensortedmap::keyiter::name = "sortedmap.frozenkeyiter";
+const char *frozensortedmap::valiter::name = "sortedmap.frozenvaliter";
+const char *frozensortedmap::itemiter::name = "sortedmap.frozenitemiter";
+const char *frozensortedmap::keyview::name = "sortedmap.frozenkeyview";
+const char *frozensortedmap::valview::name = "sortedmap.frozenvalview";
+const char *frozensortedmap::itemview::name = "sortedmap.frozenitemview";
+const char *shardedsortedmap::keyview::name = "sortedmap.shardedkeyview";
+const char *shardedsortedmap::valview::name = "sortedmap.shardedvalview";
+const char *shardedsortedmap::itemview::name = "sortedmap.shardeditemview";
+const char *sharedsortedmap::keyview::name = "sortedmap.sharedkeyview";
+const char *sharedsortedmap::valview::name = "sortedmap.sharedvalview";
+const char *sharedsortedmap::itemview::name = "sortedmap.shareditemview";
 
 PyObject*
 py_identity(PyObject *ob) {
@@ -18,7 +58,17 @@ py_identity(PyObject *ob) {
 }
 
 PyObject *
-sortedmap::Comparator::call(PyObject *ob) {
+sortedmap::Comparator::call(PyObject *ob) const {
+#ifdef Py_GIL_DISABLED
+    // another thread may compare on this map while the keyfunc has the
+    // critical section suspended, so the argument goes on the stack
+    PyObject *args[2] = {NULL, ob};
+
+    return PyObject_Vectorcall(keyfunc,
+                               args + 1,
+                               1 | PY_VECTORCALL_ARGUMENTS_OFFSET,
+                               NULL);
+#else
     PyObject *ret;
 
     PyTuple_SET_ITEM(argtuple, 0, ob);
@@ -34,6 +84,7 @@ sortedmap::Comparator::call(PyObject *ob) {
         PyTuple_SET_ITEM(argtuple, 0, NULL);
     }
     return ret;
+#endif  // Py_GIL_DISABLED
 }
 
 sortedmap::Comparator::Comparator() {
@@ -47,6 +98,12 @@ sortedmap::Comparator::Comparator(PyObject *keyfunc) {
     argtuple = NULL;
 }
 
+sortedmap::Comparator::Comparator(const Comparator &other) {
+    keyfunc = other.keyfunc;
+    Py_XINCREF(keyfunc);
+    argtuple = NULL;
+}
+
 sortedmap::Comparator::~Comparator() {
     Py_XDECREF(keyfunc);
     Py_XDECREF(argtuple);
@@ -54,39 +111,383 @@ sortedmap::Comparator::~Comparator() {
 
 sortedmap::Comparator&
 sortedmap::Comparator::operator=(const Comparator &other) {
+    PyObject *old = keyfunc;
+
+    // the old keyfunc may run code which reaches this comparator
+    Py_XINCREF(other.keyfunc);
     keyfunc = other.keyfunc;
-    Py_XINCREF(keyfunc);
-    argtuple = NULL;
+    Py_XDECREF(old);
+    Py_CLEAR(argtuple);
     return *this;
 }
 
+// Compare two byte strings in the same order as ``bytes.__lt__``.
+static inline bool
+bytes_less(const char *a, Py_ssize_t alen, const char *b, Py_ssize_t blen) {
+    int cmp = std::memcmp(a, b, std::min(alen, blen));
+    return (cmp) ? cmp < 0 : alen < blen;
+}
+
+// Compare two arrays of code units by value. Long shared prefixes are
+// skipped a block at a time with memcmp, which only tests for equality.
+template<typename T>
+static inline bool
+units_less(const T *a, Py_ssize_t alen, const T *b, Py_ssize_t blen) {
+    const Py_ssize_t block = 64 / sizeof(T);
+    Py_ssize_t len = std::min(alen, blen);
+    Py_ssize_t ix = 0;
+
+    while (ix + block <= len &&
+           !std::memcmp(a + ix, b + ix, block * sizeof(T))) {
+        ix += block;
+    }
+    for (; ix < len; ++ix) {
+        if (a[ix] != b[ix]) {
+            return a[ix] < b[ix];
+        }
+    }
+    return alen < blen;
+}
+
+// Compare exact ``bytes`` and ``str`` objects without going through
+// ``tp_richcompare``, and exact ``int`` objects with themselves. Returns 1 or
+// 0, or -1 if there is no native comparison for these objects.
+static inline int
+native_less(PyObject *a, PyObject *b) {
+    PyTypeObject *type = Py_TYPE(a);
+
+    if (type != Py_TYPE(b)) {
+        return -1;
+    }
+    if (a == b &&
+        (type == &PyBytes_Type ||
+         type == &PyUnicode_Type ||
+         type == &PyLong_Type)) {
+        // interned keys are often compared with themselves
+        return 0;
+    }
+    if (type == &PyBytes_Type) {
+        return bytes_less(PyBytes_AS_STRING(a),
+                          PyBytes_GET_SIZE(a),
+                          PyBytes_AS_STRING(b),
+                          PyBytes_GET_SIZE(b));
+    }
+#if !COMPILING_IN_PY2
+    if (type == &PyUnicode_Type) {
+        Py_ssize_t alen = PyUnicode_GET_LENGTH(a);
+        Py_ssize_t blen = PyUnicode_GET_LENGTH(b);
+
+        switch ((PyUnicode_KIND(a) == PyUnicode_KIND(b)) ?
+                PyUnicode_KIND(a) :
+                0) {
+        case PyUnicode_1BYTE_KIND:
+            // latin-1 bytes sort the same way as their code points
+            return bytes_less((const char*) PyUnicode_1BYTE_DATA(a),
+                              alen,
+                              (const char*) PyUnicode_1BYTE_DATA(b),
+                              blen);
+        case PyUnicode_2BYTE_KIND:
+            return units_less(PyUnicode_2BYTE_DATA(a),
+                              alen,
+                              PyUnicode_2BYTE_DATA(b),
+                              blen);
+        case PyUnicode_4BYTE_KIND:
+            return units_less(PyUnicode_4BYTE_DATA(a),
+                              alen,
+                              PyUnicode_4BYTE_DATA(b),
+                              blen);
+        default:
+            // this cannot fail for two exact str objects
+            return PyUnicode_Compare(a, b) < 0;
+        }
+    }
+#endif  // !COMPILING_IN_PY2
+    return -1;
+}
+
 bool
 sortedmap::Comparator::operator()(const OwnedRef<PyObject> &a,
-                                  const OwnedRef<PyObject> &b){
+                                  const OwnedRef<PyObject> &b) const {
+    int status;
+
     if (!keyfunc) {
-        return a < b;
+        status = native_less(a, b);
+        if (likely(status >= 0)) {
+            return status;
+        }
     }
-
-    if (unlikely(!argtuple)) {
+#ifndef Py_GIL_DISABLED
+    else if (unlikely(!argtuple)) {
         if (!(argtuple = PyTuple_New(1))) {
             throw PythonError();
         }
     }
+#endif  // Py_GIL_DISABLED
 
-    OwnedRef<PyObject> a_ob;
-    OwnedRef<PyObject> b_ob;
-    int status;
+    // the Python code may change the map, which can free the nodes that
+    // hold ``a`` and ``b``
+    OwnedRef<PyObject> a_ref = a;
+    OwnedRef<PyObject> b_ref = b;
+    const unsigned long *revision = active_revision;
+    unsigned long before = revision ? *revision : 0;
 
-    if (unlikely(!(a_ob = call(a)) || !(b_ob = call(b)))) {
-        throw PythonError();
+    if (!keyfunc) {
+        status = PyObject_RichCompareBool(a_ref, b_ref, Py_LT);
+    }
+    else {
+        PyObject *a_ob;
+        PyObject *b_ob;
+
+        if (unlikely(!(a_ob = call(a_ref)))) {
+            throw PythonError();
+        }
+        if (unlikely(!(b_ob = call(b_ref)))) {
+            Py_DECREF(a_ob);
+            throw PythonError();
+        }
+        status = PyObject_RichCompareBool(a_ob, b_ob, Py_LT);
+        Py_DECREF(a_ob);
+        Py_DECREF(b_ob);
     }
-    status = PyObject_RichCompareBool(a_ob, b_ob, Py_LT);
     if (unlikely(status < 0)) {
         throw PythonError();
     }
+    if (unlikely(revision && *revision != before)) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "sortedmap changed size during a key comparison");
+        throw PythonError();
+    }
     return status;
 }
 
+// Merge the write buffer of a sortedmap into its tree, see
+// ``set_write_buffer``. The caller must hold the map. Returns false with a
+// Python exception set if the buffered keys could not be compared.
+static bool flush(sortedmap::object*);
+
+// frozensortedmaps and sortedmultimaps are never buffered
+static inline bool
+flush(frozensortedmap::object*) {
+    return true;
+}
+
+static inline bool
+flush(sortedmultimap::object*) {
+    return true;
+}
+
+// Mutation logs and snapshots are a header followed by records. The header
+// is a magic string and an id as a little endian uint64. A log's id is picked
+// when the log is started or emptied by a checkpoint. A snapshot's id is the
+// id of the log whose changes it holds, or 0, so that ``recover`` can tell a
+// log which was not emptied because of a crash. Each record is an op byte,
+// the size of the payload as a little endian uint32, and the marshalled
+// payload.
+static const char log_magic[] = "SMAPLOG2";
+static const std::size_t log_magic_size = sizeof(log_magic) - 1;
+static const std::size_t log_file_header_size = log_magic_size + 8;
+static const std::size_t log_header_size = 5;
+
+enum log_op : char {
+    // (key, value): set a key.
+    LOG_SET = 'S',
+    // key: delete a key.
+    LOG_DEL = 'D',
+    // no payload: remove every pair.
+    LOG_CLEAR = 'C',
+    // key: remove the keys at or after ``key``, like ``split``.
+    LOG_SPLIT = 'T',
+    // (maxlen, evict_first): bound the map, like ``set_maxlen``.
+    LOG_MAXLEN = 'M',
+};
+
+static std::string
+log_file_header(std::uint64_t id) {
+    std::string out(log_magic, log_magic_size);
+
+    for (int shift = 0; shift < 64; shift += 8) {
+        out.push_back((char) (id >> shift));
+    }
+    return out;
+}
+
+// Read the id from a header. Returns false if ``data`` does not start with
+// one.
+static bool
+log_file_id(const char *data, std::size_t size, std::uint64_t &id) {
+    if (size < log_file_header_size ||
+        memcmp(data, log_magic, log_magic_size)) {
+        return false;
+    }
+    id = 0;
+    for (int ix = 0; ix < 8; ++ix) {
+        id |= (std::uint64_t) (unsigned char) data[log_magic_size + ix] <<
+            (8 * ix);
+    }
+    return true;
+}
+
+// A new log id, which is never 0.
+static std::uint64_t
+new_log_id() {
+    std::uint64_t id = std::chrono::steady_clock::now()
+        .time_since_epoch()
+        .count();
+
+    try {
+        std::random_device device;
+        id ^= (std::uint64_t) device() << 32 | device();
+    }
+    catch (std::exception &e) {
+        // the clock alone still differs between logs
+    }
+    return (id) ? id : 1;
+}
+
+// Append a record to ``out``. Raises a ValueError if the payload cannot be
+// marshalled.
+static void
+log_encode(std::string &out, log_op op, PyObject *payload) {
+    PyObject *data = NULL;
+    std::size_t size = 0;
+
+    if (payload) {
+        data = PyMarshal_WriteObjectToString(payload, Py_MARSHAL_VERSION);
+        if (unlikely(!data)) {
+            throw PythonError();
+        }
+        size = PyBytes_GET_SIZE(data);
+    }
+    if (unlikely(size > UINT32_MAX)) {
+        Py_DECREF(data);
+        PyErr_SetString(PyExc_ValueError, "log record is too large");
+        throw PythonError();
+    }
+
+    out.push_back(op);
+    for (int shift = 0; shift < 32; shift += 8) {
+        out.push_back((char) (size >> shift));
+    }
+    if (data) {
+        out.append(PyBytes_AS_STRING(data), size);
+        Py_DECREF(data);
+    }
+}
+
+static void
+log_encode_set(std::string &out, PyObject *key, PyObject *value) {
+    PyObject *pair;
+
+    if (unlikely(!(pair = PyTuple_Pack(2, key, value)))) {
+        throw PythonError();
+    }
+    try {
+        log_encode(out, LOG_SET, pair);
+    }
+    catch (PythonError &e) {
+        Py_DECREF(pair);
+        throw;
+    }
+    Py_DECREF(pair);
+}
+
+static void
+log_encode_maxlen(std::string &out, Py_ssize_t maxlen, bool evict_first) {
+    PyObject *payload = Py_BuildValue("(nO)",
+                                      maxlen,
+                                      evict_first ? Py_True : Py_False);
+
+    if (unlikely(!payload)) {
+        throw PythonError();
+    }
+    try {
+        log_encode(out, LOG_MAXLEN, payload);
+    }
+    catch (PythonError &e) {
+        Py_DECREF(payload);
+        throw;
+    }
+    Py_DECREF(payload);
+}
+
+// Write all of ``size`` bytes, retrying short writes. Returns false with
+// errno set on failure.
+static bool
+write_all(int fd, const char *buf, std::size_t size) {
+    while (size) {
+        ssize_t written = write(fd, buf, size);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Write the pending records to the log file and sync it. The GIL is held
+// throughout so that records from other threads cannot be committed out of
+// order. Returns false with an OSError set on failure; the records stay
+// pending.
+static bool
+log_commit(sortedmap::mutationlog *log) {
+    if (log->pending.empty()) {
+        return true;
+    }
+    if (!write_all(log->fd, log->pending.data(), log->pending.size()) ||
+        fsync(log->fd)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, log->path.c_str());
+        return false;
+    }
+    log->pending.clear();
+    log->npending = 0;
+    return true;
+}
+
+// Add ``count`` encoded records for a change which has already been made to
+// the map, committing them if the group is full.
+static void
+log_push(sortedmap::object *self,
+         const std::string &records,
+         std::size_t count) {
+    sortedmap::mutationlog *log = self->log;
+
+    log->pending += records;
+    log->npending += count;
+    if (log->npending >= log->group && !log_commit(log)) {
+        throw PythonError();
+    }
+}
+
+// Log a change with no payload.
+static void
+log_push(sortedmap::object *self, log_op op) {
+    std::string record;
+
+    log_encode(record, op, NULL);
+    log_push(self, record, 1);
+}
+
+// Commit and close the map's log.
+static bool
+log_close(sortedmap::object *self) {
+    sortedmap::mutationlog *log = self->log;
+    bool ok;
+
+    if (!log) {
+        return true;
+    }
+    ok = log_commit(log);
+    close(log->fd);
+    delete log;
+    self->log = nullptr;
+    return ok;
+}
+
 bool
 sortedmap::check(PyObject *ob) {
     return PyObject_IsInstance(ob, (PyObject*) &sortedmap::type);
@@ -97,108 +498,298 @@ sortedmap::check_exact(PyObject *ob) {
     return Py_TYPE(ob) == &sortedmap::type;
 }
 
-void
-sortedmap::abstractiter::dealloc(sortedmap::abstractiter::object *self) {
-    using sortedmap::abstractiter::itertype;
-    using ownedtype = OwnedRef<sortedmap::object>;
-
-    self->iter.~itertype();
-    self->map.~ownedtype();
-    PyObject_Del(self);
-}
-
 PyObject*
-sortedmap::keyiter::elem(sortedmap::abstractiter::itertype it) {
+sortedmap::keyiter::elem(
+    sortedmap::abstractiter::itertype<sortedmap::object> it) {
     return std::get<0>(*it).incref();
 }
 
 PyObject*
-sortedmap::valiter::elem(sortedmap::abstractiter::itertype it) {
+sortedmap::valiter::elem(
+    sortedmap::abstractiter::itertype<sortedmap::object> it) {
     return std::get<1>(*it).incref();
 }
 
 PyObject*
-sortedmap::itemiter::elem(sortedmap::abstractiter::itertype it) {
-    return PyTuple_Pack(2,
-                        sortedmap::keyiter::elem(it),
-                        sortedmap::valiter::elem(it));
+sortedmap::itemiter::elem(
+    sortedmap::abstractiter::itertype<sortedmap::object> it) {
+    return PyTuple_Pack(2, std::get<0>(*it).ob, std::get<1>(*it).ob);
 }
 
 PyObject*
 sortedmap::keyiter::iter(sortedmap::object *self) {
-    return sortedmap::abstractiter::iter<sortedmap::keyiter::object,
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+    return sortedmap::abstractiter::iter<sortedmap::object,
                                          sortedmap::keyiter::type>(self);
 }
 
 PyObject*
 sortedmap::valiter::iter(sortedmap::object *self) {
-    return sortedmap::abstractiter::iter<sortedmap::valiter::object,
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+    return sortedmap::abstractiter::iter<sortedmap::object,
                                          sortedmap::valiter::type>(self);
 }
 
 PyObject*
 sortedmap::itemiter::iter(sortedmap::object *self) {
-    return sortedmap::abstractiter::iter<sortedmap::itemiter::object,
-                                         sortedmap::itemiter::type>(self);
-}
-
-PyObject*
-sortedmap::abstractview::repr(sortedmap::abstractview::object *self) {
-    PyObject *aslist;
-    PyObject *ret;
+    MapSection cs(self);
 
-    if (!(aslist = PySequence_List((PyObject*) self))) {
+    if (unlikely(!flush(self))) {
         return NULL;
     }
-    ret = PyUnicode_FromFormat("%s(%R)", Py_TYPE(self)->tp_name, aslist);
-    Py_DECREF(aslist);
-    return ret;
+    return sortedmap::abstractiter::iter<sortedmap::object,
+                                         sortedmap::itemiter::type>(self);
 }
 
 PyObject*
 sortedmap::keyview::view(sortedmap::object *self) {
-    return sortedmap::abstractview::view<sortedmap::keyview::object,
+    return sortedmap::abstractview::view<sortedmap::object,
                                          sortedmap::keyview::type>(self);
 }
 
 PyObject*
 sortedmap::valview::view(sortedmap::object *self) {
-    return sortedmap::abstractview::view<sortedmap::valview::object,
+    return sortedmap::abstractview::view<sortedmap::object,
                                          sortedmap::valview::type>(self);
 }
 
 PyObject*
 sortedmap::itemview::view(sortedmap::object *self) {
-    return sortedmap::abstractview::view<sortedmap::itemview::object,
+    return sortedmap::abstractview::view<sortedmap::object,
                                          sortedmap::itemview::type>(self);
 }
 
-void
-sortedmap::abstractview::dealloc(sortedmap::abstractview::object *self) {
-    using ownedtype = OwnedRef<sortedmap::object>;
+// ``(key, value) in m.items()`` looks the key up in the tree and compares
+// the values stored under it instead of scanning every item.
+template<typename M>
+static int
+item_contains(sortedmap::abstractview::object<M> *view, PyObject *item) {
+    M *self = view->map;
 
-    self->map.~ownedtype();
-    PyObject_Del(self);
+    if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+        return 0;
+    }
+
+    PyObject *key = PyTuple_GET_ITEM(item, 0);
+    PyObject *value = PyTuple_GET_ITEM(item, 1);
+    std::vector<OwnedRef<PyObject>> candidates;
+
+    {
+        MapSection cs(self);
+
+        if (unlikely(!flush(self))) {
+            return -1;
+        }
+        try {
+            const auto comp = self->map.key_comp();
+            auto it = self->map.lower_bound(key);
+
+            for (; it != self->map.end() && !comp(key, std::get<0>(*it));
+                 ++it) {
+                candidates.emplace_back(std::get<1>(*it));
+            }
+        }
+        catch (PythonError &e) {
+            return -1;
+        }
+    }
+
+    // compare outside of the lock, __eq__ may change the map
+    for (const auto &candidate : candidates) {
+        int status = PyObject_RichCompareBool(candidate, value, Py_EQ);
+        if (status) {
+            return status;
+        }
+    }
+    return 0;
+}
+
+int
+sortedmap::itemview::contains(sortedmap::itemview::object *self,
+                              PyObject *item) {
+    return item_contains(self, item);
+}
+
+// Like dicts, maps start out untracked by the cyclic GC and are only tracked
+// once they hold an object which could refer back to them. Collections then
+// skip maps of atomic keys and values like ints, floats, and strs entirely.
+template<typename M>
+static inline void
+gc_track(M *self) {
+    if (!gc_is_tracked((PyObject*) self)) {
+        PyObject_GC_Track((PyObject*) self);
+    }
+}
+
+// Track ``self`` if ``ob`` may be part of a reference cycle.
+template<typename M>
+static inline void
+gc_maybe_track(M *self, PyObject *ob) {
+    if (PyObject_IS_GC(ob)) {
+        gc_track(self);
+    }
+}
+
+template<typename M>
+static inline void
+gc_maybe_track(M *self, PyObject *key, PyObject *value) {
+    if (PyObject_IS_GC(key) || PyObject_IS_GC(value)) {
+        gc_track(self);
+    }
+}
+
+// Track ``self`` after it takes pairs from ``other`` in bulk.
+template<typename M, typename O>
+static inline void
+gc_track_like(M *self, O *other) {
+    if (gc_is_tracked((PyObject*) other)) {
+        gc_track(self);
+    }
 }
 
-static sortedmap::object*
+template<typename M>
+static M*
 innernew(PyTypeObject *cls, PyObject *keyfunc) {
-    sortedmap::object *self = PyObject_GC_New(sortedmap::object, cls);
-    ;
+    M *self = PyObject_GC_New(M, cls);
 
     if (unlikely(!self)) {
         return NULL;
     }
 
-    self = new(self) sortedmap::object;
-    Py_XINCREF(keyfunc);
-    self->map = std::move(sortedmap::maptype(sortedmap::Comparator(keyfunc)));
+    self = new(self) M;
+    self->map = std::move(typename M::maptype(sortedmap::Comparator(keyfunc)));
+    if (keyfunc) {
+        gc_maybe_track(self, keyfunc);
+    }
     return self;
 }
 
+// Read a value for the aggregate tree, raising a TypeError if it is not a
+// number.
+static double
+aggregate_value(PyObject *value) {
+    double ret = PyFloat_AsDouble(value);
+
+    if (unlikely(ret == -1.0 && PyErr_Occurred())) {
+        PyErr_Clear();
+        PyErr_Format(PyExc_TypeError,
+                     "cannot aggregate a value of type %s",
+                     Py_TYPE(value)->tp_name);
+        throw PythonError();
+    }
+    return ret;
+}
+
+// Free an aggregate tree, which may be NULL.
+static void
+free_aggregates(sortedmap::aggregatetree *tree) {
+#if HAVE_AGGREGATE_TREE
+    delete tree;
+#endif  // HAVE_AGGREGATE_TREE
+}
+
+// Stop tracking aggregates. This is used when the aggregate tree could not
+// be kept in sync with the map so that it never gives wrong answers.
+static void
+drop_aggregates(sortedmap::object *self) {
+    free_aggregates(self->aggregates);
+    self->aggregates = nullptr;
+}
+
+// The helpers below are only called while ``self->aggregates`` is set, which
+// never happens without the aggregate tree.
+
+// Set ``key`` to ``value`` in the aggregate tree. The mapped value of a
+// node cannot change in place because the subtree metadata would be stale.
+static void
+aggregates_set(sortedmap::object *self, PyObject *key, double value) {
+#if HAVE_AGGREGATE_TREE
+    try {
+        auto &tree = *self->aggregates;
+        auto it = tree.find(key);
+
+        if (it != tree.end()) {
+            tree.erase(it);
+        }
+        tree.insert(std::make_pair(OwnedRef<PyObject>(key), value));
+    }
+    catch (PythonError &e) {
+        drop_aggregates(self);
+        throw;
+    }
+#endif  // HAVE_AGGREGATE_TREE
+}
+
+static void
+aggregates_erase(sortedmap::object *self, PyObject *key) {
+#if HAVE_AGGREGATE_TREE
+    try {
+        self->aggregates->erase(key);
+    }
+    catch (PythonError &e) {
+        drop_aggregates(self);
+        throw;
+    }
+#endif  // HAVE_AGGREGATE_TREE
+}
+
+// Erase ``count`` keys from the front or back of the aggregate tree.
+static void
+aggregates_pop(sortedmap::object *self, bool front, std::size_t count) {
+#if HAVE_AGGREGATE_TREE
+    auto &tree = *self->aggregates;
+    for (std::size_t n = 0; n < count; ++n) {
+        tree.erase((front) ? tree.begin() : std::prev(tree.end()));
+    }
+#endif  // HAVE_AGGREGATE_TREE
+}
+
+static sortedmap::aggregatetree*
+copy_aggregates(const sortedmap::aggregatetree &tree) {
+#if HAVE_AGGREGATE_TREE
+    return new sortedmap::aggregatetree(tree);
+#else
+    return nullptr;
+#endif  // HAVE_AGGREGATE_TREE
+}
+
+// Build a new aggregate tree over [first, last).
+static sortedmap::aggregatetree*
+new_aggregates(const sortedmap::maptype &map,
+               sortedmap::maptype::const_iterator first,
+               sortedmap::maptype::const_iterator last) {
+#if HAVE_AGGREGATE_TREE
+    auto ret = new sortedmap::aggregatetree(map.key_comp());
+
+    try {
+        for (; first != last; ++first) {
+            ret->insert(std::make_pair(std::get<0>(*first),
+                                       aggregate_value(std::get<1>(*first))));
+        }
+    }
+    catch (PythonError &e) {
+        delete ret;
+        throw;
+    }
+    return ret;
+#else
+    PyErr_SetString(PyExc_NotImplementedError,
+                    "sortedmap was built without aggregate trees");
+    throw PythonError();
+#endif  // HAVE_AGGREGATE_TREE
+}
+
 sortedmap::object*
 sortedmap::newobject(PyTypeObject *cls, PyObject *args, PyObject *kwargs) {
-    return innernew(cls, NULL);
+    return innernew<sortedmap::object>(cls, NULL);
 }
 
 int
@@ -209,29 +800,86 @@ sortedmap::init(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
 void
 sortedmap::dealloc(sortedmap::object *self) {
     using sortedmap::maptype;
+    using sortedmap::buffertype;
 
+    PyObject_GC_UnTrack(self);
+    if (unlikely(!log_close(self))) {
+        PyErr_WriteUnraisable((PyObject*) self);
+    }
     sortedmap::clear(self);
+    drop_aggregates(self);
     self->map.~maptype();
+    self->buffer.~buffertype();
+    Py_XDECREF(self->intern_pool);
     PyObject_GC_Del(self);
 }
 
 int
 sortedmap::traverse(sortedmap::object *self, visitproc visit, void *arg) {
+    PyObject *keyfunc = self->map.key_comp().keyfunc;
+
+    Py_VISIT(keyfunc);
     for (const auto &pair : self->map) {
         Py_VISIT(pair.first);
         Py_VISIT(pair.second);
     }
+    for (const auto &pair : self->buffer) {
+        Py_VISIT(pair.first);
+        Py_VISIT(pair.second);
+    }
+    Py_VISIT(self->intern_pool);
+#if HAVE_AGGREGATE_TREE
+    if (self->aggregates) {
+        // the aggregate tree holds its own references to the keys and the
+        // keyfunc
+        Py_VISIT(self->aggregates->get_cmp_fn().keyfunc);
+        for (const auto &pair : *self->aggregates) {
+            Py_VISIT(pair.first);
+        }
+    }
+#endif  // HAVE_AGGREGATE_TREE
     return 0;
 }
 
-void
-sortedmap::clear(sortedmap::object *self) {
-    self->map.clear();
-}
+int
+sortedmap::gcclear(sortedmap::object *self) {
+    MapSection cs(self);
+
+    sortedmap::clear(self);
+    drop_aggregates(self);
+    // the keyfunc and intern pool may be part of the cycle too
+    self->map = sortedmap::maptype(sortedmap::Comparator());
+    Py_CLEAR(self->intern_pool);
+    ++self->iter_revision;
+    return 0;
+}
+
+void
+sortedmap::clear(sortedmap::object *self) {
+    MapSection cs(self);
+
+    self->map.clear();
+    self->buffer.clear();
+#if HAVE_AGGREGATE_TREE
+    if (self->aggregates) {
+        self->aggregates->clear();
+    }
+#endif  // HAVE_AGGREGATE_TREE
+}
 
 PyObject*
 sortedmap::pyclear(sortedmap::object *self) {
+    MapSection cs(self);
+
     sortedmap::clear(self);
+    if (unlikely(self->log)) {
+        try {
+            log_push(self, LOG_CLEAR);
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
     Py_RETURN_NONE;
 }
 
@@ -242,7 +890,11 @@ sortedmap::richcompare(sortedmap::object *self, PyObject *other, int opid) {
     }
 
     sortedmap::object *asmap = (sortedmap::object*) other;
+    CriticalSection2 cs((PyObject*) self, other);
 
+    if (unlikely(!flush(self) || !flush(asmap))) {
+        return NULL;
+    }
     if (self->map.size() != asmap->map.size()) {
         return PyBool_FromLong(opid != Py_EQ);
     }
@@ -290,11 +942,127 @@ sortedmap::richcompare(sortedmap::object *self, PyObject *other, int opid) {
 
 Py_ssize_t
 sortedmap::len(sortedmap::object *self) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return -1;
+    }
+
     return self->map.size();
 }
 
+#if HAVE_FASTCALL
+// Unpack the arguments of ``fname`` into ``out`` by position or by keyword.
+// ``keywords`` is NULL terminated and the first ``required`` arguments must
+// be passed. Optional arguments which were not passed are set to NULL.
+static bool
+unpack_kwargs(const char *fname,
+              const char *const *keywords,
+              Py_ssize_t required,
+              PyObject **out,
+              PyObject *const *args,
+              Py_ssize_t nargs,
+              PyObject *kwnames) {
+    Py_ssize_t total = 0;
+
+    while (keywords[total]) {
+        out[total++] = NULL;
+    }
+
+    if (unlikely(nargs > total)) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s() takes at most %zd arguments (%zd given)",
+                     fname,
+                     total,
+                     nargs);
+        return false;
+    }
+    for (Py_ssize_t ix = 0; ix < nargs; ++ix) {
+        out[ix] = args[ix];
+    }
+
+    if (kwnames) {
+        for (Py_ssize_t kw = 0; kw < PyTuple_GET_SIZE(kwnames); ++kw) {
+            PyObject *name = PyTuple_GET_ITEM(kwnames, kw);
+            Py_ssize_t ix = 0;
+
+            while (ix < total &&
+                   PyUnicode_CompareWithASCIIString(name, keywords[ix])) {
+                ++ix;
+            }
+            if (unlikely(ix == total)) {
+                PyErr_Format(PyExc_TypeError,
+                             "'%U' is an invalid keyword argument for %s()",
+                             name,
+                             fname);
+                return false;
+            }
+            if (unlikely(out[ix])) {
+                PyErr_Format(PyExc_TypeError,
+                             "argument for %s() given by name ('%s') and"
+                             " position (%zd)",
+                             fname,
+                             keywords[ix],
+                             ix + 1);
+                return false;
+            }
+            out[ix] = args[nargs + kw];
+        }
+    }
+
+    for (Py_ssize_t ix = 0; ix < required; ++ix) {
+        if (unlikely(!out[ix])) {
+            PyErr_Format(PyExc_TypeError,
+                         "%s() missing required argument '%s' (pos %zd)",
+                         fname,
+                         keywords[ix],
+                         ix + 1);
+            return false;
+        }
+    }
+    return true;
+}
+#else
+static bool
+unpack_kwargs(const char *fname,
+              const char *const *keywords,
+              Py_ssize_t required,
+              PyObject **out,
+              PyObject *args,
+              PyObject *kwargs) {
+    // build the format string for PyArg_ParseTupleAndKeywords, there are
+    // never more than a few arguments
+    char format[32];
+    Py_ssize_t total = 0;
+    char *c = format;
+
+    while (keywords[total]) {
+        if (total == required) {
+            *c++ = '|';
+        }
+        *c++ = 'O';
+        out[total++] = NULL;
+    }
+    *c++ = ':';
+    std::strcpy(c, fname);
+
+    return PyArg_ParseTupleAndKeywords(args,
+                                       kwargs,
+                                       format,
+                                       (char**) keywords,
+                                       &out[0],
+                                       &out[1]);
+}
+#endif  // HAVE_FASTCALL
+
 PyObject*
 sortedmap::getitem(sortedmap::object *self, PyObject *key) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
     try {
         const auto &it = self->map.find(key);
         if (it == self->map.end()) {
@@ -310,6 +1078,12 @@ sortedmap::getitem(sortedmap::object *self, PyObject *key) {
 
 PyObject*
 sortedmap::get(sortedmap::object *self, PyObject *key, PyObject *def) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
     try {
         const auto &it = self->map.find(key);
         if (it == self->map.end()) {
@@ -324,29 +1098,25 @@ sortedmap::get(sortedmap::object *self, PyObject *key, PyObject *def) {
 }
 
 PyObject*
-sortedmap::pyget(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    const char *keywords[] = {"key", "default", NULL};
-    PyObject *key;
-    PyObject *def = NULL;
+sortedmap::pyget(sortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O|O:get",
-                                     (char**) keywords,
-                                     &key,
-                                     &def)) {
+    if (!unpack_kwargs("get", keywords, 1, argv, KWARGS_FORWARD)) {
         return NULL;
     }
 
-    if (!def) {
-        def = Py_None;
-    }
-
-    return sortedmap::get(self, key, def);
+    return sortedmap::get(self, argv[0], (argv[1]) ? argv[1] : Py_None);
 }
 
 PyObject*
 sortedmap::pop(sortedmap::object *self, PyObject *key, PyObject *def) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
     try {
         PyObject *ret;
 
@@ -360,10 +1130,26 @@ sortedmap::pop(sortedmap::object *self, PyObject *key, PyObject *def) {
             }
             return def;
         }
+        std::string record;
+        if (unlikely(self->log)) {
+            log_encode(record, LOG_DEL, std::get<0>(*it));
+        }
         ret = std::get<1>(*it).incref();
         // use the same iterator to the item for a faster erase
         self->map.erase(it);
         ++self->iter_revision;
+        try {
+            if (self->aggregates) {
+                aggregates_erase(self, key);
+            }
+            if (unlikely(self->log)) {
+                log_push(self, record, 1);
+            }
+        }
+        catch (PythonError &e) {
+            Py_DECREF(ret);
+            throw;
+        }
         return ret;
     }
     catch (PythonError &e) {
@@ -372,25 +1158,25 @@ sortedmap::pop(sortedmap::object *self, PyObject *key, PyObject *def) {
 }
 
 PyObject*
-sortedmap::pypop(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    const char *keywords[] = {"key", "default", NULL};
-    PyObject *key;
-    PyObject *def = NULL;
+sortedmap::pypop(sortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O|O:pop",
-                                     (char**) keywords,
-                                     &key,
-                                     &def)) {
+    if (!unpack_kwargs("pop", keywords, 1, argv, KWARGS_FORWARD)) {
         return NULL;
     }
 
-    return sortedmap::pop(self, key, def);
+    return sortedmap::pop(self, argv[0], argv[1]);
 }
 
 PyObject*
 sortedmap::popitem(sortedmap::object *self, bool front) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
     sortedmap::maptype::iterator it;
     bool empty;
     PyObject *ret;
@@ -410,27 +1196,42 @@ sortedmap::popitem(sortedmap::object *self, bool front) {
         return NULL;
     }
 
+    std::string record;
+    try {
+        if (unlikely(self->log)) {
+            log_encode(record, LOG_DEL, std::get<0>(*it));
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
     if (!(ret = sortedmap::itemiter::elem(it))) {
         return NULL;
     }
     ++self->iter_revision;
     self->map.erase(it);
+    if (self->aggregates) {
+        aggregates_pop(self, front, 1);
+    }
+    if (unlikely(self->log)) {
+        try {
+            log_push(self, record, 1);
+        }
+        catch (PythonError &e) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+    }
     return ret;
 }
 
 PyObject*
-sortedmap::pypopitem(sortedmap::object *self,
-                     PyObject *args,
-                     PyObject *kwargs) {
-    const char *keywords[] = {"first", NULL};
-    PyObject *pyfirst = NULL;
+sortedmap::pypopitem(sortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"first", NULL};
+    PyObject *pyfirst;
     int first;
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "|O:popitem",
-                                     (char**) keywords,
-                                     &pyfirst)) {
+    if (!unpack_kwargs("popitem", keywords, 0, &pyfirst, KWARGS_FORWARD)) {
         return NULL;
     }
 
@@ -446,444 +1247,6457 @@ sortedmap::pypopitem(sortedmap::object *self,
     return sortedmap::popitem(self, first);
 }
 
-static void
-setitem_throws(sortedmap::object *self, PyObject *key, PyObject *value) {
-    const auto &pair = self->map.emplace(key, value);
-    if (std::get<1>(pair)) {
-        ++self->iter_revision;
+// Remove the ``count`` pairs starting at ``first`` or, if ``!front``, ending
+// at ``last``. The pairs are returned in a list in the order ``popitem``
+// would have returned them.
+static PyObject*
+erase_run(sortedmap::object *self,
+          sortedmap::maptype::iterator first,
+          sortedmap::maptype::iterator last,
+          std::size_t count,
+          bool front) {
+    PyObject *ret = PyList_New(count);
+    Py_ssize_t ix = (front) ? 0 : count - 1;
+    PyObject *item;
+    std::string records;
+
+    if (unlikely(!ret)) {
+        return NULL;
     }
-    else {
-        std::get<1>(*std::get<0>(pair)) = std::move(OwnedRef<PyObject>(value));
+    for (auto it = first; it != last; ++it) {
+        if (unlikely(self->log)) {
+            try {
+                log_encode(records, LOG_DEL, std::get<0>(*it));
+            }
+            catch (PythonError &e) {
+                Py_DECREF(ret);
+                return NULL;
+            }
+        }
+        if (unlikely(!(item = sortedmap::itemiter::elem(it)))) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        PyList_SET_ITEM(ret, ix, item);
+        ix += (front) ? 1 : -1;
     }
-}
 
-int
-sortedmap::setitem(sortedmap::object *self, PyObject *key, PyObject *value) {
-    try {
-        if (!value) {
-            self->map.erase(key);
-            ++self->iter_revision;
+    if (count) {
+        self->map.erase(first, last);
+        ++self->iter_revision;
+        if (self->aggregates) {
+            aggregates_pop(self, front, count);
         }
-        else {
-            setitem_throws(self, key, value);
+        if (unlikely(self->log)) {
+            try {
+                log_push(self, records, count);
+            }
+            catch (PythonError &e) {
+                Py_DECREF(ret);
+                return NULL;
+            }
         }
     }
-    catch (PythonError &e) {
-        return -1;
-    }
-    return 0;
+    return ret;
 }
 
-
 PyObject*
-sortedmap::setdefault(sortedmap::object *self, PyObject *key, PyObject *def) {
-    PyObject *ret;
-    try {
-        ret = sortedmap::valiter::elem(
-            std::get<0>(self->map.emplace(key, def)));
-        if (ret != def) {
-            ++self->iter_revision;
-        }
-        return ret;
-    }
-    catch (PythonError &e) {
+sortedmap::popitems(sortedmap::object *self, Py_ssize_t n, bool front) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
         return NULL;
     }
+
+    std::size_t count = std::min((std::size_t) n, self->map.size());
+
+    if (front) {
+        return erase_run(self,
+                         self->map.begin(),
+                         std::next(self->map.begin(), count),
+                         count,
+                         front);
+    }
+    return erase_run(self,
+                     std::prev(self->map.end(), count),
+                     self->map.end(),
+                     count,
+                     front);
 }
 
 PyObject*
-sortedmap::pysetdefault(sortedmap::object *self,
-                        PyObject *args,
-                        PyObject *kwargs) {
-    const char *keywords[] = {"key", "default", NULL};
-    PyObject *key;
-    PyObject *def = NULL;
+sortedmap::pypopitems(sortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"n", "first", NULL};
+    PyObject *argv[2];
+    Py_ssize_t n;
+    int first;
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwargs,
-                                     "O|O:setdefault",
-                                     (char**) keywords,
-                                     &key,
-                                     &def)) {
+    if (!unpack_kwargs("popitems", keywords, 1, argv, KWARGS_FORWARD)) {
         return NULL;
     }
 
-    if (!def) {
-        def = Py_None;
+    n = PyNumber_AsSsize_t(argv[0], PyExc_OverflowError);
+    if (n == -1 && PyErr_Occurred()) {
+        return NULL;
     }
-    return sortedmap::setdefault(self, key, def);
-}
-
-int
-sortedmap::contains(sortedmap::object *self, PyObject *key) {
-    try {
-        return self->map.find(key) != self->map.end();
+    if (n < 0) {
+        PyErr_Format(PyExc_ValueError, "n must be non-negative, got %zd", n);
+        return NULL;
     }
-    catch (PythonError &e) {
-        return -1;
+    if (argv[1]) {
+        first = PyObject_IsTrue(argv[1]);
+        if (first < 0) {
+            return NULL;
+        }
+    }
+    else {
+        first = true;
     }
+    return sortedmap::popitems(self, n, first);
 }
 
 PyObject*
-sortedmap::repr(sortedmap::object *self) {
-    PyObject *it;
-    PyObject *aslist;
-    PyObject *ret;
-    PyObject *keyfunc;
+sortedmap::pop_until(sortedmap::object *self, PyObject *key) {
+    MapSection cs(self);
 
-    if (!(it = itemiter::iter(self))) {
+    if (unlikely(!flush(self))) {
         return NULL;
     }
-    aslist = PySequence_List(it);
-    Py_DECREF(it);
-    if (!aslist) {
+
+    try {
+        auto last = self->map.lower_bound(key);
+        return erase_run(self,
+                         self->map.begin(),
+                         last,
+                         std::distance(self->map.begin(), last),
+                         true);
+    }
+    catch (PythonError &e) {
         return NULL;
     }
-    if (self->map.key_comp().keyfunc) {
-        if (!(keyfunc =
-              PyUnicode_FromFormat("[%R]", self->map.key_comp().keyfunc))) {
-            Py_DECREF(aslist);
-            return NULL;
-        }
+}
+
+// Drop pairs from the evicting end until the map fits in ``maxlen``.
+static void
+trim(sortedmap::object *self) {
+    auto &map = self->map;
+
+    if (self->maxlen < 0 || map.size() <= (std::size_t) self->maxlen) {
+        return;
     }
-    else {
-        if (!(keyfunc = PyUnicode_FromString(""))) {
-            Py_DECREF(aslist);
-            return NULL;
+
+    ++self->iter_revision;
+    while (map.size() > (std::size_t) self->maxlen) {
+        map.erase((self->evict_first) ? map.begin() : std::prev(map.end()));
+        if (self->aggregates) {
+            aggregates_pop(self, self->evict_first, 1);
         }
     }
-    ret = PyUnicode_FromFormat("%s%S(%R)",
-                               Py_TYPE(self)->tp_name,
-                               keyfunc,
-                               aslist);
-    Py_DECREF(keyfunc);
-    Py_DECREF(aslist);
-    return ret;
 }
 
-sortedmap::object*
-sortedmap::copy(sortedmap::object *self) {
-    sortedmap::object *ret = innernew(Py_TYPE(self),
-                                      self->map.key_comp().keyfunc);
+// Find the canonical copy of ``key`` in the map's intern pool, adding
+// ``key`` if it is new. Only exact str, bytes, and int keys are interned.
+// Returns a borrowed reference which the pool keeps alive.
+static PyObject*
+intern_key(sortedmap::object *self, PyObject *key) {
+    PyTypeObject *type = Py_TYPE(key);
 
-    if (unlikely(!ret)) {
-        return NULL;
+    if (!self->intern_pool ||
+        !(type == &PyUnicode_Type ||
+          type == &PyBytes_Type ||
+          type == &PyLong_Type)) {
+        return key;
     }
 
-    ret->map = self->map;
+#if !COMPILING_IN_PY2
+    PyObject *ret = PyDict_SetDefault(self->intern_pool, key, key);
+#else
+    PyObject *ret = PyDict_GetItem(self->intern_pool, key);
+    if (!ret && !PyDict_SetItem(self->intern_pool, key, key)) {
+        ret = key;
+    }
+#endif  // !COMPILING_IN_PY2
+    if (unlikely(!ret)) {
+        throw PythonError();
+    }
     return ret;
 }
 
-static bool
-merge(sortedmap::object *self, PyObject *other) {
-    if (sortedmap::check_exact(other)) {
-        sortedmap::object *asmap = (sortedmap::object*) other;
-        if (!self->map.size() &&
-            self->map.key_comp().keyfunc == asmap->map.key_comp().keyfunc) {
-            // fast path for copy constructor
-            self->map = asmap->map;
-            return true;
+// Store a pair in a map which is at ``maxlen``. A key which would be evicted
+// right away is dropped after one comparison against the boundary key,
+// otherwise the boundary node is reused for the new pair.
+static void
+bounded_setitem(sortedmap::object *self,
+                PyObject *key,
+                PyObject *value,
+                double aggvalue) {
+    auto &map = self->map;
+    const auto comp = map.key_comp();
+
+    if (!map.size()) {
+        return;
+    }
+
+    auto boundary = (self->evict_first) ? map.begin() : std::prev(map.end());
+    if ((self->evict_first) ?
+        comp(key, std::get<0>(*boundary)) :
+        comp(std::get<0>(*boundary), key)) {
+        return;
+    }
+
+    auto it = map.lower_bound(key);
+    if (it != map.end() && !comp(key, std::get<0>(*it))) {
+        std::get<1>(*it) = value;
+        if (self->aggregates) {
+            aggregates_set(self, key, aggvalue);
         }
+        return;
+    }
+
+    // when evicting the last pair the new key may belong right before it
+    bool at_boundary = it == boundary;
+    auto node = map.extract(boundary);
+    OwnedRef<PyObject> old_key = node.key();
+    OwnedRef<PyObject> old_value = node.mapped();
+
+    node.key() = intern_key(self, key);
+    node.mapped() = value;
+    ++self->iter_revision;
+    try {
+        map.insert((at_boundary) ? map.end() : it, std::move(node));
+    }
+    catch (PythonError &e) {
+        // put the evicted pair back so that it is not dropped
+        PyObject *type, *exc, *tb;
+
+        PyErr_Fetch(&type, &exc, &tb);
+        node.key() = old_key;
+        node.mapped() = old_value;
         try {
-            for (const auto &pair : ((sortedmap::object*) other)->map) {
-                setitem_throws(self, std::get<0>(pair), std::get<1>(pair));
-            }
+            map.insert(std::move(node));
         }
         catch (PythonError &e) {
-            return false;
+            PyErr_Clear();
         }
-
-        return true;
+        PyErr_Restore(type, exc, tb);
+        throw;
+    }
+    if (self->aggregates) {
+        aggregates_erase(self, old_key);
+        aggregates_set(self, key, aggvalue);
     }
+}
 
-    PyObject *key;
+// Store a pair directly in the tree, skipping the write buffer.
+static void
+write_through(sortedmap::object *self, PyObject *key, PyObject *value) {
+    // read the value first so that a bad value does not change the map
+    double aggvalue = (self->aggregates) ? aggregate_value(value) : 0;
 
-    if (PyDict_Check(other)) {
-        PyObject *value;
-        Py_ssize_t pos = 0;
+    gc_maybe_track(self, key, value);
 
-        while (PyDict_Next(other, &pos, &key, &value)) {
-            try {
-                setitem_throws(self, key, value);
-            }
-            catch (PythonError &e) {
-                return false;
-            }
+    // only keys which are stored are interned, so rejected keys do not grow
+    // the pool
+    if (self->maxlen >= 0 && self->map.size() >= (std::size_t) self->maxlen) {
+        bounded_setitem(self, key, value, aggvalue);
+        return;
+    }
+
+    if (self->intern_pool) {
+        auto &map = self->map;
+        auto it = map.lower_bound(key);
+
+        if (it != map.end() && !map.key_comp()(key, std::get<0>(*it))) {
+            std::get<1>(*it) = value;
+        }
+        else {
+            map.emplace_hint(it, intern_key(self, key), value);
+            ++self->iter_revision;
         }
     }
     else {
-        PyObject *keys;
-        PyObject *it;
-        PyObject *tmp;
+        const auto &pair = self->map.emplace(key, value);
+        if (std::get<1>(pair)) {
+            ++self->iter_revision;
+        }
+        else {
+            std::get<1>(*std::get<0>(pair)) =
+                std::move(OwnedRef<PyObject>(value));
+        }
+    }
+    if (self->aggregates) {
+        aggregates_set(self, key, aggvalue);
+    }
+}
 
-        if (unlikely(!(keys = PyMapping_Keys(other)))) {
-            return false;
+static void
+store_pair(sortedmap::object *self, PyObject *key, PyObject *value) {
+    if (!self->buffer_limit) {
+        write_through(self, key, value);
+        return;
+    }
+    if (self->aggregates) {
+        // raise for a bad value now instead of when the buffer is merged
+        aggregate_value(value);
+    }
+    if (self->buffer.empty()) {
+        // iterators made while the buffer was empty do not see these pairs
+        ++self->iter_revision;
+    }
+    gc_maybe_track(self, key, value);
+    self->buffer.emplace_back(key, value);
+    if (self->buffer.size() >= self->buffer_limit && !flush(self)) {
+        throw PythonError();
+    }
+}
+
+static void
+setitem_throws(sortedmap::object *self, PyObject *key, PyObject *value) {
+    if (likely(!self->log)) {
+        store_pair(self, key, value);
+        return;
+    }
+
+    // encode the record first so that a value which cannot be logged does
+    // not change the map
+    std::string record;
+
+    log_encode_set(record, key, value);
+    // skip the buffer, a buffered key may fail to compare when it is merged
+    // and must not be in the log
+    if (unlikely(!flush(self))) {
+        throw PythonError();
+    }
+    write_through(self, key, value);
+    log_push(self, record, 1);
+}
+
+int
+sortedmap::setitem(sortedmap::object *self, PyObject *key, PyObject *value) {
+    MapSection cs(self);
+
+    try {
+        if (!value) {
+            if (unlikely(!flush(self))) {
+                return -1;
+            }
+
+            std::string record;
+            if (unlikely(self->log)) {
+                log_encode(record, LOG_DEL, key);
+            }
+            bool erased = self->map.erase(key);
+            ++self->iter_revision;
+            if (self->aggregates) {
+                aggregates_erase(self, key);
+            }
+            if (unlikely(self->log) && erased) {
+                log_push(self, record, 1);
+            }
+        }
+        else {
+            setitem_throws(self, key, value);
         }
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+    return 0;
+}
 
-        it = PyObject_GetIter(keys);
-        Py_DECREF(keys);
-        if (unlikely(!it)) {
-            return false;
+
+PyObject*
+sortedmap::setdefault(sortedmap::object *self, PyObject *key, PyObject *def) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    try {
+        std::string record;
+        if (unlikely(self->log)) {
+            log_encode_set(record, key, def);
         }
-        while ((key = PyIter_Next(it))) {
-            if (unlikely(!(tmp = PyObject_GetItem(other, key)))) {
-                Py_DECREF(key);
-                Py_DECREF(it);
-                return false;
+
+        key = intern_key(self, key);
+        gc_maybe_track(self, key, def);
+
+        const auto &pair = self->map.emplace(key, def);
+        if (std::get<1>(pair)) {
+            if (self->aggregates) {
+                try {
+                    aggregates_set(self, key, aggregate_value(def));
+                }
+                catch (PythonError &e) {
+                    self->map.erase(std::get<0>(pair));
+                    throw;
+                }
             }
+            ++self->iter_revision;
+        }
+
+        bool inserted = std::get<1>(pair);
+        PyObject *ret = sortedmap::valiter::elem(std::get<0>(pair));
+        trim(self);
+        if (unlikely(self->log) && inserted) {
             try {
-                setitem_throws(self, key, tmp);
+                log_push(self, record, 1);
             }
             catch (PythonError &e) {
-                Py_DECREF(key);
-                Py_DECREF(it);
-                return false;
+                Py_DECREF(ret);
+                throw;
             }
-            Py_DECREF(key);
         }
-        Py_DECREF(it);
-        if (unlikely(PyErr_Occurred())) {
-            return false;
+        return ret;
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmap::pysetdefault(sortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
+
+    if (!unpack_kwargs("setdefault", keywords, 1, argv, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    return sortedmap::setdefault(self,
+                                 argv[0],
+                                 (argv[1]) ? argv[1] : Py_None);
+}
+
+// Build the (key, value) tuple for a pair in any kind of map.
+template<typename P>
+static inline PyObject*
+pair_tuple(const P &pair) {
+    return PyTuple_Pack(2, std::get<0>(pair).ob, std::get<1>(pair).ob);
+}
+
+// Find the pair next to ``key``. ``upper`` selects ``upper_bound`` over
+// ``lower_bound`` and ``before`` steps back to the pair before the bound.
+template<typename M, bool upper, bool before>
+static PyObject*
+neighbor_item(M *self, PyObject *key) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    try {
+        auto it = (upper) ? self->map.upper_bound(key) :
+            self->map.lower_bound(key);
+
+        if (before ? it == self->map.begin() : it == self->map.end()) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+        if (before) {
+            --it;
+        }
+        return pair_tuple(*it);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmap::floor_item(sortedmap::object *self, PyObject *key) {
+    return neighbor_item<sortedmap::object, true, true>(self, key);
+}
+
+PyObject*
+sortedmap::ceiling_item(sortedmap::object *self, PyObject *key) {
+    return neighbor_item<sortedmap::object, false, false>(self, key);
+}
+
+PyObject*
+sortedmap::lower_item(sortedmap::object *self, PyObject *key) {
+    return neighbor_item<sortedmap::object, false, true>(self, key);
+}
+
+PyObject*
+sortedmap::higher_item(sortedmap::object *self, PyObject *key) {
+    return neighbor_item<sortedmap::object, true, false>(self, key);
+}
+
+// Compute ``abs(a - b)``.
+static PyObject*
+distance(PyObject *a, PyObject *b) {
+    PyObject *diff;
+    PyObject *ret;
+
+    if (unlikely(!(diff = PyNumber_Subtract(a, b)))) {
+        return NULL;
+    }
+    ret = PyNumber_Absolute(diff);
+    Py_DECREF(diff);
+    return ret;
+}
+
+template<typename M>
+static PyObject*
+innernearest_item(M *self, PyObject *key) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    try {
+        auto it = self->map.lower_bound(key);
+
+        if (it == self->map.end()) {
+            if (it == self->map.begin()) {
+                PyErr_SetObject(PyExc_KeyError, key);
+                return NULL;
+            }
+            return pair_tuple(*std::prev(it));
+        }
+        if (it == self->map.begin() ||
+            !self->map.key_comp()(key, std::get<0>(*it))) {
+            // nothing before the key or an exact match
+            return pair_tuple(*it);
+        }
+
+        auto prev = std::prev(it);
+        PyObject *above;
+        PyObject *below;
+        int status;
+
+        if (unlikely(!(above = distance(std::get<0>(*it), key)))) {
+            return NULL;
+        }
+        if (unlikely(!(below = distance(key, std::get<0>(*prev))))) {
+            Py_DECREF(above);
+            return NULL;
+        }
+        status = PyObject_RichCompareBool(above, below, Py_LT);
+        Py_DECREF(above);
+        Py_DECREF(below);
+        if (unlikely(status < 0)) {
+            return NULL;
+        }
+        return pair_tuple((status) ? *it : *prev);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmap::nearest_item(sortedmap::object *self, PyObject *key) {
+    return innernearest_item(self, key);
+}
+
+// Compute the smallest string which is greater than every string starting
+// with ``prefix``. This returns None if there is no such string.
+static PyObject*
+prefix_successor(PyObject *prefix) {
+    if (PyBytes_Check(prefix)) {
+        const unsigned char *data =
+            (const unsigned char*) PyBytes_AS_STRING(prefix);
+        Py_ssize_t len = PyBytes_GET_SIZE(prefix);
+
+        while (len && data[len - 1] == 0xff) {
+            --len;
+        }
+        if (!len) {
+            Py_RETURN_NONE;
+        }
+
+        PyObject *ret = PyBytes_FromStringAndSize((const char*) data, len);
+        if (likely(ret)) {
+            ++((unsigned char*) PyBytes_AS_STRING(ret))[len - 1];
+        }
+        return ret;
+    }
+
+#if !COMPILING_IN_PY2
+    Py_ssize_t len = PyUnicode_GET_LENGTH(prefix);
+    Py_UCS4 last = 0;
+
+    while (len && (last = PyUnicode_READ_CHAR(prefix, len - 1)) == 0x10ffff) {
+        --len;
+    }
+    if (!len) {
+        Py_RETURN_NONE;
+    }
+
+    PyObject *head;
+    PyObject *tail;
+    PyObject *ret;
+
+    if (unlikely(!(head = PyUnicode_Substring(prefix, 0, len - 1)))) {
+        return NULL;
+    }
+    if (unlikely(!(tail = PyUnicode_FromOrdinal(last + 1)))) {
+        Py_DECREF(head);
+        return NULL;
+    }
+    ret = PyUnicode_Concat(head, tail);
+    Py_DECREF(head);
+    Py_DECREF(tail);
+    return ret;
+#else
+    PyErr_SetString(PyExc_TypeError, "unicode prefixes are not supported");
+    return NULL;
+#endif  // !COMPILING_IN_PY2
+}
+
+template<typename M, PyTypeObject &keyiter>
+static PyObject*
+inneriprefix(M *self, PyObject *prefix) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    if (!(PyBytes_Check(prefix) || PyUnicode_Check(prefix))) {
+        PyErr_Format(PyExc_TypeError,
+                     "prefix must be str or bytes, got %s",
+                     Py_TYPE(prefix)->tp_name);
+        return NULL;
+    }
+    if (self->map.key_comp().keyfunc) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot search for a prefix with a keyfunc");
+        return NULL;
+    }
+
+    PyObject *successor;
+    if (unlikely(!(successor = prefix_successor(prefix)))) {
+        return NULL;
+    }
+
+    // every key with the prefix sorts in [prefix, successor)
+    PyObject *ret;
+    try {
+        auto first = self->map.lower_bound(prefix);
+        auto last = (successor == Py_None) ?
+            self->map.end() :
+            self->map.lower_bound(successor);
+
+        ret = sortedmap::abstractiter::iter<M, keyiter>(self, first, last);
+    }
+    catch (PythonError &e) {
+        ret = NULL;
+    }
+    Py_DECREF(successor);
+    return ret;
+}
+
+PyObject*
+sortedmap::iprefix(sortedmap::object *self, PyObject *prefix) {
+    return inneriprefix<sortedmap::object, sortedmap::keyiter::type>(self,
+                                                                    prefix);
+}
+
+int
+sortedmap::contains(sortedmap::object *self, PyObject *key) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return -1;
+    }
+
+    try {
+        return self->map.find(key) != self->map.end();
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+// Shared implementation of ``repr`` which shows the keyfunc and the items.
+template<typename M, PyObject *items(M*)>
+static PyObject*
+innerrepr(M *self) {
+    PyObject *it;
+    PyObject *aslist;
+    PyObject *ret;
+    PyObject *keyfunc;
+
+    if (!(it = items(self))) {
+        return NULL;
+    }
+    aslist = PySequence_List(it);
+    Py_DECREF(it);
+    if (!aslist) {
+        return NULL;
+    }
+    if (self->map.key_comp().keyfunc) {
+        if (!(keyfunc =
+              PyUnicode_FromFormat("[%R]", self->map.key_comp().keyfunc))) {
+            Py_DECREF(aslist);
+            return NULL;
         }
     }
+    else {
+        if (!(keyfunc = PyUnicode_FromString(""))) {
+            Py_DECREF(aslist);
+            return NULL;
+        }
+    }
+    ret = PyUnicode_FromFormat("%s%S(%R)",
+                               Py_TYPE(self)->tp_name,
+                               keyfunc,
+                               aslist);
+    Py_DECREF(keyfunc);
+    Py_DECREF(aslist);
+    return ret;
+}
+
+PyObject*
+sortedmap::repr(sortedmap::object *self) {
+    return innerrepr<sortedmap::object, sortedmap::itemiter::iter>(self);
+}
+
+sortedmap::object*
+sortedmap::copy(sortedmap::object *self) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    sortedmap::object *ret = innernew<sortedmap::object>(Py_TYPE(self),
+                                      self->map.key_comp().keyfunc);
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+
+    ret->map = self->map;
+    gc_track_like(ret, self);
+    ret->maxlen = self->maxlen;
+    ret->evict_first = self->evict_first;
+    ret->buffer_limit = self->buffer_limit;
+    Py_XINCREF(self->intern_pool);
+    ret->intern_pool = self->intern_pool;
+    if (self->aggregates) {
+        ret->aggregates = copy_aggregates(*self->aggregates);
+    }
+    return ret;
+}
+
+// The bytes used by each node of a map of type ``T``.
+template<typename T>
+static constexpr std::size_t
+node_size() {
+#ifdef __GLIBCXX__
+    return pool_allocator<
+        std::_Rb_tree_node<typename T::value_type>>::node_size;
+#else
+    // a color and three pointers per node is typical
+    return sizeof(typename T::value_type) + 4 * sizeof(void*);
+#endif  // __GLIBCXX__
+}
+
+template<typename M>
+static std::size_t
+innersizeof(M *self) {
+    return Py_TYPE(self)->tp_basicsize +
+        self->map.size() * node_size<typename M::maptype>();
+}
+
+PyObject*
+sortedmap::sizeof_(sortedmap::object *self) {
+    MapSection cs(self);
+
+    std::size_t size = innersizeof(self) +
+        self->buffer.capacity() * sizeof(sortedmap::buffertype::value_type);
+
+#if HAVE_AGGREGATE_TREE
+    if (self->aggregates) {
+        // the tree policy nodes are not exposed, estimate them the same way
+        // as a map node with the metadata, a color, three pointers, and
+        // malloc's header
+        size += sizeof(sortedmap::aggregatetree) +
+            self->aggregates->size() *
+            (sizeof(sortedmap::aggregatetree::value_type) +
+             sizeof(sortedmap::aggregate) +
+             5 * sizeof(void*));
+    }
+#endif  // HAVE_AGGREGATE_TREE
+    return PyLong_FromSize_t(size);
+}
+
+// Check if two maps order their keys the same way.
+// Returns 1 if they do, 0 if they do not, and -1 if comparing the keyfuncs
+// raised.
+template<typename A, typename B>
+static int
+same_order(A *a, B *b) {
+    PyObject *a_keyfunc = a->map.key_comp().keyfunc;
+    PyObject *b_keyfunc = b->map.key_comp().keyfunc;
+
+    if (a_keyfunc == b_keyfunc) {
+        return 1;
+    }
+    if (!a_keyfunc || !b_keyfunc) {
+        return 0;
+    }
+    return PyObject_RichCompareBool(a_keyfunc, b_keyfunc, Py_EQ);
+}
+
+// Check if two maps hold equal pairs in the same order. Both maps must be
+// held by the caller.
+// Returns 1 if they do, 0 if they do not, and -1 if a comparison raised.
+template<typename A, typename B>
+static int
+equal_pairs(A *a, B *b) {
+    int status;
+
+    if (a->map.size() != b->map.size()) {
+        return 0;
+    }
+    if (unlikely((status = same_order(a, b)) < 0) || !status) {
+        return status;
+    }
+
+    // Both maps are sorted the same way so walk them in lock-step; equal
+    // keys must hold equal values in the same order.
+    const auto comp = a->map.key_comp();
+    auto b_it = b->map.cbegin();
+
+    try {
+        for (const auto &pair : a->map) {
+            const auto &b_pair = *b_it++;
+
+            if (comp(std::get<0>(pair), std::get<0>(b_pair)) ||
+                comp(std::get<0>(b_pair), std::get<0>(pair))) {
+                return 0;
+            }
+            status = PyObject_RichCompareBool(std::get<1>(pair),
+                                              std::get<1>(b_pair),
+                                              Py_EQ);
+            if (status <= 0) {
+                return status;
+            }
+        }
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+    return 1;
+}
+
+// Move the nodes in [first, last) from src to dst without reallocating them.
+// When all of the moved keys sort after (back) or before (!back) every key in
+// dst each node is linked in with a constant time hinted insert.
+static void
+splice(sortedmap::maptype &dst,
+       sortedmap::maptype &src,
+       sortedmap::maptype::iterator first,
+       sortedmap::maptype::iterator last,
+       bool back) {
+    sortedmap::maptype::node_type node;
+
+    try {
+        if (back) {
+            while (first != last) {
+                node = src.extract(first++);
+                dst.insert(dst.end(), std::move(node));
+            }
+        }
+        else if (first != last) {
+            // first is invalidated when it is extracted so check for the
+            // end of the range before moving the node
+            bool done;
+            do {
+                auto it = std::prev(last);
+                done = it == first;
+                node = src.extract(it);
+                dst.insert(dst.begin(), std::move(node));
+            } while (!done);
+        }
+    }
+    catch (PythonError &e) {
+        if (node) {
+            // put the node we were moving back where it came from so that
+            // it is not dropped
+            PyObject *type, *value, *tb;
+
+            PyErr_Fetch(&type, &value, &tb);
+            try {
+                src.insert(std::move(node));
+            }
+            catch (PythonError &e) {
+                PyErr_Clear();
+            }
+            PyErr_Restore(type, value, tb);
+        }
+        throw;
+    }
+}
+
+// Whether ``it`` has fewer pairs before it than after it. This walks in from
+// both ends at once so it only takes as many steps as the smaller side.
+template<typename M>
+static bool
+nearer_begin(const M &map, typename M::const_iterator it) {
+    auto front = map.begin();
+    auto back = map.end();
+
+    // ``it`` is between the two so neither walks off of the map
+    for (;;) {
+        if (front == it) {
+            return true;
+        }
+        if (back == it) {
+            return false;
+        }
+        ++front;
+        --back;
+    }
+}
+
+PyObject*
+sortedmap::split(sortedmap::object *self, PyObject *key) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    sortedmap::object *ret;
+    std::string record;
+
+    if (unlikely(self->log)) {
+        try {
+            log_encode(record, LOG_SPLIT, key);
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+    if (unlikely(!(ret = innernew<sortedmap::object>(Py_TYPE(self),
+                                  self->map.key_comp().keyfunc)))) {
+        return NULL;
+    }
+    ret->maxlen = self->maxlen;
+    ret->evict_first = self->evict_first;
+    ret->buffer_limit = self->buffer_limit;
+    Py_XINCREF(self->intern_pool);
+    ret->intern_pool = self->intern_pool;
+    gc_track_like(ret, self);
+
+    try {
+        auto it = self->map.lower_bound(key);
+
+        // move whichever side is smaller, the swap is constant time
+        if (nearer_begin(self->map, it)) {
+            splice(ret->map, self->map, self->map.begin(), it, true);
+            self->map.swap(ret->map);
+        }
+        else {
+            splice(ret->map, self->map, it, self->map.end(), true);
+        }
+    }
+    catch (PythonError &e) {
+        PyObject *type, *value, *tb;
+
+        // return the nodes that were already moved
+        PyErr_Fetch(&type, &value, &tb);
+        try {
+            splice(self->map, ret->map, ret->map.begin(), ret->map.end(), true);
+        }
+        catch (PythonError &e) {
+            PyErr_Clear();
+        }
+        PyErr_Restore(type, value, tb);
+        Py_DECREF(ret);
+        return NULL;
+    }
+
+#if HAVE_AGGREGATE_TREE
+    if (self->aggregates) {
+        auto &lower = *self->aggregates;
+
+        ret->aggregates = new sortedmap::aggregatetree(lower.get_cmp_fn());
+        try {
+            // the tree's split keeps ``key`` on the left so move it over
+            lower.split(key, *ret->aggregates);
+            if (lower.size() && !lower.get_cmp_fn()(
+                    std::prev(lower.end())->first, key)) {
+                auto it = std::prev(lower.end());
+                ret->aggregates->insert(*it);
+                lower.erase(it);
+            }
+        }
+        catch (PythonError &e) {
+            // the maps were split, just stop tracking aggregates
+            PyErr_Clear();
+            drop_aggregates(self);
+            drop_aggregates(ret);
+        }
+    }
+#endif  // HAVE_AGGREGATE_TREE
+
+    if (ret->map.size()) {
+        ++self->iter_revision;
+    }
+    if (unlikely(self->log)) {
+        try {
+            log_push(self, record, 1);
+        }
+        catch (PythonError &e) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+    }
+    return (PyObject*) ret;
+}
+
+PyObject*
+sortedmap::join(sortedmap::object *self, PyObject *other) {
+    if (!sortedmap::check(other)) {
+        PyErr_Format(PyExc_TypeError,
+                     "cannot join a sortedmap with a %s",
+                     Py_TYPE(other)->tp_name);
+        return NULL;
+    }
+
+    sortedmap::object *asmap = (sortedmap::object*) other;
+    CriticalSection2 cs((PyObject*) self, other);
+    int status;
+
+    if (unlikely(!flush(self) || !flush(asmap))) {
+        return NULL;
+    }
+    if (asmap == self || !asmap->map.size()) {
+        if (asmap == self && self->map.size()) {
+            PyErr_SetString(PyExc_ValueError,
+                            "cannot join a sortedmap with itself");
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+
+    if (unlikely((status = same_order(self, asmap)) < 0)) {
+        return NULL;
+    }
+    if (!status) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot join sortedmaps with different keyfuncs");
+        return NULL;
+    }
+
+    // the pairs move from other's log to self's
+    std::string records;
+    std::size_t nrecords = asmap->map.size();
+    if (unlikely(self->log)) {
+        try {
+            for (const auto &[key, value] : asmap->map) {
+                log_encode_set(records, key, value);
+            }
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+
+    sortedmap::aggregatetree *rhs_aggregates = asmap->aggregates;
+    if (self->aggregates && !rhs_aggregates) {
+        try {
+            rhs_aggregates = new_aggregates(asmap->map,
+                                            asmap->map.begin(),
+                                            asmap->map.end());
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+
+    gc_track_like(self, asmap);
+    try {
+        auto &lhs = self->map;
+        auto &rhs = asmap->map;
+
+        if (!lhs.size()) {
+            lhs.swap(rhs);
+        }
+        else if (lhs.key_comp()(std::prev(lhs.end())->first,
+                                rhs.begin()->first)) {
+            // other goes after self; move the smaller side
+            if (lhs.size() < rhs.size()) {
+                lhs.swap(rhs);
+                splice(lhs, rhs, rhs.begin(), rhs.end(), false);
+            }
+            else {
+                splice(lhs, rhs, rhs.begin(), rhs.end(), true);
+            }
+        }
+        else if (lhs.key_comp()(std::prev(rhs.end())->first,
+                                lhs.begin()->first)) {
+            // other goes before self
+            if (lhs.size() < rhs.size()) {
+                lhs.swap(rhs);
+                splice(lhs, rhs, rhs.begin(), rhs.end(), true);
+            }
+            else {
+                splice(lhs, rhs, rhs.begin(), rhs.end(), false);
+            }
+        }
+        else {
+            if (rhs_aggregates != asmap->aggregates) {
+                free_aggregates(rhs_aggregates);
+            }
+            PyErr_SetString(PyExc_ValueError,
+                            "cannot join sortedmaps with overlapping keys");
+            return NULL;
+        }
+    }
+    catch (PythonError &e) {
+        if (rhs_aggregates != asmap->aggregates) {
+            free_aggregates(rhs_aggregates);
+        }
+        // nodes may have moved in either direction
+        gc_track_like(asmap, self);
+        drop_aggregates(self);
+        drop_aggregates(asmap);
+        ++self->iter_revision;
+        ++asmap->iter_revision;
+        return NULL;
+    }
+
+#if HAVE_AGGREGATE_TREE
+    if (self->aggregates) {
+        try {
+            self->aggregates->join(*rhs_aggregates);
+        }
+        catch (PythonError &e) {
+            // the maps were joined, just stop tracking aggregates
+            PyErr_Clear();
+            drop_aggregates(self);
+        }
+    }
+    if (rhs_aggregates != asmap->aggregates) {
+        delete rhs_aggregates;
+    }
+    else if (rhs_aggregates) {
+        rhs_aggregates->clear();
+    }
+#endif  // HAVE_AGGREGATE_TREE
+    trim(self);
+
+    ++self->iter_revision;
+    ++asmap->iter_revision;
+    try {
+        if (unlikely(self->log)) {
+            log_push(self, records, nrecords);
+        }
+        if (unlikely(asmap->log)) {
+            log_push(asmap, LOG_CLEAR);
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmap::set_maxlen(sortedmap::object *self,
+                      PyObject *args,
+                      PyObject *kwargs) {
+    const char *keywords[] = {"maxlen", "evict", NULL};
+    PyObject *pymaxlen;
+    const char *evict = "first";
+    Py_ssize_t maxlen = -1;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|s:set_maxlen",
+                                     (char**) keywords,
+                                     &pymaxlen,
+                                     &evict)) {
+        return NULL;
+    }
+
+    if (pymaxlen != Py_None) {
+        maxlen = PyNumber_AsSsize_t(pymaxlen, PyExc_OverflowError);
+        if (maxlen == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (maxlen < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "maxlen must be non-negative, got %zd",
+                         maxlen);
+            return NULL;
+        }
+    }
+    if (strcmp(evict, "first") && strcmp(evict, "last")) {
+        PyErr_Format(PyExc_ValueError,
+                     "evict must be 'first' or 'last', got '%s'",
+                     evict);
+        return NULL;
+    }
+
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    std::string record;
+    bool evict_first = !strcmp(evict, "first");
+    try {
+        if (unlikely(self->log)) {
+            log_encode_maxlen(record, maxlen, evict_first);
+        }
+        self->maxlen = maxlen;
+        self->evict_first = evict_first;
+        trim(self);
+        if (unlikely(self->log)) {
+            log_push(self, record, 1);
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmap::set_write_buffer(sortedmap::object *self, PyObject *pysize) {
+    Py_ssize_t size = 0;
+
+    if (pysize != Py_None) {
+        size = PyNumber_AsSsize_t(pysize, PyExc_OverflowError);
+        if (size == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (size < 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "size must be non-negative, got %zd",
+                         size);
+            return NULL;
+        }
+    }
+
+    MapSection cs(self);
+
+    self->buffer_limit = size;
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+    self->buffer.reserve(size);
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmap::set_intern_pool(sortedmap::object *self, PyObject *pool) {
+    if (pool != Py_None && !PyDict_CheckExact(pool)) {
+        PyErr_Format(PyExc_TypeError,
+                     "pool must be a dict or None, got %s",
+                     Py_TYPE(pool)->tp_name);
+        return NULL;
+    }
+
+    MapSection cs(self);
+    PyObject *old = self->intern_pool;
+
+    if (pool == Py_None) {
+        self->intern_pool = NULL;
+    }
+    else {
+        Py_INCREF(pool);
+        self->intern_pool = pool;
+        gc_track(self);
+    }
+    Py_XDECREF(old);
+    Py_RETURN_NONE;
+}
+
+// Read all of the file at ``path`` into ``out``. A missing file is read as
+// empty when ``missing_ok`` is set. Returns false with an OSError set on
+// failure.
+static bool
+read_file(const char *path, std::string &out, bool missing_ok) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    char buf[1 << 16];
+
+    out.clear();
+    if (fd < 0) {
+        if (errno == ENOENT && missing_ok) {
+            return true;
+        }
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
+    for (;;) {
+        ssize_t size = read(fd, buf, sizeof(buf));
+
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            close(fd);
+            return false;
+        }
+        if (!size) {
+            break;
+        }
+        out.append(buf, size);
+    }
+    close(fd);
+    return true;
+}
+
+// Decode the record at ``pos`` and move ``pos`` past it. Returns 1 for a
+// record, 0 at the end of the data, and -1 without an exception set if the
+// record is cut off or cannot be unmarshalled.
+static int
+log_decode(const std::string &data,
+           std::size_t &pos,
+           char &op,
+           PyObject *&payload) {
+    if (pos == data.size()) {
+        return 0;
+    }
+    if (data.size() - pos < log_header_size) {
+        return -1;
+    }
+
+    std::size_t size = 0;
+    for (int ix = 0; ix < 4; ++ix) {
+        size |= (std::size_t) (unsigned char) data[pos + 1 + ix] << (8 * ix);
+    }
+    if (data.size() - pos - log_header_size < size) {
+        return -1;
+    }
+
+    op = data[pos];
+    payload = NULL;
+    if (size) {
+        payload = PyMarshal_ReadObjectFromString(
+            data.data() + pos + log_header_size,
+            size);
+        if (!payload) {
+            PyErr_Clear();
+            return -1;
+        }
+    }
+    pos += log_header_size + size;
+    return 1;
+}
+
+// Apply a decoded record to ``self``. Returns 0 if the record is not valid,
+// and throws if the change cannot be made.
+static int
+log_apply(sortedmap::object *self, char op, PyObject *payload) {
+    auto &map = self->map;
+
+    switch (op) {
+    case LOG_SET:
+        if (!payload || !PyTuple_CheckExact(payload) ||
+            PyTuple_GET_SIZE(payload) != 2) {
+            return 0;
+        }
+        setitem_throws(self,
+                       PyTuple_GET_ITEM(payload, 0),
+                       PyTuple_GET_ITEM(payload, 1));
+        return 1;
+    case LOG_DEL:
+        if (!payload) {
+            return 0;
+        }
+        if (map.erase(payload)) {
+            ++self->iter_revision;
+        }
+        return 1;
+    case LOG_CLEAR:
+        sortedmap::clear(self);
+        ++self->iter_revision;
+        return 1;
+    case LOG_SPLIT:
+        if (!payload) {
+            return 0;
+        }
+        map.erase(map.lower_bound(payload), map.end());
+        ++self->iter_revision;
+        return 1;
+    case LOG_MAXLEN: {
+        Py_ssize_t maxlen;
+        int evict_first;
+
+        if (!payload ||
+            !PyArg_ParseTuple(payload, "np", &maxlen, &evict_first)) {
+            PyErr_Clear();
+            return 0;
+        }
+        self->maxlen = maxlen;
+        self->evict_first = evict_first;
+        trim(self);
+        return 1;
+    }
+    default:
+        return 0;
+    }
+}
+
+// Write a new header with a new id to an empty log. Returns false with errno
+// set on failure.
+static bool
+start_log(int fd, std::uint64_t &id) {
+    std::uint64_t new_id = new_log_id();
+    std::string header = log_file_header(new_id);
+
+    if (!write_all(fd, header.data(), header.size()) || fsync(fd)) {
+        return false;
+    }
+    id = new_id;
+    return true;
+}
+
+// Open a log for appending, starting a new log if the file is empty. Returns
+// -1 with an exception set on failure.
+static int
+open_log(const char *path, std::uint64_t &id) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    char header[log_file_header_size];
+
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
+    if (fstat(fd, &st)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+    else if (!st.st_size) {
+        if (start_log(fd, id)) {
+            return fd;
+        }
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    }
+    else if (pread(fd, header, sizeof(header), 0) != (ssize_t) sizeof(header) ||
+             !log_file_id(header, sizeof(header), id)) {
+        PyErr_Format(PyExc_ValueError, "%s is not a sortedmap log", path);
+    }
+    else {
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+PyObject*
+sortedmap::set_log(sortedmap::object *self,
+                   PyObject *args,
+                   PyObject *kwargs) {
+    const char *keywords[] = {"path", "group", NULL};
+    PyObject *pypath;
+    Py_ssize_t group = 64;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|n:set_log",
+                                     (char**) keywords,
+                                     &pypath,
+                                     &group)) {
+        return NULL;
+    }
+    if (group < 1) {
+        PyErr_Format(PyExc_ValueError,
+                     "group must be positive, got %zd",
+                     group);
+        return NULL;
+    }
+
+    MapSection cs(self);
+
+    if (pypath == Py_None) {
+        if (unlikely(!log_close(self))) {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+
+    PyObject *bytes;
+    std::uint64_t id;
+    int fd;
+
+    // the buffered writes were made before this log was set
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+    if (!PyUnicode_FSConverter(pypath, &bytes)) {
+        return NULL;
+    }
+    if ((fd = open_log(PyBytes_AS_STRING(bytes), id)) < 0) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    // the changes logged so far go to the old log
+    if (unlikely(!log_close(self))) {
+        close(fd);
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    self->log = new sortedmap::mutationlog{fd,
+                                           id,
+                                           PyBytes_AS_STRING(bytes),
+                                           std::string(),
+                                           0,
+                                           (std::size_t) group};
+    Py_DECREF(bytes);
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmap::commit_log(sortedmap::object *self) {
+    MapSection cs(self);
+
+    if (self->log && unlikely(!log_commit(self->log))) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// Sync the directory holding ``path`` so that a rename into it is durable.
+static bool
+sync_parent(const char *path) {
+    const char *slash = strrchr(path, '/');
+    std::string dir = (slash) ? std::string(path, slash - path + 1) : ".";
+    int fd = open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok;
+
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, dir.c_str());
+        return false;
+    }
+    if (!(ok = !fsync(fd))) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, dir.c_str());
+    }
+    close(fd);
+    return ok;
+}
+
+// Write a snapshot of ``self`` to ``path``, which must not exist. Throws on
+// failure.
+static void
+write_snapshot(sortedmap::object *self, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    std::string out = log_file_header((self->log) ? self->log->id : 0);
+
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        throw PythonError();
+    }
+    try {
+        if (self->maxlen >= 0) {
+            log_encode_maxlen(out, self->maxlen, self->evict_first);
+        }
+        for (const auto &[key, value] : self->map) {
+            log_encode_set(out, key, value);
+            // write in chunks so the snapshot is not held in memory
+            if (out.size() >= 1 << 20) {
+                if (!write_all(fd, out.data(), out.size())) {
+                    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+                    throw PythonError();
+                }
+                out.clear();
+            }
+        }
+        if (!write_all(fd, out.data(), out.size()) || fsync(fd)) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+            throw PythonError();
+        }
+    }
+    catch (PythonError &e) {
+        close(fd);
+        unlink(path);
+        throw;
+    }
+    close(fd);
+}
+
+PyObject*
+sortedmap::checkpoint(sortedmap::object *self, PyObject *pypath) {
+    PyObject *bytes;
+
+    if (!PyUnicode_FSConverter(pypath, &bytes)) {
+        return NULL;
+    }
+
+    MapSection cs(self);
+    const char *path = PyBytes_AS_STRING(bytes);
+    std::string tmp = std::string(path) + ".tmp";
+
+    // The log must be durable before the snapshot replaces the old one, and
+    // it may only be emptied once the snapshot is in place. After a crash
+    // between the two the log still has the id written to the snapshot, so
+    // ``recover`` skips it instead of replaying changes, and the evictions
+    // they caused, which the snapshot already holds.
+    if (unlikely(!flush(self) ||
+                 (self->log && !log_commit(self->log)))) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    try {
+        write_snapshot(self, tmp.c_str());
+    }
+    catch (PythonError &e) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    if (rename(tmp.c_str(), path)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        unlink(tmp.c_str());
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    if (!sync_parent(path)) {
+        Py_DECREF(bytes);
+        return NULL;
+    }
+    Py_DECREF(bytes);
+
+    // O_APPEND writes ignore the offset, so the log is emptied and then
+    // started again with a new id. A crash in between leaves an empty log.
+    sortedmap::mutationlog *log = self->log;
+    if (log && (ftruncate(log->fd, 0) || !start_log(log->fd, log->id))) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, log->path.c_str());
+        // changes appended under the snapshot's id would be skipped by
+        // ``recover``, so stop logging
+        close(log->fd);
+        delete log;
+        self->log = nullptr;
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// Convert an optional path argument, None is no path.
+static bool
+optional_path(PyObject *ob, PyObject *&out) {
+    out = NULL;
+    return !ob || ob == Py_None || PyUnicode_FSConverter(ob, &out);
+}
+
+// Replay the records in a snapshot or log onto ``self``. A snapshot must be
+// complete and ``id`` is set to its id. A log is skipped when it has the id
+// ``id`` because the snapshot already holds its changes. A log may end in a
+// record that was cut off by a crash, which is truncated from the file.
+// Throws on failure.
+static void
+replay(sortedmap::object *self,
+       const char *path,
+       bool snapshot,
+       std::uint64_t &id) {
+    std::string data;
+    std::uint64_t file_id;
+
+    if (!read_file(path, data, !snapshot)) {
+        throw PythonError();
+    }
+    if (data.empty() && !snapshot) {
+        return;
+    }
+    if (!log_file_id(data.data(), data.size(), file_id)) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s is not a sortedmap %s",
+                     path,
+                     (snapshot) ? "snapshot" : "log");
+        throw PythonError();
+    }
+    if (snapshot) {
+        id = file_id;
+    }
+    else if (id && file_id == id) {
+        return;
+    }
+
+    std::size_t pos = log_file_header_size;
+    std::size_t good = pos;
+    auto &map = self->map;
+    char op;
+    PyObject *payload;
+    int status;
+
+    while ((status = log_decode(data, pos, op, payload)) > 0) {
+        try {
+            if (snapshot && op == LOG_SET && payload &&
+                PyTuple_CheckExact(payload) &&
+                PyTuple_GET_SIZE(payload) == 2) {
+                // the pairs are in order, so each goes at the end
+                PyObject *key = PyTuple_GET_ITEM(payload, 0);
+                PyObject *value = PyTuple_GET_ITEM(payload, 1);
+
+                gc_maybe_track(self, key, value);
+                map.emplace_hint(map.end(), key, value);
+                status = 1;
+            }
+            else {
+                status = log_apply(self, op, payload);
+            }
+        }
+        catch (PythonError &e) {
+            Py_XDECREF(payload);
+            throw;
+        }
+        Py_XDECREF(payload);
+        if (!status) {
+            break;
+        }
+        good = pos;
+    }
+
+    if (good == data.size()) {
+        return;
+    }
+    if (snapshot) {
+        PyErr_Format(PyExc_ValueError, "%s is corrupt", path);
+        throw PythonError();
+    }
+    if (truncate(path, good)) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        throw PythonError();
+    }
+}
+
+sortedmap::object*
+sortedmap::recover(PyObject *cls, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"snapshot", "log", "keyfunc", NULL};
+    PyObject *pysnapshot = NULL;
+    PyObject *pylog = NULL;
+    PyObject *keyfunc = NULL;
+    PyObject *snapshot;
+    PyObject *log;
+    sortedmap::object *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|OOO:recover",
+                                     (char**) keywords,
+                                     &pysnapshot,
+                                     &pylog,
+                                     &keyfunc)) {
+        return NULL;
+    }
+    if (keyfunc == Py_None) {
+        keyfunc = NULL;
+    }
+    if (!optional_path(pysnapshot, snapshot)) {
+        return NULL;
+    }
+    if (!optional_path(pylog, log)) {
+        Py_XDECREF(snapshot);
+        return NULL;
+    }
+
+    self = innernew<sortedmap::object>((PyTypeObject*) cls, keyfunc);
+    if (likely(self)) {
+        std::uint64_t id = 0;
+
+        try {
+            if (snapshot) {
+                replay(self, PyBytes_AS_STRING(snapshot), true, id);
+            }
+            if (log) {
+                replay(self, PyBytes_AS_STRING(log), false, id);
+            }
+        }
+        catch (PythonError &e) {
+            Py_CLEAR(self);
+        }
+    }
+    Py_XDECREF(snapshot);
+    Py_XDECREF(log);
+    return self;
+}
+
+PyObject*
+sortedmap::track_aggregates(sortedmap::object *self) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    if (!self->aggregates) {
+        try {
+            self->aggregates = new_aggregates(self->map,
+                                              self->map.begin(),
+                                              self->map.end());
+        }
+        catch (PythonError &e) {
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+#if HAVE_AGGREGATE_TREE
+using aggnode = sortedmap::aggregatetree::node_const_iterator;
+
+static inline void
+add_subtree(sortedmap::aggregate &agg, aggnode node, aggnode end) {
+    if (node != end) {
+        agg += node.get_metadata();
+    }
+}
+
+// Aggregate the keys in the subtree at ``node`` which are >= lo.
+static void
+aggregate_suffix(sortedmap::aggregate &agg,
+                 const sortedmap::aggregatetree &tree,
+                 aggnode node,
+                 PyObject *lo) {
+    const auto &comp = tree.get_cmp_fn();
+    const auto end = tree.node_end();
+
+    while (node != end) {
+        if (comp((*node)->first, lo)) {
+            node = node.get_r_child();
+        }
+        else {
+            agg += sortedmap::aggregate((*node)->second);
+            add_subtree(agg, node.get_r_child(), end);
+            node = node.get_l_child();
+        }
+    }
+}
+
+// Aggregate the keys in the subtree at ``node`` which are < hi.
+static void
+aggregate_prefix(sortedmap::aggregate &agg,
+                 const sortedmap::aggregatetree &tree,
+                 aggnode node,
+                 PyObject *hi) {
+    const auto &comp = tree.get_cmp_fn();
+    const auto end = tree.node_end();
+
+    while (node != end) {
+        if (comp((*node)->first, hi)) {
+            agg += sortedmap::aggregate((*node)->second);
+            add_subtree(agg, node.get_l_child(), end);
+            node = node.get_r_child();
+        }
+        else {
+            node = node.get_l_child();
+        }
+    }
+}
+
+// Aggregate the keys in [lo, hi) by descending to the first node in the
+// range and then walking down each side of it, this visits O(log(n)) nodes.
+// A NULL bound is unbounded.
+static sortedmap::aggregate
+tree_aggregate(const sortedmap::aggregatetree &tree,
+               PyObject *lo,
+               PyObject *hi) {
+    const auto &comp = tree.get_cmp_fn();
+    const auto end = tree.node_end();
+    sortedmap::aggregate agg;
+    aggnode node = tree.node_begin();
+
+    while (node != end) {
+        if (lo && comp((*node)->first, lo)) {
+            node = node.get_r_child();
+        }
+        else if (hi && !comp((*node)->first, hi)) {
+            node = node.get_l_child();
+        }
+        else {
+            agg += sortedmap::aggregate((*node)->second);
+            if (lo) {
+                aggregate_suffix(agg, tree, node.get_l_child(), lo);
+            }
+            else {
+                add_subtree(agg, node.get_l_child(), end);
+            }
+            if (hi) {
+                aggregate_prefix(agg, tree, node.get_r_child(), hi);
+            }
+            else {
+                add_subtree(agg, node.get_r_child(), end);
+            }
+            break;
+        }
+    }
+    return agg;
+}
+#endif  // HAVE_AGGREGATE_TREE
+
+PyObject*
+sortedmap::aggregate_range(sortedmap::object *self,
+                           PyObject *args,
+                           PyObject *kwargs) {
+    const char *keywords[] = {"lo", "hi", NULL};
+    PyObject *lo = Py_None;
+    PyObject *hi = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "|OO:aggregate",
+                                     (char**) keywords,
+                                     &lo,
+                                     &hi)) {
+        return NULL;
+    }
+    if (lo == Py_None) {
+        lo = NULL;
+    }
+    if (hi == Py_None) {
+        hi = NULL;
+    }
+
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+    sortedmap::aggregate agg;
+
+    try {
+#if HAVE_AGGREGATE_TREE
+        if (self->aggregates) {
+            agg = tree_aggregate(*self->aggregates, lo, hi);
+        }
+        else
+#endif  // HAVE_AGGREGATE_TREE
+        {
+            auto it = (lo) ? self->map.lower_bound(lo) : self->map.begin();
+            auto last = (hi) ? self->map.lower_bound(hi) : self->map.end();
+
+            if (lo && hi && !self->map.key_comp()(lo, hi)) {
+                last = it;
+            }
+            for (; it != last; ++it) {
+                agg += sortedmap::aggregate(
+                    aggregate_value(std::get<1>(*it)));
+            }
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+
+    if (!agg.count) {
+        return Py_BuildValue("(ndOO)", (Py_ssize_t) 0, 0.0, Py_None, Py_None);
+    }
+    return Py_BuildValue("(nddd)",
+                         (Py_ssize_t) agg.count,
+                         agg.sum,
+                         agg.min,
+                         agg.max);
+}
+
+// Append a new tuple of ``obs`` to ``list``.
+template<typename... Ts>
+static void
+append_tuple(PyObject *list, Ts... obs) {
+    PyObject *tuple;
+
+    if (unlikely(!(tuple = PyTuple_Pack(sizeof...(obs), obs...)))) {
+        throw PythonError();
+    }
+    int status = PyList_Append(list, tuple);
+    Py_DECREF(tuple);
+    if (unlikely(status)) {
+        throw PythonError();
+    }
+}
+
+// Walk the keys of both maps in ``[lo, hi)`` in lock-step, sorting the pairs
+// into ``added``, ``removed``, and ``changed``. Both maps must be held by the
+// caller.
+template<typename B>
+static void
+innerdiff(sortedmap::object *self,
+          B *other,
+          PyObject *lo,
+          PyObject *hi,
+          PyObject *added,
+          PyObject *removed,
+          PyObject *changed) {
+    const auto comp = self->map.key_comp();
+
+    if (lo && hi && !comp(lo, hi)) {
+        return;
+    }
+
+    auto a = (lo) ? self->map.lower_bound(lo) : self->map.cbegin();
+    auto a_end = (hi) ? self->map.lower_bound(hi) : self->map.cend();
+    auto b = (lo) ? other->map.lower_bound(lo) : other->map.cbegin();
+    auto b_end = (hi) ? other->map.lower_bound(hi) : other->map.cend();
+    auto a_revision = self->iter_revision;
+    auto b_revision = other->iter_revision;
+
+    while (a != a_end && b != b_end) {
+        const auto &a_key = std::get<0>(*a);
+        const auto &b_key = std::get<0>(*b);
+
+        if (comp(a_key, b_key)) {
+            append_tuple(added, a_key.ob, std::get<1>(*a).ob);
+            ++a;
+        }
+        else if (comp(b_key, a_key)) {
+            append_tuple(removed, b_key.ob, std::get<1>(*b).ob);
+            ++b;
+        }
+        else {
+            // __eq__ may change either map, hold the values while comparing
+            OwnedRef<PyObject> old_value = std::get<1>(*b);
+            OwnedRef<PyObject> new_value = std::get<1>(*a);
+            int status = PyObject_RichCompareBool(old_value,
+                                                  new_value,
+                                                  Py_EQ);
+
+            if (unlikely(status < 0)) {
+                throw PythonError();
+            }
+            if (unlikely(self->iter_revision != a_revision ||
+                         other->iter_revision != b_revision)) {
+                PyErr_SetString(PyExc_RuntimeError,
+                                "sortedmap changed size during diff");
+                throw PythonError();
+            }
+            if (!status) {
+                append_tuple(changed, a_key.ob, old_value.ob, new_value.ob);
+            }
+            ++a;
+            ++b;
+        }
+    }
+    for (; a != a_end; ++a) {
+        append_tuple(added, std::get<0>(*a).ob, std::get<1>(*a).ob);
+    }
+    for (; b != b_end; ++b) {
+        append_tuple(removed, std::get<0>(*b).ob, std::get<1>(*b).ob);
+    }
+}
+
+template<typename B>
+static PyObject*
+diff_with(sortedmap::object *self, B *other, PyObject *lo, PyObject *hi) {
+    CriticalSection2 cs((PyObject*) self, (PyObject*) other);
+
+    if (unlikely(!flush(self) || !flush(other))) {
+        return NULL;
+    }
+
+    int status = same_order(self, other);
+    if (unlikely(status < 0)) {
+        return NULL;
+    }
+    if (!status) {
+        PyErr_SetString(PyExc_ValueError,
+                        "cannot diff sortedmaps with different keyfuncs");
+        return NULL;
+    }
+
+    PyObject *added = PyList_New(0);
+    PyObject *removed = PyList_New(0);
+    PyObject *changed = PyList_New(0);
+    PyObject *ret = NULL;
+
+    if (likely(added && removed && changed)) {
+        try {
+            innerdiff(self, other, lo, hi, added, removed, changed);
+            ret = PyTuple_Pack(3, added, removed, changed);
+        }
+        catch (PythonError &e) {}
+    }
+    Py_XDECREF(added);
+    Py_XDECREF(removed);
+    Py_XDECREF(changed);
+    return ret;
+}
+
+PyObject*
+sortedmap::diff(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"other", "lo", "hi", NULL};
+    PyObject *other;
+    PyObject *lo = Py_None;
+    PyObject *hi = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|OO:diff",
+                                     (char**) keywords,
+                                     &other,
+                                     &lo,
+                                     &hi)) {
+        return NULL;
+    }
+    if (lo == Py_None) {
+        lo = NULL;
+    }
+    if (hi == Py_None) {
+        hi = NULL;
+    }
+
+    if (sortedmap::check(other)) {
+        return diff_with(self, (sortedmap::object*) other, lo, hi);
+    }
+    if (frozensortedmap::check(other)) {
+        return diff_with(self, (frozensortedmap::object*) other, lo, hi);
+    }
+    PyErr_Format(PyExc_TypeError,
+                 "cannot diff a sortedmap with a %s",
+                 Py_TYPE(other)->tp_name);
+    return NULL;
+}
+
+// Merge the ``size`` pairs in [first, last), which are sorted and unique
+// under self's key order, into self.
+// The keys arrive in sorted order so each one can be inserted with a hint
+// instead of a full descent. When there are about as many new pairs as pairs
+// in self we walk both in lock-step, which costs O(n + m) comparisons,
+// otherwise we search for each key, which costs O(m log n).
+// Every key is placed before the map is changed, so a key which fails to
+// compare leaves the map as it was. The keys are compared again when they
+// are inserted; if one of those comparisons fails, ``merged`` is set to the
+// number of pairs which were stored before it.
+template<typename I>
+static void
+merge_sorted(sortedmap::object *self,
+             I first,
+             I last,
+             std::size_t size,
+             std::size_t *merged = nullptr) {
+    std::size_t count = 0;
+    auto &map = self->map;
+    const auto comp = map.key_comp();
+    std::size_t log2n = 0;
+    bool grew = false;
+
+    for (std::size_t n = map.size(); n; n >>= 1) {
+        ++log2n;
+    }
+    bool walk = size * log2n > map.size() + size;
+
+    // ``hints[ix]`` is the first node which is not less than the ix'th key
+    std::vector<sortedmap::maptype::iterator> hints;
+    std::vector<char> found;
+
+    hints.reserve(size);
+    found.reserve(size);
+    try {
+        auto pos = map.begin();
+        for (I it = first; it != last; ++it) {
+            const auto &key = std::get<0>(*it);
+
+            if (walk) {
+                while (pos != map.end() && comp(std::get<0>(*pos), key)) {
+                    ++pos;
+                }
+            }
+            else {
+                pos = map.lower_bound(key);
+            }
+            hints.push_back(pos);
+            found.push_back(pos != map.end() &&
+                            !comp(key, std::get<0>(*pos)));
+        }
+
+        if (self->intern_pool && self->maxlen >= 0) {
+            // store each pair on its own so that keys which are evicted
+            // right away are never interned
+            for (; first != last; ++first, ++count) {
+                write_through(self,
+                              std::get<0>(*first),
+                              std::get<1>(*first));
+            }
+            return;
+        }
+
+        for (; first != last; ++first) {
+            const auto &pair = *first;
+            const auto &key = std::get<0>(pair);
+            double aggvalue = (self->aggregates) ?
+                aggregate_value(std::get<1>(pair)) :
+                0;
+
+            gc_maybe_track(self, key, std::get<1>(pair));
+            if (found[count]) {
+                std::get<1>(*hints[count]) = std::get<1>(pair);
+            }
+            else {
+                // new keys with the same hint go before it in order
+                map.emplace_hint(hints[count],
+                                 intern_key(self, key),
+                                 std::get<1>(pair));
+                grew = true;
+            }
+            if (self->aggregates) {
+                aggregates_set(self, key, aggvalue);
+            }
+            ++count;
+        }
+    }
+    catch (PythonError &e) {
+        if (grew) {
+            ++self->iter_revision;
+        }
+        if (merged) {
+            *merged = count;
+        }
+        throw;
+    }
+    if (grew) {
+        ++self->iter_revision;
+    }
+}
+
+// Read a key as an unboxed number for sorting the write buffer. This fails
+// for NaN because it does not have a strict weak order.
+static inline bool
+unbox_key(PyObject *ob, std::int64_t &out) {
+    int overflow = 0;
+
+    if (!PyLong_CheckExact(ob)) {
+        return false;
+    }
+    out = PyLong_AsLongLongAndOverflow(ob, &overflow);
+    return !overflow;
+}
+
+static inline bool
+unbox_key(PyObject *ob, double &out) {
+    if (!PyFloat_CheckExact(ob)) {
+        return false;
+    }
+    out = PyFloat_AS_DOUBLE(ob);
+    return !std::isnan(out);
+}
+
+// Sort the buffered writes by their unboxed keys without calling into
+// Python. ``same[ix]`` is set when the key of ``order[ix]`` equals the key
+// before it. Returns false if a key is not a ``T``.
+template<typename T>
+static bool
+native_sort(const sortedmap::buffertype &pending,
+            std::vector<std::size_t> &order,
+            std::vector<char> &same) {
+    std::vector<std::pair<T, std::size_t>> keyed;
+
+    keyed.reserve(pending.size());
+    for (std::size_t ix = 0; ix < pending.size(); ++ix) {
+        T key;
+
+        if (!unbox_key(std::get<0>(pending[ix]).ob, key)) {
+            return false;
+        }
+        keyed.emplace_back(key, ix);
+    }
+    // ties are broken by the position of the write, which keeps it stable
+    std::sort(keyed.begin(), keyed.end());
+    for (std::size_t ix = 0; ix < keyed.size(); ++ix) {
+        order[ix] = std::get<1>(keyed[ix]);
+        same[ix] = ix && std::get<0>(keyed[ix]) == std::get<0>(keyed[ix - 1]);
+    }
+    return true;
+}
+
+static bool
+flush(sortedmap::object *self) {
+    auto &buffer = self->buffer;
+
+    if (buffer.empty()) {
+        return true;
+    }
+
+    sortedmap::buffertype pending;
+    const auto comp = self->map.key_comp();
+    std::vector<std::size_t> order(buffer.size());
+    std::vector<char> same(buffer.size());
+
+    // ``run_of[ix]`` is the run which the write ``order[ix]`` belongs to
+    std::vector<std::size_t> run_of(buffer.size());
+    std::size_t merged = 0;
+
+    pending.swap(buffer);
+    try {
+        if (comp.keyfunc ||
+            !(native_sort<std::int64_t>(pending, order, same) ||
+              native_sort<double>(pending, order, same))) {
+            for (std::size_t ix = 0; ix < order.size(); ++ix) {
+                order[ix] = ix;
+            }
+            // stable so that the first write to a key starts its run of
+            // equal keys
+            std::stable_sort(order.begin(),
+                             order.end(),
+                             [&](std::size_t a, std::size_t b) {
+                                 return comp(std::get<0>(pending[a]),
+                                             std::get<0>(pending[b]));
+                             });
+            for (std::size_t ix = 1; ix < order.size(); ++ix) {
+                same[ix] = !comp(std::get<0>(pending[order[ix - 1]]),
+                                 std::get<0>(pending[order[ix]]));
+            }
+        }
+
+        // keep the first key object and the last value written to each
+        // key, like storing the writes one at a time would
+        sortedmap::buffertype run;
+        run.reserve(pending.size());
+        for (std::size_t ix = 0; ix < order.size(); ++ix) {
+            if (same[ix]) {
+                std::get<1>(run.back()) = std::get<1>(pending[order[ix]]);
+            }
+            else {
+                run.push_back(pending[order[ix]]);
+            }
+            run_of[ix] = run.size() - 1;
+        }
+        merge_sorted(self, run.cbegin(), run.cend(), run.size(), &merged);
+    }
+    catch (PythonError &e) {
+        // Some of the keys could not be compared. The map has not changed
+        // yet, so replay the writes in order: the pairs before the first bad
+        // key are stored, the error is the one that key would have raised
+        // without the buffer, and the pairs after it are dropped. If a
+        // comparison only failed when it was repeated by the merge, the runs
+        // which the merge already stored are not written again, with a
+        // maxlen that could evict another pair.
+        std::vector<char> stored(pending.size());
+
+        for (std::size_t ix = 0; merged && ix < order.size(); ++ix) {
+            stored[order[ix]] = run_of[ix] < merged;
+        }
+        PyErr_Clear();
+        try {
+            for (std::size_t ix = 0; ix < pending.size(); ++ix) {
+                if (!stored[ix]) {
+                    write_through(self,
+                                  std::get<0>(pending[ix]),
+                                  std::get<1>(pending[ix]));
+                }
+            }
+        }
+        catch (PythonError &e) {
+            trim(self);
+            return false;
+        }
+    }
+    trim(self);
+    return true;
+}
+
+// Merge a mapping which is not a sortedmap into self, storing each pair with
+// ``set``.
+template<typename M, void set(M*, PyObject*, PyObject*)>
+static bool
+merge_mapping(M *self, PyObject *other) {
+    PyObject *key;
+
+    if (PyDict_Check(other)) {
+        PyObject *value;
+        Py_ssize_t pos = 0;
+
+        while (PyDict_Next(other, &pos, &key, &value)) {
+            try {
+                set(self, key, value);
+            }
+            catch (PythonError &e) {
+                return false;
+            }
+        }
+    }
+    else {
+        PyObject *keys;
+        PyObject *it;
+        PyObject *tmp;
+
+        if (unlikely(!(keys = PyMapping_Keys(other)))) {
+            return false;
+        }
+
+        it = PyObject_GetIter(keys);
+        Py_DECREF(keys);
+        if (unlikely(!it)) {
+            return false;
+        }
+        while ((key = PyIter_Next(it))) {
+            if (unlikely(!(tmp = PyObject_GetItem(other, key)))) {
+                Py_DECREF(key);
+                Py_DECREF(it);
+                return false;
+            }
+            try {
+                set(self, key, tmp);
+            }
+            catch (PythonError &e) {
+                Py_DECREF(tmp);
+                Py_DECREF(key);
+                Py_DECREF(it);
+                return false;
+            }
+            Py_DECREF(tmp);
+            Py_DECREF(key);
+        }
+        Py_DECREF(it);
+        if (unlikely(PyErr_Occurred())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool
+merge(sortedmap::object *self, PyObject *other) {
+    if (sortedmap::check_exact(other)) {
+        sortedmap::object *asmap = (sortedmap::object*) other;
+        // self is already held by update
+        CriticalSection cs(other);
+
+        // the pairs are written directly to the tree, so anything buffered
+        // in self must go first
+        if (unlikely(!flush(self) || !flush(asmap))) {
+            return false;
+        }
+
+        int status = same_order(self, asmap);
+
+        if (unlikely(status < 0)) {
+            return false;
+        }
+        // a logged map takes the slow path so that each pair is logged as
+        // it is stored
+        if (status && !self->map.size() && !self->intern_pool &&
+            !self->log) {
+            // fast path for copy constructor
+            if (self->aggregates) {
+                sortedmap::aggregatetree *tree;
+                try {
+                    tree = (asmap->aggregates) ?
+                        copy_aggregates(*asmap->aggregates) :
+                        new_aggregates(asmap->map,
+                                       asmap->map.begin(),
+                                       asmap->map.end());
+                }
+                catch (PythonError &e) {
+                    return false;
+                }
+                free_aggregates(self->aggregates);
+                self->aggregates = tree;
+            }
+            self->map = asmap->map;
+            gc_track_like(self, asmap);
+            ++self->iter_revision;
+            return true;
+        }
+        try {
+            if (status && !self->log) {
+                merge_sorted(self,
+                             asmap->map.cbegin(),
+                             asmap->map.cend(),
+                             asmap->map.size());
+            }
+            else {
+                for (const auto &pair : asmap->map) {
+                    setitem_throws(self,
+                                   std::get<0>(pair),
+                                   std::get<1>(pair));
+                }
+            }
+        }
+        catch (PythonError &e) {
+            return false;
+        }
+
+        return true;
+    }
+
+    if (frozensortedmap::check_exact(other)) {
+        frozensortedmap::object *asmap = (frozensortedmap::object*) other;
+
+        if (unlikely(!flush(self))) {
+            return false;
+        }
+
+        int status = same_order(self, asmap);
+
+        if (unlikely(status < 0)) {
+            return false;
+        }
+        try {
+            if (status && !self->log) {
+                merge_sorted(self,
+                             asmap->map.cbegin(),
+                             asmap->map.cend(),
+                             asmap->map.size());
+            }
+            else {
+                for (const auto &pair : asmap->map) {
+                    setitem_throws(self,
+                                   std::get<0>(pair),
+                                   std::get<1>(pair));
+                }
+            }
+        }
+        catch (PythonError &e) {
+            return false;
+        }
+        return true;
+    }
+
+    return merge_mapping<sortedmap::object, setitem_throws>(self, other);
+}
+
+template<typename M, void set(M*, PyObject*, PyObject*)>
+static bool
+merge_from_seq2(M *self, PyObject *seq2) {
+    PyObject *it;
+    Py_ssize_t n;
+    PyObject *item;
+    PyObject *fast;
+
+    if (unlikely(!(it = PyObject_GetIter(seq2)))) {
+        return false;
+    }
+
+    for (n = 0;;++n) {
+        PyObject *key, *value;
+        Py_ssize_t len;
+
+        fast = NULL;
+        if (unlikely(!(item = PyIter_Next(it)))) {
+            if (unlikely(PyErr_Occurred())) {
+                goto fail;
+            }
+            break;
+        }
+
+        // convert item to sequence, and verify length 2
+        if (unlikely(!(fast = PySequence_Fast(item, "")))) {
+            if (PyErr_ExceptionMatches(PyExc_TypeError))
+                PyErr_Format(PyExc_TypeError,
+                             "cannot convert %s update "
+                             "sequence element %zd to a sequence",
+                             Py_TYPE(self)->tp_name,
+                             n);
+            goto fail;
+        }
+        len = PySequence_Fast_GET_SIZE(fast);
+        if (unlikely(len != 2)) {
+            PyErr_Format(PyExc_ValueError,
+                         "%s update sequence element %zd "
+                         "has length %zd; 2 is required",
+                         Py_TYPE(self)->tp_name,
+                         n, len);
+            goto fail;
+        }
+
+        // update with this (key, value) pair
+        key = PySequence_Fast_GET_ITEM(fast, 0);
+        value = PySequence_Fast_GET_ITEM(fast, 1);
+        try{
+            set(self, key, value);
+        }
+        catch (PythonError &e) {
+            goto fail;
+        }
+        Py_DECREF(fast);
+        Py_DECREF(item);
+    }
+
+    n = 0;
+    goto return_;
+fail:
+    Py_XDECREF(item);
+    Py_XDECREF(fast);
+    n = -1;
+return_:
+    Py_DECREF(it);
+    return !Py_SAFE_DOWNCAST(n, Py_ssize_t, int);
+}
+
+// Shared implementation of ``update`` where ``merge`` handles mappings and
+// ``set`` stores the pairs of an iterable.
+template<typename M,
+         bool merge(M*, PyObject*),
+         void set(M*, PyObject*, PyObject*)>
+static bool
+innerupdate_from(M *self, PyObject *arg, PyObject *kwargs) {
+    if (arg) {
+        if (PyObject_HasAttrString(arg, "keys"))
+        {
+
+            if (unlikely(!merge(self, arg))) {
+                return false;
+            }
+        }
+        else {
+            if (unlikely(!(merge_from_seq2<M, set>(self, arg)))) {
+                return false;
+            }
+        }
+    }
+    if (kwargs && PyDict_Size(kwargs)) {
+        if (unlikely(!merge(self, kwargs))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template<typename M,
+         bool merge(M*, PyObject*),
+         void set(M*, PyObject*, PyObject*)>
+static bool
+innerupdate(M *self, PyObject *args, PyObject *kwargs) {
+    PyObject *arg = NULL;
+
+    if (unlikely(!PyArg_UnpackTuple(args, "update", 0, 1, &arg))) {
+        return false;
+    }
+    return innerupdate_from<M, merge, set>(self, arg, kwargs);
+}
+
+bool
+sortedmap::update(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
+    MapSection cs(self);
+
+    // pairs from a sortedmap are merged without checking the bound
+    bool ret = innerupdate<sortedmap::object, merge, setitem_throws>(self,
+                                                                     args,
+                                                                     kwargs);
+    trim(self);
+    return ret;
+}
+
+PyObject*
+sortedmap::pyupdate(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
+    if (unlikely(!sortedmap::update(self, args, kwargs))) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+sortedmap::object*
+sortedmap::fromkeys(PyTypeObject *cls, PyObject *seq, PyObject *value) {
+    sortedmap::object *self;
+    PyObject *it;
+    PyObject *key;
+
+    if (unlikely(!(it = PyObject_GetIter(seq)))) {
+        return NULL;
+    }
+
+    if (unlikely(!(self = innernew<sortedmap::object>(cls, NULL)))) {
+        Py_DECREF(it);
+        return NULL;
+    }
+
+    gc_maybe_track(self, value);
+    while ((key = PyIter_Next(it))) {
+        gc_maybe_track(self, key);
+        self->map.emplace(key, value);
+        Py_DECREF(key);
+    }
+    Py_DECREF(it);
+    if (unlikely(PyErr_Occurred())) {
+        return NULL;
+    }
+
+    return self;
+}
+
+sortedmap::object*
+sortedmap::pyfromkeys(PyObject *cls, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"seq", "value", NULL};
+    PyObject *seq;
+    PyObject *value = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O|O:fromkeys",
+                                     (char**) keywords,
+                                     &seq,
+                                     &value)) {
+        return NULL;
+    }
+
+    if (!value) {
+        value = Py_None;
+    }
+
+    return sortedmap::fromkeys((PyTypeObject*) cls, seq, value);
+}
+
+// Move a merge cursor to the next pair of its map. Returns false when the
+// map is exhausted.
+static bool
+advance(sortedmap::mergeiter::cursor &cur) {
+    sortedmap::object *map = cur.map;
+    CriticalSection cs((PyObject*) map);
+
+    if (unlikely(cur.iter_revision != map->iter_revision)) {
+        PyErr_Format(PyExc_RuntimeError,
+                     "%s changed size during iteration",
+                     Py_TYPE(map)->tp_name);
+        throw PythonError();
+    }
+    if (cur.iter == cur.end) {
+        return false;
+    }
+    cur.key = std::get<0>(*cur.iter);
+    cur.value = std::get<1>(*cur.iter);
+    ++cur.iter;
+    return true;
+}
+
+namespace {
+// Heap order for merge cursors: true if cursor ``a`` comes after cursor
+// ``b``. Equal keys come out in the order the maps were passed.
+struct merge_after {
+    const std::vector<sortedmap::mergeiter::cursor> &cursors;
+    const sortedmap::Comparator &comp;
+
+    bool operator()(std::size_t a, std::size_t b) const {
+        const auto &a_key = cursors[a].key;
+        const auto &b_key = cursors[b].key;
+
+        // the index breaks ties so one comparison is enough
+        return (a < b) ? comp(b_key, a_key) : !comp(a_key, b_key);
+    }
+};
+
+// Move the cursor at the top of the heap past its current pair and restore
+// the heap order. Advancing the top cursor in place and sifting it down
+// costs about half the comparisons of a pop and push.
+void
+replace_top(sortedmap::mergeiter::object *self, const merge_after &after) {
+    auto &heap = self->heap;
+
+    if (!advance(self->cursors[heap.front()])) {
+        heap.front() = heap.back();
+        heap.pop_back();
+        if (heap.empty()) {
+            return;
+        }
+    }
+
+    std::size_t ix = heap.front();
+    std::size_t hole = 0;
+    std::size_t size = heap.size();
+
+    for (std::size_t child; (child = 2 * hole + 1) < size; hole = child) {
+        if (child + 1 < size && after(heap[child], heap[child + 1])) {
+            ++child;
+        }
+        if (!after(ix, heap[child])) {
+            break;
+        }
+        heap[hole] = heap[child];
+    }
+    heap[hole] = ix;
+}
+}
+
+PyObject*
+sortedmap::merge_iter(PyObject*, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"dedupe", "items", NULL};
+    PyObject *dedupe = Py_False;
+    PyObject *items = Py_False;
+    PyObject *noargs;
+    int status;
+
+    if (!(noargs = PyTuple_New(0))) {
+        return NULL;
+    }
+    status = PyArg_ParseTupleAndKeywords(noargs,
+                                         kwargs,
+                                         "|OO:merge_iter",
+                                         (char**) keywords,
+                                         &dedupe,
+                                         &items);
+    Py_DECREF(noargs);
+    if (!status) {
+        return NULL;
+    }
+
+    Py_ssize_t nmaps = PyTuple_GET_SIZE(args);
+    for (Py_ssize_t ix = 0; ix < nmaps; ++ix) {
+        PyObject *map = PyTuple_GET_ITEM(args, ix);
+
+        if (!sortedmap::check(map)) {
+            PyErr_Format(PyExc_TypeError,
+                         "cannot merge a %s",
+                         Py_TYPE(map)->tp_name);
+            return NULL;
+        }
+        if (ix) {
+            status = same_order(
+                (sortedmap::object*) PyTuple_GET_ITEM(args, 0),
+                (sortedmap::object*) map);
+            if (unlikely(status < 0)) {
+                return NULL;
+            }
+            if (!status) {
+                PyErr_SetString(PyExc_ValueError,
+                                "cannot merge sortedmaps with different"
+                                " keyfuncs");
+                return NULL;
+            }
+        }
+    }
+
+    sortedmap::mergeiter::object *self;
+    if (!(self = PyObject_GC_New(sortedmap::mergeiter::object,
+                                 &sortedmap::mergeiter::type))) {
+        return NULL;
+    }
+    new(&self->cursors) std::vector<sortedmap::mergeiter::cursor>();
+    new(&self->heap) std::vector<std::size_t>();
+    PyObject_GC_Track(self);
+
+    int dedupe_flag = PyObject_IsTrue(dedupe);
+    int items_flag = PyObject_IsTrue(items);
+    if (unlikely(dedupe_flag < 0 || items_flag < 0)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    self->dedupe = dedupe_flag;
+    self->items = items_flag;
+
+    try {
+        self->cursors.resize(nmaps);
+        for (Py_ssize_t ix = 0; ix < nmaps; ++ix) {
+            auto map = (sortedmap::object*) PyTuple_GET_ITEM(args, ix);
+            auto &cur = self->cursors[ix];
+            CriticalSection cs((PyObject*) map);
+
+            if (unlikely(!flush(map))) {
+                throw PythonError();
+            }
+            cur.map = map;
+            cur.iter = map->map.cbegin();
+            cur.end = map->map.cend();
+            cur.iter_revision = map->iter_revision;
+        }
+        for (Py_ssize_t ix = 0; ix < nmaps; ++ix) {
+            if (advance(self->cursors[ix])) {
+                self->heap.push_back(ix);
+            }
+        }
+        if (nmaps) {
+            merge_after after{self->cursors,
+                              self->cursors[0].map.ob->map.key_comp()};
+            std::make_heap(self->heap.begin(), self->heap.end(), after);
+        }
+    }
+    catch (PythonError &e) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return (PyObject*) self;
+}
+
+void
+sortedmap::mergeiter::dealloc(sortedmap::mergeiter::object *self) {
+    using cursors = std::vector<sortedmap::mergeiter::cursor>;
+    using heap = std::vector<std::size_t>;
+
+    PyObject_GC_UnTrack(self);
+    self->cursors.~cursors();
+    self->heap.~heap();
+    PyObject_GC_Del(self);
+}
+
+int
+sortedmap::mergeiter::traverse(sortedmap::mergeiter::object *self,
+                               visitproc visit,
+                               void *arg) {
+    for (const auto &cur : self->cursors) {
+        Py_VISIT(cur.map.ob);
+        Py_VISIT(cur.key.ob);
+        Py_VISIT(cur.value.ob);
+    }
+    return 0;
+}
+
+PyObject*
+sortedmap::mergeiter::next(sortedmap::mergeiter::object *self) {
+    CriticalSection cs((PyObject*) self);
+    auto &heap = self->heap;
+
+    if (heap.empty()) {
+        return NULL;
+    }
+
+    auto &cursors = self->cursors;
+    const auto &comp = cursors[0].map.ob->map.key_comp();
+    merge_after after{cursors, comp};
+
+    try {
+        OwnedRef<PyObject> key = cursors[heap.front()].key;
+        OwnedRef<PyObject> value = cursors[heap.front()].value;
+
+        replace_top(self, after);
+
+        // every key in the heap is at least ``key`` so the equal keys are
+        // on top; the value of the last map wins like update
+        while (self->dedupe &&
+               !heap.empty() &&
+               !comp(key, cursors[heap.front()].key)) {
+            value = cursors[heap.front()].value;
+            replace_top(self, after);
+        }
+
+        if (self->items) {
+            return PyTuple_Pack(2, key.ob, value.ob);
+        }
+        return key.incref();
+    }
+    catch (PythonError &e) {
+        // the heap may be out of order, stop the merge
+        heap.clear();
+        return NULL;
+    }
+}
+
+// A one dimensional buffer of fixed width numbers. ``kind`` is one of 'b'
+// (bool), 'i' (signed int), 'u' (unsigned int), or 'f' (float).
+struct column {
+    Py_buffer view;
+    char kind;
+};
+
+template<typename T>
+static inline T
+load(const char *p) {
+    T ret;
+    std::memcpy(&ret, p, sizeof(T));
+    return ret;
+}
+
+template<typename T>
+static inline T
+column_get(const column &col, Py_ssize_t ix) {
+    const char *p = (const char*) col.view.buf + ix * col.view.strides[0];
+
+    switch (col.kind) {
+    case 'b':
+        return load<std::uint8_t>(p) != 0;
+    case 'i':
+        switch (col.view.itemsize) {
+        case 1:
+            return load<std::int8_t>(p);
+        case 2:
+            return load<std::int16_t>(p);
+        case 4:
+            return load<std::int32_t>(p);
+        default:
+            return load<std::int64_t>(p);
+        }
+    case 'u':
+        switch (col.view.itemsize) {
+        case 1:
+            return load<std::uint8_t>(p);
+        case 2:
+            return load<std::uint16_t>(p);
+        case 4:
+            return load<std::uint32_t>(p);
+        default:
+            return load<std::uint64_t>(p);
+        }
+    default:
+        return (col.view.itemsize == 4) ? load<float>(p) : load<double>(p);
+    }
+}
+
+static PyObject*
+column_box(const column &col, Py_ssize_t ix) {
+    switch (col.kind) {
+    case 'b':
+        return PyBool_FromLong(column_get<long>(col, ix));
+    case 'i':
+        return PyLong_FromLongLong(column_get<long long>(col, ix));
+    case 'u':
+        return PyLong_FromUnsignedLongLong(
+            column_get<unsigned long long>(col, ix));
+    default:
+        return PyFloat_FromDouble(column_get<double>(col, ix));
+    }
+}
+
+// Get a read only view of ``ob`` as a column, returns false with an
+// exception raised on failure. On success the caller must release
+// ``col.view``.
+static bool
+column_from_object(column &col, PyObject *ob, const char *name) {
+    if (PyObject_GetBuffer(ob, &col.view, PyBUF_FORMAT | PyBUF_STRIDES)) {
+        return false;
+    }
+    if (col.view.ndim != 1) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s must be one dimensional, got %d dimensions",
+                     name,
+                     col.view.ndim);
+        PyBuffer_Release(&col.view);
+        return false;
+    }
+
+    const char *fmt = (col.view.format) ? col.view.format : "B";
+    bool native = true;
+    switch (*fmt) {
+    case '<':
+        native = PY_LITTLE_ENDIAN;
+        ++fmt;
+        break;
+    case '>':
+    case '!':
+        native = !PY_LITTLE_ENDIAN;
+        ++fmt;
+        break;
+    case '@':
+    case '=':
+        ++fmt;
+        break;
+    }
+
+    auto itemsize = col.view.itemsize;
+    bool valid = fmt[0] && !fmt[1] && (native || itemsize == 1);
+    if (valid) {
+        if (std::strchr("bhilqn", fmt[0])) {
+            col.kind = 'i';
+        }
+        else if (std::strchr("BHILQN", fmt[0])) {
+            col.kind = 'u';
+        }
+        else if (fmt[0] == 'f' || fmt[0] == 'd') {
+            col.kind = 'f';
+        }
+        else if (fmt[0] == '?') {
+            col.kind = 'b';
+        }
+        else {
+            valid = false;
+        }
+    }
+    if (valid) {
+        switch (col.kind) {
+        case 'b':
+            valid = itemsize == 1;
+            break;
+        case 'f':
+            valid = itemsize == 4 || itemsize == 8;
+            break;
+        default:
+            valid = itemsize == 1 || itemsize == 2 ||
+                itemsize == 4 || itemsize == 8;
+        }
+    }
+    if (!valid) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s must hold native integers, floats, or bools, got"
+                     " format '%s'",
+                     name,
+                     (col.view.format) ? col.view.format : "B");
+        PyBuffer_Release(&col.view);
+        return false;
+    }
+    return true;
+}
+
+// Run ``f(0) ... f(count - 1)`` concurrently. If the system will not give
+// us more threads the remaining work is done on the calling thread.
+template<typename F>
+static void
+parallel_for(std::size_t count, const F &f) {
+    std::vector<std::thread> threads;
+    std::size_t ix = 1;
+
+    threads.reserve(count);
+    try {
+        for (; ix < count; ++ix) {
+            threads.emplace_back(f, ix);
+        }
+    }
+    catch (std::system_error &e) {}
+
+    f(0);
+    for (; ix < count; ++ix) {
+        f(ix);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+// Stable argsort of ``keys`` into ``perm``. Each thread sorts one run and
+// then neighbouring runs are merged pairwise, halving the number of runs
+// each round.
+template<typename T>
+static void
+parallel_argsort(const std::vector<T> &keys,
+                 std::vector<Py_ssize_t> &perm,
+                 std::size_t nthreads) {
+    const auto cmp = [&keys](Py_ssize_t a, Py_ssize_t b) {
+        return keys[a] < keys[b];
+    };
+    std::vector<std::size_t> bounds(nthreads + 1);
+
+    for (std::size_t ix = 0; ix <= nthreads; ++ix) {
+        bounds[ix] = perm.size() * ix / nthreads;
+    }
+
+    parallel_for(nthreads, [&](std::size_t ix) {
+        std::stable_sort(perm.begin() + bounds[ix],
+                         perm.begin() + bounds[ix + 1],
+                         cmp);
+    });
+
+    for (std::size_t width = 1; width < nthreads; width *= 2) {
+        std::size_t merges = (nthreads + 2 * width - 1) / (2 * width);
+
+        parallel_for(merges, [&](std::size_t ix) {
+            std::size_t first = ix * 2 * width;
+            std::size_t mid = std::min(first + width, nthreads);
+            std::size_t last = std::min(first + 2 * width, nthreads);
+
+            if (mid < last) {
+                std::inplace_merge(perm.begin() + bounds[first],
+                                   perm.begin() + bounds[mid],
+                                   perm.begin() + bounds[last],
+                                   cmp);
+            }
+        });
+    }
+}
+
+// Load the keys, sort them, and drop all but the last index of each run of
+// equal keys. This does not touch any python objects so it may be called
+// without the GIL. Returns false if the keys contain NaN.
+template<typename T>
+static bool
+sorted_unique_indices(const column &keycol,
+                      std::vector<Py_ssize_t> &perm,
+                      std::size_t nthreads) {
+    Py_ssize_t len = keycol.view.shape[0];
+    std::vector<T> keys(len);
+
+    for (Py_ssize_t ix = 0; ix < len; ++ix) {
+        keys[ix] = column_get<T>(keycol, ix);
+        if (std::is_floating_point<T>::value && keys[ix] != keys[ix]) {
+            return false;
+        }
+        perm[ix] = ix;
+    }
+
+    parallel_argsort(keys, perm, nthreads);
+
+    // the sort is stable so the last of each run is the last one given
+    std::size_t out = 0;
+    for (std::size_t ix = 0; ix < perm.size(); ++ix) {
+        if (ix + 1 == perm.size() || keys[perm[ix]] < keys[perm[ix + 1]]) {
+            perm[out++] = perm[ix];
+        }
+    }
+    perm.resize(out);
+    return true;
+}
+
+// the smallest run worth giving its own thread
+static const Py_ssize_t min_rows_per_thread = 1 << 15;
+
+sortedmap::object*
+sortedmap::from_arrays(PyTypeObject *cls,
+                       PyObject *keys,
+                       PyObject *values,
+                       Py_ssize_t nthreads) {
+    column keycol;
+    column valcol;
+    sortedmap::object *self = NULL;
+
+    if (!column_from_object(keycol, keys, "keys")) {
+        return NULL;
+    }
+    if (!column_from_object(valcol, values, "values")) {
+        PyBuffer_Release(&keycol.view);
+        return NULL;
+    }
+
+    Py_ssize_t len = keycol.view.shape[0];
+    if (len != valcol.view.shape[0]) {
+        PyErr_Format(PyExc_ValueError,
+                     "keys and values must be the same length, %zd != %zd",
+                     len,
+                     valcol.view.shape[0]);
+        goto done;
+    }
+
+    if (nthreads <= 0) {
+        nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    nthreads = std::max<Py_ssize_t>(
+        std::min(nthreads, len / min_rows_per_thread),
+        1);
+
+    try {
+        std::vector<Py_ssize_t> perm(len);
+        bool ok = false;
+        bool no_memory = false;
+
+        Py_BEGIN_ALLOW_THREADS
+        // the error can only be set once the GIL is held again
+        try {
+            if (keycol.kind == 'f') {
+                ok = sorted_unique_indices<double>(keycol, perm, nthreads);
+            }
+            else if (keycol.kind == 'u' && keycol.view.itemsize == 8) {
+                ok = sorted_unique_indices<std::uint64_t>(keycol,
+                                                          perm,
+                                                          nthreads);
+            }
+            else {
+                ok = sorted_unique_indices<std::int64_t>(keycol,
+                                                         perm,
+                                                         nthreads);
+            }
+        }
+        catch (std::bad_alloc &e) {
+            no_memory = true;
+        }
+        Py_END_ALLOW_THREADS
+
+        if (no_memory) {
+            PyErr_NoMemory();
+            goto done;
+        }
+        if (!ok) {
+            PyErr_SetString(PyExc_ValueError, "keys must not contain NaN");
+            goto done;
+        }
+
+        if (unlikely(!(self = innernew<sortedmap::object>(cls, NULL)))) {
+            goto done;
+        }
+
+        // the keys are already in order so each pair goes at the end
+        for (auto ix : perm) {
+            PyObject *key = column_box(keycol, ix);
+            PyObject *value;
+
+            if (unlikely(!key)) {
+                Py_CLEAR(self);
+                goto done;
+            }
+            if (unlikely(!(value = column_box(valcol, ix)))) {
+                Py_DECREF(key);
+                Py_CLEAR(self);
+                goto done;
+            }
+            gc_maybe_track(self, key, value);
+            self->map.emplace_hint(self->map.end(), key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+        }
+    }
+    catch (std::bad_alloc &e) {
+        Py_CLEAR(self);
+        PyErr_NoMemory();
+    }
+    catch (PythonError &e) {
+        Py_CLEAR(self);
+    }
+
+done:
+    PyBuffer_Release(&keycol.view);
+    PyBuffer_Release(&valcol.view);
+    return self;
+}
+
+sortedmap::object*
+sortedmap::pyfrom_arrays(PyObject *cls, PyObject *args, PyObject *kwargs) {
+    const char *keywords[] = {"keys", "values", "nthreads", NULL};
+    PyObject *keys;
+    PyObject *values;
+    PyObject *pynthreads = Py_None;
+    // 0 uses a thread per core
+    Py_ssize_t nthreads = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "OO|O:from_arrays",
+                                     (char**) keywords,
+                                     &keys,
+                                     &values,
+                                     &pynthreads)) {
+        return NULL;
+    }
+
+    if (pynthreads != Py_None) {
+        nthreads = PyNumber_AsSsize_t(pynthreads, PyExc_OverflowError);
+        if (nthreads == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (nthreads <= 0) {
+            PyErr_Format(PyExc_ValueError,
+                         "nthreads must be positive, got %zd",
+                         nthreads);
+            return NULL;
+        }
+    }
+
+    return sortedmap::from_arrays((PyTypeObject*) cls, keys, values, nthreads);
+}
+
+PyObject*
+sortedmap::get_iter_revision(object *self) {
+    return PyLong_FromUnsignedLong(self->iter_revision);
+}
+
+template<typename M>
+static PyObject*
+innerkeyfunc(M *self) {
+    PyObject *ret = self->map.key_comp().keyfunc;
+    if (!ret) {
+        ret = Py_None;
+    }
+    Py_INCREF(ret);
+    return ret;
+}
+
+PyObject*
+sortedmap::get_keyfunc(object *self) {
+    return innerkeyfunc(self);
+}
+
+PyObject*
+sortedmap::get_write_buffer(object *self) {
+    if (!self->buffer_limit) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromSize_t(self->buffer_limit);
+}
+
+PyObject*
+sortedmap::get_intern_pool(object *self) {
+    PyObject *ret = (self->intern_pool) ? self->intern_pool : Py_None;
+
+    Py_INCREF(ret);
+    return ret;
+}
+
+PyObject*
+sortedmap::get_maxlen(object *self) {
+    if (self->maxlen < 0) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromSsize_t(self->maxlen);
+}
+
+bool
+sortedmultimap::check(PyObject *ob) {
+    return PyObject_IsInstance(ob, (PyObject*) &sortedmultimap::type);
+}
+
+bool
+sortedmultimap::check_exact(PyObject *ob) {
+    return Py_TYPE(ob) == &sortedmultimap::type;
+}
+
+PyObject*
+sortedmultimap::keyiter::elem(
+    sortedmap::abstractiter::itertype<sortedmultimap::object> it) {
+    return std::get<0>(*it).incref();
+}
+
+PyObject*
+sortedmultimap::valiter::elem(
+    sortedmap::abstractiter::itertype<sortedmultimap::object> it) {
+    return std::get<1>(*it).incref();
+}
+
+PyObject*
+sortedmultimap::itemiter::elem(
+    sortedmap::abstractiter::itertype<sortedmultimap::object> it) {
+    return PyTuple_Pack(2, std::get<0>(*it).ob, std::get<1>(*it).ob);
+}
+
+PyObject*
+sortedmultimap::keyiter::iter(sortedmultimap::object *self) {
+    return sortedmap::abstractiter::iter<sortedmultimap::object,
+                                         sortedmultimap::keyiter::type>(self);
+}
+
+PyObject*
+sortedmultimap::valiter::iter(sortedmultimap::object *self) {
+    return sortedmap::abstractiter::iter<sortedmultimap::object,
+                                         sortedmultimap::valiter::type>(self);
+}
+
+PyObject*
+sortedmultimap::itemiter::iter(sortedmultimap::object *self) {
+    return sortedmap::abstractiter::iter<sortedmultimap::object,
+                                         sortedmultimap::itemiter::type>(self);
+}
+
+PyObject*
+sortedmultimap::keyview::view(sortedmultimap::object *self) {
+    return sortedmap::abstractview::view<sortedmultimap::object,
+                                         sortedmultimap::keyview::type>(self);
+}
+
+PyObject*
+sortedmultimap::valview::view(sortedmultimap::object *self) {
+    return sortedmap::abstractview::view<sortedmultimap::object,
+                                         sortedmultimap::valview::type>(self);
+}
+
+int
+sortedmultimap::itemview::contains(sortedmultimap::itemview::object *self,
+                                   PyObject *item) {
+    return item_contains(self, item);
+}
+
+PyObject*
+sortedmultimap::itemview::view(sortedmultimap::object *self) {
+    return sortedmap::abstractview::view<sortedmultimap::object,
+                                         sortedmultimap::itemview::type>(self);
+}
+
+sortedmultimap::object*
+sortedmultimap::newobject(PyTypeObject *cls,
+                          PyObject *args,
+                          PyObject *kwargs) {
+    return innernew<sortedmultimap::object>(cls, NULL);
+}
+
+int
+sortedmultimap::init(sortedmultimap::object *self,
+                     PyObject *args,
+                     PyObject *kwargs) {
+    return (sortedmultimap::update(self, args, kwargs)) ? 0 : -1;
+}
+
+void
+sortedmultimap::dealloc(sortedmultimap::object *self) {
+    using sortedmultimap::maptype;
+
+    PyObject_GC_UnTrack(self);
+    sortedmultimap::clear(self);
+    self->map.~maptype();
+    PyObject_GC_Del(self);
+}
+
+int
+sortedmultimap::traverse(sortedmultimap::object *self,
+                         visitproc visit,
+                         void *arg) {
+    PyObject *keyfunc = self->map.key_comp().keyfunc;
+
+    Py_VISIT(keyfunc);
+    for (const auto &pair : self->map) {
+        Py_VISIT(pair.first);
+        Py_VISIT(pair.second);
+    }
+    return 0;
+}
+
+void
+sortedmultimap::clear(sortedmultimap::object *self) {
+    MapSection cs(self);
+
+    if (self->map.size()) {
+        ++self->iter_revision;
+    }
+    self->map.clear();
+}
+
+int
+sortedmultimap::gcclear(sortedmultimap::object *self) {
+    MapSection cs(self);
+
+    sortedmultimap::clear(self);
+    // the keyfunc may be part of the cycle too
+    self->map = sortedmultimap::maptype(sortedmap::Comparator());
+    return 0;
+}
+
+PyObject*
+sortedmultimap::pyclear(sortedmultimap::object *self) {
+    sortedmultimap::clear(self);
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmultimap::richcompare(sortedmultimap::object *self,
+                            PyObject *other,
+                            int opid) {
+    if (!(opid == Py_EQ || opid == Py_NE) || !sortedmultimap::check(other)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    CriticalSection2 cs((PyObject*) self, other);
+    int status = equal_pairs(self, (sortedmultimap::object*) other);
+
+    if (unlikely(status < 0)) {
+        return NULL;
+    }
+    return PyBool_FromLong((opid == Py_EQ) == status);
+}
+
+Py_ssize_t
+sortedmultimap::len(sortedmultimap::object *self) {
+    MapSection cs(self);
+
+    return self->map.size();
+}
+
+PyObject*
+sortedmultimap::getitem(sortedmultimap::object *self, PyObject *key) {
+    MapSection cs(self);
+
+    try {
+        const auto &range = self->map.equal_range(key);
+        if (std::get<0>(range) == std::get<1>(range)) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+
+        PyObject *ret = PyList_New(std::distance(std::get<0>(range),
+                                                 std::get<1>(range)));
+        Py_ssize_t ix = 0;
+
+        if (unlikely(!ret)) {
+            return NULL;
+        }
+        for (auto it = std::get<0>(range); it != std::get<1>(range); ++it) {
+            PyList_SET_ITEM(ret, ix++, std::get<1>(*it).incref());
+        }
+        return ret;
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+int
+sortedmultimap::setitem(sortedmultimap::object *self,
+                        PyObject *key,
+                        PyObject *value) {
+    MapSection cs(self);
+
+    if (value) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s does not support item assignment, use insert()",
+                     Py_TYPE(self)->tp_name);
+        return -1;
+    }
+
+    try {
+        if (!self->map.erase(key)) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+        ++self->iter_revision;
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+    return 0;
+}
+
+int
+sortedmultimap::contains(sortedmultimap::object *self, PyObject *key) {
+    MapSection cs(self);
+
+    try {
+        return self->map.find(key) != self->map.end();
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+static void
+insert_throws(sortedmultimap::object *self, PyObject *key, PyObject *value) {
+    gc_maybe_track(self, key, value);
+    self->map.emplace(key, value);
+    ++self->iter_revision;
+}
+
+PyObject*
+sortedmultimap::insert(sortedmultimap::object *self, PyObject *args) {
+    MapSection cs(self);
+
+    PyObject *key;
+    PyObject *value;
+
+    if (!PyArg_ParseTuple(args, "OO:insert", &key, &value)) {
+        return NULL;
+    }
+
+    try {
+        insert_throws(self, key, value);
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmultimap::count(sortedmultimap::object *self, PyObject *key) {
+    MapSection cs(self);
+
+    try {
+        const auto &range = self->map.equal_range(key);
+        return PyLong_FromSize_t(std::distance(std::get<0>(range),
+                                               std::get<1>(range)));
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmultimap::equal_range(sortedmultimap::object *self, PyObject *key) {
+    MapSection cs(self);
+
+    try {
+        const auto &range = self->map.equal_range(key);
+        return sortedmap::abstractiter::iter<sortedmultimap::object,
+                                             sortedmultimap::itemiter::type>(
+            self,
+            std::get<0>(range),
+            std::get<1>(range));
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+sortedmultimap::popitem(sortedmultimap::object *self, bool front) {
+    MapSection cs(self);
+
+    PyObject *ret;
+
+    if (!self->map.size()) {
+        PyErr_Format(PyExc_KeyError, "%s is empty", Py_TYPE(self)->tp_name);
+        return NULL;
+    }
+
+    auto it = (front) ? self->map.begin() : std::prev(self->map.end());
+    if (!(ret = sortedmultimap::itemiter::elem(it))) {
+        return NULL;
+    }
+    ++self->iter_revision;
+    self->map.erase(it);
+    return ret;
+}
+
+PyObject*
+sortedmultimap::pypopitem(sortedmultimap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"first", NULL};
+    PyObject *pyfirst;
+    int first;
+
+    if (!unpack_kwargs("popitem", keywords, 0, &pyfirst, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    if (pyfirst) {
+        first = PyObject_IsTrue(pyfirst);
+        if (first < 0) {
+            return NULL;
+        }
+    }
+    else {
+        first = true;
+    }
+    return sortedmultimap::popitem(self, first);
+}
+
+PyObject*
+sortedmultimap::repr(sortedmultimap::object *self) {
+    return innerrepr<sortedmultimap::object,
+                     sortedmultimap::itemiter::iter>(self);
+}
+
+sortedmultimap::object*
+sortedmultimap::copy(sortedmultimap::object *self) {
+    MapSection cs(self);
+
+    sortedmultimap::object *ret = innernew<sortedmultimap::object>(
+        Py_TYPE(self),
+        self->map.key_comp().keyfunc);
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+
+    ret->map = self->map;
+    gc_track_like(ret, self);
+    return ret;
+}
+
+PyObject*
+sortedmultimap::sizeof_(sortedmultimap::object *self) {
+    MapSection cs(self);
+
+    return PyLong_FromSize_t(innersizeof(self));
+}
+
+// Add all of the pairs of the map ``other`` to self. When other is sorted
+// the same way as self and self is empty or only holds smaller keys, the
+// pairs are appended in linear time.
+template<typename M>
+static void
+multimerge_map(sortedmultimap::object *self, M *other) {
+    // self is already held by update
+    CriticalSection cs((PyObject*) other);
+    auto size = self->map.size();
+
+    if (unlikely(!flush(other))) {
+        throw PythonError();
+    }
+    gc_track_like(self, other);
+    try {
+        self->map.insert(other->map.cbegin(), other->map.cend());
+    }
+    catch (PythonError &e) {
+        if (self->map.size() != size) {
+            ++self->iter_revision;
+        }
+        throw;
+    }
+    if (self->map.size() != size) {
+        ++self->iter_revision;
+    }
+}
+
+static bool
+multimerge(sortedmultimap::object *self, PyObject *other) {
+    try {
+        if (sortedmultimap::check_exact(other)) {
+            multimerge_map(self, (sortedmultimap::object*) other);
+            return true;
+        }
+        if (sortedmap::check_exact(other)) {
+            multimerge_map(self, (sortedmap::object*) other);
+            return true;
+        }
+    }
+    catch (PythonError &e) {
+        return false;
+    }
+    return merge_mapping<sortedmultimap::object, insert_throws>(self, other);
+}
+
+bool
+sortedmultimap::update(sortedmultimap::object *self,
+                       PyObject *args,
+                       PyObject *kwargs) {
+    MapSection cs(self);
+
+    return innerupdate<sortedmultimap::object,
+                       multimerge,
+                       insert_throws>(self, args, kwargs);
+}
+
+PyObject*
+sortedmultimap::pyupdate(sortedmultimap::object *self,
+                         PyObject *args,
+                         PyObject *kwargs) {
+    if (unlikely(!sortedmultimap::update(self, args, kwargs))) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sortedmultimap::get_iter_revision(sortedmultimap::object *self) {
+    return PyLong_FromUnsignedLong(self->iter_revision);
+}
+
+PyObject*
+sortedmultimap::get_keyfunc(sortedmultimap::object *self) {
+    return innerkeyfunc(self);
+}
+
+bool
+frozensortedmap::check(PyObject *ob) {
+    return PyObject_IsInstance(ob, (PyObject*) &frozensortedmap::type);
+}
+
+bool
+frozensortedmap::check_exact(PyObject *ob) {
+    return Py_TYPE(ob) == &frozensortedmap::type;
+}
+
+PyObject*
+frozensortedmap::keyiter::elem(
+    sortedmap::abstractiter::itertype<frozensortedmap::object> it) {
+    return std::get<0>(*it).incref();
+}
+
+PyObject*
+frozensortedmap::valiter::elem(
+    sortedmap::abstractiter::itertype<frozensortedmap::object> it) {
+    return std::get<1>(*it).incref();
+}
+
+PyObject*
+frozensortedmap::itemiter::elem(
+    sortedmap::abstractiter::itertype<frozensortedmap::object> it) {
+    return pair_tuple(*it);
+}
+
+PyObject*
+frozensortedmap::keyiter::iter(frozensortedmap::object *self) {
+    return sortedmap::abstractiter::iter<frozensortedmap::object,
+                                         frozensortedmap::keyiter::type>(self);
+}
+
+PyObject*
+frozensortedmap::valiter::iter(frozensortedmap::object *self) {
+    return sortedmap::abstractiter::iter<frozensortedmap::object,
+                                         frozensortedmap::valiter::type>(self);
+}
+
+PyObject*
+frozensortedmap::itemiter::iter(frozensortedmap::object *self) {
+    return sortedmap::abstractiter::iter<frozensortedmap::object,
+                                         frozensortedmap::itemiter::type>(
+                                             self);
+}
+
+PyObject*
+frozensortedmap::keyview::view(frozensortedmap::object *self) {
+    return sortedmap::abstractview::view<frozensortedmap::object,
+                                         frozensortedmap::keyview::type>(self);
+}
+
+PyObject*
+frozensortedmap::valview::view(frozensortedmap::object *self) {
+    return sortedmap::abstractview::view<frozensortedmap::object,
+                                         frozensortedmap::valview::type>(self);
+}
+
+int
+frozensortedmap::itemview::contains(frozensortedmap::itemview::object *self,
+                                    PyObject *item) {
+    return item_contains(self, item);
+}
+
+PyObject*
+frozensortedmap::itemview::view(frozensortedmap::object *self) {
+    return sortedmap::abstractview::view<frozensortedmap::object,
+                                         frozensortedmap::itemview::type>(
+                                             self);
+}
+
+// Copy the pairs of a sortedmap into a new frozensortedmap of type ``cls``.
+// The caller must hold ``map``.
+static frozensortedmap::object*
+freeze_map(PyTypeObject *cls, sortedmap::object *map) {
+    frozensortedmap::object *self = innernew<frozensortedmap::object>(
+        cls,
+        map->map.key_comp().keyfunc);
+
+    if (unlikely(!self)) {
+        return NULL;
+    }
+    self->map.assign(map->map.cbegin(), map->map.cend(), map->map.size());
+    gc_track_like(self, map);
+    return self;
+}
+
+// Create a frozensortedmap of type ``cls`` from ``arg`` and ``kwargs`` like
+// ``sortedmap.update``. The pairs are sorted and deduplicated in a temporary
+// sortedmap which is then copied into the flat arrays.
+static frozensortedmap::object*
+frozen_from(PyTypeObject *cls,
+            PyObject *keyfunc,
+            PyObject *arg,
+            PyObject *kwargs) {
+    sortedmap::object *tmp;
+    frozensortedmap::object *ret;
+
+    if (unlikely(!(tmp = innernew<sortedmap::object>(&sortedmap::type,
+                                                     keyfunc)))) {
+        return NULL;
+    }
+    bool ok = innerupdate_from<sortedmap::object,
+                               merge,
+                               setitem_throws>(tmp, arg, kwargs);
+    if (unlikely(!ok)) {
+        Py_DECREF(tmp);
+        return NULL;
+    }
+    ret = freeze_map(cls, tmp);
+    Py_DECREF(tmp);
+    return ret;
+}
+
+PyObject*
+sortedmap::freeze(sortedmap::object *self) {
+    MapSection cs(self);
+
+    if (unlikely(!flush(self))) {
+        return NULL;
+    }
+
+    return (PyObject*) freeze_map(&frozensortedmap::type, self);
+}
+
+frozensortedmap::object*
+frozensortedmap::newobject(PyTypeObject *cls,
+                           PyObject *args,
+                           PyObject *kwargs) {
+    PyObject *arg = NULL;
+
+    if (unlikely(!PyArg_UnpackTuple(args, "frozensortedmap", 0, 1, &arg))) {
+        return NULL;
+    }
+    return frozen_from(cls, NULL, arg, kwargs);
+}
+
+void
+frozensortedmap::dealloc(frozensortedmap::object *self) {
+    using frozensortedmap::flatmap;
+
+    PyObject_GC_UnTrack(self);
+    self->map.~flatmap();
+    PyObject_GC_Del(self);
+}
+
+int
+frozensortedmap::traverse(frozensortedmap::object *self,
+                          visitproc visit,
+                          void *arg) {
+    PyObject *keyfunc = self->map.key_comp().keyfunc;
+
+    Py_VISIT(keyfunc);
+    // the search index holds its own references to the keys, these are the
+    // same objects so visiting the pairs is enough to find any cycles
+    for (const auto &pair : self->map) {
+        Py_VISIT(pair.first);
+        Py_VISIT(pair.second);
+    }
+    return 0;
+}
+
+PyObject*
+frozensortedmap::richcompare(frozensortedmap::object *self,
+                             PyObject *other,
+                             int opid) {
+    if (!(opid == Py_EQ || opid == Py_NE)) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    int status;
+
+    if (frozensortedmap::check(other)) {
+        status = equal_pairs(self, (frozensortedmap::object*) other);
+    }
+    else if (sortedmap::check(other)) {
+        CriticalSection cs(other);
+
+        if (unlikely(!flush((sortedmap::object*) other))) {
+            return NULL;
+        }
+        status = equal_pairs(self, (sortedmap::object*) other);
+    }
+    else {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+    if (unlikely(status < 0)) {
+        return NULL;
+    }
+    return PyBool_FromLong((opid == Py_EQ) == status);
+}
+
+// Mix one hash into the running hash of the pairs. This is the same mixing
+// that tuple used before Python 3.8.
+static inline bool
+hash_combine(Py_uhash_t &acc,
+             Py_uhash_t &mult,
+             std::size_t &remaining,
+             PyObject *ob) {
+    Py_hash_t hash = PyObject_Hash(ob);
+
+    if (unlikely(hash == -1)) {
+        return false;
+    }
+    acc = (acc ^ hash) * mult;
+    mult += (Py_uhash_t) (82520UL + --remaining * 2);
+    return true;
+}
+
+Py_hash_t
+frozensortedmap::hash(frozensortedmap::object *self) {
+    if (self->hash != -1) {
+        return self->hash;
+    }
+
+    PyObject *keyfunc = self->map.key_comp().keyfunc;
+    Py_uhash_t acc = 0x345678UL;
+    Py_uhash_t mult = 1000003UL;
+    std::size_t remaining = 2 * self->map.size();
+
+    for (const auto &pair : self->map) {
+        // keys are equal when neither sorts before the other, with a keyfunc
+        // that means their keys are equal so hash those instead
+        PyObject *key = (keyfunc) ?
+            PyObject_CallFunctionObjArgs(keyfunc, pair.first.ob, NULL) :
+            pair.first.incref();
+        bool ok;
+
+        if (unlikely(!key)) {
+            return -1;
+        }
+        ok = hash_combine(acc, mult, remaining, key);
+        Py_DECREF(key);
+        if (unlikely(!ok) ||
+            unlikely(!hash_combine(acc, mult, remaining, pair.second))) {
+            return -1;
+        }
+    }
+    acc += 97531UL;
+    if (acc == (Py_uhash_t) -1) {
+        acc = -2;
+    }
+    return self->hash = acc;
+}
+
+Py_ssize_t
+frozensortedmap::len(frozensortedmap::object *self) {
+    return self->map.size();
+}
+
+PyObject*
+frozensortedmap::getitem(frozensortedmap::object *self, PyObject *key) {
+    try {
+        const auto &it = self->map.find(key);
+        if (it == self->map.end()) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+        return std::get<1>(*it).incref();
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+frozensortedmap::get(frozensortedmap::object *self,
+                     PyObject *key,
+                     PyObject *def) {
+    try {
+        const auto &it = self->map.find(key);
+        if (it == self->map.end()) {
+            Py_INCREF(def);
+            return def;
+        }
+        return std::get<1>(*it).incref();
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+frozensortedmap::pyget(frozensortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
+
+    if (!unpack_kwargs("get", keywords, 1, argv, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    return frozensortedmap::get(self,
+                                argv[0],
+                                (argv[1]) ? argv[1] : Py_None);
+}
+
+PyObject*
+frozensortedmap::get_many(frozensortedmap::object *self,
+                          PyObject *keys,
+                          PyObject *def) {
+    PyObject *fast;
+    PyObject *ret;
+
+    if (unlikely(!(fast = PySequence_Fast(keys, "keys must be iterable")))) {
+        return NULL;
+    }
+
+    Py_ssize_t size = PySequence_Fast_GET_SIZE(fast);
+    std::vector<frozensortedmap::flatmap::const_iterator> found(size);
+
+    try {
+        self->map.find_many(PySequence_Fast_ITEMS(fast), size, found.data());
+    }
+    catch (PythonError &e) {
+        Py_DECREF(fast);
+        return NULL;
+    }
+    Py_DECREF(fast);
+
+    if (unlikely(!(ret = PyList_New(size)))) {
+        return NULL;
+    }
+    for (Py_ssize_t ix = 0; ix < size; ++ix) {
+        PyObject *value = (found[ix] == self->map.end()) ?
+            def :
+            std::get<1>(*found[ix]).ob;
+
+        Py_INCREF(value);
+        PyList_SET_ITEM(ret, ix, value);
+    }
+    return ret;
+}
+
+PyObject*
+frozensortedmap::pyget_many(frozensortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"keys", "default", NULL};
+    PyObject *argv[2];
+
+    if (!unpack_kwargs("get_many", keywords, 1, argv, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    return frozensortedmap::get_many(self,
+                                     argv[0],
+                                     (argv[1]) ? argv[1] : Py_None);
+}
+
+int
+frozensortedmap::contains(frozensortedmap::object *self, PyObject *key) {
+    try {
+        return self->map.find(key) != self->map.end();
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+PyObject*
+frozensortedmap::repr(frozensortedmap::object *self) {
+    return innerrepr<frozensortedmap::object,
+                     frozensortedmap::itemiter::iter>(self);
+}
+
+frozensortedmap::object*
+frozensortedmap::copy(frozensortedmap::object *self) {
+    Py_INCREF(self);
+    return self;
+}
+
+PyObject*
+frozensortedmap::sizeof_(frozensortedmap::object *self) {
+    return PyLong_FromSize_t(Py_TYPE(self)->tp_basicsize +
+                             self->map.memory());
+}
+
+PyObject*
+frozensortedmap::floor_item(frozensortedmap::object *self, PyObject *key) {
+    return neighbor_item<frozensortedmap::object, true, true>(self, key);
+}
+
+PyObject*
+frozensortedmap::ceiling_item(frozensortedmap::object *self, PyObject *key) {
+    return neighbor_item<frozensortedmap::object, false, false>(self, key);
+}
+
+PyObject*
+frozensortedmap::lower_item(frozensortedmap::object *self, PyObject *key) {
+    return neighbor_item<frozensortedmap::object, false, true>(self, key);
+}
+
+PyObject*
+frozensortedmap::higher_item(frozensortedmap::object *self, PyObject *key) {
+    return neighbor_item<frozensortedmap::object, true, false>(self, key);
+}
+
+PyObject*
+frozensortedmap::nearest_item(frozensortedmap::object *self, PyObject *key) {
+    return innernearest_item(self, key);
+}
+
+PyObject*
+frozensortedmap::iprefix(frozensortedmap::object *self, PyObject *prefix) {
+    return inneriprefix<frozensortedmap::object,
+                        frozensortedmap::keyiter::type>(self, prefix);
+}
+
+PyObject*
+frozensortedmap::get_iter_revision(frozensortedmap::object *self) {
+    return PyLong_FromUnsignedLong(self->iter_revision);
+}
+
+PyObject*
+frozensortedmap::get_keyfunc(frozensortedmap::object *self) {
+    return innerkeyfunc(self);
+}
+
+// A shard may grow to this many pairs past one and a half times its share
+// before it is rebalanced, so that small maps are not rebalanced on every
+// write.
+static const std::size_t shard_slack = 256;
+
+bool
+shardedsortedmap::check(PyObject *ob) {
+    return PyObject_IsInstance(ob, (PyObject*) &shardedsortedmap::type);
+}
+
+// Allocate a shardedsortedmap with ``nshards`` empty shards. Every key is
+// routed to the first shard until the map is rebalanced.
+static shardedsortedmap::object*
+sharded_new(PyTypeObject *cls, PyObject *keyfunc, std::size_t nshards) {
+    shardedsortedmap::object *self = PyObject_GC_New(shardedsortedmap::object,
+                                                     cls);
+
+    if (unlikely(!self)) {
+        return NULL;
+    }
+
+    self = new(self) shardedsortedmap::object;
+    self->keyfunc = keyfunc;
+    self->bounds = std::make_shared<const shardedsortedmap::boundtype>(
+        nshards - 1);
+    self->shards.reserve(nshards);
+    for (std::size_t ix = 0; ix < nshards; ++ix) {
+        sortedmap::object *shard =
+            innernew<sortedmap::object>(&sortedmap::type, keyfunc);
+
+        if (unlikely(!shard)) {
+            Py_DECREF(self);
+            return NULL;
+        }
+        self->shards.push_back(shard);
+    }
+    // the shards are containers so this always takes part in collection
+    gc_track(self);
+    return self;
+}
+
+static inline std::size_t
+default_nshards() {
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// The number of pairs in a shard.
+static inline std::size_t
+shard_len(sortedmap::object *shard) {
+    MapSection cs(shard);
+
+    return shard->map.size();
+}
+
+// Find the shard which owns ``key`` under ``bounds``.
+static std::size_t
+route(const shardedsortedmap::boundtype &bounds,
+      const sortedmap::Comparator &comp,
+      PyObject *key) {
+    std::size_t lo = 0;
+    std::size_t hi = bounds.size();
+
+    while (lo < hi) {
+        std::size_t mid = lo + (hi - lo) / 2;
+
+        if (!bounds[mid].ob || comp(key, bounds[mid])) {
+            hi = mid;
+        }
+        else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+// Call ``f(shard, ix)`` with the shard which owns ``key`` held. If a
+// rebalance publishes new bounds before the shard is held the key is routed
+// again. Throws if the key cannot be compared.
+template<typename F>
+static auto
+with_shard(shardedsortedmap::object *self, PyObject *key, F f) {
+    const sortedmap::Comparator comp(self->keyfunc.ob);
+
+    for (;;) {
+        auto bounds = std::atomic_load(&self->bounds);
+        std::size_t ix = route(*bounds, comp, key);
+        sortedmap::object *shard = self->shards[ix];
+        MapSection cs(shard);
+
+        if (std::atomic_load(&self->bounds) == bounds) {
+            return f(shard, ix);
+        }
+    }
+}
+
+// Replace the bound between shards ``ix`` and ``ix + 1``. Both shards must
+// be held. Rebalances of other pairs may publish at the same time, so this
+// retries until the swap lands on the latest bounds.
+static void
+publish_bound(shardedsortedmap::object *self,
+              std::size_t ix,
+              const OwnedRef<PyObject> &bound) {
+    auto old = std::atomic_load(&self->bounds);
+
+    for (;;) {
+        auto next = std::make_shared<shardedsortedmap::boundtype>(*old);
+
+        (*next)[ix] = bound;
+        std::shared_ptr<const shardedsortedmap::boundtype> frozen = next;
+        if (std::atomic_compare_exchange_strong(&self->bounds,
+                                                &old,
+                                                frozen)) {
+            return;
+        }
+    }
+}
+
+// The key at position ``pos`` of a shard, walking from the nearer end.
+static inline const OwnedRef<PyObject>&
+key_at(sortedmap::object *shard, std::size_t pos) {
+    auto &map = shard->map;
+
+    return std::get<0>(*((pos <= map.size() / 2) ?
+                         std::next(map.begin(), pos) :
+                         std::prev(map.end(), map.size() - pos)));
+}
+
+// Move the pairs of ``from`` into ``to`` with ``join``. Throws on failure.
+static void
+join_into(sortedmap::object *to, PyObject *from) {
+    PyObject *status = sortedmap::join(to, from);
+
+    if (unlikely(!status)) {
+        throw PythonError();
+    }
+    Py_DECREF(status);
+}
+
+// Put the pairs split off into ``from`` back into ``to`` after a failed
+// move, keeping the error from the move.
+static void
+restore(sortedmap::object *to, PyObject *from) {
+    PyObject *type, *value, *tb;
+    PyObject *status;
+
+    PyErr_Fetch(&type, &value, &tb);
+    if ((status = sortedmap::join(to, from))) {
+        Py_DECREF(status);
+    }
+    else {
+        PyErr_Clear();
+    }
+    PyErr_Restore(type, value, tb);
+    Py_DECREF(from);
+}
+
+// Move pairs between the adjacent shards ``ix`` and ``ix + 1`` until shard
+// ``ix`` holds ``want`` pairs, or as close as the pairs in the two shards
+// allow. Both shards must be held. Throws on failure.
+static void
+transfer(shardedsortedmap::object *self, std::size_t ix, std::size_t want) {
+    sortedmap::object *left = self->shards[ix];
+    sortedmap::object *right = self->shards[ix + 1];
+    std::size_t nleft = left->map.size();
+    std::size_t nright = right->map.size();
+    OwnedRef<PyObject> bound;
+    PyObject *moved;
+
+    if (want > nleft && nright) {
+        std::size_t count = std::min(want - nleft, nright);
+
+        if (count == nright) {
+            // the right shard is emptied so it owns no keys
+            auto bounds = std::atomic_load(&self->bounds);
+            if (ix + 1 < bounds->size()) {
+                bound = (*bounds)[ix + 1];
+            }
+            join_into(left, (PyObject*) right);
+        }
+        else {
+            // split off the pairs which stay, move the rest left, then put
+            // the pairs which stay back into the emptied shard
+            bound = key_at(right, count);
+            if (unlikely(!(moved = sortedmap::split(right, bound)))) {
+                throw PythonError();
+            }
+            try {
+                join_into(left, (PyObject*) right);
+                join_into(right, moved);
+            }
+            catch (PythonError &e) {
+                restore(right, moved);
+                throw;
+            }
+            Py_DECREF(moved);
+        }
+    }
+    else if (want < nleft) {
+        bound = key_at(left, want);
+        if (unlikely(!(moved = sortedmap::split(left, bound)))) {
+            throw PythonError();
+        }
+        try {
+            join_into(right, moved);
+        }
+        catch (PythonError &e) {
+            restore(left, moved);
+            throw;
+        }
+        Py_DECREF(moved);
+    }
+    else {
+        return;
+    }
+    publish_bound(self, ix, bound);
+}
+
+// The size past which a shard is rebalanced.
+static inline std::size_t
+shard_limit(shardedsortedmap::object *self) {
+    std::size_t size = std::max<Py_ssize_t>(self->size.load(), 0);
+
+    return 3 * size / (2 * self->shards.size()) + shard_slack;
+}
+
+// Even out shard ``ix`` with its smaller neighbor. If that leaves the
+// neighbor over its share, keep going in the same direction so that the
+// surplus spreads into emptier shards.
+static void
+balance(shardedsortedmap::object *self, std::size_t ix) {
+    std::size_t nshards = self->shards.size();
+    bool down;
+
+    if (nshards < 2) {
+        return;
+    }
+    if (ix == 0 || ix == nshards - 1) {
+        down = ix;
+    }
+    else {
+        down = shard_len(self->shards[ix - 1]) <=
+            shard_len(self->shards[ix + 1]);
+    }
+
+    for (;;) {
+        std::size_t other = (down) ? ix - 1 : ix + 1;
+        std::size_t lo = std::min(ix, other);
+
+        {
+            CriticalSection2 cs((PyObject*) self->shards[lo],
+                                (PyObject*) self->shards[lo + 1]);
+            transfer(self,
+                     lo,
+                     (self->shards[lo]->map.size() +
+                      self->shards[lo + 1]->map.size()) / 2);
+        }
+        ix = other;
+        if ((down ? ix == 0 : ix == nshards - 1) ||
+            shard_len(self->shards[ix]) <=
+                std::max<Py_ssize_t>(self->size.load(), 0) /
+                    self->shards.size() + shard_slack) {
+            return;
+        }
+    }
+}
+
+// Release the result of a write which is being discarded.
+static inline void
+release(PyObject *ob) {
+    Py_DECREF(ob);
+}
+
+static inline void
+release(int) {}
+
+// Run a write on the shard which owns ``key``, keeping the size up to date
+// and rebalancing the shard if it has grown past its limit. ``f`` returns
+// ``error`` on failure.
+template<typename R, typename F>
+static R
+write_shard(shardedsortedmap::object *self, PyObject *key, R error, F f) {
+    std::size_t ix = 0;
+    std::size_t size = 0;
+    R ret = error;
+
+    try {
+        ret = with_shard(self, key, [&](sortedmap::object *shard,
+                                        std::size_t shardix) {
+            std::size_t before = shard->map.size();
+            R ret = f(shard);
+
+            size = shard->map.size();
+            self->size += (Py_ssize_t) size - (Py_ssize_t) before;
+            ix = shardix;
+            return ret;
+        });
+        if (ret != error && size > shard_limit(self)) {
+            balance(self, ix);
+        }
+    }
+    catch (PythonError &e) {
+        if (ret != error) {
+            release(ret);
+        }
+        return error;
+    }
+    return ret;
+}
+
+shardedsortedmap::object*
+shardedsortedmap::newobject(PyTypeObject *cls,
+                            PyObject *args,
+                            PyObject *kwargs) {
+    return sharded_new(cls, NULL, default_nshards());
+}
+
+int
+shardedsortedmap::init(shardedsortedmap::object *self,
+                       PyObject *args,
+                       PyObject *kwargs) {
+    return (shardedsortedmap::update(self, args, kwargs)) ? 0 : -1;
+}
+
+void
+shardedsortedmap::dealloc(shardedsortedmap::object *self) {
+    using shardedsortedmap::object;
+
+    PyObject_GC_UnTrack(self);
+    for (sortedmap::object *shard : self->shards) {
+        Py_DECREF(shard);
+    }
+    self->~object();
+    PyObject_GC_Del(self);
+}
+
+int
+shardedsortedmap::traverse(shardedsortedmap::object *self,
+                           visitproc visit,
+                           void *arg) {
+    for (sortedmap::object *shard : self->shards) {
+        Py_VISIT(shard);
+    }
+    for (const auto &bound : *std::atomic_load(&self->bounds)) {
+        Py_VISIT(bound.ob);
+    }
+    Py_VISIT(self->keyfunc.ob);
+    return 0;
+}
+
+void
+shardedsortedmap::clear(shardedsortedmap::object *self) {
+    std::atomic_store(
+        &self->bounds,
+        std::make_shared<const shardedsortedmap::boundtype>(
+            self->shards.size() - 1));
+    for (sortedmap::object *shard : self->shards) {
+        MapSection cs(shard);
+
+        self->size -= shard->map.size();
+        sortedmap::clear(shard);
+        ++shard->iter_revision;
+    }
+}
+
+PyObject*
+shardedsortedmap::pyclear(shardedsortedmap::object *self) {
+    shardedsortedmap::clear(self);
+    Py_RETURN_NONE;
+}
+
+template<sortedmap::iterfunc shard_iter>
+static PyObject*
+sharded_iter(shardedsortedmap::object *self) {
+    shardedsortedmap::iter::object *ret =
+        PyObject_GC_New(shardedsortedmap::iter::object,
+                        &shardedsortedmap::iter::type);
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+    ret = new(ret) shardedsortedmap::iter::object;
+    ret->map = self;
+    ret->shard_iter = shard_iter;
+    ret->ix = 0;
+    ret->bounds = std::atomic_load(&self->bounds);
+    if (unlikely(!(ret->it = shard_iter(self->shards[0])))) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+    gc_track(ret);
+    return (PyObject*) ret;
+}
+
+PyObject*
+shardedsortedmap::keyiter::iter(shardedsortedmap::object *self) {
+    return sharded_iter<sortedmap::keyiter::iter>(self);
+}
+
+PyObject*
+shardedsortedmap::valiter::iter(shardedsortedmap::object *self) {
+    return sharded_iter<sortedmap::valiter::iter>(self);
+}
+
+PyObject*
+shardedsortedmap::itemiter::iter(shardedsortedmap::object *self) {
+    return sharded_iter<sortedmap::itemiter::iter>(self);
+}
+
+void
+shardedsortedmap::iter::dealloc(shardedsortedmap::iter::object *self) {
+    using shardedsortedmap::iter::object;
+
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(self->it);
+    self->~object();
+    PyObject_GC_Del(self);
+}
+
+int
+shardedsortedmap::iter::traverse(shardedsortedmap::iter::object *self,
+                                 visitproc visit,
+                                 void *arg) {
+    Py_VISIT(self->map.ob);
+    Py_VISIT(self->it);
+    return 0;
+}
+
+PyObject*
+shardedsortedmap::iter::next(shardedsortedmap::iter::object *self) {
+    shardedsortedmap::object *map = self->map;
+    PyObject *ret;
+
+    while (self->it) {
+        if ((ret = Py_TYPE(self->it)->tp_iternext(self->it))) {
+            return ret;
+        }
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+        Py_CLEAR(self->it);
+        if (++self->ix == map->shards.size()) {
+            break;
+        }
+        // pairs may have moved past the shards which were already seen
+        if (std::atomic_load(&map->bounds) != self->bounds) {
+            PyErr_Format(PyExc_RuntimeError,
+                         "%s was rebalanced during iteration",
+                         Py_TYPE(map)->tp_name);
+            return NULL;
+        }
+        self->it = self->shard_iter(map->shards[self->ix]);
+    }
+    return NULL;
+}
+
+PyObject*
+shardedsortedmap::keyview::view(shardedsortedmap::object *self) {
+    return sortedmap::abstractview::view<shardedsortedmap::object,
+                                         shardedsortedmap::keyview::type>(
+        self);
+}
+
+PyObject*
+shardedsortedmap::valview::view(shardedsortedmap::object *self) {
+    return sortedmap::abstractview::view<shardedsortedmap::object,
+                                         shardedsortedmap::valview::type>(
+        self);
+}
+
+int
+shardedsortedmap::itemview::contains(shardedsortedmap::itemview::object *self,
+                                     PyObject *item) {
+    if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+        return 0;
+    }
+
+    PyObject *value = shardedsortedmap::getitem(self->map,
+                                                PyTuple_GET_ITEM(item, 0));
+    int ret;
+
+    if (!value) {
+        if (PyErr_ExceptionMatches(PyExc_KeyError)) {
+            PyErr_Clear();
+            return 0;
+        }
+        return -1;
+    }
+    // compare outside of the shard's lock, __eq__ may change the map
+    ret = PyObject_RichCompareBool(value, PyTuple_GET_ITEM(item, 1), Py_EQ);
+    Py_DECREF(value);
+    return ret;
+}
+
+PyObject*
+shardedsortedmap::itemview::view(shardedsortedmap::object *self) {
+    return sortedmap::abstractview::view<shardedsortedmap::object,
+                                         shardedsortedmap::itemview::type>(
+        self);
+}
+
+PyObject*
+shardedsortedmap::richcompare(shardedsortedmap::object *self,
+                              PyObject *other,
+                              int opid) {
+    if (!(opid == Py_EQ || opid == Py_NE) ||
+        !(shardedsortedmap::check(other) || sortedmap::check(other))) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    // both sides iterate their pairs in sorted order
+    PyObject *lhs = NULL;
+    PyObject *rhs = NULL;
+    PyObject *ret = NULL;
+    PyObject *it;
+
+    if (unlikely(!(it = shardedsortedmap::itemiter::iter(self)))) {
+        return NULL;
+    }
+    lhs = PySequence_List(it);
+    Py_DECREF(it);
+    if (unlikely(!lhs)) {
+        return NULL;
+    }
+    it = (shardedsortedmap::check(other)) ?
+        shardedsortedmap::itemiter::iter((shardedsortedmap::object*) other) :
+        sortedmap::itemiter::iter((sortedmap::object*) other);
+    if (likely(it)) {
+        rhs = PySequence_List(it);
+        Py_DECREF(it);
+    }
+    if (likely(rhs)) {
+        ret = PyObject_RichCompare(lhs, rhs, opid);
+    }
+    Py_DECREF(lhs);
+    Py_XDECREF(rhs);
+    return ret;
+}
+
+Py_ssize_t
+shardedsortedmap::len(shardedsortedmap::object *self) {
+    return self->size.load();
+}
+
+PyObject*
+shardedsortedmap::getitem(shardedsortedmap::object *self, PyObject *key) {
+    try {
+        return with_shard(self, key, [&](sortedmap::object *shard,
+                                         std::size_t) {
+            return sortedmap::getitem(shard, key);
+        });
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+shardedsortedmap::pyget(shardedsortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
+
+    if (!unpack_kwargs("get", keywords, 1, argv, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    PyObject *def = (argv[1]) ? argv[1] : Py_None;
+    try {
+        return with_shard(self, argv[0], [&](sortedmap::object *shard,
+                                             std::size_t) {
+            return sortedmap::get(shard, argv[0], def);
+        });
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+shardedsortedmap::pypop(shardedsortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
+
+    if (!unpack_kwargs("pop", keywords, 1, argv, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    return write_shard(self,
+                       argv[0],
+                       (PyObject*) NULL,
+                       [&](sortedmap::object *shard) {
+                           return sortedmap::pop(shard, argv[0], argv[1]);
+                       });
+}
+
+PyObject*
+shardedsortedmap::pypopitem(shardedsortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"first", NULL};
+    PyObject *pyfirst;
+    int first = true;
+
+    if (!unpack_kwargs("popitem", keywords, 0, &pyfirst, KWARGS_FORWARD)) {
+        return NULL;
+    }
+    if (pyfirst && (first = PyObject_IsTrue(pyfirst)) < 0) {
+        return NULL;
+    }
+
+    std::size_t nshards = self->shards.size();
+    for (;;) {
+        auto bounds = std::atomic_load(&self->bounds);
+
+        for (std::size_t n = 0; n < nshards; ++n) {
+            sortedmap::object *shard =
+                self->shards[(first) ? n : nshards - 1 - n];
+            MapSection cs(shard);
+
+            if (!shard->map.size()) {
+                continue;
+            }
+            // a rebalance may have moved pairs into a shard we skipped
+            if (std::atomic_load(&self->bounds) != bounds) {
+                break;
+            }
+
+            PyObject *ret = sortedmap::popitem(shard, first);
+            if (likely(ret)) {
+                --self->size;
+            }
+            return ret;
+        }
+        if (std::atomic_load(&self->bounds) == bounds) {
+            PyErr_Format(PyExc_KeyError,
+                         "%s is empty",
+                         Py_TYPE(self)->tp_name);
+            return NULL;
+        }
+    }
+}
+
+int
+shardedsortedmap::setitem(shardedsortedmap::object *self,
+                          PyObject *key,
+                          PyObject *value) {
+    return write_shard(self, key, -1, [&](sortedmap::object *shard) {
+        return sortedmap::setitem(shard, key, value);
+    });
+}
+
+PyObject*
+shardedsortedmap::pysetdefault(shardedsortedmap::object *self,
+                               KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
+
+    if (!unpack_kwargs("setdefault", keywords, 1, argv, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    PyObject *def = (argv[1]) ? argv[1] : Py_None;
+    return write_shard(self,
+                       argv[0],
+                       (PyObject*) NULL,
+                       [&](sortedmap::object *shard) {
+                           return sortedmap::setdefault(shard, argv[0], def);
+                       });
+}
+
+int
+shardedsortedmap::contains(shardedsortedmap::object *self, PyObject *key) {
+    try {
+        return with_shard(self, key, [&](sortedmap::object *shard,
+                                         std::size_t) {
+            return sortedmap::contains(shard, key);
+        });
+    }
+    catch (PythonError &e) {
+        return -1;
+    }
+}
+
+PyObject*
+shardedsortedmap::repr(shardedsortedmap::object *self) {
+    PyObject *it;
+    PyObject *aslist;
+    PyObject *ret;
+
+    if (!(it = shardedsortedmap::itemiter::iter(self))) {
+        return NULL;
+    }
+    aslist = PySequence_List(it);
+    Py_DECREF(it);
+    if (!aslist) {
+        return NULL;
+    }
+    if (self->keyfunc.ob) {
+        ret = PyUnicode_FromFormat("%s[%R](%R)",
+                                   Py_TYPE(self)->tp_name,
+                                   self->keyfunc.ob,
+                                   aslist);
+    }
+    else {
+        ret = PyUnicode_FromFormat("%s(%R)", Py_TYPE(self)->tp_name, aslist);
+    }
+    Py_DECREF(aslist);
+    return ret;
+}
+
+shardedsortedmap::object*
+shardedsortedmap::copy(shardedsortedmap::object *self) {
+    shardedsortedmap::object *ret = sharded_new(Py_TYPE(self),
+                                                self->keyfunc.ob,
+                                                self->shards.size());
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+
+    // copy the shards under one set of bounds
+    for (;;) {
+        auto bounds = std::atomic_load(&self->bounds);
+        Py_ssize_t size = 0;
+
+        for (std::size_t ix = 0; ix < self->shards.size(); ++ix) {
+            sortedmap::object *shard = self->shards[ix];
+            sortedmap::object *dst = ret->shards[ix];
+            MapSection cs(shard);
+
+            dst->map = shard->map;
+            gc_track_like(dst, shard);
+            size += dst->map.size();
+        }
+        if (std::atomic_load(&self->bounds) == bounds) {
+            ret->bounds = bounds;
+            ret->size = size;
+            return ret;
+        }
+    }
+}
+
+// Find the pair next to ``key`` like ``neighbor_item``. If the shard which
+// owns ``key`` has no such pair, it is the first or last pair of the nearest
+// shard in that direction.
+template<bool upper, bool before>
+static PyObject*
+sharded_neighbor_item(shardedsortedmap::object *self, PyObject *key) {
+    const sortedmap::Comparator comp(self->keyfunc.ob);
+
+    try {
+        for (;;) {
+            auto bounds = std::atomic_load(&self->bounds);
+            std::size_t ix = route(*bounds, comp, key);
+
+            for (;;) {
+                sortedmap::object *shard = self->shards[ix];
+                MapSection cs(shard);
+                auto &map = shard->map;
+
+                if (std::atomic_load(&self->bounds) != bounds) {
+                    break;
+                }
+
+                auto it = (upper) ? map.upper_bound(key) :
+                    map.lower_bound(key);
+                if (before ? it != map.begin() : it != map.end()) {
+                    if (before) {
+                        --it;
+                    }
+                    return pair_tuple(*it);
+                }
+                if (before ? ix == 0 : ix == self->shards.size() - 1) {
+                    PyErr_SetObject(PyExc_KeyError, key);
+                    return NULL;
+                }
+                ix += (before) ? -1 : 1;
+            }
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+}
+
+PyObject*
+shardedsortedmap::floor_item(shardedsortedmap::object *self, PyObject *key) {
+    return sharded_neighbor_item<true, true>(self, key);
+}
+
+PyObject*
+shardedsortedmap::ceiling_item(shardedsortedmap::object *self,
+                               PyObject *key) {
+    return sharded_neighbor_item<false, false>(self, key);
+}
+
+PyObject*
+shardedsortedmap::lower_item(shardedsortedmap::object *self, PyObject *key) {
+    return sharded_neighbor_item<false, true>(self, key);
+}
+
+PyObject*
+shardedsortedmap::higher_item(shardedsortedmap::object *self, PyObject *key) {
+    return sharded_neighbor_item<true, false>(self, key);
+}
+
+PyObject*
+shardedsortedmap::rebalance(shardedsortedmap::object *self) {
+    std::size_t nshards = self->shards.size();
+    std::size_t size = std::max<Py_ssize_t>(self->size.load(), 0);
+
+    // Shard ix should end where the first size * (ix + 1) / nshards pairs
+    // end. A pass up pushes every surplus toward the last shard, then a
+    // pass down pulls each shard up to its share.
+    auto move = [&](std::size_t ix) {
+        std::size_t target = size / nshards * (ix + 1) +
+            size % nshards * (ix + 1) / nshards;
+        std::size_t before = 0;
+
+        for (std::size_t n = 0; n < ix; ++n) {
+            before += shard_len(self->shards[n]);
+        }
+
+        CriticalSection2 cs((PyObject*) self->shards[ix],
+                            (PyObject*) self->shards[ix + 1]);
+        transfer(self, ix, (target > before) ? target - before : 0);
+    };
+
+    try {
+        for (std::size_t ix = 0; ix + 1 < nshards; ++ix) {
+            move(ix);
+        }
+        for (std::size_t ix = nshards - 1; ix-- > 0;) {
+            move(ix);
+        }
+    }
+    catch (PythonError &e) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+shardedsortedmap::shard_sizes(shardedsortedmap::object *self) {
+    PyObject *ret = PyList_New(self->shards.size());
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+    for (std::size_t ix = 0; ix < self->shards.size(); ++ix) {
+        PyObject *size = PyLong_FromSize_t(shard_len(self->shards[ix]));
+
+        if (unlikely(!size)) {
+            Py_DECREF(ret);
+            return NULL;
+        }
+        PyList_SET_ITEM(ret, ix, size);
+    }
+    return ret;
+}
+
+static void
+sharded_setitem_throws(shardedsortedmap::object *self,
+                       PyObject *key,
+                       PyObject *value) {
+    if (unlikely(shardedsortedmap::setitem(self, key, value))) {
+        throw PythonError();
+    }
+}
+
+static bool
+sharded_merge(shardedsortedmap::object *self, PyObject *other) {
+    return merge_mapping<shardedsortedmap::object,
+                         sharded_setitem_throws>(self, other);
+}
+
+bool
+shardedsortedmap::update(shardedsortedmap::object *self,
+                         PyObject *args,
+                         PyObject *kwargs) {
+    return innerupdate<shardedsortedmap::object,
+                       sharded_merge,
+                       sharded_setitem_throws>(self, args, kwargs);
+}
+
+PyObject*
+shardedsortedmap::pyupdate(shardedsortedmap::object *self,
+                           PyObject *args,
+                           PyObject *kwargs) {
+    if (unlikely(!shardedsortedmap::update(self, args, kwargs))) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+// Create a shardedsortedmap of type ``cls`` which is filled from ``arg`` and
+// ``kwargs`` like ``update``.
+static shardedsortedmap::object*
+sharded_from(PyTypeObject *cls,
+             PyObject *keyfunc,
+             std::size_t nshards,
+             PyObject *arg,
+             PyObject *kwargs) {
+    shardedsortedmap::object *self;
+
+    if (unlikely(!(self = sharded_new(cls, keyfunc, nshards)))) {
+        return NULL;
+    }
+    bool ok = innerupdate_from<shardedsortedmap::object,
+                               sharded_merge,
+                               sharded_setitem_throws>(self, arg, kwargs);
+    if (unlikely(!ok)) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    return self;
+}
+
+shardedsortedmap::object*
+shardedsortedmap::with_shards(PyObject *cls,
+                              PyObject *args,
+                              PyObject *kwargs) {
+    const char *keywords[] = {"nshards", "mapping", "keyfunc", NULL};
+    Py_ssize_t nshards;
+    PyObject *mapping = NULL;
+    PyObject *keyfunc = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "n|OO:with_shards",
+                                     (char**) keywords,
+                                     &nshards,
+                                     &mapping,
+                                     &keyfunc)) {
+        return NULL;
+    }
+    if (nshards < 1) {
+        PyErr_Format(PyExc_ValueError,
+                     "nshards must be positive, got %zd",
+                     nshards);
+        return NULL;
+    }
+    if (keyfunc == Py_None) {
+        keyfunc = NULL;
+    }
+    if (mapping == Py_None) {
+        mapping = NULL;
+    }
+
+    return sharded_from((PyTypeObject*) cls, keyfunc, nshards, mapping, NULL);
+}
+
+PyObject*
+shardedsortedmap::get_keyfunc(shardedsortedmap::object *self) {
+    PyObject *ret = (self->keyfunc.ob) ? self->keyfunc.ob : Py_None;
+
+    Py_INCREF(ret);
+    return ret;
+}
+
+PyObject*
+shardedsortedmap::get_nshards(shardedsortedmap::object *self) {
+    return PyLong_FromSize_t(self->shards.size());
+}
+
+void
+sortedmap::meta::partial::dealloc(sortedmap::meta::partial::object *self) {
+    using ownedtype = OwnedRef<PyObject>;
+    using ownedcls = OwnedRef<PyTypeObject>;
+
+    self->cls.~ownedcls();
+    self->keyfunc.~ownedtype();
+    PyObject_GC_Del(self);
+}
+
+// Create an instance of ``cls`` which uses the given keyfunc and is filled
+// from ``arg`` and ``kwargs`` like ``update``.
+template<typename M,
+         bool merge(M*, PyObject*),
+         void set(M*, PyObject*, PyObject*)>
+static PyObject*
+newwithkeyfunc(PyTypeObject *cls,
+               PyObject *keyfunc,
+               PyObject *arg,
+               PyObject *kwargs) {
+    M *m;
+
+    if (!(m = innernew<M>(cls, keyfunc))) {
+        return NULL;
+    }
+    if (!innerupdate_from<M, merge, set>(m, arg, kwargs)) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    return (PyObject*) m;
+}
+
+static PyObject*
+partial_new(sortedmap::meta::partial::object *self,
+            PyObject *arg,
+            PyObject *kwargs) {
+    if (PyType_IsSubtype(self->cls, &frozensortedmap::type)) {
+        return (PyObject*) frozen_from(self->cls,
+                                       self->keyfunc.ob,
+                                       arg,
+                                       kwargs);
+    }
+    if (PyType_IsSubtype(self->cls, &shardedsortedmap::type)) {
+        return (PyObject*) sharded_from(self->cls,
+                                        self->keyfunc.ob,
+                                        default_nshards(),
+                                        arg,
+                                        kwargs);
+    }
+    if (PyType_IsSubtype(self->cls, &sortedmultimap::type)) {
+        return newwithkeyfunc<sortedmultimap::object,
+                              multimerge,
+                              insert_throws>(self->cls,
+                                             self->keyfunc.ob,
+                                             arg,
+                                             kwargs);
+    }
+    return newwithkeyfunc<sortedmap::object,
+                          merge,
+                          setitem_throws>(self->cls,
+                                          self->keyfunc.ob,
+                                          arg,
+                                          kwargs);
+}
+
+PyObject*
+sortedmap::meta::partial::call(sortedmap::meta::partial::object *self,
+                               PyObject *args,
+                               PyObject *kwargs) {
+    PyObject *arg = NULL;
+
+    if (unlikely(!PyArg_UnpackTuple(args, "update", 0, 1, &arg))) {
+        return NULL;
+    }
+    return partial_new(self, arg, kwargs);
+}
+
+#if HAVE_VECTORCALL
+PyObject*
+sortedmap::meta::partial::vectorcall(PyObject *self,
+                                     PyObject *const *args,
+                                     std::size_t nargsf,
+                                     PyObject *kwnames) {
+    Py_ssize_t nargs = PyVectorcall_NARGS(nargsf);
+    PyObject *arg = (nargs) ? args[0] : NULL;
+
+    if (unlikely(nargs > 1)) {
+        PyErr_Format(PyExc_TypeError,
+                     "update expected at most 1 argument, got %zd",
+                     nargs);
+        return NULL;
+    }
+    if (!kwnames || !PyTuple_GET_SIZE(kwnames)) {
+        // the common case, no argument tuple or kwargs dict is built
+        return partial_new((partial::object*) self, arg, NULL);
+    }
+
+    PyObject *kwargs = PyDict_New();
+    PyObject *ret;
+
+    if (unlikely(!kwargs)) {
+        return NULL;
+    }
+    for (Py_ssize_t ix = 0; ix < PyTuple_GET_SIZE(kwnames); ++ix) {
+        if (unlikely(PyDict_SetItem(kwargs,
+                                    PyTuple_GET_ITEM(kwnames, ix),
+                                    args[nargs + ix]))) {
+            Py_DECREF(kwargs);
+            return NULL;
+        }
+    }
+    ret = partial_new((partial::object*) self, arg, kwargs);
+    Py_DECREF(kwargs);
+    return ret;
+}
+#endif  // HAVE_VECTORCALL
+
+PyObject*
+sortedmap::meta::partial::repr(sortedmap::meta::partial::object *self) {
+    return PyUnicode_FromFormat("%s[%R]",
+                                self->cls.ob->tp_name,
+                                self->keyfunc.ob);
+}
+
+int
+sortedmap::meta::partial::traverse(sortedmap::meta::partial::object *self,
+                                   visitproc visit,
+                                   void *arg) {
+    Py_VISIT((PyObject*) self->cls.ob);
+    Py_VISIT(self->keyfunc);
+    return 0;
+}
+
+void
+sortedmap::meta::partial::clear(sortedmap::meta::partial::object *self) {
+    Py_CLEAR(self->cls.ob);
+    Py_CLEAR(self->keyfunc.ob);
+}
+
+sortedmap::meta::partial::object*
+sortedmap::meta::getitem(PyObject *cls, PyObject *keyfunc) {
+    sortedmap::meta::partial::object *partial;
+
+    if (!PyType_Check(cls)) {
+        PyErr_Format(PyExc_TypeError, "%R is not a type object", cls);
+        return NULL;
+    }
+
+    if (!(partial = PyObject_GC_New(sortedmap::meta::partial::object,
+                                    &sortedmap::meta::partial::type))) {
+        return NULL;
+    }
+    new(partial) sortedmap::meta::partial::object;
+#if HAVE_VECTORCALL
+    partial->vectorcall = sortedmap::meta::partial::vectorcall;
+#endif  // HAVE_VECTORCALL
+    partial->cls = std::move((PyTypeObject*) cls);
+    partial->keyfunc = std::move(keyfunc);
+    return partial;
+}
+
+// The magic at the start of a data segment and of a control segment.
+static const char shared_magic[] = "SMAPSHM1";
+static const char shared_control_magic[] = "SMAPCTL1";
+
+static_assert(sizeof(shared_magic) - 1 ==
+              sizeof(sharedsortedmap::header::magic) &&
+              sizeof(shared_control_magic) - 1 ==
+              sizeof(sharedsortedmap::control::magic),
+              "the magic must fill the header field");
+
+bool
+sharedsortedmap::check(PyObject *ob) {
+    return PyObject_IsInstance(ob, (PyObject*) &sharedsortedmap::type);
+}
+
+// Write the shm name of the control segment for ``name`` to ``out``, or of
+// the data segment for ``generation`` when it is not zero. Returns false
+// with an exception set when ``name`` is not a valid name.
+static bool
+shared_path(PyObject *name, std::uint64_t generation, std::string &out) {
+    const char *cname;
+    Py_ssize_t size;
+
+    if (!PyUnicode_Check(name)) {
+        PyErr_Format(PyExc_TypeError,
+                     "name must be a str, got %.200s",
+                     Py_TYPE(name)->tp_name);
+        return false;
+    }
+    if (unlikely(!(cname = PyUnicode_AsUTF8AndSize(name, &size)))) {
+        return false;
+    }
+    // the leading slash is added here, shm names may not hold another
+    if (!size ||
+        memchr(cname, '/', size) ||
+        strlen(cname) != (std::size_t) size) {
+        PyErr_Format(PyExc_ValueError, "invalid shared memory name: %R", name);
+        return false;
+    }
+    out = "/";
+    out.append(cname, size);
+    if (generation) {
+        out += '.';
+        out += std::to_string(generation);
+    }
+    return true;
+}
+
+// Map the shm segment ``path`` read only. When ``length`` is zero the whole
+// segment is mapped and ``length`` is set to its size, otherwise the segment
+// must hold at least ``length`` bytes. Returns NULL with ``errno`` set on
+// failure.
+static const char*
+shared_map(const char *path, std::size_t &length) {
+    int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+    struct stat st;
+    void *base = MAP_FAILED;
+    int err;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!fstat(fd, &st)) {
+        if (!length) {
+            length = st.st_size;
+        }
+        if (length && (std::size_t) st.st_size >= length) {
+            base = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        else {
+            errno = EINVAL;
+        }
+    }
+    err = errno;
+    close(fd);
+    errno = err;
+    return (base == MAP_FAILED) ? NULL : static_cast<const char*>(base);
+}
+
+static inline std::uint64_t
+shared_generation(const sharedsortedmap::control *ctl) {
+    return __atomic_load_n(&ctl->generation, __ATOMIC_ACQUIRE);
+}
+
+// Check that a column of ``size`` entries starting at ``column`` fits in a
+// segment of ``length`` bytes. For a bytes column every offset is checked,
+// so each entry is a range inside the segment.
+static bool
+shared_column_ok(const char *base,
+                 std::size_t length,
+                 sharedsortedmap::kind storage,
+                 std::uint64_t size,
+                 std::uint64_t column,
+                 std::uint64_t data) {
+    using sharedsortedmap::kind;
+
+    // ``size < length / 8`` keeps ``8 * (size + 1)`` from overflowing
+    if (column % 8 || column > length || size >= length / 8) {
+        return false;
+    }
+    if (storage == kind::int64 || storage == kind::float64) {
+        return 8 * size <= length - column;
+    }
+    if (storage != kind::bytes ||
+        8 * (size + 1) > length - column ||
+        data > length) {
+        return false;
+    }
+
+    auto offsets = reinterpret_cast<const std::uint64_t*>(base + column);
+    if (offsets[size] > length - data) {
+        return false;
+    }
+    for (std::uint64_t ix = 0; ix < size; ++ix) {
+        if (offsets[ix] > offsets[ix + 1]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check that a mapped data segment is a map which can be read safely. This
+// runs once when a map attaches, publishers never write to a segment after
+// storing its generation.
+static bool
+shared_segment_ok(const char *base, std::size_t length) {
+    auto head = reinterpret_cast<const sharedsortedmap::header*>(base);
+
+    return length >= sizeof(sharedsortedmap::header) &&
+        !memcmp(head->magic, shared_magic, sizeof(head->magic)) &&
+        head->length <= length &&
+        shared_column_ok(base,
+                         head->length,
+                         head->key_kind,
+                         head->size,
+                         head->keys,
+                         head->key_data) &&
+        shared_column_ok(base,
+                         head->length,
+                         head->value_kind,
+                         head->size,
+                         head->values,
+                         head->value_data);
+}
+
+// Map the control segment for ``name`` read only. Returns NULL with an
+// exception set on failure.
+static const sharedsortedmap::control*
+shared_map_control(const char *path) {
+    std::size_t length = sizeof(sharedsortedmap::control);
+    const char *base = shared_map(path, length);
+
+    if (!base) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return NULL;
+    }
+
+    auto ctl = reinterpret_cast<const sharedsortedmap::control*>(base);
+    if (memcmp(ctl->magic, shared_control_magic, sizeof(ctl->magic))) {
+        munmap((void*) base, length);
+        PyErr_Format(PyExc_ValueError, "%s is not a sharedsortedmap", path);
+        return NULL;
+    }
+    return ctl;
+}
+
+// Attach to the current generation of ``name``.
+static sharedsortedmap::object*
+shared_attach(PyTypeObject *cls, PyObject *name) {
+    std::string path;
+    const sharedsortedmap::control *ctl;
+    const char *base;
+    std::size_t length;
+    std::uint64_t generation;
+
+    if (!(shared_path(name, 0, path) &&
+          (ctl = shared_map_control(path.c_str())))) {
+        return NULL;
+    }
+    for (;;) {
+        if (!(generation = shared_generation(ctl))) {
+            PyErr_Format(PyExc_ValueError,
+                         "%s has not been published",
+                         path.c_str());
+            munmap((void*) ctl, sizeof(sharedsortedmap::control));
+            return NULL;
+        }
+        if (!shared_path(name, generation, path)) {
+            munmap((void*) ctl, sizeof(sharedsortedmap::control));
+            return NULL;
+        }
+        length = 0;
+        if ((base = shared_map(path.c_str(), length))) {
+            break;
+        }
+        // a publisher removes the old segment after storing the new
+        // generation, so a missing segment means there is a newer one
+        if (errno != ENOENT || shared_generation(ctl) == generation) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+            munmap((void*) ctl, sizeof(sharedsortedmap::control));
+            return NULL;
+        }
+    }
+
+    sharedsortedmap::object *self;
+    if (!shared_segment_ok(base, length)) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s is not a sharedsortedmap segment",
+                     path.c_str());
+        self = NULL;
+    }
+    else if (likely(self = PyObject_New(sharedsortedmap::object, cls))) {
+        self = new(self) sharedsortedmap::object;
+        self->base = base;
+        self->length = length;
+        self->ctl = ctl;
+        self->generation = generation;
+        self->name = name;
+        return self;
+    }
+    munmap((void*) base, length);
+    munmap((void*) ctl, sizeof(sharedsortedmap::control));
+    return NULL;
+}
+
+sharedsortedmap::object*
+sharedsortedmap::newobject(PyTypeObject *cls,
+                           PyObject *args,
+                           PyObject *kwargs) {
+    const char *keywords[] = {"name", NULL};
+    PyObject *name;
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwargs,
+                                     "O:sharedsortedmap",
+                                     (char**) keywords,
+                                     &name)) {
+        return NULL;
+    }
+    return shared_attach(cls, name);
+}
+
+void
+sharedsortedmap::dealloc(sharedsortedmap::object *self) {
+    using sharedsortedmap::object;
+
+    munmap((void*) self->base, self->length);
+    munmap((void*) self->ctl, sizeof(sharedsortedmap::control));
+    self->~object();
+    PyObject_Del(self);
+}
+
+// Read entry ``ix`` of a column.
+static inline PyObject*
+shared_column(const char *base,
+              sharedsortedmap::kind storage,
+              std::uint64_t column,
+              std::uint64_t data,
+              std::uint64_t ix) {
+    using sharedsortedmap::kind;
+
+    switch (storage) {
+    case kind::int64:
+        return PyLong_FromLongLong(
+            reinterpret_cast<const std::int64_t*>(base + column)[ix]);
+    case kind::float64:
+        return PyFloat_FromDouble(
+            reinterpret_cast<const double*>(base + column)[ix]);
+    case kind::bytes:
+        break;
+    }
+
+    auto offsets = reinterpret_cast<const std::uint64_t*>(base + column);
+    return PyBytes_FromStringAndSize(base + data + offsets[ix],
+                                     offsets[ix + 1] - offsets[ix]);
+}
+
+static PyObject*
+shared_key(sharedsortedmap::object *self, std::uint64_t ix) {
+    const sharedsortedmap::header *head = self->head();
+
+    return shared_column(self->base,
+                         head->key_kind,
+                         head->keys,
+                         head->key_data,
+                         ix);
+}
+
+static PyObject*
+shared_value(sharedsortedmap::object *self, std::uint64_t ix) {
+    const sharedsortedmap::header *head = self->head();
+
+    return shared_column(self->base,
+                         head->value_kind,
+                         head->values,
+                         head->value_data,
+                         ix);
+}
+
+static PyObject*
+shared_item(sharedsortedmap::object *self, std::uint64_t ix) {
+    PyObject *key;
+    PyObject *value;
+
+    if (unlikely(!(key = shared_key(self, ix)))) {
+        return NULL;
+    }
+    if (unlikely(!(value = shared_value(self, ix)))) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    PyObject *ret = PyTuple_Pack(2, key, value);
+    Py_DECREF(key);
+    Py_DECREF(value);
+    return ret;
+}
+
+// The first position in ``[0, size)`` where ``key_less`` is false.
+template<typename F>
+static inline std::uint64_t
+shared_lower_bound(std::uint64_t size, F key_less) {
+    std::uint64_t lo = 0;
+
+    while (size) {
+        std::uint64_t half = size / 2;
+
+        if (key_less(lo + half)) {
+            lo += half + 1;
+            size -= half + 1;
+        }
+        else {
+            size = half;
+        }
+    }
+    return lo;
+}
+
+// Find the first key which is not less than ``key``, storing its position in
+// ``pos`` and whether it equals ``key`` in ``found``. Returns 0 when ``key``
+// has no place in the order, like a nan, and -1 with an exception set when
+// ``key`` is the wrong type.
+static int
+shared_search(sharedsortedmap::object *self,
+              PyObject *key,
+              std::uint64_t &pos,
+              bool &found) {
+    using sharedsortedmap::kind;
+
+    const sharedsortedmap::header *head = self->head();
+    const std::uint64_t size = head->size;
+    const char *column = self->base + head->keys;
+
+    switch (head->key_kind) {
+    case kind::int64: {
+        if (!PyLong_Check(key)) {
+            break;
+        }
+
+        int overflow;
+        std::int64_t probe = PyLong_AsLongLongAndOverflow(key, &overflow);
+
+        if (unlikely(probe == -1 && PyErr_Occurred())) {
+            return -1;
+        }
+        if (overflow) {
+            pos = (overflow > 0) ? size : 0;
+            found = false;
+            return 1;
+        }
+
+        auto keys = reinterpret_cast<const std::int64_t*>(column);
+        pos = shared_lower_bound(size, [&](std::uint64_t ix) {
+            return keys[ix] < probe;
+        });
+        found = pos < size && keys[pos] == probe;
+        return 1;
+    }
+    case kind::float64: {
+        if (!(PyFloat_Check(key) || PyLong_Check(key))) {
+            break;
+        }
+
+        auto keys = reinterpret_cast<const double*>(column);
+        double probe = PyFloat_AsDouble(key);
+
+        if (unlikely(probe == -1.0 && PyErr_Occurred())) {
+            if (!PyErr_ExceptionMatches(PyExc_OverflowError)) {
+                return -1;
+            }
+            PyErr_Clear();
+
+            // the int is past every finite key but short of the infinities
+            int overflow;
+            PyLong_AsLongLongAndOverflow(key, &overflow);
+            double inf = std::numeric_limits<double>::infinity();
+            pos = shared_lower_bound(size, [&](std::uint64_t ix) {
+                return (overflow > 0) ? keys[ix] < inf : keys[ix] == -inf;
+            });
+            found = false;
+            return 1;
+        }
+        if (std::isnan(probe)) {
+            return 0;
+        }
+
+        pos = shared_lower_bound(size, [&](std::uint64_t ix) {
+            return keys[ix] < probe;
+        });
+        found = pos < size && keys[pos] == probe;
+        if (found && PyLong_Check(key)) {
+            // an int rounds to the nearest float, no other float is between
+            // the two so only the key it rounded to needs to be checked
+            PyObject *exact = PyLong_FromDouble(probe);
+            int cmp;
+
+            if (unlikely(!exact)) {
+                return -1;
+            }
+            cmp = PyObject_RichCompareBool(key, exact, Py_GT);
+            if (cmp <= 0) {
+                found = !cmp && !PyObject_RichCompareBool(key, exact, Py_LT);
+            }
+            else {
+                found = false;
+                ++pos;
+            }
+            Py_DECREF(exact);
+            if (unlikely(PyErr_Occurred())) {
+                return -1;
+            }
+        }
+        return 1;
+    }
+    case kind::bytes: {
+        if (!PyBytes_Check(key)) {
+            break;
+        }
+
+        const char *probe = PyBytes_AS_STRING(key);
+        std::size_t probe_size = PyBytes_GET_SIZE(key);
+        const char *data = self->base + head->key_data;
+        auto offsets = reinterpret_cast<const std::uint64_t*>(column);
+        // compare like ``bytes``: by the common prefix, then by length
+        auto compare = [&](std::uint64_t ix) {
+            std::size_t key_size = offsets[ix + 1] - offsets[ix];
+            int cmp = memcmp(data + offsets[ix],
+                             probe,
+                             std::min(key_size, probe_size));
+
+            if (cmp) {
+                return cmp;
+            }
+            return (key_size > probe_size) - (key_size < probe_size);
+        };
+
+        pos = shared_lower_bound(size, [&](std::uint64_t ix) {
+            return compare(ix) < 0;
+        });
+        found = pos < size && !compare(pos);
+        return 1;
+    }
+    }
+
+    PyErr_Format(PyExc_TypeError,
+                 "%s keys are %s, got %.200s",
+                 Py_TYPE(self)->tp_name,
+                 (head->key_kind == kind::bytes) ? "bytes" : "numbers",
+                 Py_TYPE(key)->tp_name);
+    return -1;
+}
+
+// Look up ``key``. Returns NULL without an exception set when ``key`` is not
+// in the map.
+static PyObject*
+shared_find(sharedsortedmap::object *self, PyObject *key) {
+    std::uint64_t pos;
+    bool found;
+
+    switch (shared_search(self, key, pos, found)) {
+    case -1:
+        return NULL;
+    case 0:
+        return NULL;
+    }
+    return found ? shared_value(self, pos) : NULL;
+}
+
+Py_ssize_t
+sharedsortedmap::len(sharedsortedmap::object *self) {
+    return self->head()->size;
+}
+
+PyObject*
+sharedsortedmap::getitem(sharedsortedmap::object *self, PyObject *key) {
+    PyObject *ret = shared_find(self, key);
+
+    if (!ret && !PyErr_Occurred()) {
+        PyErr_SetObject(PyExc_KeyError, key);
+    }
+    return ret;
+}
+
+PyObject*
+sharedsortedmap::pyget(sharedsortedmap::object *self, KWARGS_PARAMS) {
+    static const char *const keywords[] = {"key", "default", NULL};
+    PyObject *argv[2];
+
+    if (!unpack_kwargs("get", keywords, 1, argv, KWARGS_FORWARD)) {
+        return NULL;
+    }
+
+    PyObject *ret = shared_find(self, argv[0]);
+
+    if (!ret && !PyErr_Occurred()) {
+        ret = (argv[1]) ? argv[1] : Py_None;
+        Py_INCREF(ret);
+    }
+    return ret;
+}
+
+int
+sharedsortedmap::contains(sharedsortedmap::object *self, PyObject *key) {
+    std::uint64_t pos;
+    bool found;
+    int ret = shared_search(self, key, pos, found);
+
+    return (ret > 0) ? found : ret;
+}
+
+// Find the pair next to ``key``. ``upper`` moves past a key equal to ``key``
+// and ``before`` steps back to the pair before that position.
+template<bool upper, bool before>
+static PyObject*
+shared_neighbor_item(sharedsortedmap::object *self, PyObject *key) {
+    std::uint64_t pos;
+    bool found;
+    int ret = shared_search(self, key, pos, found);
+
+    if (ret < 0) {
+        return NULL;
+    }
+    if (ret) {
+        pos += upper && found;
+        if (before ? pos > 0 : pos < self->head()->size) {
+            return shared_item(self, pos - before);
+        }
+    }
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+}
+
+PyObject*
+sharedsortedmap::floor_item(sharedsortedmap::object *self, PyObject *key) {
+    return shared_neighbor_item<true, true>(self, key);
+}
+
+PyObject*
+sharedsortedmap::ceiling_item(sharedsortedmap::object *self, PyObject *key) {
+    return shared_neighbor_item<false, false>(self, key);
+}
+
+PyObject*
+sharedsortedmap::lower_item(sharedsortedmap::object *self, PyObject *key) {
+    return shared_neighbor_item<false, true>(self, key);
+}
+
+PyObject*
+sharedsortedmap::higher_item(sharedsortedmap::object *self, PyObject *key) {
+    return shared_neighbor_item<true, false>(self, key);
+}
+
+template<sharedsortedmap::elemfunc elem>
+static PyObject*
+shared_iter(sharedsortedmap::object *self) {
+    sharedsortedmap::iter::object *ret =
+        PyObject_New(sharedsortedmap::iter::object,
+                     &sharedsortedmap::iter::type);
+
+    if (unlikely(!ret)) {
+        return NULL;
+    }
+    ret = new(ret) sharedsortedmap::iter::object;
+    ret->map = self;
+    ret->elem = elem;
+    ret->ix = 0;
+    return (PyObject*) ret;
+}
+
+PyObject*
+sharedsortedmap::keyiter::iter(sharedsortedmap::object *self) {
+    return shared_iter<shared_key>(self);
+}
+
+PyObject*
+sharedsortedmap::valiter::iter(sharedsortedmap::object *self) {
+    return shared_iter<shared_value>(self);
+}
+
+PyObject*
+sharedsortedmap::itemiter::iter(sharedsortedmap::object *self) {
+    return shared_iter<shared_item>(self);
+}
+
+void
+sharedsortedmap::iter::dealloc(sharedsortedmap::iter::object *self) {
+    using sharedsortedmap::iter::object;
+
+    self->~object();
+    PyObject_Del(self);
+}
+
+PyObject*
+sharedsortedmap::iter::next(sharedsortedmap::iter::object *self) {
+    CriticalSection cs((PyObject*) self);
+
+    if (self->ix == self->map.ob->head()->size) {
+        return NULL;
+    }
+    return self->elem(self->map, self->ix++);
+}
+
+PyObject*
+sharedsortedmap::keyview::view(sharedsortedmap::object *self) {
+    return sortedmap::abstractview::view<sharedsortedmap::object,
+                                         sharedsortedmap::keyview::type>(
+        self);
+}
+
+PyObject*
+sharedsortedmap::valview::view(sharedsortedmap::object *self) {
+    return sortedmap::abstractview::view<sharedsortedmap::object,
+                                         sharedsortedmap::valview::type>(
+        self);
+}
+
+int
+sharedsortedmap::itemview::contains(sharedsortedmap::itemview::object *self,
+                                    PyObject *item) {
+    if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+        return 0;
+    }
+
+    PyObject *value = shared_find(self->map, PyTuple_GET_ITEM(item, 0));
+    int ret;
+
+    if (!value) {
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    ret = PyObject_RichCompareBool(value, PyTuple_GET_ITEM(item, 1), Py_EQ);
+    Py_DECREF(value);
+    return ret;
+}
+
+PyObject*
+sharedsortedmap::itemview::view(sharedsortedmap::object *self) {
+    return sortedmap::abstractview::view<sharedsortedmap::object,
+                                         sharedsortedmap::itemview::type>(
+        self);
+}
+
+PyObject*
+sharedsortedmap::richcompare(sharedsortedmap::object *self,
+                             PyObject *other,
+                             int opid) {
+    if (!(opid == Py_EQ || opid == Py_NE) ||
+        !(sharedsortedmap::check(other) ||
+          sortedmap::check(other) ||
+          frozensortedmap::check(other))) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    // both sides list their pairs in sorted order
+    PyObject *lhs;
+    PyObject *rhs;
+    PyObject *ret = NULL;
+
+    if (unlikely(!(lhs = PyMapping_Items((PyObject*) self)))) {
+        return NULL;
+    }
+    if (likely(rhs = PyMapping_Items(other))) {
+        ret = PyObject_RichCompare(lhs, rhs, opid);
+        Py_DECREF(rhs);
+    }
+    Py_DECREF(lhs);
+    return ret;
+}
+
+PyObject*
+sharedsortedmap::repr(sharedsortedmap::object *self) {
+    PyObject *aslist;
+    PyObject *ret;
+
+    if (!(aslist = PyMapping_Items((PyObject*) self))) {
+        return NULL;
+    }
+    ret = PyUnicode_FromFormat("%s(%R)", Py_TYPE(self)->tp_name, aslist);
+    Py_DECREF(aslist);
+    return ret;
+}
+
+sharedsortedmap::object*
+sharedsortedmap::copy(sharedsortedmap::object *self) {
+    Py_INCREF(self);
+    return self;
+}
+
+PyObject*
+sharedsortedmap::refresh(sharedsortedmap::object *self) {
+    if (shared_generation(self->ctl) == self->generation) {
+        Py_INCREF(self);
+        return (PyObject*) self;
+    }
+    return (PyObject*) shared_attach(Py_TYPE(self), self->name);
+}
+
+// One key or value read from python, in the form it is stored in.
+struct shared_field {
+    std::int64_t i = 0;
+    double f = 0;
+    const char *b = nullptr;
+    std::size_t size = 0;
+};
+
+static bool
+shared_kind(const char *name, sharedsortedmap::kind &out) {
+    using sharedsortedmap::kind;
+
+    if (!strcmp(name, "bytes")) {
+        out = kind::bytes;
+    }
+    else if (!strcmp(name, "int64")) {
+        out = kind::int64;
+    }
+    else if (!strcmp(name, "float64")) {
+        out = kind::float64;
+    }
+    else {
+        PyErr_Format(PyExc_ValueError,
+                     "type must be one of 'bytes', 'int64', or 'float64',"
+                     " got '%s'",
+                     name);
+        return false;
+    }
     return true;
 }
 
+// Read ``ob`` as stored by ``storage``. The field borrows the buffer of a
+// bytes object.
 static bool
-merge_from_seq2(sortedmap::object *self, PyObject *seq2) {
-    PyObject *it;
-    Py_ssize_t n;
-    PyObject *item;
-    PyObject *fast;
-
-    if (unlikely(!(it = PyObject_GetIter(seq2)))) {
-        return false;
-    }
-
-    for (n = 0;;++n) {
-        PyObject *key, *value;
-        Py_ssize_t len;
+shared_encode(sharedsortedmap::kind storage, PyObject *ob, shared_field &out) {
+    using sharedsortedmap::kind;
 
-        fast = NULL;
-        if (unlikely(!(item = PyIter_Next(it)))) {
-            if (unlikely(PyErr_Occurred())) {
-                goto fail;
-            }
+    switch (storage) {
+    case kind::int64:
+        if (!PyLong_Check(ob)) {
             break;
         }
-
-        // convert item to sequence, and verify length 2
-        if (unlikely(!(fast = PySequence_Fast(item, "")))) {
-            if (PyErr_ExceptionMatches(PyExc_TypeError))
-                PyErr_Format(PyExc_TypeError,
-                             "cannot convert sortedmap update "
-                             "sequence element %zd to a sequence",
-                             n);
-            goto fail;
+        out.i = PyLong_AsLongLong(ob);
+        return !(out.i == -1 && PyErr_Occurred());
+    case kind::float64:
+        if (!(PyFloat_Check(ob) || PyLong_Check(ob))) {
+            break;
         }
-        len = PySequence_Fast_GET_SIZE(fast);
-        if (unlikely(len != 2)) {
-            PyErr_Format(PyExc_ValueError,
-                         "sortedmap update sequence element %zd "
-                         "has length %zd; 2 is required",
-                         n, len);
-            goto fail;
+        out.f = PyFloat_AsDouble(ob);
+        return !(out.f == -1.0 && PyErr_Occurred());
+    case kind::bytes:
+        if (!PyBytes_Check(ob)) {
+            break;
         }
+        out.b = PyBytes_AS_STRING(ob);
+        out.size = PyBytes_GET_SIZE(ob);
+        return true;
+    }
+    PyErr_Format(PyExc_TypeError,
+                 "expected %s, got %.200s",
+                 (storage == kind::bytes) ? "bytes" : "a number",
+                 Py_TYPE(ob)->tp_name);
+    return false;
+}
 
-        // update with this (key, value) pair
-        key = PySequence_Fast_GET_ITEM(fast, 0);
-        value = PySequence_Fast_GET_ITEM(fast, 1);
-        try{
-            setitem_throws(self, key, value);
-        }
-        catch (PythonError &e) {
-            goto fail;
-        }
-        Py_DECREF(fast);
-        Py_DECREF(item);
+static inline int
+shared_field_compare(sharedsortedmap::kind storage,
+                     const shared_field &a,
+                     const shared_field &b) {
+    using sharedsortedmap::kind;
+
+    switch (storage) {
+    case kind::int64:
+        return (a.i > b.i) - (a.i < b.i);
+    case kind::float64:
+        return (a.f > b.f) - (a.f < b.f);
+    case kind::bytes:
+        break;
     }
 
-    n = 0;
-    goto return_;
-fail:
-    Py_XDECREF(item);
-    Py_XDECREF(fast);
-    n = -1;
-return_:
-    Py_DECREF(it);
-    return !Py_SAFE_DOWNCAST(n, Py_ssize_t, int);
+    int cmp = memcmp(a.b, b.b, std::min(a.size, b.size));
+    return (cmp) ? cmp : (a.size > b.size) - (a.size < b.size);
 }
 
-bool
-sortedmap::update(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    PyObject *arg = NULL;
+static inline std::uint64_t
+shared_align(std::uint64_t n) {
+    return (n + 7) & ~std::uint64_t(7);
+}
 
-    if (unlikely(!PyArg_UnpackTuple(args, "update", 0, 1, &arg))) {
-        return false;
+// Lay out a column starting at ``pos``, returning the end of the column.
+static std::uint64_t
+shared_layout(sharedsortedmap::kind storage,
+              const std::vector<const shared_field*> &fields,
+              std::uint64_t pos,
+              std::uint64_t &column,
+              std::uint64_t &data) {
+    column = pos;
+    if (storage != sharedsortedmap::kind::bytes) {
+        data = 0;
+        return pos + 8 * fields.size();
     }
 
-    if (arg) {
-        if (PyObject_HasAttrString(arg, "keys"))
-        {
+    std::uint64_t total = 0;
+    for (const shared_field *field : fields) {
+        total += field->size;
+    }
+    data = pos + 8 * (fields.size() + 1);
+    return shared_align(data + total);
+}
 
-            if (unlikely(!merge(self, arg))) {
-                return false;
-            }
-        }
-        else {
-            if (unlikely(!merge_from_seq2(self, arg))) {
-                return false;
-            }
+static void
+shared_write(char *base,
+             sharedsortedmap::kind storage,
+             const std::vector<const shared_field*> &fields,
+             std::uint64_t column,
+             std::uint64_t data) {
+    using sharedsortedmap::kind;
+
+    switch (storage) {
+    case kind::int64: {
+        auto out = reinterpret_cast<std::int64_t*>(base + column);
+        for (const shared_field *field : fields) {
+            *out++ = field->i;
         }
+        return;
     }
-    if (kwargs && PyDict_Size(kwargs)) {
-        if (unlikely(!merge(self, kwargs))) {
-            return false;
+    case kind::float64: {
+        auto out = reinterpret_cast<double*>(base + column);
+        for (const shared_field *field : fields) {
+            *out++ = field->f;
         }
+        return;
+    }
+    case kind::bytes:
+        break;
     }
-    return true;
-}
 
-PyObject*
-sortedmap::pyupdate(sortedmap::object *self, PyObject *args, PyObject *kwargs) {
-    if (unlikely(!sortedmap::update(self, args, kwargs))) {
-        return NULL;
+    auto offsets = reinterpret_cast<std::uint64_t*>(base + column);
+    std::uint64_t offset = 0;
+    for (const shared_field *field : fields) {
+        *offsets++ = offset;
+        memcpy(base + data + offset, field->b, field->size);
+        offset += field->size;
     }
-    Py_RETURN_NONE;
+    *offsets = offset;
 }
 
-sortedmap::object*
-sortedmap::fromkeys(PyTypeObject *cls, PyObject *seq, PyObject *value) {
-    sortedmap::object *self;
-    PyObject *it;
-    PyObject *key;
+// Map the control segment for writing, creating it if needed.
+static sharedsortedmap::control*
+shared_open_control(const char *path) {
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    void *ctl = MAP_FAILED;
 
-    if (unlikely(!(it = PyObject_GetIter(seq)))) {
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
         return NULL;
     }
-
-    if (unlikely(!(self = innernew(cls, NULL)))) {
-        Py_DECREF(it);
+    if (fstat(fd, &st) ||
+        (!st.st_size && ftruncate(fd, sizeof(sharedsortedmap::control))) ||
+        (ctl = mmap(NULL,
+                    sizeof(sharedsortedmap::control),
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    fd,
+                    0)) == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        close(fd);
         return NULL;
     }
+    close(fd);
 
-    while ((key = PyIter_Next(it))) {
-        self->map.emplace(key, value);
-        Py_DECREF(key);
+    auto ret = static_cast<sharedsortedmap::control*>(ctl);
+    char empty[sizeof(ret->magic)] = {0};
+
+    // a new segment is filled with zeros
+    if (!memcmp(ret->magic, empty, sizeof(empty))) {
+        memcpy(ret->magic, shared_control_magic, sizeof(ret->magic));
     }
-    Py_DECREF(it);
-    if (unlikely(PyErr_Occurred())) {
+    else if (memcmp(ret->magic, shared_control_magic, sizeof(ret->magic))) {
+        munmap(ctl, sizeof(sharedsortedmap::control));
+        PyErr_Format(PyExc_ValueError, "%s is not a sharedsortedmap", path);
         return NULL;
     }
+    return ret;
+}
 
-    return self;
+// Write the data segment ``path``, which must not exist yet.
+static bool
+shared_write_segment(const char *path,
+                     const sharedsortedmap::header &head,
+                     const std::vector<const shared_field*> &keys,
+                     const std::vector<const shared_field*> &values) {
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    void *base = MAP_FAILED;
+
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return false;
+    }
+    if (ftruncate(fd, head.length) ||
+        (base = mmap(NULL,
+                     head.length,
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED,
+                     fd,
+                     0)) == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        close(fd);
+        shm_unlink(path);
+        return false;
+    }
+    close(fd);
+
+    char *out = static_cast<char*>(base);
+    memcpy(out, &head, sizeof(head));
+    shared_write(out, head.key_kind, keys, head.keys, head.key_data);
+    shared_write(out, head.value_kind, values, head.values, head.value_data);
+    munmap(base, head.length);
+    return true;
 }
 
-sortedmap::object*
-sortedmap::pyfromkeys(PyObject *cls, PyObject *args, PyObject *kwargs) {
-    const char *keywords[] = {"seq", "value", NULL};
-    PyObject *seq;
-    PyObject *value = NULL;
+PyObject*
+sharedsortedmap::publish(PyObject *cls, PyObject *args, PyObject *kwargs) {
+    using sharedsortedmap::kind;
+
+    const char *keywords[] = {"name",
+                              "mapping",
+                              "key_type",
+                              "value_type",
+                              NULL};
+    PyObject *name;
+    PyObject *mapping;
+    const char *key_type = "bytes";
+    const char *value_type = "bytes";
+    sharedsortedmap::header head = {};
 
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwargs,
-                                     "O|O:fromkeys",
+                                     "OO|ss:publish",
                                      (char**) keywords,
-                                     &seq,
-                                     &value)) {
+                                     &name,
+                                     &mapping,
+                                     &key_type,
+                                     &value_type)) {
+        return NULL;
+    }
+    if (!(shared_kind(key_type, head.key_kind) &&
+          shared_kind(value_type, head.value_kind))) {
         return NULL;
     }
 
-    if (!value) {
-        value = Py_None;
+    std::string control_path;
+    if (!shared_path(name, 0, control_path)) {
+        return NULL;
     }
 
-    return sortedmap::fromkeys((PyTypeObject*) cls, seq, value);
-}
+    PyObject *it;
+    PyObject *item;
+    // the pairs, kept alive while the fields borrow their bytes
+    std::vector<OwnedRef<PyObject>> pairs;
+    std::vector<std::pair<shared_field, shared_field>> fields;
 
-PyObject*
-sortedmap::get_iter_revision(object *self) {
-    return PyLong_FromUnsignedLong(self->iter_revision);
-}
+    if (PyObject_HasAttrString(mapping, "keys")) {
+        PyObject *items = PyMapping_Items(mapping);
 
-PyObject*
-sortedmap::get_keyfunc(object *self) {
-    PyObject *ret =self->map.key_comp().keyfunc;
-    if (!ret) {
-        ret = Py_None;
+        if (unlikely(!items)) {
+            return NULL;
+        }
+        it = PyObject_GetIter(items);
+        Py_DECREF(items);
     }
-    Py_INCREF(ret);
-    return ret;
-}
+    else {
+        it = PyObject_GetIter(mapping);
+    }
+    if (unlikely(!it)) {
+        return NULL;
+    }
+    while ((item = PyIter_Next(it))) {
+        PyObject *pair = PySequence_Fast(item, "pairs must be sequences");
+        shared_field key;
+        shared_field value;
 
-void
-sortedmap::meta::partial::dealloc(sortedmap::meta::partial::object *self) {
-    using ownedtype = OwnedRef<PyObject>;
-    using ownedcls = OwnedRef<PyTypeObject>;
+        Py_DECREF(item);
+        if (unlikely(!pair)) {
+            Py_DECREF(it);
+            return NULL;
+        }
+        pairs.emplace_back(pair);
+        Py_DECREF(pair);
+        if (PySequence_Fast_GET_SIZE(pair) != 2) {
+            PyErr_Format(PyExc_ValueError,
+                         "pairs must have length 2, got %zd",
+                         PySequence_Fast_GET_SIZE(pair));
+            Py_DECREF(it);
+            return NULL;
+        }
+        if (!(shared_encode(head.key_kind,
+                            PySequence_Fast_GET_ITEM(pair, 0),
+                            key) &&
+              shared_encode(head.value_kind,
+                            PySequence_Fast_GET_ITEM(pair, 1),
+                            value))) {
+            Py_DECREF(it);
+            return NULL;
+        }
+        if (head.key_kind == kind::float64 && std::isnan(key.f)) {
+            PyErr_SetString(PyExc_ValueError, "nan cannot be a key");
+            Py_DECREF(it);
+            return NULL;
+        }
+        fields.emplace_back(key, value);
+    }
+    Py_DECREF(it);
+    if (unlikely(PyErr_Occurred())) {
+        return NULL;
+    }
 
-    self->cls.~ownedcls();
-    self->keyfunc.~ownedtype();
-    PyObject_GC_Del(self);
-}
+    // sort the pairs, keeping the last value for a repeated key
+    std::vector<std::size_t> order(fields.size());
+    for (std::size_t ix = 0; ix < order.size(); ++ix) {
+        order[ix] = ix;
+    }
+    std::stable_sort(order.begin(),
+                     order.end(),
+                     [&](std::size_t a, std::size_t b) {
+                         return shared_field_compare(head.key_kind,
+                                                     fields[a].first,
+                                                     fields[b].first) < 0;
+                     });
 
-sortedmap::object*
-sortedmap::meta::partial::call(sortedmap::meta::partial::object *self,
-                               PyObject *args,
-                               PyObject *kwargs) {
-    sortedmap::object *m;
+    std::vector<const shared_field*> keys;
+    std::vector<const shared_field*> values;
+    for (std::size_t ix = 0; ix < order.size(); ++ix) {
+        if (ix + 1 < order.size() &&
+            !shared_field_compare(head.key_kind,
+                                  fields[order[ix]].first,
+                                  fields[order[ix + 1]].first)) {
+            continue;
+        }
+        keys.push_back(&fields[order[ix]].first);
+        values.push_back(&fields[order[ix]].second);
+    }
+
+    memcpy(head.magic, shared_magic, sizeof(head.magic));
+    head.size = keys.size();
+    head.length = shared_layout(head.value_kind,
+                                values,
+                                shared_layout(head.key_kind,
+                                              keys,
+                                              sizeof(head),
+                                              head.keys,
+                                              head.key_data),
+                                head.values,
+                                head.value_data);
 
-    if (!(m = innernew(self->cls, self->keyfunc.ob))) {
+    sharedsortedmap::control *ctl;
+    if (!(ctl = shared_open_control(control_path.c_str()))) {
         return NULL;
     }
-    if (sortedmap::init(m, args, kwargs)) {
-        Py_DECREF(m);
+
+    std::uint64_t generation = shared_generation(ctl) + 1;
+    std::string path;
+
+    if (!(shared_path(name, generation, path) &&
+          shared_write_segment(path.c_str(), head, keys, values))) {
+        munmap(ctl, sizeof(sharedsortedmap::control));
         return NULL;
     }
-    return m;
+    // readers which load the new generation see the whole segment
+    __atomic_store_n(&ctl->generation, generation, __ATOMIC_RELEASE);
+    munmap(ctl, sizeof(sharedsortedmap::control));
+    if (generation > 1 && shared_path(name, generation - 1, path)) {
+        shm_unlink(path.c_str());
+    }
+    return PyLong_FromUnsignedLongLong(generation);
 }
 
 PyObject*
-sortedmap::meta::partial::repr(sortedmap::meta::partial::object *self) {
-    return PyUnicode_FromFormat("%s[%R]",
-                                self->cls.ob->tp_name,
-                                self->keyfunc.ob);
-}
+sharedsortedmap::unlink(PyObject *cls, PyObject *name) {
+    std::string path;
+    const sharedsortedmap::control *ctl;
 
-int
-sortedmap::meta::partial::traverse(sortedmap::meta::partial::object *self,
-                                   visitproc visit,
-                                   void *arg) {
-    Py_VISIT((PyObject*) self->cls.ob);
-    Py_VISIT(self->keyfunc);
-    return 0;
-}
-
-void
-sortedmap::meta::partial::clear(sortedmap::meta::partial::object *self) {
-    using ownedtype = OwnedRef<PyObject>;
-    using ownedcls = OwnedRef<PyTypeObject>;
-
-    self->cls.~ownedcls();
-    self->keyfunc.~ownedtype();
-}
-
-sortedmap::meta::partial::object*
-sortedmap::meta::getitem(PyObject *cls, PyObject *keyfunc) {
-    sortedmap::meta::partial::object *partial;
-
-    if (!PyType_Check(cls)) {
-        PyErr_Format(PyExc_TypeError, "%R is not a type object", cls);
+    if (!(shared_path(name, 0, path) &&
+          (ctl = shared_map_control(path.c_str())))) {
         return NULL;
     }
 
-    if (!(partial = PyObject_GC_New(sortedmap::meta::partial::object,
-                                    &sortedmap::meta::partial::type))) {
+    std::uint64_t generation = shared_generation(ctl);
+
+    munmap((void*) ctl, sizeof(sharedsortedmap::control));
+    if (shm_unlink(path.c_str())) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
         return NULL;
     }
-    new(partial) sortedmap::meta::partial::object;
-    partial->cls = std::move((PyTypeObject*) cls);
-    partial->keyfunc = std::move(keyfunc);
-    return partial;
+    if (generation) {
+        if (!shared_path(name, generation, path)) {
+            return NULL;
+        }
+        // already gone if a publisher raced with this
+        if (shm_unlink(path.c_str()) && errno != ENOENT) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, path.c_str());
+            return NULL;
+        }
+    }
+    Py_RETURN_NONE;
+}
+
+PyObject*
+sharedsortedmap::get_name(sharedsortedmap::object *self) {
+    Py_INCREF(self->name.ob);
+    return self->name.ob;
+}
+
+PyObject*
+sharedsortedmap::get_generation(sharedsortedmap::object *self) {
+    return PyLong_FromUnsignedLongLong(self->generation);
 }
 
 #define MODULE_NAME "sortedmap._sortedmap"
@@ -916,8 +7730,33 @@ init_sortedmap(void)
                                      &sortedmap::itemiter::type,
                                      &sortedmap::keyview::type,
                                      &sortedmap::valview::type,
-                                     &sortedmap::itemiter::type,
-                                     &sortedmap::type};
+                                     &sortedmap::itemview::type,
+                                     &sortedmap::mergeiter::type,
+                                     &sortedmap::type,
+                                     &sortedmultimap::keyiter::type,
+                                     &sortedmultimap::valiter::type,
+                                     &sortedmultimap::itemiter::type,
+                                     &sortedmultimap::keyview::type,
+                                     &sortedmultimap::valview::type,
+                                     &sortedmultimap::itemview::type,
+                                     &sortedmultimap::type,
+                                     &frozensortedmap::keyiter::type,
+                                     &frozensortedmap::valiter::type,
+                                     &frozensortedmap::itemiter::type,
+                                     &frozensortedmap::keyview::type,
+                                     &frozensortedmap::valview::type,
+                                     &frozensortedmap::itemview::type,
+                                     &frozensortedmap::type,
+                                     &shardedsortedmap::iter::type,
+                                     &shardedsortedmap::keyview::type,
+                                     &shardedsortedmap::valview::type,
+                                     &shardedsortedmap::itemview::type,
+                                     &shardedsortedmap::type,
+                                     &sharedsortedmap::iter::type,
+                                     &sharedsortedmap::keyview::type,
+                                     &sharedsortedmap::valview::type,
+                                     &sharedsortedmap::itemview::type,
+                                     &sharedsortedmap::type};
     PyObject *m;
 
     for (const auto &t : ts) {
@@ -935,10 +7774,51 @@ init_sortedmap(void)
         return ERROR_RETURN;
     }
 
+#ifdef Py_GIL_DISABLED
+    // every map, iterator, and view operation holds the critical section of
+    // the objects it touches
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif  // Py_GIL_DISABLED
+
     if (PyModule_AddObject(m, "sortedmap", (PyObject*) &sortedmap::type)) {
         Py_DECREF(m);
         return ERROR_RETURN;
     }
+    if (PyModule_AddObject(m,
+                           "sortedmultimap",
+                           (PyObject*) &sortedmultimap::type)) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+    if (PyModule_AddObject(m,
+                           "frozensortedmap",
+                           (PyObject*) &frozensortedmap::type)) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+    if (PyModule_AddObject(m,
+                           "shardedsortedmap",
+                           (PyObject*) &shardedsortedmap::type)) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+    if (PyModule_AddObject(m,
+                           "sharedsortedmap",
+                           (PyObject*) &sharedsortedmap::type)) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+
+    PyObject *pool;
+    if (!(pool = PyDict_New())) {
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
+    if (PyModule_AddObject(m, "intern_pool", pool)) {
+        Py_DECREF(pool);
+        Py_DECREF(m);
+        return ERROR_RETURN;
+    }
 
 #if !COMPILING_IN_PY2
     return m;
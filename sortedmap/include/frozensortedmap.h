@@ -0,0 +1,615 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "sortedmap.h"
+
+namespace frozensortedmap {
+    // An immutable map stored as one sorted array of pairs. Lookups search a
+    // second copy of the keys laid out in Eytzinger (breadth first) order:
+    // the first few levels of the implicit tree share a handful of cache
+    // lines and the children of a node are adjacent, so the next level can
+    // be prefetched while the current key is being compared.
+    //
+    // When there is no keyfunc and every key is an exact ``int`` that fits
+    // in 64 bits, or every key is an exact ``float``, the search copy holds
+    // the unboxed numbers instead. Each step of the search is then a single
+    // compare which the compiler turns into a conditional move, so there are
+    // no branches to mispredict and no calls into Python.
+    class flatmap {
+    public:
+        using value_type = std::pair<OwnedRef<PyObject>, OwnedRef<PyObject>>;
+        using const_iterator = std::vector<value_type>::const_iterator;
+
+    private:
+        enum class keykind : char {
+            object,
+            int64,
+            float64,
+        };
+
+        sortedmap::Comparator comp;
+        std::vector<value_type> pairs;
+        keykind kind = keykind::object;
+        // ``index[k]`` is the key of the k'th node of the implicit tree,
+        // with the root at 1. ``rank[k]`` is its position in ``pairs``. Only
+        // one of ``index``, ``ints``, or ``floats`` is filled, based on
+        // ``kind``.
+        std::vector<OwnedRef<PyObject>> index;
+        std::vector<std::int64_t> ints;
+        std::vector<double> floats;
+        std::vector<std::size_t> rank;
+
+        std::size_t build(std::size_t pos, std::size_t k) {
+            if (k <= pairs.size()) {
+                pos = build(pos, 2 * k);
+                rank[k] = pos++;
+                pos = build(pos, 2 * k + 1);
+            }
+            return pos;
+        }
+
+        // Pick the key kind and fill the matching search copy.
+        void build_index() {
+            const std::size_t n = pairs.size();
+            bool all_ints = !comp.keyfunc && n;
+            bool all_floats = !comp.keyfunc && n;
+
+            for (const auto &pair : pairs) {
+                PyObject *key = std::get<0>(pair).ob;
+                int overflow = 0;
+
+                if (!(PyLong_CheckExact(key) &&
+                      (PyLong_AsLongLongAndOverflow(key, &overflow),
+                       !overflow))) {
+                    all_ints = false;
+                }
+                all_floats = all_floats && PyFloat_CheckExact(key);
+            }
+
+            index.clear();
+            ints.clear();
+            floats.clear();
+            if (all_ints) {
+                kind = keykind::int64;
+                ints.resize(n + 1);
+                for (std::size_t k = 1; k <= n; ++k) {
+                    ints[k] = PyLong_AsLongLong(std::get<0>(pairs[rank[k]]));
+                }
+            }
+            else if (all_floats) {
+                kind = keykind::float64;
+                floats.resize(n + 1);
+                for (std::size_t k = 1; k <= n; ++k) {
+                    floats[k] = PyFloat_AS_DOUBLE(
+                        std::get<0>(pairs[rank[k]]).ob);
+                }
+            }
+            else {
+                kind = keykind::object;
+                index.resize(n + 1);
+                for (std::size_t k = 1; k <= n; ++k) {
+                    index[k] = std::get<0>(pairs[rank[k]]);
+                }
+            }
+        }
+
+        // Read ``key`` as an unboxed number of the same kind as the keys.
+        // Returns false when ``key`` needs to be compared as an object.
+        bool native_key(PyObject *key, std::int64_t &out) const {
+            int overflow = 0;
+
+            if (!PyLong_CheckExact(key)) {
+                return false;
+            }
+            out = PyLong_AsLongLongAndOverflow(key, &overflow);
+            return !overflow;
+        }
+
+        bool native_key(PyObject *key, double &out) const {
+            if (!PyFloat_CheckExact(key)) {
+                return false;
+            }
+            out = PyFloat_AS_DOUBLE(key);
+            return true;
+        }
+
+        // Walk the implicit tree going right while ``go_right(k)``.
+        // Returns the tree index of the last node where the walk went left,
+        // or 0 if it never did.
+        template<typename T, typename F>
+        std::size_t descend(const std::vector<T> &keys, F go_right) const {
+            const std::size_t n = pairs.size();
+            std::size_t k = 1;
+
+            while (k <= n) {
+                // the 16 descendants of k four levels down are adjacent
+                __builtin_prefetch(keys.data() + std::min(16 * k, n));
+                k = 2 * k + go_right(keys[k]);
+            }
+            // strip the trailing right turns and the final left turn
+            return k >> __builtin_ffsll(~k);
+        }
+
+        // Search the unboxed keys for the first node which is not less than
+        // (or with ``upper``, greater than) ``key``.
+        template<bool upper, typename T>
+        std::size_t native_bound(const std::vector<T> &keys, T key) const {
+            return descend(keys, [key](T node) {
+                return (upper) ? !(key < node) : node < key;
+            });
+        }
+
+        const_iterator at_node(std::size_t k) const {
+            return (k) ? pairs.cbegin() + rank[k] : pairs.cend();
+        }
+
+        template<bool upper>
+        const_iterator bound(const OwnedRef<PyObject> &key) const {
+            std::int64_t i;
+            double d;
+
+            switch (kind) {
+            case keykind::object:
+                return at_node(descend(index,
+                                       [&](const OwnedRef<PyObject> &node) {
+                    return (upper) ? !comp(key, node) : comp(node, key);
+                }));
+            case keykind::int64:
+                if (native_key(key, i)) {
+                    return at_node(native_bound<upper>(ints, i));
+                }
+                break;
+            case keykind::float64:
+                if (native_key(key, d)) {
+                    return at_node(native_bound<upper>(floats, d));
+                }
+                break;
+            }
+
+            // the key is a different type than the keys in the map, fall
+            // back to comparing objects in the sorted array
+            return (upper) ?
+                std::upper_bound(pairs.cbegin(),
+                                 pairs.cend(),
+                                 key,
+                                 [&](const OwnedRef<PyObject> &probe,
+                                     const value_type &pair) {
+                                     return comp(probe, std::get<0>(pair));
+                                 }) :
+                std::lower_bound(pairs.cbegin(),
+                                 pairs.cend(),
+                                 key,
+                                 [&](const value_type &pair,
+                                     const OwnedRef<PyObject> &probe) {
+                                     return comp(std::get<0>(pair), probe);
+                                 });
+        }
+
+        template<typename T>
+        const_iterator native_find(const std::vector<T> &keys, T key) const {
+            std::size_t k = native_bound<false>(keys, key);
+
+            return (k && keys[k] == key) ? at_node(k) : pairs.cend();
+        }
+
+        // Find many unboxed keys at once. The probes walk the tree in
+        // lock-step, a level at a time, so the cache misses of one probe are
+        // overlapped with the compares of the others.
+        template<typename T>
+        void native_find_many(const std::vector<T> &keys,
+                              PyObject *const *probes,
+                              std::size_t count,
+                              const_iterator *out) const {
+            constexpr std::size_t lanes = 16;
+            const std::size_t n = pairs.size();
+            // the number of levels that every walk passes through
+            const int full = 63 - __builtin_clzll(n + 1);
+
+            for (std::size_t base = 0; base < count; base += lanes) {
+                const std::size_t width = std::min(lanes, count - base);
+                T xs[lanes];
+                std::size_t ks[lanes];
+                std::size_t ixs[lanes];
+                std::size_t m = 0;
+
+                for (std::size_t j = 0; j < width; ++j) {
+                    if (native_key(probes[base + j], xs[m])) {
+                        ks[m] = 1;
+                        ixs[m++] = base + j;
+                    }
+                    else {
+                        out[base + j] = find(probes[base + j]);
+                    }
+                }
+                for (int level = 0; level < full; ++level) {
+                    for (std::size_t j = 0; j < m; ++j) {
+                        ks[j] = 2 * ks[j] + (keys[ks[j]] < xs[j]);
+                        __builtin_prefetch(keys.data() +
+                                           std::min(2 * ks[j], n));
+                    }
+                }
+                for (std::size_t j = 0; j < m; ++j) {
+                    std::size_t k = ks[j];
+
+                    if (k <= n) {
+                        k = 2 * k + (keys[k] < xs[j]);
+                    }
+                    k >>= __builtin_ffsll(~k);
+                    out[ixs[j]] = (k && keys[k] == xs[j]) ?
+                        at_node(k) :
+                        pairs.cend();
+                }
+            }
+        }
+
+    public:
+        flatmap() : index(1), rank(1) {}
+
+        explicit flatmap(const sortedmap::Comparator &comp)
+            : comp(comp), index(1), rank(1) {}
+
+        // Copy the pairs of a sorted range. The keys must already be sorted
+        // and unique under ``comp``.
+        template<typename I>
+        void assign(I first, I last, std::size_t size) {
+            pairs.clear();
+            pairs.reserve(size);
+            for (; first != last; ++first) {
+                pairs.emplace_back(std::get<0>(*first), std::get<1>(*first));
+            }
+            rank.assign(pairs.size() + 1, 0);
+            build(0, 1);
+            build_index();
+        }
+
+        sortedmap::Comparator key_comp() const {
+            return comp;
+        }
+
+        std::size_t size() const {
+            return pairs.size();
+        }
+
+        const_iterator begin() const {
+            return pairs.cbegin();
+        }
+
+        const_iterator end() const {
+            return pairs.cend();
+        }
+
+        const_iterator cbegin() const {
+            return pairs.cbegin();
+        }
+
+        const_iterator cend() const {
+            return pairs.cend();
+        }
+
+        const_iterator lower_bound(const OwnedRef<PyObject> &key) const {
+            return bound<false>(key);
+        }
+
+        const_iterator upper_bound(const OwnedRef<PyObject> &key) const {
+            return bound<true>(key);
+        }
+
+        const_iterator find(const OwnedRef<PyObject> &key) const {
+            std::int64_t i;
+            double d;
+
+            if (kind == keykind::int64 && native_key(key, i)) {
+                return native_find(ints, i);
+            }
+            if (kind == keykind::float64 && native_key(key, d)) {
+                return native_find(floats, d);
+            }
+
+            const_iterator it = lower_bound(key);
+
+            if (it != pairs.cend() && comp(key, std::get<0>(*it))) {
+                return pairs.cend();
+            }
+            return it;
+        }
+
+        // Look up ``count`` keys, storing the position of each in ``out``.
+        void find_many(PyObject *const *probes,
+                       std::size_t count,
+                       const_iterator *out) const {
+            switch (kind) {
+            case keykind::int64:
+                native_find_many(ints, probes, count, out);
+                break;
+            case keykind::float64:
+                native_find_many(floats, probes, count, out);
+                break;
+            case keykind::object:
+                for (std::size_t ix = 0; ix < count; ++ix) {
+                    out[ix] = find(probes[ix]);
+                }
+                break;
+            }
+        }
+
+        // The bytes used by the arrays, not counting the keys and values.
+        std::size_t memory() const {
+            return pairs.capacity() * sizeof(value_type) +
+                index.capacity() * sizeof(OwnedRef<PyObject>) +
+                ints.capacity() * sizeof(std::int64_t) +
+                floats.capacity() * sizeof(double) +
+                rank.capacity() * sizeof(std::size_t);
+        }
+    };
+
+    struct object {
+        typedef frozensortedmap::flatmap maptype;
+
+        PyObject_HEAD
+        maptype map;
+        // The map never changes, this is here for the shared iterators.
+        unsigned long iter_revision = 0;
+        // -1 until the hash has been computed.
+        Py_hash_t hash = -1;
+    };
+
+    bool check(PyObject*);
+    bool check_exact(PyObject*);
+
+    typedef PyObject *iterfunc(object*);
+    typedef PyObject *viewfunc(object*);
+    object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    void dealloc(object*);
+    int traverse(object*, visitproc, void*);
+    PyObject *richcompare(object*, PyObject*, int);
+    Py_hash_t hash(object*);
+    Py_ssize_t len(object*);
+    PyObject *getitem(object*, PyObject*);
+    PyObject *get(object*, PyObject*, PyObject*);
+    PyObject *pyget(object*, KWARGS_PARAMS);
+    PyObject *get_many(object*, PyObject*, PyObject*);
+    PyObject *pyget_many(object*, KWARGS_PARAMS);
+    int contains(object*, PyObject*);
+    PyObject *repr(object*);
+    object *copy(object*);
+    PyObject *sizeof_(object*);
+    PyObject *floor_item(object*, PyObject*);
+    PyObject *ceiling_item(object*, PyObject*);
+    PyObject *lower_item(object*, PyObject*);
+    PyObject *higher_item(object*, PyObject*);
+    PyObject *nearest_item(object*, PyObject*);
+    PyObject *iprefix(object*, PyObject*);
+
+    namespace keyiter {
+        using object = sortedmap::abstractiter::object<frozensortedmap::object>;
+
+        sortedmap::abstractiter::extract_element<frozensortedmap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractiter::type<
+            name,
+            frozensortedmap::object,
+            elem>;
+    }
+
+    namespace valiter {
+        using object = sortedmap::abstractiter::object<frozensortedmap::object>;
+
+        sortedmap::abstractiter::extract_element<frozensortedmap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractiter::type<
+            name,
+            frozensortedmap::object,
+            elem>;
+    }
+
+    namespace itemiter {
+        using object = sortedmap::abstractiter::object<frozensortedmap::object>;
+
+        sortedmap::abstractiter::extract_element<frozensortedmap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractiter::type<
+            name,
+            frozensortedmap::object,
+            elem,
+            true>;
+    }
+
+    namespace keyview {
+        using object = sortedmap::abstractview::object<frozensortedmap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            frozensortedmap::object,
+            PySet_New,
+            keyiter::iter,
+            len,
+            sortedmap::abstractview::keycontains<frozensortedmap::object,
+                                                 contains>>;
+    }
+
+    namespace valview {
+        using object = sortedmap::abstractview::object<frozensortedmap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            frozensortedmap::object,
+            PySequence_List,
+            valiter::iter,
+            len,
+            nullptr>;
+    }
+
+    namespace itemview {
+        using object = sortedmap::abstractview::object<frozensortedmap::object>;
+
+        viewfunc view;
+        sortedmap::abstractview::containsfunc<frozensortedmap::object> contains;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            frozensortedmap::object,
+            PySet_New,
+            itemiter::iter,
+            len,
+            contains>;
+    }
+
+    PySequenceMethods as_sequence = {
+        0,                                          // sq_length
+        0,                                          // sq_concat
+        0,                                          // sq_repeat
+        0,                                          // sq_item
+        0,                                          // placeholder
+        0,                                          // sq_ass_item
+        0,                                          // placeholder
+        (objobjproc) contains,                      // sq_contains
+    };
+
+    PyMappingMethods as_mapping = {
+        (lenfunc) len,                              // mp_length
+        (binaryfunc) getitem,                       // mp_subscript
+        0,                                          // mp_ass_subscript
+    };
+
+    PyDoc_STRVAR(copy_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "copy : frozensortedmap\n"
+                 "    This frozensortedmap, which cannot change.\n");
+    PyDoc_STRVAR(sizeof_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "size : int\n"
+                 "    The size of the frozensortedmap in bytes, including\n"
+                 "    the arrays but not the keys and values.\n");
+
+    PyDoc_STRVAR(get_many_doc,
+                 "Lookup many keys at once.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "keys : iterable[any]\n"
+                 "    The keys to lookup.\n"
+                 "default, optional\n"
+                 "    The value to use for keys which are not in this map.\n"
+                 "    This defaults to None.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "values : list\n"
+                 "    ``[self.get(key, default) for key in keys]``\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "When every key in the map is an ``int`` that fits in 64\n"
+                 "bits, or every key is a ``float``, the lookups are\n"
+                 "interleaved so the memory accesses of one overlap with\n"
+                 "the others.\n");
+
+    PyMethodDef methods[] = {
+        {"keys", (PyCFunction) keyview::view,
+         METH_NOARGS, sortedmap::keys_doc},
+        {"values", (PyCFunction) valview::view,
+         METH_NOARGS, sortedmap::values_doc},
+        {"items", (PyCFunction) itemview::view,
+         METH_NOARGS, sortedmap::items_doc},
+        {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
+        {"__sizeof__", (PyCFunction) sizeof_, METH_NOARGS, sizeof_doc},
+        {"floor_item", (PyCFunction) floor_item,
+         METH_O, sortedmap::floor_item_doc},
+        {"ceiling_item", (PyCFunction) ceiling_item,
+         METH_O, sortedmap::ceiling_item_doc},
+        {"lower_item", (PyCFunction) lower_item,
+         METH_O, sortedmap::lower_item_doc},
+        {"higher_item", (PyCFunction) higher_item,
+         METH_O, sortedmap::higher_item_doc},
+        {"nearest_item", (PyCFunction) nearest_item,
+         METH_O, sortedmap::nearest_item_doc},
+        {"iprefix", (PyCFunction) iprefix, METH_O, sortedmap::iprefix_doc},
+        {"get", (PyCFunction) pyget, METH_KWARGS, sortedmap::get_doc},
+        {"get_many", (PyCFunction) pyget_many, METH_KWARGS, get_many_doc},
+        {NULL},
+    };
+
+    PyObject *get_iter_revision(object*);
+    PyObject *get_keyfunc(object*);
+
+    // not using a member because object has a non standard layout
+    PyGetSetDef getsets[] = {
+        {(char*) "keyfunc",
+         (getter) get_keyfunc,
+         NULL,
+         sortedmap::keyfunc_doc,
+         NULL},
+        {(char*) "_iter_revision",
+         (getter) get_iter_revision,
+         NULL,
+         sortedmap::iter_revision_doc,
+         NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(frozensortedmap_doc,
+                 "An immutable, hashable sortedmap stored in flat arrays.\n"
+                 "Lookups are faster than a sortedmap and the pairs take\n"
+                 "less memory.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "mapping : mapping\n"
+                 "**kwargs\n"
+                 "    The pairs.\n");
+
+    PyTypeObject type = {
+        PyVarObject_HEAD_INIT(&sortedmap::meta::type, 0)
+        "sortedmap.frozensortedmap",                // tp_name
+        sizeof(object),                             // tp_basicsize
+        0,                                          // tp_itemsize
+        (destructor) dealloc,                       // tp_dealloc
+        0,                                          // tp_print
+        0,                                          // tp_getattr
+        0,                                          // tp_setattr
+        0,                                          // tp_reserved
+        (reprfunc) repr,                            // tp_repr
+        0,                                          // tp_as_number
+        &as_sequence,                               // tp_as_sequence
+        &as_mapping,                                // tp_as_mapping
+        (hashfunc) hash,                            // tp_hash
+        0,                                          // tp_call
+        (reprfunc) repr,                            // tp_str
+        0,                                          // tp_getattro
+        0,                                          // tp_setattro
+        0,                                          // tp_as_buffer
+        Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                         // tp_flags
+        frozensortedmap_doc,                        // tp_doc
+        (traverseproc) traverse,                    // tp_traverse
+        0,                                          // tp_clear
+        (richcmpfunc) richcompare,                  // tp_richcompare
+        0,                                          // tp_weaklistoffset
+        (getiterfunc) keyiter::iter,                // tp_iter
+        0,                                          // tp_iternext
+        methods,                                    // tp_methods
+        0,                                          // tp_members
+        getsets,                                    // tp_getset
+        0,                                          // tp_base
+        0,                                          // tp_dict
+        0,                                          // tp_descr_get
+        0,                                          // tp_descr_set
+        0,                                          // tp_dictoffset
+        0,                                          // tp_init
+        0,                                          // tp_alloc
+        (newfunc) newobject,                        // tp_new
+    };
+}
@@ -0,0 +1,349 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "sortedmap.h"
+
+namespace shardedsortedmap {
+    // The keys which separate the shards. Shard ``ix`` holds the keys in
+    // ``[bounds[ix - 1], bounds[ix])``. A NULL bound is above every key, so
+    // the shards after it are empty. A set of bounds is never changed once
+    // it is published, a rebalance publishes a new one.
+    using boundtype = std::vector<OwnedRef<PyObject>>;
+
+    struct object {
+        PyObject_HEAD
+        // The shards in key order, this does not change after ``init``.
+        std::vector<sortedmap::object*> shards;
+        // The keyfunc of every shard, kept here so routing does not read a
+        // shard's tree.
+        OwnedRef<PyObject> keyfunc;
+        // Read and written with ``std::atomic_load`` and
+        // ``std::atomic_store`` so that routing does not take a lock.
+        std::shared_ptr<const boundtype> bounds;
+        // The number of pairs in all of the shards.
+        std::atomic<Py_ssize_t> size{0};
+    };
+
+    bool check(PyObject*);
+
+    typedef PyObject *iterfunc(object*);
+    typedef PyObject *viewfunc(object*);
+    object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    int init(object*, PyObject*, PyObject*);
+    void dealloc(object*);
+    int traverse(object*, visitproc, void*);
+    void clear(object*);
+    PyObject *pyclear(object*);
+    PyObject *richcompare(object*, PyObject*, int);
+    Py_ssize_t len(object*);
+    PyObject *getitem(object*, PyObject*);
+    PyObject *pyget(object*, KWARGS_PARAMS);
+    PyObject *pypop(object*, KWARGS_PARAMS);
+    PyObject *pypopitem(object*, KWARGS_PARAMS);
+    int setitem(object*, PyObject*, PyObject*);
+    PyObject *pysetdefault(object*, KWARGS_PARAMS);
+    int contains(object*, PyObject*);
+    PyObject *repr(object*);
+    object *copy(object*);
+    PyObject *floor_item(object*, PyObject*);
+    PyObject *ceiling_item(object*, PyObject*);
+    PyObject *lower_item(object*, PyObject*);
+    PyObject *higher_item(object*, PyObject*);
+    PyObject *rebalance(object*);
+    PyObject *shard_sizes(object*);
+    bool update(object*, PyObject*, PyObject*);
+    PyObject *pyupdate(object*, PyObject*, PyObject*);
+    object *with_shards(PyObject*, PyObject*, PyObject*);
+
+    // Iterates the shards in order, moving to the next shard when one is
+    // exhausted.
+    namespace iter {
+        struct object {
+            PyObject_HEAD
+            OwnedRef<shardedsortedmap::object> map;
+            // Makes the iterator over a single shard.
+            sortedmap::iterfunc *shard_iter;
+            // The index of the shard being iterated.
+            std::size_t ix;
+            // The iterator over shard ``ix``, or NULL once all of the shards
+            // have been iterated.
+            PyObject *it;
+            // The bounds when iteration started. The pairs may not be seen
+            // in order if a rebalance moves them between shards.
+            std::shared_ptr<const boundtype> bounds;
+        };
+
+        void dealloc(object*);
+        int traverse(object*, visitproc, void*);
+        PyObject *next(object*);
+
+        PyTypeObject type = {
+            PyVarObject_HEAD_INIT(&PyType_Type, 0)
+            "sortedmap.shardediter",                    // tp_name
+            sizeof(object),                             // tp_basicsize
+            0,                                          // tp_itemsize
+            (destructor) dealloc,                       // tp_dealloc
+            0,                                          // tp_print
+            0,                                          // tp_getattr
+            0,                                          // tp_setattr
+            0,                                          // tp_reserved
+            0,                                          // tp_repr
+            0,                                          // tp_as_number
+            0,                                          // tp_as_sequence
+            0,                                          // tp_as_mapping
+            0,                                          // tp_hash
+            0,                                          // tp_call
+            0,                                          // tp_str
+            0,                                          // tp_getattro
+            0,                                          // tp_setattro
+            0,                                          // tp_as_buffer
+            Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    // tp_flags
+            0,                                          // tp_doc
+            (traverseproc) traverse,                    // tp_traverse
+            0,                                          // tp_clear
+            0,                                          // tp_richcompare
+            0,                                          // tp_weaklistoffset
+            PyObject_SelfIter,                          // tp_iter
+            (iternextfunc) next,                        // tp_iternext
+        };
+    }
+
+    namespace keyiter {
+        iterfunc iter;
+    }
+
+    namespace valiter {
+        iterfunc iter;
+    }
+
+    namespace itemiter {
+        iterfunc iter;
+    }
+
+    namespace keyview {
+        using object = sortedmap::abstractview::object<
+            shardedsortedmap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            shardedsortedmap::object,
+            PySet_New,
+            keyiter::iter,
+            len,
+            sortedmap::abstractview::keycontains<shardedsortedmap::object,
+                                                 contains>>;
+    }
+
+    namespace valview {
+        using object = sortedmap::abstractview::object<
+            shardedsortedmap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            shardedsortedmap::object,
+            PySequence_List,
+            valiter::iter,
+            len,
+            nullptr>;
+    }
+
+    namespace itemview {
+        using object = sortedmap::abstractview::object<
+            shardedsortedmap::object>;
+
+        viewfunc view;
+        sortedmap::abstractview::containsfunc<shardedsortedmap::object>
+            contains;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            shardedsortedmap::object,
+            PySet_New,
+            itemiter::iter,
+            len,
+            contains>;
+    }
+
+    PySequenceMethods as_sequence = {
+        0,                                          // sq_length
+        0,                                          // sq_concat
+        0,                                          // sq_repeat
+        0,                                          // sq_item
+        0,                                          // placeholder
+        0,                                          // sq_ass_item
+        0,                                          // placeholder
+        (objobjproc) contains,                      // sq_contains
+    };
+
+    PyMappingMethods as_mapping = {
+        (lenfunc) len,                              // mp_length
+        (binaryfunc) getitem,                       // mp_subscript
+        (objobjargproc) setitem,                    // mp_ass_subscript
+    };
+
+    PyDoc_STRVAR(copy_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "copy : shardedsortedmap\n"
+                 "    A shallow copy of this shardedsortedmap with the same\n"
+                 "    number of shards and the same bounds.\n");
+    PyDoc_STRVAR(rebalance_doc,
+                 "Move the bounds between the shards so that each one\n"
+                 "holds about the same number of pairs.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Writes rebalance the shard they land in with its smaller\n"
+                 "neighbor once it holds half again its share of the\n"
+                 "pairs, so this is only needed to even out the shards\n"
+                 "all at once, for example after a bulk load.\n");
+    PyDoc_STRVAR(shard_sizes_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "sizes : list[int]\n"
+                 "    The number of pairs in each shard, in key order.\n");
+    PyDoc_STRVAR(with_shards_doc,
+                 "Create a shardedsortedmap with a given number of shards.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "nshards : int\n"
+                 "    The number of shards.\n"
+                 "mapping : mapping, optional\n"
+                 "    The initial pairs.\n"
+                 "keyfunc : callable, optional\n"
+                 "    The key function used for comparing keys.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "m : shardedsortedmap\n"
+                 "    The new map.\n");
+
+    PyMethodDef methods[] = {
+        {"keys", (PyCFunction) keyview::view, METH_NOARGS,
+         sortedmap::keys_doc},
+        {"values", (PyCFunction) valview::view, METH_NOARGS,
+         sortedmap::values_doc},
+        {"items", (PyCFunction) itemview::view, METH_NOARGS,
+         sortedmap::items_doc},
+        {"clear", (PyCFunction) pyclear, METH_NOARGS, sortedmap::clear_doc},
+        {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
+        {"floor_item", (PyCFunction) floor_item,
+         METH_O, sortedmap::floor_item_doc},
+        {"ceiling_item", (PyCFunction) ceiling_item,
+         METH_O, sortedmap::ceiling_item_doc},
+        {"lower_item", (PyCFunction) lower_item,
+         METH_O, sortedmap::lower_item_doc},
+        {"higher_item", (PyCFunction) higher_item,
+         METH_O, sortedmap::higher_item_doc},
+        {"rebalance", (PyCFunction) rebalance, METH_NOARGS, rebalance_doc},
+        {"shard_sizes", (PyCFunction) shard_sizes,
+         METH_NOARGS, shard_sizes_doc},
+        {"update", (PyCFunction) pyupdate,
+         METH_VARARGS | METH_KEYWORDS, sortedmap::update_doc},
+        {"with_shards", (PyCFunction) with_shards,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, with_shards_doc},
+        {"get", (PyCFunction) pyget, METH_KWARGS, sortedmap::get_doc},
+        {"pop", (PyCFunction) pypop, METH_KWARGS, sortedmap::pop_doc},
+        {"popitem", (PyCFunction) pypopitem,
+         METH_KWARGS, sortedmap::popitem_doc},
+        {"setdefault", (PyCFunction) pysetdefault,
+         METH_KWARGS, sortedmap::setdefault_doc},
+        {NULL},
+    };
+
+    PyObject *get_keyfunc(object*);
+    PyObject *get_nshards(object*);
+
+    PyDoc_STRVAR(nshards_doc,
+                 "The number of shards the keys are split between.\n");
+
+    // not using a member because object has a non standard layout
+    PyGetSetDef getsets[] = {
+        {(char*) "keyfunc",
+         (getter) get_keyfunc,
+         NULL,
+         sortedmap::keyfunc_doc,
+         NULL},
+        {(char*) "nshards",
+         (getter) get_nshards,
+         NULL,
+         nshards_doc,
+         NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(shardedsortedmap_doc,
+                 "A sorted mapping split into shards by key range, each\n"
+                 "with its own lock.\n"
+                 "\n"
+                 "Writers to different shards do not wait for each other\n"
+                 "in the free-threaded build. The bounds between the\n"
+                 "shards move as the keys skew so that the shards stay\n"
+                 "about the same size. Iteration walks the shards in\n"
+                 "order, so the pairs come out sorted like ``sortedmap``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "mapping : mapping\n"
+                 "**kwargs\n"
+                 "    The initial pairs.\n"
+                 "\n"
+                 "See Also\n"
+                 "--------\n"
+                 "shardedsortedmap.with_shards\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "There is one shard per CPU unless ``with_shards`` is\n"
+                 "used.\n");
+
+    PyTypeObject type = {
+        PyVarObject_HEAD_INIT(&sortedmap::meta::type, 0)
+        "sortedmap.shardedsortedmap",               // tp_name
+        sizeof(object),                             // tp_basicsize
+        0,                                          // tp_itemsize
+        (destructor) dealloc,                       // tp_dealloc
+        0,                                          // tp_print
+        0,                                          // tp_getattr
+        0,                                          // tp_setattr
+        0,                                          // tp_reserved
+        (reprfunc) repr,                            // tp_repr
+        0,                                          // tp_as_number
+        &as_sequence,                               // tp_as_sequence
+        &as_mapping,                                // tp_as_mapping
+        0,                                          // tp_hash
+        0,                                          // tp_call
+        (reprfunc) repr,                            // tp_str
+        0,                                          // tp_getattro
+        0,                                          // tp_setattro
+        0,                                          // tp_as_buffer
+        Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                         // tp_flags
+        shardedsortedmap_doc,                       // tp_doc
+        (traverseproc) traverse,                    // tp_traverse
+        (inquiry) clear,                            // tp_clear
+        (richcmpfunc) richcompare,                  // tp_richcompare
+        0,                                          // tp_weaklistoffset
+        (getiterfunc) keyiter::iter,                // tp_iter
+        0,                                          // tp_iternext
+        methods,                                    // tp_methods
+        0,                                          // tp_members
+        getsets,                                    // tp_getset
+        0,                                          // tp_base
+        0,                                          // tp_dict
+        0,                                          // tp_descr_get
+        0,                                          // tp_descr_set
+        0,                                          // tp_dictoffset
+        (initproc) init,                            // tp_init
+        0,                                          // tp_alloc
+        (newfunc) newobject,                        // tp_new
+    };
+}
@@ -0,0 +1,371 @@
+#pragma once
+#include <cstdint>
+
+#include "sortedmap.h"
+
+namespace sharedsortedmap {
+    // How the keys or the values are stored in a segment. Python code names
+    // these 'bytes', 'int64', and 'float64'.
+    enum class kind : std::uint32_t {
+        bytes,
+        int64,
+        float64,
+    };
+
+    // The start of a data segment. The pairs are sorted by key, the keys
+    // and the values are each stored as a column. A fixed width column is
+    // an array of ``size`` numbers. A bytes column is an array of
+    // ``size + 1`` offsets into its data, pair ``ix`` is the bytes in
+    // ``[offsets[ix], offsets[ix + 1])``. Every offset is from the start of
+    // the segment and the arrays are 8 byte aligned.
+    struct header {
+        char magic[8];
+        std::uint64_t size;
+        kind key_kind;
+        kind value_kind;
+        std::uint64_t keys;
+        std::uint64_t key_data;
+        std::uint64_t values;
+        std::uint64_t value_data;
+        // The size of the segment in bytes.
+        std::uint64_t length;
+    };
+
+    // The segment named after the map. It only holds the generation of the
+    // current data segment, ``<name>.<generation>``, which is written
+    // atomically once the new data segment is complete.
+    struct control {
+        char magic[8];
+        std::uint64_t generation;
+    };
+
+    struct object {
+        PyObject_HEAD
+        // The data segment, mapped read only. Every process attached to the
+        // same generation shares these pages.
+        const char *base;
+        std::size_t length;
+        // The control segment, kept mapped so that ``refresh`` is cheap.
+        const control *ctl;
+        std::uint64_t generation;
+        OwnedRef<PyObject> name;
+
+        const header *head() const {
+            return reinterpret_cast<const header*>(base);
+        }
+    };
+
+    bool check(PyObject*);
+
+    typedef PyObject *iterfunc(object*);
+    typedef PyObject *viewfunc(object*);
+    // Read pair ``ix`` of a map.
+    typedef PyObject *elemfunc(object*, std::uint64_t);
+    object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    void dealloc(object*);
+    PyObject *richcompare(object*, PyObject*, int);
+    Py_ssize_t len(object*);
+    PyObject *getitem(object*, PyObject*);
+    PyObject *pyget(object*, KWARGS_PARAMS);
+    int contains(object*, PyObject*);
+    PyObject *repr(object*);
+    object *copy(object*);
+    PyObject *floor_item(object*, PyObject*);
+    PyObject *ceiling_item(object*, PyObject*);
+    PyObject *lower_item(object*, PyObject*);
+    PyObject *higher_item(object*, PyObject*);
+    PyObject *refresh(object*);
+    PyObject *publish(PyObject*, PyObject*, PyObject*);
+    PyObject *unlink(PyObject*, PyObject*);
+
+    // Walks the pairs by position, the segment never changes once it is
+    // mapped.
+    namespace iter {
+        struct object {
+            PyObject_HEAD
+            OwnedRef<sharedsortedmap::object> map;
+            elemfunc *elem;
+            std::uint64_t ix;
+        };
+
+        void dealloc(object*);
+        PyObject *next(object*);
+
+        PyTypeObject type = {
+            PyVarObject_HEAD_INIT(&PyType_Type, 0)
+            "sortedmap.sharediter",                     // tp_name
+            sizeof(object),                             // tp_basicsize
+            0,                                          // tp_itemsize
+            (destructor) dealloc,                       // tp_dealloc
+            0,                                          // tp_print
+            0,                                          // tp_getattr
+            0,                                          // tp_setattr
+            0,                                          // tp_reserved
+            0,                                          // tp_repr
+            0,                                          // tp_as_number
+            0,                                          // tp_as_sequence
+            0,                                          // tp_as_mapping
+            0,                                          // tp_hash
+            0,                                          // tp_call
+            0,                                          // tp_str
+            0,                                          // tp_getattro
+            0,                                          // tp_setattro
+            0,                                          // tp_as_buffer
+            Py_TPFLAGS_DEFAULT,                         // tp_flags
+            0,                                          // tp_doc
+            0,                                          // tp_traverse
+            0,                                          // tp_clear
+            0,                                          // tp_richcompare
+            0,                                          // tp_weaklistoffset
+            PyObject_SelfIter,                          // tp_iter
+            (iternextfunc) next,                        // tp_iternext
+        };
+    }
+
+    namespace keyiter {
+        iterfunc iter;
+    }
+
+    namespace valiter {
+        iterfunc iter;
+    }
+
+    namespace itemiter {
+        iterfunc iter;
+    }
+
+    namespace keyview {
+        using object = sortedmap::abstractview::object<
+            sharedsortedmap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            sharedsortedmap::object,
+            PySet_New,
+            keyiter::iter,
+            len,
+            sortedmap::abstractview::keycontains<sharedsortedmap::object,
+                                                 contains>>;
+    }
+
+    namespace valview {
+        using object = sortedmap::abstractview::object<
+            sharedsortedmap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            sharedsortedmap::object,
+            PySequence_List,
+            valiter::iter,
+            len,
+            nullptr>;
+    }
+
+    namespace itemview {
+        using object = sortedmap::abstractview::object<
+            sharedsortedmap::object>;
+
+        viewfunc view;
+        sortedmap::abstractview::containsfunc<sharedsortedmap::object>
+            contains;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            sharedsortedmap::object,
+            PySet_New,
+            itemiter::iter,
+            len,
+            contains>;
+    }
+
+    PySequenceMethods as_sequence = {
+        0,                                          // sq_length
+        0,                                          // sq_concat
+        0,                                          // sq_repeat
+        0,                                          // sq_item
+        0,                                          // placeholder
+        0,                                          // sq_ass_item
+        0,                                          // placeholder
+        (objobjproc) contains,                      // sq_contains
+    };
+
+    PyMappingMethods as_mapping = {
+        (lenfunc) len,                              // mp_length
+        (binaryfunc) getitem,                       // mp_subscript
+        0,                                          // mp_ass_subscript
+    };
+
+    PyDoc_STRVAR(copy_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "copy : sharedsortedmap\n"
+                 "    This sharedsortedmap, which cannot change.\n");
+    PyDoc_STRVAR(refresh_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "latest : sharedsortedmap\n"
+                 "    The map attached to the generation most recently\n"
+                 "    published under this name, or this map if it is\n"
+                 "    already the latest.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Checking for a new generation reads one integer from\n"
+                 "shared memory, so this is cheap enough to call before\n"
+                 "each request.\n");
+    PyDoc_STRVAR(publish_doc,
+                 "Write a new generation of a shared map.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "name : str\n"
+                 "    The name of the map, without a leading slash.\n"
+                 "mapping : mapping or iterable[(key, value)]\n"
+                 "    The pairs. When a key repeats, the last value wins.\n"
+                 "key_type : {'bytes', 'int64', 'float64'}, optional\n"
+                 "    How the keys are stored. Defaults to 'bytes'.\n"
+                 "value_type : {'bytes', 'int64', 'float64'}, optional\n"
+                 "    How the values are stored. Defaults to 'bytes'.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "generation : int\n"
+                 "    The generation which was published.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "The new segment is written in full before its generation\n"
+                 "is stored, so readers see either the old pairs or the new\n"
+                 "ones. The name of the old segment is removed, maps which\n"
+                 "are already attached to it keep reading it until they\n"
+                 "are refreshed. There should be only one publisher for a\n"
+                 "name at a time.\n");
+    PyDoc_STRVAR(unlink_doc,
+                 "Remove the shared memory for a name.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "name : str\n"
+                 "    The name of the map.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Maps which are already attached keep working, the memory\n"
+                 "is released when the last one is deallocated.\n");
+
+    PyMethodDef methods[] = {
+        {"keys", (PyCFunction) keyview::view,
+         METH_NOARGS, sortedmap::keys_doc},
+        {"values", (PyCFunction) valview::view,
+         METH_NOARGS, sortedmap::values_doc},
+        {"items", (PyCFunction) itemview::view,
+         METH_NOARGS, sortedmap::items_doc},
+        {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
+        {"floor_item", (PyCFunction) floor_item,
+         METH_O, sortedmap::floor_item_doc},
+        {"ceiling_item", (PyCFunction) ceiling_item,
+         METH_O, sortedmap::ceiling_item_doc},
+        {"lower_item", (PyCFunction) lower_item,
+         METH_O, sortedmap::lower_item_doc},
+        {"higher_item", (PyCFunction) higher_item,
+         METH_O, sortedmap::higher_item_doc},
+        {"get", (PyCFunction) pyget, METH_KWARGS, sortedmap::get_doc},
+        {"refresh", (PyCFunction) refresh, METH_NOARGS, refresh_doc},
+        {"publish", (PyCFunction) publish,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, publish_doc},
+        {"unlink", (PyCFunction) unlink,
+         METH_CLASS | METH_O, unlink_doc},
+        {NULL},
+    };
+
+    PyObject *get_name(object*);
+    PyObject *get_generation(object*);
+
+    PyDoc_STRVAR(name_doc, "The name the map was published under.\n");
+    PyDoc_STRVAR(generation_doc,
+                 "The generation of the segment this map reads.\n");
+
+    // not using a member because object has a non standard layout
+    PyGetSetDef getsets[] = {
+        {(char*) "name",
+         (getter) get_name,
+         NULL,
+         name_doc,
+         NULL},
+        {(char*) "generation",
+         (getter) get_generation,
+         NULL,
+         generation_doc,
+         NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(sharedsortedmap_doc,
+                 "A read only sorted mapping stored in POSIX shared memory.\n"
+                 "\n"
+                 "One process writes the pairs with ``publish`` and any\n"
+                 "number of processes attach to them by name. The pairs are\n"
+                 "read in place from the shared pages, so each process only\n"
+                 "pays for the keys and values it looks up.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "name : str\n"
+                 "    The name the map was published under.\n"
+                 "\n"
+                 "See Also\n"
+                 "--------\n"
+                 "sharedsortedmap.publish\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Keys and values are each ``bytes``, 64 bit ``int``, or\n"
+                 "``float``, chosen when the map is published. Keys are\n"
+                 "ordered as python orders them. Lookups with a key of\n"
+                 "another type raise a ``TypeError``.\n");
+
+    PyTypeObject type = {
+        PyVarObject_HEAD_INIT(&PyType_Type, 0)
+        "sortedmap.sharedsortedmap",                // tp_name
+        sizeof(object),                             // tp_basicsize
+        0,                                          // tp_itemsize
+        (destructor) dealloc,                       // tp_dealloc
+        0,                                          // tp_print
+        0,                                          // tp_getattr
+        0,                                          // tp_setattr
+        0,                                          // tp_reserved
+        (reprfunc) repr,                            // tp_repr
+        0,                                          // tp_as_number
+        &as_sequence,                               // tp_as_sequence
+        &as_mapping,                                // tp_as_mapping
+        0,                                          // tp_hash
+        0,                                          // tp_call
+        (reprfunc) repr,                            // tp_str
+        0,                                          // tp_getattro
+        0,                                          // tp_setattro
+        0,                                          // tp_as_buffer
+        Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   // tp_flags
+        sharedsortedmap_doc,                        // tp_doc
+        0,                                          // tp_traverse
+        0,                                          // tp_clear
+        (richcmpfunc) richcompare,                  // tp_richcompare
+        0,                                          // tp_weaklistoffset
+        (getiterfunc) keyiter::iter,                // tp_iter
+        0,                                          // tp_iternext
+        methods,                                    // tp_methods
+        0,                                          // tp_members
+        getsets,                                    // tp_getset
+        0,                                          // tp_base
+        0,                                          // tp_dict
+        0,                                          // tp_descr_get
+        0,                                          // tp_descr_set
+        0,                                          // tp_dictoffset
+        0,                                          // tp_init
+        0,                                          // tp_alloc
+        (newfunc) newobject,                        // tp_new
+    };
+}
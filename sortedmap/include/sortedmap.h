@@ -1,12 +1,47 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <cstdint>
 #include <exception>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+// The aggregate trees are built on pb_ds which only ships with libstdc++,
+// with other standard libraries ``track_aggregates`` is not supported.
+#ifdef __GLIBCXX__
+#define HAVE_AGGREGATE_TREE 1
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+#else
+#define HAVE_AGGREGATE_TREE 0
+#endif  // __GLIBCXX__
 
 #include <Python.h>
+#include <marshal.h>
 #include <structmember.h>
 
 #define COMPILING_IN_PY2 (PY_VERSION_HEX <= 0x03000000)
+#define HAVE_FASTCALL (PY_VERSION_HEX >= 0x03070000)
+#define HAVE_VECTORCALL (PY_VERSION_HEX >= 0x03090000)
+#define HAVE_GC_ISTRACKED (PY_VERSION_HEX >= 0x03090000)
+
+// The signature of methods which take keyword arguments. These use the
+// METH_FASTCALL convention where it is available.
+#if HAVE_FASTCALL
+#define METH_KWARGS (METH_FASTCALL | METH_KEYWORDS)
+#define KWARGS_PARAMS                                           \
+    PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames
+#define KWARGS_FORWARD args, nargs, kwnames
+#else
+#define METH_KWARGS (METH_VARARGS | METH_KEYWORDS)
+#define KWARGS_PARAMS PyObject *args, PyObject *kwargs
+#define KWARGS_FORWARD args, kwargs
+#endif  // HAVE_FASTCALL
 
 #ifndef Py_RETURN_NOTIMPLEMENTED
 #define Py_RETURN_NOTIMPLEMENTED                \
@@ -23,6 +58,90 @@
 
 class PythonError : std::exception {};
 
+static inline bool
+gc_is_tracked(PyObject *ob) {
+#if HAVE_GC_ISTRACKED
+    return PyObject_GC_IsTracked(ob);
+#else
+    return _PyObject_GC_IS_TRACKED(ob);
+#endif  // HAVE_GC_ISTRACKED
+}
+
+// Per-object locks for the free-threaded build. These hold the object's
+// critical section for the lifetime of the guard so that early returns and
+// PythonErrors release it. With the GIL these compile away.
+class CriticalSection final {
+#ifdef Py_GIL_DISABLED
+private:
+    PyCriticalSection cs;
+
+public:
+    explicit CriticalSection(PyObject *ob) {
+        PyCriticalSection_Begin(&cs, ob);
+    }
+
+    ~CriticalSection() {
+        PyCriticalSection_End(&cs);
+    }
+#else
+public:
+    explicit CriticalSection(PyObject*) {}
+#endif  // Py_GIL_DISABLED
+
+    CriticalSection(const CriticalSection&) = delete;
+    CriticalSection &operator=(const CriticalSection&) = delete;
+};
+
+class CriticalSection2 final {
+#ifdef Py_GIL_DISABLED
+private:
+    PyCriticalSection2 cs;
+
+public:
+    CriticalSection2(PyObject *a, PyObject *b) {
+        PyCriticalSection2_Begin(&cs, a, b);
+    }
+
+    ~CriticalSection2() {
+        PyCriticalSection2_End(&cs);
+    }
+#else
+public:
+    CriticalSection2(PyObject*, PyObject*) {}
+#endif  // Py_GIL_DISABLED
+
+    CriticalSection2(const CriticalSection2&) = delete;
+    CriticalSection2 &operator=(const CriticalSection2&) = delete;
+};
+
+// The ``iter_revision`` of the map this thread is working on, if any. A key
+// comparison which calls into Python may suspend the map's critical section,
+// so the comparator checks this afterwards to see if the tree it was
+// walking changed.
+inline thread_local const unsigned long *active_revision = nullptr;
+
+// A ``CriticalSection`` on a map which also makes it the ``active_revision``
+// until the guard is destroyed.
+class MapSection final {
+private:
+    CriticalSection cs;
+    const unsigned long *outer;
+
+public:
+    template<typename M>
+    explicit MapSection(M *self)
+        : cs((PyObject*) self), outer(active_revision) {
+        active_revision = &self->iter_revision;
+    }
+
+    ~MapSection() {
+        active_revision = outer;
+    }
+
+    MapSection(const MapSection&) = delete;
+    MapSection &operator=(const MapSection&) = delete;
+};
+
 template<typename T>
 class OwnedRef final {
 private:
@@ -55,11 +174,18 @@ public:
 
     OwnedRef<T>(const OwnedRef<T> &ref) : OwnedRef<T>(ref.ob) {}
 
-    OwnedRef<T> &operator=(OwnedRef<T> &&ref) {
+    OwnedRef<T> &operator=(const OwnedRef<T> &ref) {
+        T *old = ob;
         construct(ref.ob);
+        Py_XDECREF(old);
         return *this;
     }
 
+    // this does not steal the reference from ``ref``
+    OwnedRef<T> &operator=(OwnedRef<T> &&ref) {
+        return *this = static_cast<const OwnedRef<T>&>(ref);
+    }
+
     ~OwnedRef<T>() {
         if (likely(ob)) {
             Py_DECREF(ob);
@@ -102,33 +228,376 @@ public:
 
 PyObject *py_identity(PyObject*);
 
+// A pool of fixed size blocks which are carved out of large slabs. malloc
+// gives each tree node a header and rounds it up to the next size class, the
+// pool packs the nodes back to back instead. Each slab keeps its own free
+// list and count of blocks in use; once every block of a slab is freed the
+// slab is returned to the system, except for one empty slab which is kept
+// so that a map which grows and shrinks around a slab boundary does not
+// allocate a slab on every insert. On free-threaded builds each thread
+// also keeps a short list of free blocks, see ``local_list``.
+template<std::size_t size, std::size_t align>
+class node_pool final {
+private:
+    union block {
+        block *next;
+        alignas(align) unsigned char data[size];
+    };
+
+    struct slab {
+        // the neighbors in the list of slabs with free blocks
+        slab *prev;
+        slab *next;
+        block *free_list;
+        std::size_t used;
+    };
+
+    // 64KiB slabs amortize the slab header without holding much unused
+    // memory for small maps. Slabs are aligned to their size so that the
+    // slab of a block can be found by masking its address.
+    static constexpr std::size_t slab_bytes = 1 << 16;
+    static constexpr std::size_t header_bytes =
+        (sizeof(slab) + sizeof(block) - 1) / sizeof(block) * sizeof(block);
+    static constexpr std::size_t slab_blocks =
+        (slab_bytes - header_bytes) / sizeof(block);
+
+    static_assert(slab_blocks > 0, "node_pool blocks must fit in a slab");
+    static_assert(alignof(block) <= slab_bytes,
+                  "node_pool blocks must be aligned within a slab");
+
+    static inline slab *partial = nullptr;
+    static inline std::size_t empty_slabs = 0;
+
+#ifdef Py_GIL_DISABLED
+    // Without the GIL each thread keeps its own list of free blocks, so
+    // maps used by different threads do not wait on one lock for every
+    // node. The list is refilled from and flushed back to the shared slabs
+    // a batch at a time under ``mutex``. Blocks in a thread's list still
+    // count as used by their slab.
+    static constexpr std::size_t batch = 64;
+
+    struct local_list {
+        block *free_list = nullptr;
+        std::size_t count = 0;
+
+        ~local_list() {
+            std::lock_guard<std::mutex> guard(mutex);
+
+            while (free_list) {
+                block *b = free_list;
+                free_list = b->next;
+                release(b);
+            }
+        }
+    };
+
+    static inline std::mutex mutex;
+    static inline thread_local local_list local;
+#endif  // Py_GIL_DISABLED
+
+    static slab *slab_of(void *p) {
+        return reinterpret_cast<slab*>(
+            reinterpret_cast<std::uintptr_t>(p) & ~(slab_bytes - 1));
+    }
+
+    static void link(slab *s) {
+        s->prev = nullptr;
+        s->next = partial;
+        if (partial) {
+            partial->prev = s;
+        }
+        partial = s;
+    }
+
+    static void unlink(slab *s) {
+        if (s->prev) {
+            s->prev->next = s->next;
+        }
+        else {
+            partial = s->next;
+        }
+        if (s->next) {
+            s->next->prev = s->prev;
+        }
+    }
+
+    // take a block from the slabs
+    static block *take() {
+        if (unlikely(!partial)) {
+            slab *s = static_cast<slab*>(
+                ::operator new(slab_bytes, std::align_val_t(slab_bytes)));
+            block *blocks = reinterpret_cast<block*>(
+                reinterpret_cast<unsigned char*>(s) + header_bytes);
+
+            for (std::size_t ix = 0; ix < slab_blocks - 1; ++ix) {
+                blocks[ix].next = &blocks[ix + 1];
+            }
+            blocks[slab_blocks - 1].next = nullptr;
+            s->free_list = blocks;
+            s->used = 0;
+            link(s);
+            ++empty_slabs;
+        }
+
+        slab *s = partial;
+        block *ret = s->free_list;
+        s->free_list = ret->next;
+        if (!s->used++) {
+            --empty_slabs;
+        }
+        if (!s->free_list) {
+            unlink(s);
+        }
+        return ret;
+    }
+
+    // give a block back to its slab
+    static void release(block *b) {
+        slab *s = slab_of(b);
+        if (!s->free_list) {
+            link(s);
+        }
+        b->next = s->free_list;
+        s->free_list = b;
+
+        if (!--s->used) {
+            if (empty_slabs) {
+                unlink(s);
+                ::operator delete(s, std::align_val_t(slab_bytes));
+            }
+            else {
+                ++empty_slabs;
+            }
+        }
+    }
+
+public:
+    // the bytes used by one block, including its share of the slab header
+    static constexpr std::size_t block_size =
+        (slab_bytes + slab_blocks - 1) / slab_blocks;
+
+    static void *allocate() {
+#ifdef Py_GIL_DISABLED
+        local_list &list = local;
+
+        if (unlikely(!list.free_list)) {
+            std::lock_guard<std::mutex> guard(mutex);
+            block **tail = &list.free_list;
+
+            for (std::size_t ix = 0; ix < batch; ++ix) {
+                *tail = take();
+                tail = &(*tail)->next;
+            }
+            *tail = nullptr;
+            list.count = batch;
+        }
+
+        block *ret = list.free_list;
+        list.free_list = ret->next;
+        --list.count;
+        return ret;
+#else
+        return take();
+#endif  // Py_GIL_DISABLED
+    }
+
+    static void deallocate(void *p) {
+        block *b = static_cast<block*>(p);
+
+#ifdef Py_GIL_DISABLED
+        local_list &list = local;
+
+        b->next = list.free_list;
+        list.free_list = b;
+        if (unlikely(++list.count > 2 * batch)) {
+            std::lock_guard<std::mutex> guard(mutex);
+
+            for (std::size_t ix = 0; ix < batch; ++ix) {
+                b = list.free_list;
+                list.free_list = b->next;
+                release(b);
+            }
+            list.count -= batch;
+        }
+#else
+        release(b);
+#endif  // Py_GIL_DISABLED
+    }
+};
+
+// Allocator for the map types which puts single nodes in a ``node_pool``.
+template<typename T>
+class pool_allocator {
+private:
+    using pool = node_pool<sizeof(T), alignof(T)>;
+
+public:
+    typedef T value_type;
+
+    // the bytes used by one node allocated with this allocator
+    static constexpr std::size_t node_size = pool::block_size;
+
+    pool_allocator() = default;
+
+    template<typename U>
+    pool_allocator(const pool_allocator<U>&) {}
+
+    T *allocate(std::size_t n) {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(pool::allocate());
+    }
+
+    void deallocate(T *p, std::size_t n) {
+        if (n != 1) {
+            ::operator delete(p);
+        }
+        else {
+            pool::deallocate(p);
+        }
+    }
+
+    template<typename U>
+    bool operator==(const pool_allocator<U>&) const {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const pool_allocator<U>&) const {
+        return false;
+    }
+};
+
 namespace sortedmap {
     class Comparator {
     private:
-        PyObject *argtuple;  // not using ownedref for copying issues
+        // cached argument tuple for keyfunc, this is not part of the
+        // comparator's logical state; free-threaded builds do not use it
+        mutable PyObject *argtuple;  // not using ownedref for copying issues
 
-        PyObject *call(PyObject*);
+        PyObject *call(PyObject*) const;
 
     public:
         PyObject* keyfunc;  // not using ownedref for copying issues
 
         Comparator();
         Comparator(PyObject*);
+        Comparator(const Comparator&);
         ~Comparator();
         Comparator &operator=(const Comparator&);
         bool operator()(const OwnedRef<PyObject>&,
-                        const OwnedRef<PyObject>&);
+                        const OwnedRef<PyObject>&) const;
+    };
+
+    using maptype = std::map<
+        OwnedRef<PyObject>,
+        OwnedRef<PyObject>,
+        Comparator,
+        pool_allocator<std::pair<const OwnedRef<PyObject>,
+                                 OwnedRef<PyObject>>>>;
+
+    // Pairs which have been written but not yet merged into the tree, in
+    // the order they were written.
+    using buffertype = std::vector<std::pair<OwnedRef<PyObject>,
+                                             OwnedRef<PyObject>>>;
+
+    // The count, sum, min, and max of the values in some range of keys.
+    struct aggregate {
+        std::size_t count = 0;
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+
+        aggregate() = default;
+
+        explicit aggregate(double value)
+            : count(1), sum(value), min(value), max(value) {}
+
+        aggregate &operator+=(const aggregate &other) {
+            count += other.count;
+            sum += other.sum;
+            min = std::min(min, other.min);
+            max = std::max(max, other.max);
+            return *this;
+        }
+    };
+
+#if HAVE_AGGREGATE_TREE
+    // Tree node update policy which stores the aggregate of each subtree in
+    // its root, this is recomputed on insert, erase, and rotation.
+    template<typename NodeCIter,
+             typename NodeIter,
+             typename Compare,
+             typename Alloc>
+    struct aggregate_update {
+        typedef aggregate metadata_type;
+
+        void operator()(NodeIter it, NodeCIter end) const {
+            aggregate agg((*it)->second);
+
+            if (it.get_l_child() != end) {
+                agg += it.get_l_child().get_metadata();
+            }
+            if (it.get_r_child() != end) {
+                agg += it.get_r_child().get_metadata();
+            }
+            const_cast<aggregate&>(it.get_metadata()) = agg;
+        }
+
+        virtual ~aggregate_update() {}
     };
 
-    using maptype = std::map<OwnedRef<PyObject>,
-                             OwnedRef<PyObject>,
-                             Comparator>;
+    // A mirror of the map's keys with the values as doubles, used to answer
+    // range aggregates in O(log(n)). This only exists when
+    // ``track_aggregates`` has been called.
+    using aggregatetree = __gnu_pbds::tree<OwnedRef<PyObject>,
+                                           double,
+                                           Comparator,
+                                           __gnu_pbds::rb_tree_tag,
+                                           aggregate_update>;
+#else
+    // never defined, ``aggregates`` is always NULL
+    struct aggregatetree;
+#endif  // HAVE_AGGREGATE_TREE
+
+    // An append-only file of the changes made to a map, see ``set_log``.
+    struct mutationlog {
+        int fd;
+        // Written to the header of the log and of the snapshots taken while
+        // it is set.
+        std::uint64_t id;
+        std::string path;
+        // Encoded records which have not been written to ``fd`` yet.
+        std::string pending;
+        std::size_t npending = 0;
+        // Commit the pending records once there are this many.
+        std::size_t group;
+    };
 
     struct object {
+        typedef sortedmap::maptype maptype;
+
         PyObject_HEAD
         maptype map;
         // Keep track of operations that may invalidate any iterators.
         unsigned long iter_revision;
+        // NULL unless aggregates are being tracked.
+        aggregatetree *aggregates = nullptr;
+        // The most pairs to hold, or -1 if the map is unbounded.
+        Py_ssize_t maxlen = -1;
+        // Which end to drop pairs from when the map is over ``maxlen``.
+        bool evict_first = true;
+        // Writes waiting to be merged into ``map``. This is only used when
+        // ``buffer_limit`` is not 0.
+        buffertype buffer;
+        // Merge ``buffer`` once it holds this many pairs.
+        std::size_t buffer_limit = 0;
+        // A dict of canonical keys which new keys are replaced with, or
+        // NULL if keys are not interned.
+        PyObject *intern_pool = nullptr;
+        // NULL unless changes are being logged.
+        mutationlog *log = nullptr;
     };
 
     bool check(PyObject*);
@@ -140,97 +609,217 @@ namespace sortedmap {
     int init(object*, PyObject*, PyObject*);
     void dealloc(object*);
     int traverse(object*, visitproc, void*);
+    // tp_clear, this also drops the keyfunc
+    int gcclear(object*);
     void clear(object*);
     PyObject *pyclear(object*);
     PyObject *richcompare(object*, PyObject*, int);
     Py_ssize_t len(object*);
     PyObject *getitem(object*, PyObject*);
     PyObject *get(object*, PyObject*, PyObject*);
-    PyObject *pyget(object*, PyObject*, PyObject*);
+    PyObject *pyget(object*, KWARGS_PARAMS);
     PyObject *pop(object*, PyObject*, PyObject*);
-    PyObject *pypop(object*, PyObject*, PyObject*);
+    PyObject *pypop(object*, KWARGS_PARAMS);
     PyObject *popitem(object*, bool);
-    PyObject *pypopitem(object*, PyObject*, PyObject*);
+    PyObject *pypopitem(object*, KWARGS_PARAMS);
+    PyObject *popitems(object*, Py_ssize_t, bool);
+    PyObject *pypopitems(object*, KWARGS_PARAMS);
+    PyObject *pop_until(object*, PyObject*);
     int setitem(object*, PyObject*, PyObject*);
     PyObject *setdefault(object*, PyObject*, PyObject*);
-    PyObject *pysetdefault(object*, PyObject *, PyObject*);
+    PyObject *pysetdefault(object*, KWARGS_PARAMS);
     int contains(object*, PyObject*);
     PyObject *repr(object*);
     object *copy(object*);
+    PyObject *sizeof_(object*);
+    PyObject *split(object*, PyObject*);
+    PyObject *join(object*, PyObject*);
+    PyObject *floor_item(object*, PyObject*);
+    PyObject *ceiling_item(object*, PyObject*);
+    PyObject *lower_item(object*, PyObject*);
+    PyObject *higher_item(object*, PyObject*);
+    PyObject *nearest_item(object*, PyObject*);
+    PyObject *iprefix(object*, PyObject*);
+    PyObject *freeze(object*);
+    PyObject *set_maxlen(object*, PyObject*, PyObject*);
+    PyObject *set_write_buffer(object*, PyObject*);
+    PyObject *set_intern_pool(object*, PyObject*);
+    PyObject *set_log(object*, PyObject*, PyObject*);
+    PyObject *commit_log(object*);
+    PyObject *checkpoint(object*, PyObject*);
+    object *recover(PyObject*, PyObject*, PyObject*);
+    PyObject *track_aggregates(object*);
+    PyObject *aggregate_range(object*, PyObject*, PyObject*);
+    PyObject *diff(object*, PyObject*, PyObject*);
     bool update(object*, PyObject*, PyObject*);
     PyObject *pyupdate(object*, PyObject*, PyObject*);
     object *fromkeys(PyTypeObject*, PyObject*, PyObject*);
     object *pyfromkeys(PyObject*, PyObject*, PyObject*);
+    PyObject *merge_iter(PyObject*, PyObject*, PyObject*);
+    object *from_arrays(PyTypeObject*, PyObject*, PyObject*, Py_ssize_t);
+    object *pyfrom_arrays(PyObject*, PyObject*, PyObject*);
 
     PyDoc_STRVAR(iter_revision_doc,
                  "An internal counter used to invalidate iterators after\n"
                  " the map changes size.\n");
 
+    // The iterator and view machinery is shared by every object which holds
+    // a ``map`` of ``OwnedRef`` pairs and an ``iter_revision``. ``M`` is the
+    // python object type that owns the map.
     namespace abstractiter {
-        using itertype = maptype::const_iterator;
-        typedef PyObject *extract_element(itertype);
+        template<typename M>
+        using itertype = typename M::maptype::const_iterator;
+
+        template<typename M>
+        using extract_element = PyObject *(itertype<M>);
 
+        template<typename M>
         struct object {
             PyObject_HEAD
-            itertype iter;
-            itertype end;
-            OwnedRef<sortedmap::object> map;
+            itertype<M> iter;
+            itertype<M> end;
+            OwnedRef<M> map;
             // the revision of the map when this iter was created.
             unsigned long iter_revision;
+            // the last tuple returned by an item iterator, or NULL.
+            PyObject *result;
         };
 
-        void dealloc(object*);
+        template<typename M>
+        void
+        dealloc(object<M> *self) {
+            using ownedtype = OwnedRef<M>;
+
+            PyObject_GC_UnTrack(self);
+            self->iter.~itertype<M>();
+            self->end.~itertype<M>();
+            self->map.~ownedtype();
+            Py_XDECREF(self->result);
+            PyObject_GC_Del(self);
+        }
 
-        template<extract_element f>
+        template<typename M>
+        int
+        traverse(object<M> *self, visitproc visit, void *arg) {
+            Py_VISIT(self->map.ob);
+            Py_VISIT(self->result);
+            return 0;
+        }
+
+        // Return the ``(key, value)`` tuple for the current pair. Like
+        // dict's item iterator, the last tuple is refilled in place when the
+        // caller has already dropped it so that loops over the items do not
+        // allocate a tuple per pair.
+        template<typename M>
         PyObject*
-        next(object *self) {
+        item(object<M> *self) {
+            PyObject *key = std::get<0>(*self->iter).ob;
+            PyObject *value = std::get<1>(*self->iter).ob;
+            PyObject *ret = self->result;
+
+#ifndef Py_GIL_DISABLED
+            if (ret && Py_REFCNT(ret) == 1) {
+                PyObject *oldkey = PyTuple_GET_ITEM(ret, 0);
+                PyObject *oldvalue = PyTuple_GET_ITEM(ret, 1);
+
+                Py_INCREF(ret);
+                Py_INCREF(key);
+                Py_INCREF(value);
+                PyTuple_SET_ITEM(ret, 0, key);
+                PyTuple_SET_ITEM(ret, 1, value);
+                Py_DECREF(oldkey);
+                Py_DECREF(oldvalue);
+                // the collector untracks tuples which only hold atomic
+                // objects, the new pair may not be atomic
+                if (!gc_is_tracked(ret)) {
+                    PyObject_GC_Track(ret);
+                }
+                return ret;
+            }
+#endif  // Py_GIL_DISABLED
+
+            if (unlikely(!(ret = PyTuple_Pack(2, key, value)))) {
+                return NULL;
+            }
+#ifndef Py_GIL_DISABLED
+            PyObject *old = self->result;
+
+            Py_INCREF(ret);
+            self->result = ret;
+            Py_XDECREF(old);
+#endif  // Py_GIL_DISABLED
+            return ret;
+        }
+
+        template<typename M, extract_element<M> f, bool items>
+        PyObject*
+        next(object<M> *self) {
+            CriticalSection2 cs((PyObject*) self, (PyObject*) self->map.ob);
             PyObject *ret;
 
             if (unlikely(self->iter_revision != self->map.ob->iter_revision)) {
-                PyErr_SetString(PyExc_RuntimeError,
-                                "sortedmap changed size during iteration");
+                PyErr_Format(PyExc_RuntimeError,
+                             "%s changed size during iteration",
+                             Py_TYPE(self->map.ob)->tp_name);
                 return NULL;
             }
             if (unlikely(self->iter == self->end)) {
                 return NULL;
             }
 
-            ret = f(self->iter);
+            ret = (items) ? item(self) : f(self->iter);
             self->iter = std::move(std::next(self->iter, 1));
             return ret;
         }
 
-        template<typename iterobject, PyTypeObject &cls>
+        // Create an iterator over the range [begin, end) of the map.
+        template<typename M, PyTypeObject &cls>
         PyObject*
-        iter(sortedmap::object *self) {
-            iterobject *ret = PyObject_New(iterobject, &cls);
+        iter(M *self, itertype<M> begin, itertype<M> end) {
+            object<M> *ret = PyObject_GC_New(object<M>, &cls);
             if (!ret) {
                 return NULL;
             }
 
-            ret->iter = std::move(self->map.cbegin());
-            ret->end = std::move(self->map.cend());
-            new(&ret->map) OwnedRef<sortedmap::object>(self);
+            new(&ret->iter) itertype<M>(begin);
+            new(&ret->end) itertype<M>(end);
+            new(&ret->map) OwnedRef<M>(self);
             ret->iter_revision = self->iter_revision;
+            ret->result = NULL;
+            PyObject_GC_Track(ret);
             return (PyObject*) ret;
         }
 
+        template<typename M, PyTypeObject &cls>
+        PyObject*
+        iter(M *self) {
+            CriticalSection cs((PyObject*) self);
+
+            return iter<M, cls>(self, self->map.cbegin(), self->map.cend());
+        }
+
+        template<typename M>
         PyMemberDef members[] = {
             {(char*) "_iter_revision",
              T_ULONG,
-             offsetof(object, iter_revision),
+             offsetof(object<M>, iter_revision),
              READONLY,
              iter_revision_doc},
             {NULL},
         };
 
-        template<const char *&name, extract_element elem>
+        // ``items`` iterators return ``(key, value)`` tuples and reuse them,
+        // see ``item``.
+        template<const char *&name,
+                 typename M,
+                 extract_element<M> elem,
+                 bool items = false>
         PyTypeObject type = {
             PyVarObject_HEAD_INIT(&PyType_Type, 0)
             name,                                       // tp_name
-            sizeof(object),                             // tp_basicsize
+            sizeof(object<M>),                          // tp_basicsize
             0,                                          // tp_itemsize
-            (destructor) dealloc,                       // tp_dealloc
+            (destructor) dealloc<M>,                    // tp_dealloc
             0,                                          // tp_print
             0,                                          // tp_getattr
             0,                                          // tp_setattr
@@ -245,66 +834,104 @@ namespace sortedmap {
             0,                                          // tp_getattro
             0,                                          // tp_setattro
             0,                                          // tp_as_buffer
-            Py_TPFLAGS_DEFAULT,                         // tp_flags
+            Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    // tp_flags
             0,                                          // tp_doc
-            0,                                          // tp_traverse
+            (traverseproc) traverse<M>,                 // tp_traverse
             0,                                          // tp_clear
             0,                                          // tp_richcompare
             0,                                          // tp_weaklistoffset
             (getiterfunc) py_identity,                  // tp_iter
-            (iternextfunc) next<elem>,                  // tp_iternext
+            (iternextfunc) next<M, elem, items>,        // tp_iternext
             0,                                          // tp_methods
-            members,                                    // tp_members
+            members<M>,                                 // tp_members
         };
     }
 
     namespace keyiter {
-        using object = abstractiter::object;
+        using object = abstractiter::object<sortedmap::object>;
 
-        abstractiter::extract_element elem;
+        abstractiter::extract_element<sortedmap::object> elem;
         iterfunc iter;
         extern const char *name;
-        PyTypeObject type = abstractiter::type<name, elem>;
+        PyTypeObject type = abstractiter::type<name, sortedmap::object, elem>;
     }
 
     namespace valiter {
-        using object = abstractiter::object;
+        using object = abstractiter::object<sortedmap::object>;
 
-        abstractiter::extract_element elem;
+        abstractiter::extract_element<sortedmap::object> elem;
         iterfunc iter;
         extern const char *name;
-        PyTypeObject type = abstractiter::type<name, elem>;
+        PyTypeObject type = abstractiter::type<name, sortedmap::object, elem>;
     }
 
     namespace itemiter {
-        using object = abstractiter::object;
+        using object = abstractiter::object<sortedmap::object>;
 
-        abstractiter::extract_element elem;
+        abstractiter::extract_element<sortedmap::object> elem;
         iterfunc iter;
         extern const char *name;
-        PyTypeObject type = abstractiter::type<name, elem>;
+        PyTypeObject type = abstractiter::type<name,
+                                               sortedmap::object,
+                                               elem,
+                                               true>;
     }
 
     namespace abstractview {
         typedef PyObject *strict_func(PyObject*);
 
+        template<typename M>
+        using iterfunc = PyObject *(M*);
+
+        template<typename M>
+        using maplenfunc = Py_ssize_t(M*);
+
+        template<typename M>
+        using mapcontainsfunc = int(M*, PyObject*);
+
+        template<typename M>
         struct object {
             PyObject_HEAD
-            OwnedRef<sortedmap::object> map;
+            OwnedRef<M> map;
         };
 
-        void dealloc(object*);
-        PyObject *repr(object*);
+        template<typename M>
+        using containsfunc = int(object<M>*, PyObject*);
+
+        template<typename M>
+        void
+        dealloc(object<M> *self) {
+            using ownedtype = OwnedRef<M>;
+
+            self->map.~ownedtype();
+            PyObject_Del(self);
+        }
 
-        template<typename viewobject, PyTypeObject &cls>
+        template<typename M>
         PyObject*
-        view(sortedmap::object *self) {
-            viewobject *ret = PyObject_New(viewobject, &cls);
+        repr(object<M> *self) {
+            PyObject *aslist;
+            PyObject *ret;
+
+            if (!(aslist = PySequence_List((PyObject*) self))) {
+                return NULL;
+            }
+            ret = PyUnicode_FromFormat("%s(%R)",
+                                       Py_TYPE(self)->tp_name,
+                                       aslist);
+            Py_DECREF(aslist);
+            return ret;
+        }
+
+        template<typename M, PyTypeObject &cls>
+        PyObject*
+        view(M *self) {
+            object<M> *ret = PyObject_New(object<M>, &cls);
             if (!ret) {
                 return NULL;
             }
 
-            new(&ret->map) OwnedRef<sortedmap::object>(self);
+            new(&ret->map) OwnedRef<M>(self);
             return (PyObject*) ret;
         }
 
@@ -317,9 +944,12 @@ namespace sortedmap {
         // are valid.
         // The default case pulls the lhs and rhs into the strict container
         // and returns the result of the operation on those.
-        template<strict_func strict, binaryfunc op, iterfunc iter>
+        template<typename M,
+                 strict_func strict,
+                 binaryfunc op,
+                 iterfunc<M> iter>
         struct binop {
-            static inline PyObject *g(object *self, PyObject *other) {
+            static inline PyObject *g(object<M> *self, PyObject *other) {
                 PyObject *it;
                 PyObject *lhs;
                 PyObject *rhs;
@@ -346,27 +976,27 @@ namespace sortedmap {
             }
 
             static PyObject *f(PyObject *self, PyObject *other) {
-                return g((object*) self, other);
+                return g((object<M>*) self, other);
             }
         };
 
         // we cannot add sets
-        template<iterfunc iter>
-        struct binop<PySet_New, PyNumber_Add, iter> {
+        template<typename M, iterfunc<M> iter>
+        struct binop<M, PySet_New, PyNumber_Add, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot multiply sets
-        template<iterfunc iter>
-        struct binop<PySet_New, PyNumber_Multiply, iter> {
+        template<typename M, iterfunc<M> iter>
+        struct binop<M, PySet_New, PyNumber_Multiply, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we can multiply lists; however, we do not pull the rhs into
         // the strict container because multiply for lists is list repeat
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Multiply, iter> {
-            static inline PyObject *g(object *self, PyObject *rhs) {
+        template<typename M, iterfunc<M> iter>
+        struct binop<M, PySequence_List, PyNumber_Multiply, iter> {
+            static inline PyObject *g(object<M> *self, PyObject *rhs) {
                 PyObject *it;
                 PyObject *lhs;
                 PyObject *res;
@@ -383,42 +1013,41 @@ namespace sortedmap {
 
                 res = PyNumber_Multiply(lhs, rhs);
                 Py_DECREF(lhs);
-                Py_DECREF(rhs);
                 return res;
             }
 
             static PyObject *f(PyObject *self, PyObject *lhs) {
-                return g((object*) self, lhs);
+                return g((object<M>*) self, lhs);
             }
         };
 
         // we cannot subtract lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Subtract, iter> {
+        template<typename M, iterfunc<M> iter>
+        struct binop<M, PySequence_List, PyNumber_Subtract, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot intersect lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_And, iter> {
+        template<typename M, iterfunc<M> iter>
+        struct binop<M, PySequence_List, PyNumber_And, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot symmetric difference lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Xor, iter> {
+        template<typename M, iterfunc<M> iter>
+        struct binop<M, PySequence_List, PyNumber_Xor, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
         // we cannot union lists
-        template<iterfunc iter>
-        struct binop<PySequence_List, PyNumber_Or, iter> {
+        template<typename M, iterfunc<M> iter>
+        struct binop<M, PySequence_List, PyNumber_Or, iter> {
             static constexpr binaryfunc f = NULL;
         };
 
-        template<strict_func strict, iterfunc iter>
+        template<typename M, strict_func strict, iterfunc<M> iter>
         PyObject*
-        richcompare(object *self, PyObject *other, int opid) {
+        richcompare(object<M> *self, PyObject *other, int opid) {
             PyObject *it;
             PyObject *lhs;
             PyObject *rhs;
@@ -431,7 +1060,6 @@ namespace sortedmap {
             lhs = strict(it);
             Py_DECREF(it);
             if (!lhs) {
-                Py_DECREF(lhs);
                 return NULL;
             }
 
@@ -445,70 +1073,96 @@ namespace sortedmap {
             return res;
         }
 
-        template<strict_func strict, iterfunc iter>
+        // A view has as many elements as its map has pairs.
+        template<typename M, maplenfunc<M> maplen>
+        Py_ssize_t
+        len(object<M> *self) {
+            return maplen(self->map);
+        }
+
+        template<typename M, maplenfunc<M> maplen>
         int
-        pybool(object *self) {
-            PyObject *it;
-            PyObject *st;
+        pybool(object<M> *self) {
+            Py_ssize_t size = maplen(self->map);
 
-            if (!(it = iter(self->map))) {
-                return -1;
-            }
-            st = strict(it);
-            Py_DECREF(it);
-            if (!st) {
-                return -1;
-            }
-            return PyObject_IsTrue(st);
+            return (size < 0) ? -1 : size != 0;
+        }
+
+        // Look a key up in the map instead of scanning the view.
+        template<typename M, mapcontainsfunc<M> mapcontains>
+        int
+        keycontains(object<M> *self, PyObject *key) {
+            return mapcontains(self->map, key);
         }
 
-        template<iterfunc iterf>
+        // valviews have no ``sq_contains`` so ``in`` scans the values.
+        template<typename M, maplenfunc<M> maplen, containsfunc<M> contains>
+        PySequenceMethods as_sequence = {
+            (lenfunc) len<M, maplen>,                   // sq_length
+            0,                                          // sq_concat
+            0,                                          // sq_repeat
+            0,                                          // sq_item
+            0,                                          // placeholder
+            0,                                          // sq_ass_item
+            0,                                          // placeholder
+            (objobjproc) contains,                      // sq_contains
+        };
+
+        template<typename M, iterfunc<M> iterf>
         PyObject*
-        iter(object *self) {
+        iter(object<M> *self) {
             return iterf(self->map);
         }
 
-        template<strict_func strict, iterfunc iter>
+        template<typename M,
+                 strict_func strict,
+                 iterfunc<M> iter,
+                 maplenfunc<M> maplen>
         PyNumberMethods as_number = {
-            binop<strict, PyNumber_Add, iter>::f,       // nb_add
-            binop<strict, PyNumber_Subtract, iter>::f,  // nb_subtract
-            binop<strict, PyNumber_Multiply, iter>::f,  // nb_multiply
+            binop<M, strict, PyNumber_Add, iter>::f,       // nb_add
+            binop<M, strict, PyNumber_Subtract, iter>::f,  // nb_subtract
+            binop<M, strict, PyNumber_Multiply, iter>::f,  // nb_multiply
 #if COMPILING_IN_PY2
-            0,                                          // nb_divide
+            0,                                             // nb_divide
 #endif  // COMPILING_IN_PY2
-            0,                                          // nb_remainder
-            0,                                          // nb_divmod
-            0,                                          // nb_power
-            0,                                          // nb_negative
-            0,                                          // nb_positive
-            0,                                          // nb_absolute
-            (inquiry) pybool<strict, iter>,             // nb_bool
-            0,                                          // nb_invert
-            0,                                          // nb_lshift
-            0,                                          // nb_rshift
-            binop<strict, PyNumber_And, iter>::f,       // nb_and
-            binop<strict, PyNumber_Xor, iter>::f,       // nb_xor
-            binop<strict, PyNumber_Or, iter>::f,        // nb_or
+            0,                                             // nb_remainder
+            0,                                             // nb_divmod
+            0,                                             // nb_power
+            0,                                             // nb_negative
+            0,                                             // nb_positive
+            0,                                             // nb_absolute
+            (inquiry) pybool<M, maplen>,                   // nb_bool
+            0,                                             // nb_invert
+            0,                                             // nb_lshift
+            0,                                             // nb_rshift
+            binop<M, strict, PyNumber_And, iter>::f,       // nb_and
+            binop<M, strict, PyNumber_Xor, iter>::f,       // nb_xor
+            binop<M, strict, PyNumber_Or, iter>::f,        // nb_or
         };
 
-        template<const char *&name, strict_func strict, iterfunc iterf>
+        template<const char *&name,
+                 typename M,
+                 strict_func strict,
+                 iterfunc<M> iterf,
+                 maplenfunc<M> maplen,
+                 containsfunc<M> contains>
         PyTypeObject type = {
             PyVarObject_HEAD_INIT(&PyType_Type, 0)
             name,                                       // tp_name
-            sizeof(object),                             // tp_basicsize
+            sizeof(object<M>),                          // tp_basicsize
             0,                                          // tp_itemsize
-            (destructor) dealloc,                       // tp_dealloc
+            (destructor) dealloc<M>,                    // tp_dealloc
             0,                                          // tp_print
             0,                                          // tp_getattr
             0,                                          // tp_setattr
             0,                                          // tp_reserved
-            (reprfunc) repr,                            // tp_repr
-            &as_number<strict, iterf>,                  // tp_as_number
-            0,                                          // tp_as_sequence
+            (reprfunc) repr<M>,                         // tp_repr
+            &as_number<M, strict, iterf, maplen>,       // tp_as_number
+            &as_sequence<M, maplen, contains>,          // tp_as_sequence
             0,                                          // tp_as_mapping
             0,                                          // tp_hash
             0,                                          // tp_call
-            (reprfunc) repr,                            // tp_str
+            (reprfunc) repr<M>,                         // tp_str
             0,                                          // tp_getattro
             0,                                          // tp_setattro
             0,                                          // tp_as_buffer
@@ -517,39 +1171,112 @@ namespace sortedmap {
             0,                                          // tp_doc
             0,                                          // tp_traverse
             0,                                          // tp_clear
-            (richcmpfunc) richcompare<strict, iterf>,   // tp_richcompare
+            (richcmpfunc) richcompare<M, strict, iterf>,  // tp_richcompare
             0,                                          // tp_weaklistoffset
-            (getiterfunc) iter<iterf>,                  // tp_iter
+            (getiterfunc) iter<M, iterf>,               // tp_iter
         };
     }
 
     namespace keyview {
-        using object = abstractview::object;
+        using object = abstractview::object<sortedmap::object>;
+
         viewfunc view;
         extern const char *name;
-        PyTypeObject type = abstractview::type<name,
-                                               PySet_New,
-                                               keyiter::iter>;
+        PyTypeObject type = abstractview::type<
+            name,
+            sortedmap::object,
+            PySet_New,
+            keyiter::iter,
+            len,
+            abstractview::keycontains<sortedmap::object, contains>>;
     }
 
     namespace valview {
-        using object = abstractview::object;
+        using object = abstractview::object<sortedmap::object>;
 
         viewfunc view;
         extern const char *name;
         PyTypeObject type = abstractview::type<name,
+                                               sortedmap::object,
                                                PySequence_List,
-                                               valiter::iter>;
+                                               valiter::iter,
+                                               len,
+                                               nullptr>;
     }
 
     namespace itemview {
-        using object = abstractview::object;
+        using object = abstractview::object<sortedmap::object>;
 
         viewfunc view;
+        abstractview::containsfunc<sortedmap::object> contains;
         extern const char *name;
         PyTypeObject type = abstractview::type<name,
+                                               sortedmap::object,
                                                PySet_New,
-                                               itemiter::iter>;
+                                               itemiter::iter,
+                                               len,
+                                               contains>;
+    }
+
+    // A k-way merge of several sortedmaps with the same key order, see
+    // ``merge_iter``.
+    namespace mergeiter {
+        // The position of the merge in one of the maps.
+        struct cursor {
+            OwnedRef<sortedmap::object> map;
+            maptype::const_iterator iter;
+            maptype::const_iterator end;
+            // the revision of the map when the merge started.
+            unsigned long iter_revision;
+            // the pair the cursor is on; these are owned so that comparing
+            // cursors never touches the maps.
+            OwnedRef<PyObject> key;
+            OwnedRef<PyObject> value;
+        };
+
+        struct object {
+            PyObject_HEAD
+            std::vector<cursor> cursors;
+            // the indices of the cursors which are not exhausted, kept as a
+            // min heap on (key, index).
+            std::vector<std::size_t> heap;
+            bool dedupe;
+            bool items;
+        };
+
+        void dealloc(object*);
+        int traverse(object*, visitproc, void*);
+        PyObject *next(object*);
+
+        PyTypeObject type = {
+            PyVarObject_HEAD_INIT(&PyType_Type, 0)
+            "sortedmap.mergeiter",                      // tp_name
+            sizeof(object),                             // tp_basicsize
+            0,                                          // tp_itemsize
+            (destructor) dealloc,                       // tp_dealloc
+            0,                                          // tp_print
+            0,                                          // tp_getattr
+            0,                                          // tp_setattr
+            0,                                          // tp_reserved
+            0,                                          // tp_repr
+            0,                                          // tp_as_number
+            0,                                          // tp_as_sequence
+            0,                                          // tp_as_mapping
+            0,                                          // tp_hash
+            0,                                          // tp_call
+            0,                                          // tp_str
+            0,                                          // tp_getattro
+            0,                                          // tp_setattro
+            0,                                          // tp_as_buffer
+            Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,    // tp_flags
+            0,                                          // tp_doc
+            (traverseproc) traverse,                    // tp_traverse
+            0,                                          // tp_clear
+            0,                                          // tp_richcompare
+            0,                                          // tp_weaklistoffset
+            (getiterfunc) py_identity,                  // tp_iter
+            (iternextfunc) next,                        // tp_iternext
+        };
     }
 
     PySequenceMethods as_sequence = {
@@ -575,10 +1302,19 @@ namespace sortedmap {
                 PyObject_HEAD
                 OwnedRef<PyTypeObject> cls;
                 OwnedRef<PyObject> keyfunc;
+#if HAVE_VECTORCALL
+                vectorcallfunc vectorcall;
+#endif  // HAVE_VECTORCALL
             };
 
             void dealloc(object*);
-            sortedmap::object *call(object*, PyObject *args, PyObject *kwargs);
+            PyObject *call(object*, PyObject *args, PyObject *kwargs);
+#if HAVE_VECTORCALL
+            PyObject *vectorcall(PyObject*,
+                                 PyObject *const*,
+                                 std::size_t,
+                                 PyObject*);
+#endif  // HAVE_VECTORCALL
             PyObject *repr(object*);
             int traverse(object*, visitproc, void*);
             void clear(object*);
@@ -593,7 +1329,11 @@ namespace sortedmap {
                 sizeof(object),                             // tp_basicsize
                 0,                                          // tp_itemsize
                 (destructor) dealloc,                       // tp_dealloc
+#if HAVE_VECTORCALL
+                offsetof(object, vectorcall),       // tp_vectorcall_offset
+#else
                 0,                                          // tp_print
+#endif  // HAVE_VECTORCALL
                 0,                                          // tp_getattr
                 0,                                          // tp_setattr
                 0,                                          // tp_reserved
@@ -607,7 +1347,11 @@ namespace sortedmap {
                 0,                                          // tp_getattro
                 0,                                          // tp_setattro
                 0,                                          // tp_as_buffer
-                Py_TPFLAGS_DEFAULT,                         // tp_flags
+                Py_TPFLAGS_DEFAULT |
+#if HAVE_VECTORCALL
+                Py_TPFLAGS_HAVE_VECTORCALL |
+#endif  // HAVE_VECTORCALL
+                Py_TPFLAGS_HAVE_GC,                         // tp_flags
                 sortedmapmeta_partial_doc,                  // tp_doc
                 (traverseproc) traverse,                    // tp_traverse
                 (inquiry) clear,                            // tp_clear
@@ -682,6 +1426,380 @@ namespace sortedmap {
                  "-------\n"
                  "copy : sortedmap\n"
                  "    A shallow copy of this sortedmap.\n");
+    PyDoc_STRVAR(sizeof_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "size : int\n"
+                 "    The size of the sortedmap in bytes, including the tree\n"
+                 "    nodes but not the keys and values.\n");
+    PyDoc_STRVAR(split_doc,
+                 "Split the sortedmap at a key.\n"
+                 "\n"
+                 "The entries with keys greater than or equal to ``key`` are\n"
+                 "moved into a new sortedmap and the entries with smaller\n"
+                 "keys stay in this sortedmap. The entries are moved without\n"
+                 "being copied.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to split at.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "upper : sortedmap\n"
+                 "    A sortedmap holding the entries at or above ``key``.\n");
+    PyDoc_STRVAR(join_doc,
+                 "Move all of the entries of another sortedmap into this\n"
+                 "sortedmap. The entries are moved without being copied and\n"
+                 "``other`` is left empty.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : sortedmap\n"
+                 "    The sortedmap to join into this one. All of its keys\n"
+                 "    must sort before or after all of the keys in this\n"
+                 "    sortedmap.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised when the key ranges overlap or the sortedmaps\n"
+                 "    have different keyfuncs.\n");
+    PyDoc_STRVAR(floor_item_doc,
+                 "Find the pair with the largest key less than or equal to\n"
+                 "``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The pair that was found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key.\n");
+    PyDoc_STRVAR(ceiling_item_doc,
+                 "Find the pair with the smallest key greater than or equal\n"
+                 "to ``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The pair that was found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key.\n");
+    PyDoc_STRVAR(lower_item_doc,
+                 "Find the pair with the largest key strictly less than\n"
+                 "``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The pair that was found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key.\n");
+    PyDoc_STRVAR(higher_item_doc,
+                 "Find the pair with the smallest key strictly greater than\n"
+                 "``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The pair that was found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when there is no such key.\n");
+    PyDoc_STRVAR(nearest_item_doc,
+                 "Find the pair whose key is closest to ``key``. Ties go to\n"
+                 "the smaller key.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to search from. This does not need to be in\n"
+                 "    the map. The distance between keys is\n"
+                 "    ``abs(a - b)``.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The pair that was found.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the map is empty.\n");
+    PyDoc_STRVAR(iprefix_doc,
+                 "Iterate over the keys which start with ``prefix``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "prefix : str or bytes\n"
+                 "    The prefix to search for. The keys must all be the\n"
+                 "    same type as ``prefix``.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "it : iterator[key]\n"
+                 "    The keys with the given prefix in sorted order.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised when the sortedmap has a keyfunc.\n");
+    PyDoc_STRVAR(freeze_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "frozen : frozensortedmap\n"
+                 "    An immutable copy of this sortedmap with the same\n"
+                 "    keyfunc.\n");
+    PyDoc_STRVAR(set_maxlen_doc,
+                 "Bound the number of pairs in the sortedmap. Once the map\n"
+                 "is full, storing a new key evicts the first or last pair.\n"
+                 "A key which would be evicted right away is not stored.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "maxlen : int or None\n"
+                 "    The most pairs to keep. If this is None the map is\n"
+                 "    unbounded. If the map is already larger than\n"
+                 "    ``maxlen`` it is trimmed.\n"
+                 "evict : {'first', 'last'}, optional\n"
+                 "    Which end of the map to drop pairs from.\n"
+                 "    This defaults to 'first', which keeps the largest\n"
+                 "    keys.\n");
+    PyDoc_STRVAR(set_write_buffer_doc,
+                 "Buffer writes to speed up inserting many pairs.\n"
+                 "\n"
+                 "New pairs are appended to an unsorted buffer which is\n"
+                 "sorted and merged into the tree in one pass when it\n"
+                 "fills up, or before anything reads the sortedmap.\n"
+                 "Reads always see every write, and the map ends up with\n"
+                 "the same key objects and values as without the buffer.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "size : int or None\n"
+                 "    The number of pairs to buffer. 0 or None merges the\n"
+                 "    buffer and writes directly to the tree again.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Keys are only compared when the buffer is merged, so a\n"
+                 "key that cannot be compared raises from the operation\n"
+                 "that merges the buffer. The writes before that key are\n"
+                 "kept and the writes after it are dropped. Any write into\n"
+                 "an empty buffer invalidates the iterators over the map.\n");
+    PyDoc_STRVAR(set_intern_pool_doc,
+                 "Intern the keys added to the sortedmap.\n"
+                 "\n"
+                 "New ``str``, ``bytes``, and ``int`` keys are replaced by\n"
+                 "the equal key already in ``pool``, or added to ``pool``,\n"
+                 "so maps built from the same keys share one copy of each\n"
+                 "key. Comparing a key with itself is free.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "pool : dict or None\n"
+                 "    The pool of canonical keys, mapping each key to\n"
+                 "    itself. ``sortedmap.intern_pool`` is shared by the\n"
+                 "    whole process. None stops interning keys.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "The pool holds a reference to every key in it, clear it\n"
+                 "to release keys which are no longer used. Keys that are\n"
+                 "already in the map are not changed.\n");
+    PyDoc_STRVAR(set_log_doc,
+                 "Log the changes to the sortedmap to a file.\n"
+                 "\n"
+                 "Each ``setitem``, ``del``, ``pop``, ``popitem``,\n"
+                 "``clear``, ``update`` and other change is appended to the\n"
+                 "log as a marshalled record. Records are buffered and\n"
+                 "written and synced to disk in groups.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "path : str or None\n"
+                 "    The log file to append to. None commits and closes\n"
+                 "    the current log.\n"
+                 "group : int, optional\n"
+                 "    Commit once this many records are pending. Writes\n"
+                 "    which have not been committed are lost in a crash.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised by later changes when a key or value cannot be\n"
+                 "    marshalled. The map is not changed.\n"
+                 "OSError\n"
+                 "    Raised when the log cannot be opened or written.\n"
+                 "\n"
+                 "See Also\n"
+                 "--------\n"
+                 "checkpoint\n"
+                 "recover\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Only changes made after the log is set are logged, use\n"
+                 "``checkpoint`` to save the pairs the map already holds.\n"
+                 "Copies of the map do not write to the log. While a log is\n"
+                 "set, writes skip the write buffer so that a key which\n"
+                 "cannot be compared is never logged.\n");
+    PyDoc_STRVAR(commit_log_doc,
+                 "Write the pending log records and sync the log file.\n");
+    PyDoc_STRVAR(checkpoint_doc,
+                 "Save all of the pairs to a snapshot and empty the log.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "path : str\n"
+                 "    The snapshot file. This is replaced atomically.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "After a checkpoint, recovery only replays the changes\n"
+                 "made since, so restarts do not depend on the size of\n"
+                 "the map. The snapshot records which log it holds the\n"
+                 "changes of, so a crash before the log is emptied does\n"
+                 "not replay them twice. If the log cannot be emptied an\n"
+                 "OSError is raised and the log is closed.\n");
+    PyDoc_STRVAR(recover_doc,
+                 "Rebuild a sortedmap from a snapshot and a log.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "snapshot : str, optional\n"
+                 "    A file written by ``checkpoint``. The pairs are\n"
+                 "    already sorted so the map is built in one pass.\n"
+                 "log : str, optional\n"
+                 "    A file written by ``set_log``. The changes are replayed\n"
+                 "    on top of the snapshot. A missing log is empty.\n"
+                 "keyfunc : callable, optional\n"
+                 "    The keyfunc of the map which was logged.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "m : sortedmap\n"
+                 "    The recovered map. This does not write to the log\n"
+                 "    until ``set_log`` is called.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised when the snapshot is corrupt.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "A record cut off by a crash at the end of the log is\n"
+                 "dropped and truncated from the file so the log can be\n"
+                 "appended to again. A log whose changes the snapshot\n"
+                 "already holds is skipped.\n");
+    PyDoc_STRVAR(track_aggregates_doc,
+                 "Keep the count, sum, min, and max of the values of every\n"
+                 "subtree so that ``aggregate`` runs in O(log(n)). While\n"
+                 "aggregates are tracked all of the values must be numbers.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "TypeError\n"
+                 "    Raised when a value is not a number.\n"
+                 "NotImplementedError\n"
+                 "    Raised when sortedmap was not built with libstdc++,\n"
+                 "    which provides the tree. ``aggregate`` still works\n"
+                 "    in O(k).\n");
+    PyDoc_STRVAR(aggregate_doc,
+                 "Aggregate the values for the keys in ``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "lo : any, optional\n"
+                 "    The inclusive lower bound. If not provided the range\n"
+                 "    starts at the first key.\n"
+                 "hi : any, optional\n"
+                 "    The exclusive upper bound. If not provided the range\n"
+                 "    ends after the last key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "agg : tuple[int, float, float, float]\n"
+                 "    The count, sum, min, and max of the values. The min\n"
+                 "    and max are None when the range is empty.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "This is O(log(n)) after ``track_aggregates`` has been\n"
+                 "called and O(k) in the size of the range otherwise.\n");
+    PyDoc_STRVAR(diff_doc,
+                 "Find the pairs which differ from an older copy of the\n"
+                 "sortedmap.\n"
+                 "\n"
+                 "Both maps are walked in lock-step, which takes one pass\n"
+                 "over the keys in ``[lo, hi)``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "other : sortedmap or frozensortedmap\n"
+                 "    The map to compare against, for example a snapshot\n"
+                 "    from ``freeze``. This must use the same keyfunc.\n"
+                 "lo : any, optional\n"
+                 "    The inclusive lower bound. If not provided the range\n"
+                 "    starts at the first key.\n"
+                 "hi : any, optional\n"
+                 "    The exclusive upper bound. If not provided the range\n"
+                 "    ends after the last key.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "added : list[tuple[any, any]]\n"
+                 "    The ``(key, value)`` pairs which are only in this\n"
+                 "    map.\n"
+                 "removed : list[tuple[any, any]]\n"
+                 "    The ``(key, value)`` pairs which are only in\n"
+                 "    ``other``.\n"
+                 "changed : list[tuple[any, any, any]]\n"
+                 "    ``(key, old, new)`` for the keys in both maps whose\n"
+                 "    values are not equal, where ``old`` is the value in\n"
+                 "    ``other``.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "A large map can be diffed in pieces by passing disjoint\n"
+                 "``[lo, hi)`` ranges, for example one per shard.\n");
     PyDoc_STRVAR(update_doc,
                  "Update the sortedmap from a mapping or iterable.\n"
                  "\n"
@@ -704,6 +1822,71 @@ namespace sortedmap {
                  "-------\n"
                  "m : sortedmap\n"
                  "    The new sorted map object.\n");
+    PyDoc_STRVAR(from_arrays_doc,
+                 "Create a new sortedmap from a pair of one dimensional\n"
+                 "arrays. The keys are sorted with the GIL released before\n"
+                 "the map is built in a single pass.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "keys : buffer\n"
+                 "    The keys of the new sortedmap. This must be an array\n"
+                 "    of integers, floats, or bools.\n"
+                 "values : buffer\n"
+                 "    The values of the new sortedmap. This must be an array\n"
+                 "    of integers, floats, or bools with the same length as\n"
+                 "    ``keys``.\n"
+                 "nthreads : int or None, optional\n"
+                 "    The number of threads to sort with. None, the\n"
+                 "    default, uses the number of cores.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "m : sortedmap\n"
+                 "    The new sorted map object. When a key appears more\n"
+                 "    than once the last value wins.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised when the arrays have different lengths,\n"
+                 "    ``keys`` contains NaN, or ``nthreads`` is not\n"
+                 "    positive.\n");
+    PyDoc_STRVAR(merge_iter_doc,
+                 "Iterate over the keys of several sortedmaps in sorted\n"
+                 "order.\n"
+                 "\n"
+                 "The maps are merged pair by pair with a heap of one\n"
+                 "position per map, comparing keys with the maps' shared\n"
+                 "ordering.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "*maps : sortedmap\n"
+                 "    The maps to merge. These must all use the same\n"
+                 "    keyfunc.\n"
+                 "dedupe : bool, optional\n"
+                 "    Yield each key once. The value comes from the last\n"
+                 "    map holding the key, like updating a sortedmap with\n"
+                 "    each map in turn.\n"
+                 "items : bool, optional\n"
+                 "    Yield ``(key, value)`` pairs instead of keys.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "it : iterator\n"
+                 "    The merged keys or items. Equal keys which are not\n"
+                 "    deduplicated come out in the order of ``maps``.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "ValueError\n"
+                 "    Raised when the maps use different keyfuncs.\n"
+                 "\n"
+                 "Notes\n"
+                 "-----\n"
+                 "Like iterating over one map, changing the size of any of\n"
+                 "the maps during the merge raises a RuntimeError.\n");
     PyDoc_STRVAR(get_doc,
                  "Lookup a key in the sortedmap. If the key is not present\n"
                  "return ``default`` instead.\n"
@@ -760,6 +1943,36 @@ namespace sortedmap {
                  "------\n"
                  "KeyError\n"
                  "    Raised when the sortedmap is empty\n");
+    PyDoc_STRVAR(popitems_doc,
+                 "Remove up to ``n`` (key, value) pairs from the front or\n"
+                 "back of the sortedmap.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "n : int\n"
+                 "    The most pairs to remove.\n"
+                 "first : bool, optional\n"
+                 "    Should this remove from the front?\n"
+                 "    This defaults to True.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pairs : list[tuple[key, value]]\n"
+                 "    The removed pairs in the order that ``popitem`` would\n"
+                 "    have returned them.\n");
+    PyDoc_STRVAR(pop_until_doc,
+                 "Remove all of the (key, value) pairs with keys less than\n"
+                 "``key``.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The exclusive upper bound of the keys to remove.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pairs : list[tuple[key, value]]\n"
+                 "    The removed pairs in sorted order.\n");
     PyDoc_STRVAR(setdefault_doc,
                  "Set a default value for a key.\n"
                  "\n"
@@ -784,25 +1997,77 @@ namespace sortedmap {
         {"items", (PyCFunction) itemview::view, METH_NOARGS, items_doc},
         {"clear", (PyCFunction) pyclear, METH_NOARGS, clear_doc},
         {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
+        {"__sizeof__", (PyCFunction) sizeof_, METH_NOARGS, sizeof_doc},
+        {"split", (PyCFunction) split, METH_O, split_doc},
+        {"join", (PyCFunction) join, METH_O, join_doc},
+        {"floor_item", (PyCFunction) floor_item, METH_O, floor_item_doc},
+        {"ceiling_item", (PyCFunction) ceiling_item,
+         METH_O, ceiling_item_doc},
+        {"lower_item", (PyCFunction) lower_item, METH_O, lower_item_doc},
+        {"higher_item", (PyCFunction) higher_item, METH_O, higher_item_doc},
+        {"nearest_item", (PyCFunction) nearest_item,
+         METH_O, nearest_item_doc},
+        {"iprefix", (PyCFunction) iprefix, METH_O, iprefix_doc},
+        {"freeze", (PyCFunction) freeze, METH_NOARGS, freeze_doc},
+        {"set_maxlen", (PyCFunction) set_maxlen,
+         METH_VARARGS | METH_KEYWORDS, set_maxlen_doc},
+        {"set_write_buffer", (PyCFunction) set_write_buffer,
+         METH_O, set_write_buffer_doc},
+        {"set_intern_pool", (PyCFunction) set_intern_pool,
+         METH_O, set_intern_pool_doc},
+        {"set_log", (PyCFunction) set_log,
+         METH_VARARGS | METH_KEYWORDS, set_log_doc},
+        {"commit_log", (PyCFunction) commit_log, METH_NOARGS, commit_log_doc},
+        {"checkpoint", (PyCFunction) checkpoint, METH_O, checkpoint_doc},
+        {"recover", (PyCFunction) recover,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, recover_doc},
+        {"track_aggregates", (PyCFunction) track_aggregates,
+         METH_NOARGS, track_aggregates_doc},
+        {"aggregate", (PyCFunction) aggregate_range,
+         METH_VARARGS | METH_KEYWORDS, aggregate_doc},
+        {"diff", (PyCFunction) diff, METH_VARARGS | METH_KEYWORDS, diff_doc},
         {"update", (PyCFunction) pyupdate,
          METH_VARARGS | METH_KEYWORDS, update_doc},
         {"fromkeys", (PyCFunction) pyfromkeys,
          METH_CLASS | METH_VARARGS | METH_KEYWORDS, fromkeys_doc},
-        {"get", (PyCFunction) pyget, METH_VARARGS | METH_KEYWORDS, get_doc},
-        {"pop", (PyCFunction) pypop, METH_VARARGS | METH_KEYWORDS, pop_doc},
-        {"popitem", (PyCFunction) pypopitem,
-         METH_VARARGS | METH_KEYWORDS, popitem_doc},
+        {"from_arrays", (PyCFunction) pyfrom_arrays,
+         METH_CLASS | METH_VARARGS | METH_KEYWORDS, from_arrays_doc},
+        {"merge_iter", (PyCFunction) merge_iter,
+         METH_STATIC | METH_VARARGS | METH_KEYWORDS, merge_iter_doc},
+        {"get", (PyCFunction) pyget, METH_KWARGS, get_doc},
+        {"pop", (PyCFunction) pypop, METH_KWARGS, pop_doc},
+        {"popitem", (PyCFunction) pypopitem, METH_KWARGS, popitem_doc},
+        {"popitems", (PyCFunction) pypopitems, METH_KWARGS, popitems_doc},
+        {"pop_until", (PyCFunction) pop_until, METH_O, pop_until_doc},
         {"setdefault", (PyCFunction) pysetdefault,
-         METH_VARARGS | METH_KEYWORDS, setdefault_doc},
+         METH_KWARGS, setdefault_doc},
         {NULL},
     };
 
     PyObject *get_iter_revision(object*);
     PyObject *get_keyfunc(object*);
+    PyObject *get_maxlen(object*);
+    PyObject *get_write_buffer(object*);
+    PyObject *get_intern_pool(object*);
+
+    PyDoc_STRVAR(maxlen_doc,
+                 "The most pairs this sortedmap will hold.\n"
+                 "If the map is unbounded this returns None.\n");
+
+    PyDoc_STRVAR(write_buffer_doc,
+                 "The number of writes to buffer before merging them.\n"
+                 "If writes are not buffered this returns None.\n");
+
+    PyDoc_STRVAR(intern_pool_doc,
+                 "The pool of canonical keys new keys are interned in.\n"
+                 "If keys are not interned this returns None.\n");
 
     PyDoc_STRVAR(keyfunc_doc,
                  "The key function used for comparing keys.\n"
-                 "If no function was provided this returns None.\n");
+                 "If no function was provided this returns None.\n"
+                 "\n"
+                 "A key function or ``__lt__`` which adds or removes keys\n"
+                 "from the map being searched raises a RuntimeError.\n");
 
     // not using a member because object has a non standard layout
     PyGetSetDef getsets[] = {
@@ -811,6 +2076,21 @@ namespace sortedmap {
          NULL,
          keyfunc_doc,
          NULL},
+        {(char*) "maxlen",
+         (getter) get_maxlen,
+         NULL,
+         maxlen_doc,
+         NULL},
+        {(char*) "write_buffer",
+         (getter) get_write_buffer,
+         NULL,
+         write_buffer_doc,
+         NULL},
+        {(char*) "intern_pool",
+         (getter) get_intern_pool,
+         NULL,
+         intern_pool_doc,
+         NULL},
         {(char*) "_iter_revision",
          (getter) get_iter_revision,
          NULL,
@@ -853,7 +2133,7 @@ namespace sortedmap {
         Py_TPFLAGS_HAVE_GC,                         // tp_flags
         sortedmap_doc,                              // tp_doc
         (traverseproc) traverse,                    // tp_traverse
-        (inquiry) clear,                            // tp_clear
+        (inquiry) gcclear,                          // tp_clear
         (richcmpfunc) richcompare,                  // tp_richcompare
         0,                                          // tp_weaklistoffset
         (getiterfunc) keyiter::iter,                // tp_iter
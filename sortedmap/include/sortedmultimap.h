@@ -0,0 +1,328 @@
+#pragma once
+#include <map>
+
+#include "sortedmap.h"
+
+namespace sortedmultimap {
+    using maptype = std::multimap<
+        OwnedRef<PyObject>,
+        OwnedRef<PyObject>,
+        sortedmap::Comparator,
+        pool_allocator<std::pair<const OwnedRef<PyObject>,
+                                 OwnedRef<PyObject>>>>;
+
+    struct object {
+        typedef sortedmultimap::maptype maptype;
+
+        PyObject_HEAD
+        maptype map;
+        // Keep track of operations that may invalidate any iterators.
+        unsigned long iter_revision;
+    };
+
+    bool check(PyObject*);
+    bool check_exact(PyObject*);
+
+    typedef PyObject *iterfunc(object*);
+    typedef PyObject *viewfunc(object*);
+    object *newobject(PyTypeObject*, PyObject*, PyObject*);
+    int init(object*, PyObject*, PyObject*);
+    void dealloc(object*);
+    int traverse(object*, visitproc, void*);
+    // tp_clear, this also drops the keyfunc
+    int gcclear(object*);
+    void clear(object*);
+    PyObject *pyclear(object*);
+    PyObject *richcompare(object*, PyObject*, int);
+    Py_ssize_t len(object*);
+    PyObject *getitem(object*, PyObject*);
+    int setitem(object*, PyObject*, PyObject*);
+    int contains(object*, PyObject*);
+    PyObject *insert(object*, PyObject*);
+    PyObject *count(object*, PyObject*);
+    PyObject *equal_range(object*, PyObject*);
+    PyObject *popitem(object*, bool);
+    PyObject *pypopitem(object*, KWARGS_PARAMS);
+    PyObject *repr(object*);
+    object *copy(object*);
+    PyObject *sizeof_(object*);
+    bool update(object*, PyObject*, PyObject*);
+    PyObject *pyupdate(object*, PyObject*, PyObject*);
+
+    namespace keyiter {
+        using object = sortedmap::abstractiter::object<sortedmultimap::object>;
+
+        sortedmap::abstractiter::extract_element<sortedmultimap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractiter::type<
+            name,
+            sortedmultimap::object,
+            elem>;
+    }
+
+    namespace valiter {
+        using object = sortedmap::abstractiter::object<sortedmultimap::object>;
+
+        sortedmap::abstractiter::extract_element<sortedmultimap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractiter::type<
+            name,
+            sortedmultimap::object,
+            elem>;
+    }
+
+    namespace itemiter {
+        using object = sortedmap::abstractiter::object<sortedmultimap::object>;
+
+        sortedmap::abstractiter::extract_element<sortedmultimap::object> elem;
+        iterfunc iter;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractiter::type<
+            name,
+            sortedmultimap::object,
+            elem,
+            true>;
+    }
+
+    // keys may repeat so all of the views are list like
+    namespace keyview {
+        using object = sortedmap::abstractview::object<sortedmultimap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            sortedmultimap::object,
+            PySequence_List,
+            keyiter::iter,
+            len,
+            sortedmap::abstractview::keycontains<sortedmultimap::object,
+                                                 contains>>;
+    }
+
+    namespace valview {
+        using object = sortedmap::abstractview::object<sortedmultimap::object>;
+
+        viewfunc view;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            sortedmultimap::object,
+            PySequence_List,
+            valiter::iter,
+            len,
+            nullptr>;
+    }
+
+    namespace itemview {
+        using object = sortedmap::abstractview::object<sortedmultimap::object>;
+
+        viewfunc view;
+        sortedmap::abstractview::containsfunc<sortedmultimap::object> contains;
+        extern const char *name;
+        PyTypeObject type = sortedmap::abstractview::type<
+            name,
+            sortedmultimap::object,
+            PySequence_List,
+            itemiter::iter,
+            len,
+            contains>;
+    }
+
+    PySequenceMethods as_sequence = {
+        0,                                          // sq_length
+        0,                                          // sq_concat
+        0,                                          // sq_repeat
+        0,                                          // sq_item
+        0,                                          // placeholder
+        0,                                          // sq_ass_item
+        0,                                          // placeholder
+        (objobjproc) contains,                      // sq_contains
+    };
+
+    PyMappingMethods as_mapping = {
+        (lenfunc) len,                              // mp_length
+        (binaryfunc) getitem,                       // mp_subscript
+        (objobjargproc) setitem,                    // mp_ass_subscript
+    };
+
+    PyDoc_STRVAR(keys_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "v : key_view\n"
+                 "    A list-like object providing a view on the keys.\n"
+                 "    Keys appear once for each value they map to.\n");
+    PyDoc_STRVAR(values_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "v : value_view\n"
+                 "    A list-like object providing a view on the values.\n");
+    PyDoc_STRVAR(items_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "v : item_view\n"
+                 "    A list-like object providing a view on the items.\n");
+    PyDoc_STRVAR(clear_doc,
+                 "Remove all items from the map.");
+    PyDoc_STRVAR(copy_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "copy : sortedmultimap\n"
+                 "    A shallow copy of this sortedmultimap.\n");
+    PyDoc_STRVAR(sizeof_doc,
+                 "Returns\n"
+                 "-------\n"
+                 "size : int\n"
+                 "    The size of the sortedmultimap in bytes, including the\n"
+                 "    tree nodes but not the keys and values.\n");
+    PyDoc_STRVAR(update_doc,
+                 "Add the pairs from a mapping or iterable.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "it : iterable[key, value]\n"
+                 "**kwargs\n"
+                 "    The pairs to add to this sortedmultimap.\n");
+    PyDoc_STRVAR(insert_doc,
+                 "Add a (key, value) pair. Pairs with equal keys are kept\n"
+                 "in insertion order.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to add.\n"
+                 "value : any\n"
+                 "    The value to add.\n");
+    PyDoc_STRVAR(count_doc,
+                 "Count the values stored under a key.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to count.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "count : int\n"
+                 "    The number of pairs with the given key.\n");
+    PyDoc_STRVAR(equal_range_doc,
+                 "Iterate over the pairs with a given key.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "key : any\n"
+                 "    The key to look up.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "it : iterator[tuple[key, value]]\n"
+                 "    The pairs with the given key in insertion order.\n");
+    PyDoc_STRVAR(popitem_doc,
+                 "Remove the first or last (key, value) pair.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "first : bool, optional\n"
+                 "    Should this remove the first pair?\n"
+                 "    This defaults to True.\n"
+                 "\n"
+                 "Returns\n"
+                 "-------\n"
+                 "pair : tuple[key, value]\n"
+                 "    The first or last pair that has been removed from the\n"
+                 "    sortedmultimap.\n"
+                 "\n"
+                 "Raises\n"
+                 "------\n"
+                 "KeyError\n"
+                 "    Raised when the sortedmultimap is empty\n");
+
+    PyMethodDef methods[] = {
+        {"keys", (PyCFunction) keyview::view, METH_NOARGS, keys_doc},
+        {"values", (PyCFunction) valview::view, METH_NOARGS, values_doc},
+        {"items", (PyCFunction) itemview::view, METH_NOARGS, items_doc},
+        {"clear", (PyCFunction) pyclear, METH_NOARGS, clear_doc},
+        {"copy", (PyCFunction) copy, METH_NOARGS, copy_doc},
+        {"__sizeof__", (PyCFunction) sizeof_, METH_NOARGS, sizeof_doc},
+        {"update", (PyCFunction) pyupdate,
+         METH_VARARGS | METH_KEYWORDS, update_doc},
+        {"insert", (PyCFunction) insert, METH_VARARGS, insert_doc},
+        {"count", (PyCFunction) count, METH_O, count_doc},
+        {"equal_range", (PyCFunction) equal_range, METH_O, equal_range_doc},
+        {"popitem", (PyCFunction) pypopitem, METH_KWARGS, popitem_doc},
+        {NULL},
+    };
+
+    PyObject *get_iter_revision(object*);
+    PyObject *get_keyfunc(object*);
+
+    // not using a member because object has a non standard layout
+    PyGetSetDef getsets[] = {
+        {(char*) "keyfunc",
+         (getter) get_keyfunc,
+         NULL,
+         sortedmap::keyfunc_doc,
+         NULL},
+        {(char*) "_iter_revision",
+         (getter) get_iter_revision,
+         NULL,
+         sortedmap::iter_revision_doc,
+         NULL},
+        {NULL},
+    };
+
+    PyDoc_STRVAR(sortedmultimap_doc,
+                 "A sorted mapping that keeps every (key, value) pair,\n"
+                 "including pairs with equal keys.\n"
+                 "\n"
+                 "Parameters\n"
+                 "----------\n"
+                 "mapping : mapping\n"
+                 "**kwargs\n"
+                 "    The initial pairs.\n");
+
+    PyTypeObject type = {
+        PyVarObject_HEAD_INIT(&sortedmap::meta::type, 0)
+        "sortedmap.sortedmultimap",                 // tp_name
+        sizeof(object),                             // tp_basicsize
+        0,                                          // tp_itemsize
+        (destructor) dealloc,                       // tp_dealloc
+        0,                                          // tp_print
+        0,                                          // tp_getattr
+        0,                                          // tp_setattr
+        0,                                          // tp_reserved
+        (reprfunc) repr,                            // tp_repr
+        0,                                          // tp_as_number
+        &as_sequence,                               // tp_as_sequence
+        &as_mapping,                                // tp_as_mapping
+        0,                                          // tp_hash
+        0,                                          // tp_call
+        (reprfunc) repr,                            // tp_str
+        0,                                          // tp_getattro
+        0,                                          // tp_setattro
+        0,                                          // tp_as_buffer
+        Py_TPFLAGS_DEFAULT |
+        Py_TPFLAGS_BASETYPE |
+        Py_TPFLAGS_HAVE_GC,                         // tp_flags
+        sortedmultimap_doc,                         // tp_doc
+        (traverseproc) traverse,                    // tp_traverse
+        (inquiry) gcclear,                          // tp_clear
+        (richcmpfunc) richcompare,                  // tp_richcompare
+        0,                                          // tp_weaklistoffset
+        (getiterfunc) keyiter::iter,                // tp_iter
+        0,                                          // tp_iternext
+        methods,                                    // tp_methods
+        0,                                          // tp_members
+        getsets,                                    // tp_getset
+        0,                                          // tp_base
+        0,                                          // tp_dict
+        0,                                          // tp_descr_get
+        0,                                          // tp_descr_set
+        0,                                          // tp_dictoffset
+        (initproc) init,                            // tp_init
+        0,                                          // tp_alloc
+        (newfunc) newobject,                        // tp_new
+    };
+}
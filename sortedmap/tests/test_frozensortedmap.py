@@ -0,0 +1,193 @@
+import gc
+import random
+import sys
+
+import pytest
+
+from sortedmap import frozensortedmap, sortedmap
+
+
+@pytest.fixture
+def m():
+    return frozensortedmap({'b': 1, 'a': 2, 'd': 3, 'c': 4})
+
+
+def test_sorted(m):
+    assert len(m) == 4
+    assert list(m) == ['a', 'b', 'c', 'd']
+    assert list(m.items()) == [('a', 2), ('b', 1), ('c', 4), ('d', 3)]
+    assert list(m.values()) == [2, 1, 4, 3]
+
+
+def test_from_pairs():
+    m = frozensortedmap([('b', 1), ('a', 2), ('b', 3)], c=4)
+    assert list(m.items()) == [('a', 2), ('b', 3), ('c', 4)]
+    assert len(frozensortedmap()) == 0
+
+
+def test_freeze():
+    m = sortedmap({'b': 1, 'a': 2})
+    f = m.freeze()
+    assert type(f) is frozensortedmap
+    assert list(f.items()) == [('a', 2), ('b', 1)]
+
+    # the frozen map does not see later changes
+    m['c'] = 3
+    assert 'c' not in f
+    assert sortedmap(f) == sortedmap({'b': 1, 'a': 2})
+
+
+def test_getitem(m):
+    assert m['a'] == 2
+    assert m.get('d') == 3
+    assert m.get('e') is None
+    assert m.get('e', default=5) == 5
+    assert 'c' in m
+    assert 'e' not in m
+    with pytest.raises(KeyError):
+        m['e']
+
+
+def test_immutable(m):
+    with pytest.raises(TypeError):
+        m['e'] = 1
+    with pytest.raises(TypeError):
+        del m['a']
+    assert not hasattr(m, 'pop')
+    assert m.copy() is m
+
+
+@pytest.mark.parametrize('n', [0, 1, 2, 7, 8, 9, 100, 1000])
+def test_search(n):
+    keys = random.Random(n).sample(range(4 * n + 1), n)
+    m = sortedmap.fromkeys(keys)
+    f = m.freeze()
+
+    for key in range(-1, 4 * n + 2):
+        assert (key in f) == (key in m)
+        for method in ('floor_item',
+                       'ceiling_item',
+                       'lower_item',
+                       'higher_item'):
+            try:
+                expected = getattr(m, method)(key)
+            except KeyError:
+                with pytest.raises(KeyError):
+                    getattr(f, method)(key)
+            else:
+                assert getattr(f, method)(key) == expected
+
+
+def test_nearest_and_prefix():
+    m = frozensortedmap({1: 'a', 5: 'b', 9: 'c'})
+    assert m.nearest_item(3) == (1, 'a')
+    assert m.nearest_item(4) == (5, 'b')
+
+    m = frozensortedmap({'ab': 1, 'ac': 2, 'b': 3})
+    assert list(m.iprefix('a')) == ['ab', 'ac']
+
+
+def test_keyfunc():
+    m = frozensortedmap[abs]({-3: 'a', 1: 'b', 2: 'c'})
+    assert m.keyfunc is abs
+    assert list(m) == [1, 2, -3]
+    assert m[3] == 'a'
+    assert m.floor_item(-2) == (2, 'c')
+
+    m = sortedmap[abs]({-3: 'a', 1: 'b'}).freeze()
+    assert m.keyfunc is abs
+    assert list(m) == [1, -3]
+
+
+def test_eq_hash(m):
+    other = frozensortedmap(a=2, b=1, c=4, d=3)
+    assert m == other
+    assert hash(m) == hash(other)
+    assert m == sortedmap(m)
+    assert sortedmap(m) == m
+    assert m != frozensortedmap(a=2)
+    assert m != frozensortedmap(a=2, b=1, c=4, d=4)
+    assert {m: 1}[other] == 1
+
+    # keys which the keyfunc makes equal hash equal
+    lower = frozensortedmap[str.lower]
+    assert lower(A=1) == lower(a=1)
+    assert hash(lower(A=1)) == hash(lower(a=1))
+
+    with pytest.raises(TypeError):
+        hash(frozensortedmap(a=[]))
+
+
+def test_views(m):
+    assert m.keys() == {'a', 'b', 'c', 'd'}
+    assert m.items() & {('a', 2)} == {('a', 2)}
+    assert m.values() == [2, 1, 4, 3]
+    assert len(m.keys()) == len(m.values()) == len(m.items()) == 4
+    assert 'c' in m.keys()
+    assert ('c', 4) in m.items()
+    assert ('c', 3) not in m.items()
+
+
+def test_repr():
+    assert repr(frozensortedmap(b=1, a=2)) == (
+        "sortedmap.frozensortedmap([('a', 2), ('b', 1)])"
+    )
+
+
+def test_sizeof():
+    n = 1000
+    m = sortedmap.fromkeys(range(n))
+    f = m.freeze()
+    assert sys.getsizeof(f) < sys.getsizeof(m)
+
+
+@pytest.mark.parametrize('convert', [int, float])
+@pytest.mark.parametrize('n', [0, 1, 15, 16, 17, 1000])
+def test_numeric_keys(convert, n):
+    keys = random.Random(n).sample(range(-4 * n, 4 * n + 1), n)
+    m = sortedmap((convert(key), key) for key in keys)
+    f = m.freeze()
+
+    # probes of the same type as the keys are compared natively, the others
+    # fall back to comparing objects
+    probes = [convert(key) for key in range(-4 * n - 1, 4 * n + 2)]
+    probes += [0.5, -0.5, 2 ** 70, -2 ** 70, True]
+    assert f.get_many(probes, default='missing') == [
+        m.get(probe, 'missing') for probe in probes
+    ]
+    for probe in probes:
+        assert f.get(probe) == m.get(probe)
+        for method in ('floor_item', 'higher_item'):
+            try:
+                expected = getattr(m, method)(probe)
+            except KeyError:
+                with pytest.raises(KeyError):
+                    getattr(f, method)(probe)
+            else:
+                assert getattr(f, method)(probe) == expected
+
+
+def test_get_many(m):
+    assert m.get_many(['a', 'e', 'c']) == [2, None, 4]
+    assert m.get_many(iter(['a', 'e']), default=0) == [2, 0]
+    assert m.get_many([]) == []
+    with pytest.raises(TypeError):
+        m.get_many(1)
+
+
+def test_gc_keyfunc_cycle():
+    class Key(object):
+        collected = False
+
+        def __call__(self, key):
+            return key
+
+        def __del__(self):
+            Key.collected = True
+
+    key = Key()
+    m = frozensortedmap[key]({1: 1})
+    key.m = m
+    del key, m
+    gc.collect()
+    assert Key.collected
@@ -0,0 +1,177 @@
+from collections.abc import MutableMapping
+import gc
+import random
+
+import pytest
+
+from sortedmap import shardedsortedmap, sortedmap
+
+
+@pytest.fixture
+def m():
+    return shardedsortedmap.with_shards(4, {'b': 1, 'a': 2, 'd': 3, 'c': 4})
+
+
+def test_sorted(m):
+    assert isinstance(m, MutableMapping)
+    assert len(m) == 4
+    assert list(m) == ['a', 'b', 'c', 'd']
+    assert list(m.items()) == [('a', 2), ('b', 1), ('c', 4), ('d', 3)]
+    assert list(m.values()) == [2, 1, 4, 3]
+    assert m.nshards == 4
+    assert shardedsortedmap().nshards >= 1
+
+
+def test_getitem_setitem(m):
+    assert m['a'] == 2
+    assert m.get('e') is None
+    assert m.get('e', default=5) == 5
+    assert 'c' in m
+    assert 'e' not in m
+    with pytest.raises(KeyError):
+        m['e']
+
+    m['e'] = 5
+    del m['a']
+    assert list(m.items()) == [('b', 1), ('c', 4), ('d', 3), ('e', 5)]
+
+
+def test_pop_popitem_setdefault(m):
+    assert m.pop('b') == 1
+    assert m.pop('b', None) is None
+    with pytest.raises(KeyError):
+        m.pop('b')
+    assert m.setdefault('a', 0) == 2
+    assert m.setdefault('e', 0) == 0
+    assert m.popitem() == ('a', 2)
+    assert m.popitem(first=False) == ('e', 0)
+    assert list(m.items()) == [('c', 4), ('d', 3)]
+    m.clear()
+    assert len(m) == 0
+    with pytest.raises(KeyError):
+        m.popitem()
+
+
+@pytest.mark.parametrize('seed', range(4))
+def test_random(seed):
+    rng = random.Random(seed)
+    m = shardedsortedmap.with_shards(rng.choice([1, 2, 3, 8]))
+    expected = {}
+
+    for n in range(5000):
+        key = rng.randrange(2000)
+        if rng.random() < 0.25:
+            assert m.pop(key, None) == expected.pop(key, None)
+        else:
+            m[key] = expected[key] = n
+    assert len(m) == len(expected)
+    assert list(m.items()) == sorted(expected.items())
+    assert sum(m.shard_sizes()) == len(expected)
+    for key in range(2000):
+        assert (key in m) == (key in expected)
+
+
+def test_rebalance():
+    m = shardedsortedmap.with_shards(4)
+    for n in range(10000):
+        m[n] = n
+    # appending moves the bounds as the last shard grows
+    assert all(m.shard_sizes())
+
+    m.rebalance()
+    assert m.shard_sizes() == [2500, 2500, 2500, 2500]
+    assert list(m) == list(range(10000))
+
+    for n in range(5000):
+        del m[n]
+    m.rebalance()
+    assert m.shard_sizes() == [1250, 1250, 1250, 1250]
+    assert list(m) == list(range(5000, 10000))
+    assert m[7500] == 7500
+
+
+def test_neighbor_items():
+    m = shardedsortedmap.with_shards(4, {n: str(n) for n in range(0, 2000, 2)})
+    m.rebalance()
+    assert m.floor_item(101) == (100, '100')
+    assert m.floor_item(100) == (100, '100')
+    assert m.lower_item(100) == (98, '98')
+    assert m.ceiling_item(101) == (102, '102')
+    assert m.higher_item(102) == (104, '104')
+
+    # the neighbor is in the next shard over
+    sizes = m.shard_sizes()
+    last = 2 * (sizes[0] - 1)
+    assert m.higher_item(last) == (last + 2, str(last + 2))
+    assert m.lower_item(last + 2) == (last, str(last))
+
+    with pytest.raises(KeyError):
+        m.lower_item(0)
+    with pytest.raises(KeyError):
+        m.higher_item(1998)
+
+
+def test_keyfunc():
+    m = shardedsortedmap[abs]({-3: 'a', 1: 'b', 2: 'c'})
+    assert m.keyfunc is abs
+    assert list(m) == [1, 2, -3]
+    assert m[3] == 'a'
+
+    m = shardedsortedmap.with_shards(2, {-3: 'a', 1: 'b'}, keyfunc=abs)
+    assert m.keyfunc is abs
+    assert list(m) == [1, -3]
+
+
+def test_views_and_eq(m):
+    assert m.keys() == {'a', 'b', 'c', 'd'}
+    assert ('a', 2) in m.items()
+    assert ('a', 3) not in m.items()
+    assert 'a' in m.keys()
+    assert len(m.keys()) == len(m.values()) == len(m.items()) == 4
+
+    assert m == sortedmap(a=2, b=1, c=4, d=3)
+    assert m == shardedsortedmap(a=2, b=1, c=4, d=3)
+    assert m != shardedsortedmap(a=2)
+    copy = m.copy()
+    assert copy == m and copy.nshards == m.nshards
+    copy['e'] = 5
+    assert 'e' not in m
+
+
+def test_repr():
+    assert repr(shardedsortedmap(b=1, a=2)) == (
+        "sortedmap.shardedsortedmap([('a', 2), ('b', 1)])"
+    )
+
+
+def test_iter_rebalanced():
+    m = shardedsortedmap.with_shards(2, {n: n for n in range(1000)})
+    m.rebalance()
+    it = iter(m)
+    next(it)
+    # the writes land past the shard being iterated until the last shard
+    # grows enough to be rebalanced
+    for n in range(1000, 5000):
+        m[n] = n
+    with pytest.raises(RuntimeError):
+        list(it)
+
+
+def test_errors():
+    with pytest.raises(ValueError):
+        shardedsortedmap.with_shards(0)
+
+    m = shardedsortedmap.with_shards(2, {n: n for n in range(1000)})
+    with pytest.raises(TypeError):
+        m['a'] = 1
+    with pytest.raises(TypeError):
+        m['a']
+    assert len(m) == 1000
+
+
+def test_gc_cycle():
+    m = shardedsortedmap()
+    m['self'] = m
+    assert gc.is_tracked(m)
+    del m
+    assert gc.collect()
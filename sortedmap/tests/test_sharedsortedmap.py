@@ -0,0 +1,207 @@
+import os
+import random
+import struct
+import subprocess
+import sys
+import uuid
+
+import pytest
+
+import sortedmap
+from sortedmap import frozensortedmap, sharedsortedmap
+
+
+@pytest.fixture
+def name():
+    name = 'sortedmap-test-' + uuid.uuid4().hex
+    yield name
+    try:
+        sharedsortedmap.unlink(name)
+    except FileNotFoundError:
+        pass
+
+
+@pytest.fixture
+def m(name):
+    sharedsortedmap.publish(name, {b'b': b'1', b'a': b'2', b'd': b'3'})
+    return sharedsortedmap(name)
+
+
+def test_sorted(m, name):
+    assert len(m) == 3
+    assert list(m) == [b'a', b'b', b'd']
+    assert list(m.items()) == [(b'a', b'2'), (b'b', b'1'), (b'd', b'3')]
+    assert list(m.values()) == [b'2', b'1', b'3']
+    assert m.name == name
+    assert m.generation == 1
+
+
+def test_getitem(m):
+    assert m[b'a'] == b'2'
+    assert m.get(b'd') == b'3'
+    assert m.get(b'c') is None
+    assert m.get(b'c', default=5) == 5
+    assert b'b' in m
+    assert b'' not in m
+    with pytest.raises(KeyError):
+        m[b'c']
+
+
+def test_views_and_eq(m):
+    assert m.keys() == {b'a', b'b', b'd'}
+    assert (b'a', b'2') in m.items()
+    assert (b'a', b'3') not in m.items()
+    assert len(m.keys()) == len(m.values()) == len(m.items()) == 3
+    assert m == sortedmap.sortedmap({b'a': b'2', b'b': b'1', b'd': b'3'})
+    assert m != frozensortedmap({b'a': b'2'})
+    assert m.copy() is m
+    assert repr(m) == (
+        "sortedmap.sharedsortedmap([(b'a', b'2'), (b'b', b'1'), (b'd', b'3')])"
+    )
+
+
+@pytest.mark.parametrize('key_type,convert', [
+    ('int64', int),
+    ('float64', float),
+    ('bytes', lambda n: b'%05d' % n),
+])
+@pytest.mark.parametrize('n', [0, 1, 2, 100])
+def test_search(name, key_type, convert, n):
+    keys = random.Random(n).sample(range(4 * n + 1), n)
+    expected = sortedmap.sortedmap((convert(key), key) for key in keys)
+    sharedsortedmap.publish(name,
+                            expected,
+                            key_type=key_type,
+                            value_type='int64')
+    m = sharedsortedmap(name)
+    assert m == expected
+
+    for probe in map(convert, range(-1, 4 * n + 2)):
+        assert m.get(probe) == expected.get(probe)
+        for method in ('floor_item',
+                       'ceiling_item',
+                       'lower_item',
+                       'higher_item'):
+            try:
+                result = getattr(expected, method)(probe)
+            except KeyError:
+                with pytest.raises(KeyError):
+                    getattr(m, method)(probe)
+            else:
+                assert getattr(m, method)(probe) == result
+
+
+def test_numeric_probes(name):
+    big = 2 ** 53
+    sharedsortedmap.publish(name,
+                            [(float(big), 1), (0.5, 2), (3.0, 3), (3, 4)],
+                            key_type='float64',
+                            value_type='int64')
+    m = sharedsortedmap(name)
+    assert list(m.items()) == [(0.5, 2), (3.0, 4), (float(big), 1)]
+    assert m[3] == 4
+    assert m[big] == 1
+    # rounds to the key but is not equal to it
+    assert big + 1 not in m
+    assert m.floor_item(big + 1) == (float(big), 1)
+    assert m.lower_item(big - 1) == (3.0, 4)
+    assert float('nan') not in m
+    with pytest.raises(KeyError):
+        m.floor_item(float('nan'))
+
+    # ints too large for a float sort between the finite keys and infinity
+    inf = float('inf')
+    sharedsortedmap.publish(name,
+                            [(-inf, 1), (0.5, 2), (inf, 3)],
+                            key_type='float64',
+                            value_type='int64')
+    m = m.refresh()
+    for huge in (10 ** 400, -10 ** 400):
+        assert huge not in m
+        assert m.get(huge) is None
+    assert m.floor_item(10 ** 400) == (0.5, 2)
+    assert m.ceiling_item(10 ** 400) == (inf, 3)
+    assert m.lower_item(-10 ** 400) == (-inf, 1)
+    assert m.higher_item(-10 ** 400) == (0.5, 2)
+    assert m.floor_item(-10 ** 400) == (-inf, 1)
+
+    sharedsortedmap.publish(name, {1: b'a', 2: b'b'}, key_type='int64')
+    m = m.refresh()
+    assert m[True] == b'a'
+    assert 2 ** 70 not in m
+    assert m.floor_item(2 ** 70) == (2, b'b')
+    assert m.ceiling_item(-2 ** 70) == (1, b'a')
+
+
+def test_generations(m, name):
+    assert m.refresh() is m
+    assert sharedsortedmap.publish(name, {b'e': b'4'}) == 2
+
+    # the old generation can still be read until it is refreshed
+    assert list(m.items()) == [(b'a', b'2'), (b'b', b'1'), (b'd', b'3')]
+    new = m.refresh()
+    assert new.generation == 2
+    assert list(new.items()) == [(b'e', b'4')]
+    assert sharedsortedmap(name) == new
+    assert new.refresh() is new
+
+    sharedsortedmap.unlink(name)
+    assert m[b'a'] == b'2' and new[b'e'] == b'4'
+    with pytest.raises(FileNotFoundError):
+        sharedsortedmap(name)
+
+
+def test_other_process(m, name):
+    path = os.path.dirname(os.path.dirname(sortedmap.__file__))
+    code = (
+        'from sortedmap import sharedsortedmap\n'
+        'm = sharedsortedmap(%r)\n'
+        'print(m.generation, m[b"a"].decode(), list(m.keys()))\n' % name
+    )
+    out = subprocess.check_output(
+        [sys.executable, '-c', code],
+        env=dict(os.environ, PYTHONPATH=path),
+    )
+    assert out.decode().split() == ['1', '2', "[b'a',", "b'b',", "b'd']"]
+
+
+def test_errors(m, name):
+    with pytest.raises(TypeError):
+        m['a']
+    with pytest.raises(TypeError):
+        'a' in m
+    with pytest.raises(TypeError):
+        m[b'a'] = b'1'
+
+    with pytest.raises(ValueError):
+        sharedsortedmap.publish(name, {}, key_type='str')
+    with pytest.raises(TypeError):
+        sharedsortedmap.publish(name, {'a': b'1'})
+    with pytest.raises(OverflowError):
+        sharedsortedmap.publish(name, {2 ** 70: b'1'}, key_type='int64')
+    with pytest.raises(ValueError):
+        sharedsortedmap.publish(name,
+                                {float('nan'): b'1'},
+                                key_type='float64')
+    with pytest.raises(ValueError):
+        sharedsortedmap.publish('a/b', {})
+    # the failed publishes did not change the map
+    assert m.refresh() is m
+
+    with pytest.raises(FileNotFoundError):
+        sharedsortedmap('sortedmap-test-' + uuid.uuid4().hex)
+
+
+@pytest.mark.skipif(not os.path.isdir('/dev/shm'),
+                    reason='shm segments are not files here')
+@pytest.mark.parametrize('offsets', [(2 ** 40, 2 ** 40 + 1), (1, 0)])
+def test_corrupt_segment(name, offsets):
+    sharedsortedmap.publish(name, {b'a': b'1', b'b': b'2'})
+    path = '/dev/shm/%s.1' % name
+    with open(path, 'r+b') as f:
+        keys, = struct.unpack_from('<Q', f.read(64), 24)
+        f.seek(keys)
+        f.write(struct.pack('<2Q', *offsets))
+
+    with pytest.raises(ValueError):
+        sharedsortedmap(name)
@@ -1,4 +1,8 @@
+from array import array
 from collections.abc import MutableMapping
+import gc
+import random
+import sys
 
 import pytest
 
@@ -264,6 +268,64 @@ def test_fromkeys():
     assert sortedmap.fromkeys(keys, ob) == sortedmap(a=ob, b=ob, c=ob)
 
 
+@pytest.mark.parametrize('keycode,valcode', (
+    ('q', 'd'),
+    ('b', 'q'),
+    ('Q', 'B'),
+    ('d', 'q'),
+    ('f', 'i'),
+))
+@pytest.mark.parametrize('nthreads', (None, 1, 3, 8))
+def test_from_arrays(keycode, valcode, nthreads):
+    rand = random.Random(0)
+    size = 100000
+    ks = [rand.randrange(100) for _ in range(size)]
+    vs = list(range(size))
+    keys = array(keycode, ks)
+    values = array(valcode, [v % 100 for v in vs])
+
+    expected = sortedmap()
+    for k, v in zip(keys, values):
+        expected[k] = v
+
+    m = sortedmap.from_arrays(keys, values, nthreads=nthreads)
+    assert m == expected
+    assert list(m.items()) == list(expected.items())
+
+
+def test_from_arrays_strided():
+    keys = memoryview(array('q', [5, 0, 4, 0, 3, 0]))[::2]
+    values = memoryview(array('d', [1, 0, 2, 0, 3, 0]))[::2]
+    assert sortedmap.from_arrays(keys, values) == sortedmap({
+        3: 3.0,
+        4: 2.0,
+        5: 1.0,
+    })
+
+
+def test_from_arrays_errors():
+    with pytest.raises(ValueError):
+        sortedmap.from_arrays(array('q', [1, 2]), array('q', [1]))
+
+    with pytest.raises(ValueError):
+        sortedmap.from_arrays(array('d', [1.0, float('nan')]),
+                              array('q', [1, 2]))
+
+    with pytest.raises(TypeError):
+        sortedmap.from_arrays(array('u', 'ab'), array('q', [1, 2]))
+
+    with pytest.raises(TypeError):
+        sortedmap.from_arrays([1, 2], array('q', [1, 2]))
+
+    for nthreads in (0, -1):
+        with pytest.raises(ValueError):
+            sortedmap.from_arrays(array('q', [1]),
+                                  array('q', [1]),
+                                  nthreads=nthreads)
+    with pytest.raises(TypeError):
+        sortedmap.from_arrays(array('q', [1]), array('q', [1]), nthreads=1.5)
+
+
 def test_clear(m):
     n = sortedmap(m)
     m.clear()
@@ -334,9 +396,1126 @@ def test_itemview_setlike(m):
     assert not sortedmap().items()
 
 
+def test_view_len_contains(m):
+    for view in m.keys(), m.values(), m.items():
+        assert len(view) == 3
+    assert len(sortedmap().items()) == 0
+
+    assert 'b' in m.keys()
+    assert 'd' not in m.keys()
+    assert ('b', 2) in m.items()
+    assert ('b', 3) not in m.items()
+    assert ('d', 2) not in m.items()
+    assert 'b' not in m.items()
+    assert ('b', 2, 3) not in m.items()
+    assert 2 in m.values()
+    assert 4 not in m.values()
+
+    # the views see writes which are still in the write buffer
+    m.set_write_buffer(10)
+    m['d'] = 4
+    assert len(m.keys()) == 4
+    assert 'd' in m.keys()
+    assert ('d', 4) in m.items()
+
+
 def test_values_listlike(m):
     values = m.values()
     assert values + [4, 5, 6] == [1, 2, 3, 4, 5, 6]
     assert values * 2 == [1, 2, 3, 1, 2, 3]
     assert values  # bool
     assert not sortedmap().values()
+
+
+def test_keyfunc_refcount():
+    def keyfunc(x):
+        return x
+
+    start = sys.getrefcount(keyfunc)
+    m = sortedmap[keyfunc](a=1)
+    for _ in range(10):
+        m.keyfunc
+    n = m.copy()
+    del m, n
+    assert sys.getrefcount(keyfunc) == start
+
+
+@pytest.mark.parametrize('use_keyfunc', [True, False])
+def test_changed_during_comparison(use_keyfunc):
+    class Key(object):
+        def __init__(self, n):
+            self.n = n
+
+        def __lt__(self, other):
+            return keyfunc(self) < keyfunc(other)
+
+        def __eq__(self, other):
+            return self.n == other.n
+
+    def keyfunc(key):
+        nonlocal armed
+        if armed:
+            armed = False
+            del m[keys[0]]
+        return key.n
+
+    keys = [Key(n) for n in range(8)]
+    armed = False
+    if use_keyfunc:
+        m = sortedmap[keyfunc]((key, key.n) for key in keys)
+    else:
+        m = sortedmap((key, key.n) for key in keys)
+
+    armed = True
+    with pytest.raises(RuntimeError) as e:
+        m[Key(5)]
+    assert 'key comparison' in str(e.value)
+    assert list(m.values()) == list(range(1, 8))
+    assert m[keys[5]] == 5
+
+
+@pytest.mark.parametrize('key', ('a', 'b', 'c', 'd', 'e', 'f', 'g'))
+def test_split(key):
+    m = sortedmap(a=1, b=2, c=3, d=4, e=5, f=6)
+    it = iter(m)
+    upper = m.split(key)
+    assert type(upper) is sortedmap
+    assert list(m) == [k for k in 'abcdef' if k < key]
+    assert list(upper) == [k for k in 'abcdef' if k >= key]
+    assert dict(m, **upper) == dict(a=1, b=2, c=3, d=4, e=5, f=6)
+    if key not in 'ag':
+        with pytest.raises(RuntimeError):
+            next(it)
+
+
+def test_split_keyfunc(keyfunc_m):
+    upper = keyfunc_m.split('xx')
+    assert upper.keyfunc is len
+    assert list(keyfunc_m.items()) == [('c', 3)]
+    assert list(upper.items()) == [('bc', 2), ('abc', 1)]
+
+
+@pytest.mark.parametrize('lhs,rhs', (
+    ('ab', 'cdef'),
+    ('abcd', 'ef'),
+    ('cdef', 'ab'),
+    ('ef', 'abcd'),
+    ('', 'abc'),
+    ('abc', ''),
+))
+def test_join(lhs, rhs):
+    m = sortedmap((k, ord(k)) for k in lhs)
+    n = sortedmap((k, ord(k)) for k in rhs)
+    assert m.join(n) is None
+    assert list(m.items()) == sorted((k, ord(k)) for k in lhs + rhs)
+    assert not n
+
+
+def test_join_overlapping(m):
+    n = sortedmap(b=4, d=5)
+    with pytest.raises(ValueError):
+        m.join(n)
+    assert m == sortedmap(a=1, b=2, c=3)
+    assert n == sortedmap(b=4, d=5)
+
+
+def test_join_different_keyfunc(m, keyfunc_m):
+    with pytest.raises(ValueError):
+        m.join(keyfunc_m)
+    with pytest.raises(TypeError):
+        m.join({'d': 4})
+
+
+@pytest.mark.parametrize('other', (
+    {'b': 4, 'd': 5},
+    {'0': 0, 'b': 4, 'bb': 6, 'z': 7},
+    {k: ord(k) for k in 'abcdefghijklmnopqrstuvwxyz'},
+    {'a': 10},
+    {},
+))
+def test_update_sortedmap(m, other):
+    expected = dict(m)
+    expected.update(other)
+    m.update(sortedmap(other))
+    assert list(m.items()) == sorted(expected.items())
+
+
+def test_update_sortedmap_keyfunc(keyfunc_m):
+    keyfunc_m.update(sortedmap[len](x=4, ab=5, abcd=6))
+    assert list(keyfunc_m.items()) == [
+        ('c', 4), ('bc', 5), ('abc', 1), ('abcd', 6),
+    ]
+
+    # different keyfunc goes through the generic path
+    keyfunc_m.update(sortedmap(y=7))
+    assert keyfunc_m['x'] == 7
+
+
+def test_update_sortedmap_iter_revision(m):
+    revision = m._iter_revision
+    m.update(sortedmap(a=4, b=5))
+    assert m._iter_revision == revision
+
+    m.update(sortedmap(a=4, d=5))
+    assert m._iter_revision != revision
+
+
+def test_overwrite_refcount(m):
+    ob = object()
+    start = sys.getrefcount(ob)
+    m['a'] = ob
+    m['a'] = 1
+    m.update(sortedmap(a=ob))
+    m.update(sortedmap(a=1))
+    assert sys.getrefcount(ob) == start
+
+
+def naive_aggregate(m, lo=None, hi=None):
+    values = [
+        float(v) for k, v in m.items()
+        if (lo is None or k >= lo) and (hi is None or k < hi)
+    ]
+    if not values:
+        return 0, 0.0, None, None
+    return len(values), sum(values), min(values), max(values)
+
+
+def track_aggregates(m):
+    try:
+        m.track_aggregates()
+    except NotImplementedError:
+        pytest.skip('sortedmap was built without aggregate trees')
+
+
+def check_aggregates(m):
+    bounds = [None] + list(range(-1, 22, 3))
+    for lo in bounds:
+        for hi in bounds:
+            assert m.aggregate(lo, hi) == naive_aggregate(m, lo, hi)
+
+
+@pytest.mark.parametrize('track', (True, False))
+def test_aggregate(track):
+    rand = random.Random(0)
+    m = sortedmap((n, rand.randrange(100)) for n in range(0, 20, 2))
+    if track:
+        track_aggregates(m)
+    check_aggregates(m)
+
+    for _ in range(50):
+        m[rand.randrange(20)] = rand.randrange(-50, 50)
+        check_aggregates(m)
+
+    m.setdefault(100, 7)
+    m.setdefault(100, 9)
+    del m[rand.choice(list(m))]
+    m.pop(rand.choice(list(m)))
+    m.popitem()
+    m.popitem(first=False)
+    m.update({-5: 3, 4: 4.5})
+    check_aggregates(m)
+
+    c = m.copy()
+    hi = c.split(10)
+    check_aggregates(c)
+    check_aggregates(hi)
+
+    c.join(hi)
+    assert c == m
+    assert not hi
+    check_aggregates(c)
+    check_aggregates(hi)
+
+    n = sortedmap()
+    if track:
+        track_aggregates(n)
+    n.update(m)
+    check_aggregates(n)
+    n.update(sortedmap({k + 0.5: -k for k in m}))
+    check_aggregates(n)
+
+    m.clear()
+    check_aggregates(m)
+
+
+def test_aggregate_join_untracked():
+    m = sortedmap({1: 1, 2: 2})
+    track_aggregates(m)
+    m.join(sortedmap({3: 3, 4: 4}))
+    assert m.aggregate() == (4, 10.0, 1.0, 4.0)
+    assert m.aggregate(2, 4) == (2, 5.0, 2.0, 3.0)
+
+
+def test_aggregate_non_numeric():
+    track_aggregates(sortedmap())
+    m = sortedmap(a=1, b='b')
+    with pytest.raises(TypeError):
+        m.track_aggregates()
+    with pytest.raises(TypeError):
+        m.aggregate()
+
+    del m['b']
+    track_aggregates(m)
+    with pytest.raises(TypeError):
+        m['c'] = 'c'
+    assert m == sortedmap(a=1)
+    with pytest.raises(TypeError):
+        m.setdefault('c', 'c')
+    assert m == sortedmap(a=1)
+    assert m.setdefault('a', 'a') == 1
+    assert m.aggregate() == (1, 1.0, 1.0, 1.0)
+
+
+@pytest.mark.parametrize('key', range(-1, 12))
+def test_neighbor_items(key):
+    m = sortedmap((n, str(n)) for n in range(0, 11, 2))
+    keys = list(m)
+
+    def check(method, candidates, pick):
+        if candidates:
+            expected = pick(candidates)
+            assert getattr(m, method)(key) == (expected, str(expected))
+        else:
+            with pytest.raises(KeyError):
+                getattr(m, method)(key)
+
+    check('floor_item', [k for k in keys if k <= key], max)
+    check('ceiling_item', [k for k in keys if k >= key], min)
+    check('lower_item', [k for k in keys if k < key], max)
+    check('higher_item', [k for k in keys if k > key], min)
+    # ties go to the smaller key
+    nearest = min(keys, key=lambda k: (abs(k - key), k))
+    assert m.nearest_item(key) == (nearest, str(nearest))
+
+
+def test_neighbor_items_empty():
+    m = sortedmap()
+    for method in ('floor_item',
+                   'ceiling_item',
+                   'lower_item',
+                   'higher_item',
+                   'nearest_item'):
+        with pytest.raises(KeyError):
+            getattr(m, method)(1)
+
+
+def test_neighbor_items_keyfunc(keyfunc_m):
+    keys = list(keyfunc_m)
+    assert keyfunc_m.floor_item(keys[1]) == (keys[1], keyfunc_m[keys[1]])
+    assert keyfunc_m.higher_item(keys[1]) == (keys[2], keyfunc_m[keys[2]])
+    assert keyfunc_m.lower_item(keys[1]) == (keys[0], keyfunc_m[keys[0]])
+
+
+@pytest.mark.parametrize('prefix', (
+    '',
+    '/',
+    '/a',
+    '/a/',
+    '/a/b',
+    '/a/b/',
+    '/b',
+    '/c',
+    'z',
+    '\U0010ffff',
+))
+@pytest.mark.parametrize('encode', (False, True))
+def test_iprefix(prefix, encode):
+    keys = [
+        '/a',
+        '/a/b',
+        '/a/b/c',
+        '/a/b/d',
+        '/a/bb',
+        '/a/c',
+        '/ab',
+        '/b/a',
+        '/b\U0010ffff',
+        '/b\U0010ffff\U0010ffff',
+        '/c',
+        '\U0010ffff',
+        '\U0010ffffa',
+    ]
+    if encode:
+        # 0xff bytes exercise carrying past the end of the byte range
+        keys = [k.replace('\U0010ffff', '\xff').encode('latin-1')
+                for k in keys]
+        prefix = prefix.replace('\U0010ffff', '\xff').encode('latin-1')
+    m = sortedmap.fromkeys(keys)
+    assert list(m.iprefix(prefix)) == [k for k in keys if k.startswith(prefix)]
+
+
+def test_iprefix_errors(keyfunc_m):
+    with pytest.raises(TypeError):
+        sortedmap().iprefix(1)
+    with pytest.raises(ValueError):
+        keyfunc_m.iprefix('a')
+    with pytest.raises(TypeError):
+        sortedmap.fromkeys([1, 2]).iprefix('a')
+
+
+@pytest.mark.parametrize('evict', ('first', 'last'))
+@pytest.mark.parametrize('track', (True, False))
+def test_maxlen(evict, track):
+    rand = random.Random(0)
+    maxlen = 10
+    m = sortedmap()
+    if track:
+        track_aggregates(m)
+    m.set_maxlen(maxlen, evict=evict)
+    assert m.maxlen == maxlen
+
+    expected = {}
+
+    def trim():
+        while len(expected) > maxlen:
+            del expected[(min if evict == 'first' else max)(expected)]
+
+    for _ in range(1000):
+        k = rand.randrange(100)
+        v = rand.randrange(100)
+        m[k] = v
+        expected[k] = v
+        trim()
+        assert m == sortedmap(expected)
+        if track:
+            assert m.aggregate() == naive_aggregate(m)
+
+    m.update({k: 0 for k in range(200)})
+    expected.update({k: 0 for k in range(200)})
+    trim()
+    assert m == sortedmap(expected)
+
+    m.set_maxlen(3)
+    assert list(m) == sorted(expected)[-3:]
+    m.set_maxlen(None)
+    assert m.maxlen is None
+    m[-1] = -1
+    m[1000] = 1000
+    assert len(m) == 5
+
+
+def test_maxlen_reject_invalidates_nothing():
+    m = sortedmap({1: 1, 2: 2, 3: 3})
+    m.set_maxlen(3)
+    it = iter(m)
+    m[0] = 0  # would be evicted right away
+    assert m == sortedmap({1: 1, 2: 2, 3: 3})
+    assert list(it) == [1, 2, 3]
+
+    it = iter(m)
+    m[4] = 4
+    assert m == sortedmap({2: 2, 3: 3, 4: 4})
+    with pytest.raises(RuntimeError):
+        next(it)
+
+
+def test_maxlen_copy_split():
+    m = sortedmap((n, n) for n in range(10))
+    m.set_maxlen(5, evict='last')
+    assert list(m) == [0, 1, 2, 3, 4]
+    assert m.copy().maxlen == 5
+    assert m.split(2).maxlen == 5
+    m.setdefault(-1, -1)
+    assert list(m) == [-1, 0, 1]
+
+
+def test_set_maxlen_errors():
+    m = sortedmap()
+    with pytest.raises(ValueError):
+        m.set_maxlen(-1)
+    with pytest.raises(ValueError):
+        m.set_maxlen(1, evict='middle')
+    with pytest.raises(TypeError):
+        m.set_maxlen('a')
+
+
+@pytest.mark.parametrize('n', (0, 1, 3, 10, 11, 100))
+@pytest.mark.parametrize('first', (True, False))
+def test_popitems(n, first):
+    m = sortedmap((k, -k) for k in range(10))
+    track_aggregates(m)
+    expected = sortedmap(m)
+    revision = m._iter_revision
+
+    popped = [expected.popitem(first=first)
+              for _ in range(min(n, len(expected)))]
+    assert m.popitems(n, first=first) == popped
+    assert m == expected
+    assert m._iter_revision == revision + bool(popped)
+    assert m.aggregate() == naive_aggregate(m)
+
+
+def test_popitems_negative():
+    with pytest.raises(ValueError):
+        sortedmap().popitems(-1)
+
+
+@pytest.mark.parametrize('key', (-1, 0, 4, 4.5, 9, 10))
+def test_pop_until(key):
+    m = sortedmap((k, k) for k in range(10))
+    track_aggregates(m)
+    assert m.pop_until(key) == [(k, k) for k in range(10) if k < key]
+    assert list(m) == [k for k in range(10) if k >= key]
+    assert m.aggregate() == naive_aggregate(m)
+
+
+def test_keyword_arguments(m):
+    assert m.get(key='a') == 1
+    assert m.get('z', default=5) == 5
+    assert m.setdefault(key='z', default=3) == 3
+    assert m.pop('z', default=None) == 3
+    assert m.popitem(first=False) == ('c', 3)
+
+    for call in (lambda: m.get(),
+                 lambda: m.get('a', 1, 2),
+                 lambda: m.get('a', key='a'),
+                 lambda: m.get(k='a'),
+                 lambda: m.popitem(True, True)):
+        with pytest.raises(TypeError):
+            call()
+
+
+def test_keyfunc_partial_call():
+    assert sortedmap[len]({'aa': 1}, b=2) == sortedmap[len](b=2, aa=1)
+    assert list(sortedmap[len]([('aa', 1), ('b', 2)])) == ['b', 'aa']
+    with pytest.raises(TypeError):
+        sortedmap[len]({}, {})
+
+
+def test_sizeof():
+    empty = sys.getsizeof(sortedmap())
+    m = sortedmap.fromkeys(range(100), 0)
+    per_node = (sys.getsizeof(m) - empty) / 100
+    assert per_node > 0
+    assert per_node == int(per_node)
+
+    del m[0]
+    assert sys.getsizeof(m) == empty + per_node * 99
+
+    tracked_empty = sortedmap()
+    track_aggregates(tracked_empty)
+    track_aggregates(m)
+    assert sys.getsizeof(m) - sys.getsizeof(tracked_empty) > per_node * 99
+
+
+@pytest.mark.parametrize('alphabet', (
+    b'ab\x00\xff',
+    'ab\x00\xff',
+    'ab€￿',
+    'ab\U0001f600\U0010ffff',
+    'a\xff€\U0001f600',
+))
+def test_native_string_order(alphabet):
+    rand = random.Random(0)
+    join = type(alphabet)().join if isinstance(alphabet, str) else bytes
+    if isinstance(alphabet, bytes):
+        alphabet = list(alphabet)
+
+    keys = {
+        join([rand.choice(alphabet) for _ in range(rand.randrange(100))])
+        for _ in range(1000)
+    }
+    # share long prefixes to exercise the block skipping
+    prefix = join(alphabet[:1] * 70)
+    keys |= {prefix + key for key in list(keys)[:100]}
+    m = sortedmap.fromkeys(keys)
+    assert list(m) == sorted(keys)
+    for key in keys:
+        assert key in m
+
+
+@pytest.mark.parametrize('size', (1, 2, 7, 64))
+@pytest.mark.parametrize('key_type', (int, float, str))
+def test_write_buffer(size, key_type):
+    rand = random.Random(size)
+    m = sortedmap()
+    m.set_write_buffer(size)
+    assert m.write_buffer == size
+    expected = {}
+
+    for step in range(2000):
+        k = key_type(rand.randrange(100))
+        op = rand.random()
+        if op < 0.6:
+            m[k] = step
+            expected[k] = step
+        elif op < 0.7:
+            assert m.get(k) == expected.get(k)
+        elif op < 0.75:
+            assert m.pop(k, None) == expected.pop(k, None)
+        elif op < 0.8:
+            assert list(m.items()) == sorted(expected.items())
+        else:
+            m.update([(k, -step), (k, step)])
+            expected[k] = step
+
+    assert m == sortedmap(expected)
+
+    m.set_write_buffer(None)
+    assert m.write_buffer is None
+    m[key_type(1000)] = 0
+    expected[key_type(1000)] = 0
+    assert m == sortedmap(expected)
+
+
+def test_write_buffer_iter_revision():
+    m = sortedmap({1: 1, 2: 2})
+    m.set_write_buffer(10)
+
+    it = iter(m)
+    m[0] = 0
+    with pytest.raises(RuntimeError):
+        next(it)
+
+    assert list(m) == [0, 1, 2]
+
+
+def test_write_buffer_bad_key():
+    m = sortedmap({1: 1})
+    m.set_write_buffer(10)
+    m[2] = 2
+    m['a'] = 3
+    m[3] = 3
+
+    with pytest.raises(TypeError):
+        len(m)
+    # the writes before the bad key are kept
+    assert m == sortedmap({1: 1, 2: 2})
+
+
+def test_write_buffer_bad_key_after_merge():
+    class Top:
+        # above every int, but cannot be compared with ``Bad``
+        def __lt__(self, other):
+            if isinstance(other, Bad):
+                raise TypeError('Top < Bad')
+            return False
+
+        def __gt__(self, other):
+            if isinstance(other, Bad):
+                raise TypeError('Top > Bad')
+            return True
+
+    class Bad:
+        # sorts after the ints in the buffer
+        def __lt__(self, other):
+            if isinstance(other, Top):
+                raise TypeError('Bad < Top')
+            return False
+
+        def __gt__(self, other):
+            if isinstance(other, Top):
+                raise TypeError('Bad > Top')
+            return True
+
+    top = Top()
+
+    def run(buffer, keys, maxlen=3):
+        m = sortedmap({10: 10, top: 0})
+        m.set_maxlen(maxlen)
+        m.set_write_buffer(buffer)
+        with pytest.raises(TypeError):
+            for key in keys:
+                m[key] = key
+            len(m)
+        return list(m.items())
+
+    # the pairs before the bad key end up like they would without the buffer
+    assert run(100, (15, 20, 5, Bad())) == [(15, 15), (20, 20), (top, 0)]
+    assert run(0, (15, 20, 5, Bad())) == [(15, 15), (20, 20), (top, 0)]
+    # and the pairs after it are dropped, even the ones which sort first
+    assert run(100, (15, Bad(), 5), 4) == [(10, 10), (15, 15), (top, 0)]
+    assert run(0, (15, Bad(), 5), 4) == [(10, 10), (15, 15), (top, 0)]
+
+
+@pytest.mark.parametrize('keyfunc', (None, abs))
+def test_write_buffer_equal_keys(keyfunc):
+    writes = [(1, 'a'), (1.0, 'b'), (0.0, 'z'), (-0.0, 'y'), (True, 'c'),
+              (-1, 'd')]
+
+    def run(buffer, tree):
+        m = sortedmap() if keyfunc is None else sortedmap[keyfunc]()
+        m.update(tree)
+        m.set_write_buffer(buffer)
+        for key, value in writes:
+            m[key] = value
+        items = list(m.items())
+        return items, [type(k) for k, _ in items], [str(k) for k, _ in items]
+
+    # the first key object written is kept with the last value
+    for tree in ({}, {1.0: 'x'}, {False: 'x'}):
+        assert run(100, tree) == run(0, tree)
+    assert run(100, {})[0] == run(0, {})[0]
+    if keyfunc is None:
+        assert run(100, {})[2] == ['-1', '0.0', '1']
+
+
+def test_write_buffer_copy_maxlen():
+    m = sortedmap()
+    m.set_maxlen(3)
+    m.set_write_buffer(100)
+    for k in range(10):
+        m[k] = k
+
+    c = m.copy()
+    assert c.write_buffer == 100
+    assert list(m.items()) == [(7, 7), (8, 8), (9, 9)]
+    assert c == m
+
+
+def test_set_write_buffer_errors():
+    m = sortedmap()
+    with pytest.raises(ValueError):
+        m.set_write_buffer(-1)
+    with pytest.raises(TypeError):
+        m.set_write_buffer('a')
+
+
+def test_intern_pool():
+    pool = {}
+    a = sortedmap()
+    b = sortedmap()
+    assert a.intern_pool is None
+    a.set_intern_pool(pool)
+    b.set_intern_pool(pool)
+    assert a.intern_pool is pool
+
+    key = ''.join(['k', 'e', 'y'])
+    a[key] = 1
+    b[''.join(['k', 'e', 'y'])] = 2
+    b.setdefault(''.join(['o', 't', 'h', 'e', 'r']), 3)
+    a.update(sortedmap({''.join(['o', 't', 'h', 'e', 'r']): 4}))
+    assert next(iter(b)) is key
+    assert pool == {key: key, 'other': 'other'}
+    assert list(a)[1] is list(b)[1]
+    assert a.copy().intern_pool is pool
+
+    # other key types are not interned
+    c = sortedmap()
+    c.set_intern_pool(pool)
+    c[(1, 2)] = 5
+    c[(10 ** 20,)] = 6
+    assert len(pool) == 2
+
+    a.set_intern_pool(None)
+    assert a.intern_pool is None
+    a['new'] = 6
+    assert 'new' not in pool
+
+
+def test_intern_pool_maxlen():
+    pool = {}
+    m = sortedmap()
+    m.set_intern_pool(pool)
+    m.set_maxlen(2)
+    for key in ('c', 'd', 'a', 'b', 'e'):
+        m[key] = 1
+    # 'a' and 'b' are below the pairs kept so they are never stored
+    assert list(m) == ['d', 'e']
+    assert pool == {'c': 'c', 'd': 'd', 'e': 'e'}
+
+    # the same when the writes are buffered or merged from a sortedmap
+    pool.clear()
+    m.set_write_buffer(10)
+    for key in ('a', 'f', 'b'):
+        m[key] = 1
+    m.update(sortedmap.fromkeys(['c', 'g']))
+    assert list(m) == ['f', 'g']
+    assert pool == {'f': 'f', 'g': 'g'}
+
+
+def test_intern_pool_shared():
+    from sortedmap import intern_pool
+
+    m = sortedmap()
+    m.set_intern_pool(intern_pool)
+    m[b'shared'] = 1
+    assert intern_pool[b'shared'] is next(iter(m))
+    intern_pool.clear()
+
+    with pytest.raises(TypeError):
+        m.set_intern_pool([])
+
+
+def test_gc_tracking():
+    m = sortedmap({1: 1.5, 2: 'a'})
+    m.update({3: b'b'})
+    m.setdefault(4, None)
+    assert not gc.is_tracked(m)
+    assert not gc.is_tracked(m.copy())
+    assert not gc.is_tracked(m.freeze())
+
+    m[5] = []
+    assert gc.is_tracked(m)
+    assert gc.is_tracked(m.copy())
+    assert gc.is_tracked(m.freeze())
+    assert gc.is_tracked(m.split(5))
+
+    assert gc.is_tracked(sortedmap[abs]())
+    assert gc.is_tracked(sortedmap.fromkeys([1], []))
+
+    other = sortedmap()
+    other.join(m)
+    assert gc.is_tracked(other)
+
+    buffered = sortedmap()
+    buffered.set_write_buffer(4)
+    buffered[1] = ()
+    assert gc.is_tracked(buffered)
+
+
+def test_gc_cycle():
+    class Marker(object):
+        collected = False
+
+        def __del__(self):
+            Marker.collected = True
+
+    m = sortedmap()
+    m[1] = [m, Marker()]
+    del m
+    gc.collect()
+    assert Marker.collected
+
+
+@pytest.mark.parametrize('track', (True, False))
+def test_gc_keyfunc_cycle(track):
+    class Key(object):
+        collected = False
+
+        def __call__(self, key):
+            return key
+
+        def __del__(self):
+            Key.collected = True
+
+    key = Key()
+    m = sortedmap[key]({1: 1})
+    if track:
+        track_aggregates(m)
+    # the only path back to the map goes through its keyfunc
+    key.m = m
+    del key, m
+    gc.collect()
+    assert Key.collected
+
+
+def test_items_reuse_tuple():
+    m = sortedmap((n, str(n)) for n in range(100))
+
+    # tuples which are dropped are refilled for the next pair
+    assert len({id(item) for item in m.items()}) < 3
+
+    # tuples which are still held are never changed
+    items = list(m.items())
+    assert items == [(n, str(n)) for n in range(100)]
+    it = iter(m.items())
+    first = next(it)
+    second = next(it)
+    assert first == (0, '0')
+    assert second == (1, '1')
+
+
+def test_iter_cycle():
+    class Marker(object):
+        collected = False
+
+        def __del__(self):
+            Marker.collected = True
+
+    m = sortedmap()
+    m[1] = Marker()
+    m[2] = [iter(m.items())]
+    del m
+    gc.collect()
+    assert Marker.collected
+
+
+def test_merge_iter():
+    a = sortedmap({1: 'a1', 3: 'a3', 5: 'a5'})
+    b = sortedmap({2: 'b2', 3: 'b3'})
+    c = sortedmap({0: 'c0', 3: 'c3', 6: 'c6'})
+
+    assert list(sortedmap.merge_iter(a, b, c)) == [0, 1, 2, 3, 3, 3, 5, 6]
+    assert list(sortedmap.merge_iter(a, b, c, items=True)) == [
+        (0, 'c0'), (1, 'a1'), (2, 'b2'),
+        (3, 'a3'), (3, 'b3'), (3, 'c3'),
+        (5, 'a5'), (6, 'c6'),
+    ]
+
+    # the last map wins like update
+    merged = sortedmap.merge_iter(a, b, c, dedupe=True, items=True)
+    expected = a.copy()
+    expected.update(b)
+    expected.update(c)
+    assert list(merged) == list(expected.items())
+
+    assert list(sortedmap.merge_iter()) == []
+    assert list(sortedmap.merge_iter(a, sortedmap())) == [1, 3, 5]
+
+
+@pytest.mark.parametrize('n', [1, 2, 5, 16])
+def test_merge_iter_random(n):
+    rand = random.Random(n)
+    maps = [
+        sortedmap((rand.randrange(200), ix) for _ in range(rand.randrange(50)))
+        for ix in range(n)
+    ]
+    expected = sorted(
+        (k, ix) for ix, m in enumerate(maps) for k in m
+    )
+    assert list(sortedmap.merge_iter(*maps)) == [k for k, _ in expected]
+
+    expected = sortedmap()
+    for m in maps:
+        expected.update(m)
+    merged = sortedmap.merge_iter(*maps, dedupe=True, items=True)
+    assert list(merged) == list(expected.items())
+
+
+def test_merge_iter_keyfunc():
+    a = sortedmap[abs]({-3: 'a', 1: 'b'})
+    b = sortedmap[abs]({2: 'c', 3: 'd'})
+    assert list(sortedmap.merge_iter(a, b, dedupe=True, items=True)) == [
+        (1, 'b'), (2, 'c'), (-3, 'd'),
+    ]
+
+    with pytest.raises(ValueError):
+        sortedmap.merge_iter(a, sortedmap())
+    with pytest.raises(TypeError):
+        sortedmap.merge_iter(a, {})
+
+
+def test_merge_iter_changed_size():
+    a = sortedmap.fromkeys(range(10))
+    b = sortedmap.fromkeys(range(10))
+    it = sortedmap.merge_iter(a, b)
+    next(it)
+    del a[5]
+    with pytest.raises(RuntimeError):
+        list(it)
+
+    # the buffer reports writes which have not been merged yet
+    b.set_write_buffer(4)
+    it = sortedmap.merge_iter(b)
+    next(it)
+    b[100] = 1
+    with pytest.raises(RuntimeError):
+        list(it)
+
+
+def test_diff():
+    old = sortedmap({1: 'a', 2: 'b', 3: 'c', 5: 'e'})
+    new = sortedmap({0: 'z', 2: 'b', 3: 'C', 4: 'd'})
+
+    assert new.diff(old) == (
+        [(0, 'z'), (4, 'd')],
+        [(1, 'a'), (5, 'e')],
+        [(3, 'c', 'C')],
+    )
+    assert new.diff(old.freeze()) == new.diff(old)
+    assert new.diff(new) == ([], [], [])
+    assert new.diff(sortedmap()) == (list(new.items()), [], [])
+
+    # ranges
+    assert new.diff(old, lo=2) == ([(4, 'd')], [(5, 'e')], [(3, 'c', 'C')])
+    assert new.diff(old, hi=3) == ([(0, 'z')], [(1, 'a')], [])
+    assert new.diff(old, 1, 4) == ([], [(1, 'a')], [(3, 'c', 'C')])
+    assert new.diff(old, 4, 1) == ([], [], [])
+
+
+@pytest.mark.parametrize('seed', range(5))
+def test_diff_random(seed):
+    rand = random.Random(seed)
+    old = sortedmap((rand.randrange(100), rand.randrange(3)) for _ in range(60))
+    new = old.copy()
+    for _ in range(30):
+        key = rand.randrange(100)
+        if rand.random() < 0.3:
+            new.pop(key, None)
+        else:
+            new[key] = rand.randrange(3)
+
+    added, removed, changed = new.diff(old)
+    assert added == [(k, new[k]) for k in new if k not in old]
+    assert removed == [(k, old[k]) for k in old if k not in new]
+    assert changed == [
+        (k, old[k], new[k]) for k in new if k in old and old[k] != new[k]
+    ]
+
+    # diffing disjoint ranges gives the same pairs
+    pieces = [new.diff(old, lo, lo + 25) for lo in range(0, 100, 25)]
+    for ix, part in enumerate((added, removed, changed)):
+        assert sum((piece[ix] for piece in pieces), []) == part
+
+
+def test_diff_errors():
+    with pytest.raises(ValueError):
+        sortedmap[abs]().diff(sortedmap())
+    with pytest.raises(TypeError):
+        sortedmap().diff({})
+
+
+def test_log_recover(tmp_path):
+    log = str(tmp_path / 'log')
+    m = sortedmap()
+    m.set_log(log, group=4)
+    for n in range(20):
+        m[n] = str(n)
+    del m[3]
+    m.pop(4)
+    m.popitem()
+    m.popitems(2, first=False)
+    m.pop_until(2)
+    m.update({30: 'a'})
+    m.update(sortedmap({31: 'b'}))
+    m.setdefault(32, 'c')
+    m.setdefault(32, 'd')
+    m.split(31)
+    m.set_maxlen(6)
+    m[40] = [1, 2]
+    m.join(sortedmap({50: 'e', 51: 'f'}))
+    m.commit_log()
+    assert sortedmap.recover(log=log) == m
+
+    m.clear()
+    m[1] = 1
+    m.set_log(None)
+    assert sortedmap.recover(log=log) == m
+
+    # a missing log is empty
+    assert sortedmap.recover(log=str(tmp_path / 'missing')) == sortedmap()
+
+
+def test_log_group(tmp_path):
+    log = tmp_path / 'log'
+    m = sortedmap()
+    m.set_log(str(log), group=3)
+    size = log.stat().st_size
+    m['a'] = 1
+    m['b'] = 2
+    assert log.stat().st_size == size
+    m['c'] = 3
+    assert log.stat().st_size > size
+
+    size = log.stat().st_size
+    m['d'] = 4
+    m.commit_log()
+    assert log.stat().st_size > size
+    assert sortedmap.recover(log=str(log)) == m
+
+
+def test_checkpoint(tmp_path):
+    log = str(tmp_path / 'log')
+    snapshot = str(tmp_path / 'snapshot')
+    m = sortedmap[abs]()
+    m.set_log(log)
+    for n in range(-50, 50):
+        m[n] = n
+    m.set_maxlen(40, evict='last')
+    m.checkpoint(snapshot)
+    assert (tmp_path / 'log').stat().st_size == 16
+
+    m[-1000] = 'a'
+    m[100] = 'b'
+    del m[5]
+    m.commit_log()
+    recovered = sortedmap.recover(snapshot, log, keyfunc=abs)
+    assert recovered == m
+    assert list(recovered) == list(m)
+    assert recovered.maxlen == 40
+
+    # a map without a log can be checkpointed
+    sortedmap(a=1).checkpoint(snapshot)
+    assert sortedmap.recover(snapshot) == sortedmap(a=1)
+
+
+def test_checkpoint_crash(tmp_path):
+    log = tmp_path / 'log'
+    snapshot = str(tmp_path / 'snapshot')
+    m = sortedmap()
+    m.set_log(str(log))
+    m.set_maxlen(2)
+    m[1] = 1
+    m[4] = 4
+    del m[4]
+    m[3] = 3
+    m.commit_log()
+
+    # a crash after the snapshot is in place but before the log is emptied
+    stale = log.read_bytes()
+    m.checkpoint(snapshot)
+    log.write_bytes(stale)
+    # replaying the log would evict 1 again
+    recovered = sortedmap.recover(snapshot, str(log))
+    assert list(recovered.items()) == list(m.items()) == [(1, 1), (3, 3)]
+
+    # the changes after a checkpoint go to a log with a new id
+    m.set_log(None)
+    m.set_log(str(log))
+    m.checkpoint(snapshot)
+    m[5] = 5
+    m.commit_log()
+    recovered = sortedmap.recover(snapshot, str(log))
+    assert list(recovered.items()) == list(m.items()) == [(3, 3), (5, 5)]
+
+
+def test_log_torn_tail(tmp_path):
+    log = tmp_path / 'log'
+    m = sortedmap()
+    m.set_log(str(log), group=1)
+    m['a'] = 1
+    m['b'] = 2
+    size = log.stat().st_size
+    m.set_log(None)
+
+    # a record cut off by a crash
+    with open(log, 'ab') as f:
+        f.write(b'S\x40\x00\x00\x00abc')
+    assert sortedmap.recover(log=str(log)) == m
+    assert log.stat().st_size == size
+
+    m.set_log(str(log))
+    m['c'] = 3
+    m.set_log(None)
+    assert sortedmap.recover(log=str(log)) == m
+
+
+def test_log_write_buffer(tmp_path):
+    log = str(tmp_path / 'log')
+    m = sortedmap()
+    m.set_write_buffer(10)
+    m[0] = 0
+    m.set_log(log)
+    m[1] = 1
+    # the bad key is not stored so it is not logged either
+    with pytest.raises(TypeError):
+        m['x'] = 2
+    m[3] = 3
+    assert m == sortedmap({0: 0, 1: 1, 3: 3})
+    m.commit_log()
+    assert sortedmap.recover(log=log) == sortedmap({1: 1, 3: 3})
+
+
+def test_log_errors(tmp_path):
+    bad = tmp_path / 'bad'
+    bad.write_bytes(b'not a log')
+    with pytest.raises(ValueError):
+        sortedmap().set_log(str(bad))
+    with pytest.raises(ValueError):
+        sortedmap.recover(str(bad))
+    with pytest.raises(ValueError):
+        sortedmap().set_log(str(tmp_path / 'log'), group=0)
+
+    m = sortedmap(a=1)
+    m.set_log(str(tmp_path / 'log'))
+    with pytest.raises(ValueError):
+        m['b'] = object()
+    assert m == sortedmap(a=1)
+
+    # a snapshot must be complete
+    snapshot = tmp_path / 'snapshot'
+    m.checkpoint(str(snapshot))
+    snapshot.write_bytes(snapshot.read_bytes()[:-1])
+    with pytest.raises(ValueError):
+        sortedmap.recover(str(snapshot))
@@ -0,0 +1,172 @@
+import gc
+import sys
+
+import pytest
+
+from sortedmap import sortedmap, sortedmultimap
+
+
+@pytest.fixture
+def m():
+    m = sortedmultimap()
+    m.insert('b', 1)
+    m.insert('a', 2)
+    m.insert('b', 3)
+    m.insert('c', 4)
+    m.insert('b', 5)
+    return m
+
+
+def test_insert_order(m):
+    assert len(m) == 5
+    assert list(m) == ['a', 'b', 'b', 'b', 'c']
+    assert list(m.items()) == [
+        ('a', 2), ('b', 1), ('b', 3), ('b', 5), ('c', 4),
+    ]
+    assert m.values() == [2, 1, 3, 5, 4]
+
+
+def test_from_pairs():
+    m = sortedmultimap([('b', 1), ('a', 2), ('b', 3)], c=4)
+    assert list(m.items()) == [('a', 2), ('b', 1), ('b', 3), ('c', 4)]
+
+
+def test_getitem(m):
+    assert m['b'] == [1, 3, 5]
+    assert m['a'] == [2]
+    with pytest.raises(KeyError):
+        m['d']
+
+
+def test_setitem(m):
+    with pytest.raises(TypeError):
+        m['d'] = 1
+
+    del m['b']
+    assert list(m.items()) == [('a', 2), ('c', 4)]
+    with pytest.raises(KeyError):
+        del m['b']
+
+
+def test_contains_count(m):
+    assert 'b' in m
+    assert 'd' not in m
+    assert m.count('b') == 3
+    assert m.count('a') == 1
+    assert m.count('d') == 0
+
+
+def test_equal_range(m):
+    assert list(m.equal_range('b')) == [('b', 1), ('b', 3), ('b', 5)]
+    assert list(m.equal_range('d')) == []
+
+    it = m.equal_range('b')
+    m.insert('b', 6)
+    with pytest.raises(RuntimeError):
+        next(it)
+
+
+def test_popitem(m):
+    assert m.popitem() == ('a', 2)
+    assert m.popitem(first=False) == ('c', 4)
+    assert m.popitem(False) == ('b', 5)
+    assert m.popitem() == ('b', 1)
+    assert m.popitem() == ('b', 3)
+    with pytest.raises(KeyError):
+        m.popitem()
+
+
+def test_keyfunc():
+    m = sortedmultimap[len]([('abc', 1), ('c', 2), ('b', 3)])
+    assert type(m) is sortedmultimap
+    assert m.keyfunc is len
+    assert list(m.items()) == [('c', 2), ('b', 3), ('abc', 1)]
+    assert m.count('x') == 2
+
+
+def test_update_from_maps(m):
+    m.update(sortedmap(a=6, d=7))
+    m.update(sortedmultimap([('a', 8)]))
+    assert m['a'] == [2, 6, 8]
+    assert m['d'] == [7]
+
+
+def test_eq(m):
+    n = m.copy()
+    assert n == m
+    assert n is not m
+    n.insert('b', 6)
+    assert n != m
+    assert sortedmultimap(a=1) != sortedmultimap[len](a=1)
+
+
+def test_clear(m):
+    m.clear()
+    assert not len(m)
+    assert m == sortedmultimap()
+
+
+def test_repr():
+    m = sortedmultimap([('a', 1), ('a', 2)])
+    assert repr(m) == "sortedmap.sortedmultimap([('a', 1), ('a', 2)])"
+    assert repr(m.keys()) == "sortedmap.multikeyview(['a', 'a'])"
+
+
+def test_views_listlike(m):
+    assert m.keys() + ['d'] == ['a', 'b', 'b', 'b', 'c', 'd']
+    assert m.values() * 1 == [2, 1, 3, 5, 4]
+    assert m.items()
+    assert not sortedmultimap().keys()
+
+
+def test_views_len_contains(m):
+    assert len(m.keys()) == len(m.values()) == len(m.items()) == 5
+    assert 'b' in m.keys()
+    assert 'd' not in m.keys()
+    assert ('b', 3) in m.items()
+    assert ('b', 5) in m.items()
+    assert ('b', 4) not in m.items()
+    assert ('d', 1) not in m.items()
+
+
+def test_sizeof():
+    empty = sys.getsizeof(sortedmultimap())
+    m = sortedmultimap([(1, 1), (1, 2), (2, 3)])
+    assert sys.getsizeof(m) > empty
+    assert (sys.getsizeof(m) - empty) % 3 == 0
+
+
+def test_gc_tracking():
+    m = sortedmultimap()
+    m.insert(1, 'a')
+    m.insert(1, 2.5)
+    assert not gc.is_tracked(m)
+    m.insert(2, [])
+    assert gc.is_tracked(m)
+    assert gc.is_tracked(m.copy())
+
+
+def test_update_from_buffered_sortedmap():
+    m = sortedmap()
+    m.set_write_buffer(10)
+    m[2] = 'b'
+    m[1] = 'a'
+    assert list(sortedmultimap(m).items()) == [(1, 'a'), (2, 'b')]
+
+
+def test_gc_keyfunc_cycle():
+    class Key(object):
+        collected = False
+
+        def __call__(self, key):
+            return key
+
+        def __del__(self):
+            Key.collected = True
+
+    key = Key()
+    m = sortedmultimap[key]()
+    key.m = m
+    del key, m
+    gc.collect()
+    assert Key.collected